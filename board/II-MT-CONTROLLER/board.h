@@ -96,8 +96,8 @@
 /*
  * Serial port assignments.
  */
-#define SD_OW1   (&SD1)
-#define SD_OW2   (&SD2)
+#define UART_OW1 (&UARTD1)
+#define UART_OW2 (&UARTD2)
 #define SD_STDIO ((void*)&SD3)
 
 /*
@@ -192,6 +192,7 @@ UDEFS = -DMAJOR_VERSION=$(MAJOR_VERSION) \
         -DVERSION_STR=\"$(MAJOR_VERSION).$(MINOR_VERSION).$(PATCH_VERSION)\" \
         -DWEB_API_HOST=$(WEB_API_HOST) \
         -DWEB_API_PORT=$(WEB_API_PORT) \
+         $(PROJECT_DEFS) \
          $(foreach dep,$(addsuffix _DEFS,$(DEPS)),$($(dep)))
 
 # Define ASM defines here
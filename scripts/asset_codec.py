@@ -0,0 +1,166 @@
+# Run length coding of the image and glyph data that imgconv and fontconv
+# put in image_resources.c and font_resources.c. Decoded on the device by
+# image.c, see image.h.
+#
+# Alpha is cut down to 4 bits and coded as one stream for the whole image,
+# row after row. Each code byte is two bits of op and a count of 1-64:
+#
+#   00nnnnnn          n+1 transparent pixels
+#   01nnnnnn          n+1 opaque pixels
+#   10nnnnnn ...      n+1 literal pixels, two per byte, high nibble first
+#   11nnnnnn v        n+1 pixels of alpha v (low nibble)
+#
+# RGB565 pixels are coded a row at a time so that rows can be found through
+# a table of offsets. Pixels are 2 bytes, low byte first:
+#
+#   0nnnnnnn p        n+1 pixels of p
+#   1nnnnnnn p...     n+1 literal pixels
+
+MAX_RUN = 64
+MAX_PX_RUN = 128
+
+OP_CLEAR = 0x00
+OP_OPAQUE = 0x40
+OP_LITERAL = 0x80
+OP_RUN = 0xC0
+
+# Shortest runs worth breaking a literal for
+MIN_EDGE_RUN = 3
+MIN_RUN = 5
+
+
+def quantize_alpha(a):
+  return (a + 8) // 17
+
+
+def expand_alpha(a):
+  return a * 17
+
+
+def _run_length(values, i, limit):
+  n = 1
+  while i + n < len(values) and values[i + n] == values[i] and n < limit:
+    n += 1
+  return n
+
+
+def _alpha_run_worth(values, i):
+  v = values[i]
+  n = _run_length(values, i, MAX_RUN)
+  if v == 0 or v == 15:
+    return n >= MIN_EDGE_RUN
+  return n >= MIN_RUN
+
+
+def encode_alpha(alpha):
+  """Codes a list of 8 bit alpha values."""
+  values = [quantize_alpha(a) for a in alpha]
+  out = bytearray()
+  i = 0
+
+  while i < len(values):
+    if _alpha_run_worth(values, i) or (i + 1 == len(values)):
+      v = values[i]
+      n = _run_length(values, i, MAX_RUN)
+      if v == 0:
+        out.append(OP_CLEAR | (n - 1))
+      elif v == 15:
+        out.append(OP_OPAQUE | (n - 1))
+      else:
+        out += bytearray([OP_RUN | (n - 1), v])
+      i += n
+      continue
+
+    start = i
+    while i < len(values) and (i - start) < MAX_RUN and \
+        (i == start or not _alpha_run_worth(values, i)):
+      i += 1
+    lit = values[start:i]
+    out.append(OP_LITERAL | (len(lit) - 1))
+    for j in range(0, len(lit), 2):
+      lo = lit[j + 1] if j + 1 < len(lit) else 0
+      out.append((lit[j] << 4) | lo)
+
+  return bytes(out)
+
+
+def decode_alpha(buf, count):
+  """Returns count 8 bit alpha values from the start of buf."""
+  buf = bytearray(buf)
+  alpha = []
+  pos = 0
+
+  while len(alpha) < count:
+    op = buf[pos] & 0xC0
+    n = (buf[pos] & 0x3F) + 1
+    pos += 1
+    if op == OP_CLEAR:
+      alpha += [0] * n
+    elif op == OP_OPAQUE:
+      alpha += [255] * n
+    elif op == OP_RUN:
+      alpha += [expand_alpha(buf[pos] & 0x0F)] * n
+      pos += 1
+    else:
+      for j in range(n):
+        b = buf[pos + (j // 2)]
+        alpha.append(expand_alpha((b >> 4) if (j % 2) == 0 else (b & 0x0F)))
+      pos += (n + 1) // 2
+
+  return alpha
+
+
+def _put_px(out, p):
+  out += bytearray([p & 0xFF, p >> 8])
+
+
+def encode_px_row(px):
+  """Codes one row of RGB565 pixels."""
+  out = bytearray()
+  i = 0
+
+  while i < len(px):
+    n = _run_length(px, i, MAX_PX_RUN)
+    if n >= 2:
+      out.append(n - 1)
+      _put_px(out, px[i])
+      i += n
+      continue
+
+    start = i
+    while i < len(px) and (i - start) < MAX_PX_RUN and \
+        (i == start or _run_length(px, i, 2) < 2):
+      i += 1
+    out.append(0x80 | (i - start - 1))
+    for p in px[start:i]:
+      _put_px(out, p)
+
+  return bytes(out)
+
+
+def encode_px(px, width):
+  """Codes RGB565 pixels row by row. Returns the data and the offset of
+  each row in it."""
+  out = bytearray()
+  rows = []
+  for y in range(0, len(px), width):
+    rows.append(len(out))
+    out += encode_px_row(px[y:y + width])
+  return bytes(out), rows
+
+
+def decode_px_row(buf, offset, width):
+  buf = bytearray(buf)
+  px = []
+  pos = offset
+
+  while len(px) < width:
+    n = (buf[pos] & 0x7F) + 1
+    literal = buf[pos] & 0x80
+    pos += 1
+    for j in range(n):
+      px.append(buf[pos] | (buf[pos + 1] << 8))
+      if literal or j == n - 1:
+        pos += 2
+
+  return px
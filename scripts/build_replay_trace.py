@@ -0,0 +1,34 @@
+# Builds a sensor replay partition image from a CSV trace.
+#
+#   python build_replay_trace.py trace.csv replay.bin
+#
+# Each CSV line is "seconds,sensor,value" with the value in deg F, e.g. as
+# logged from MSG_SENSOR_SAMPLE. Lines starting with '#' are ignored. Write
+# replay.bin to the external flash at the SP_SENSOR_REPLAY offset (0x220000)
+# and build the firmware with SENSOR_REPLAY=1.
+
+import sys
+import struct
+
+MAGIC = 0x4C505253
+PART_SIZE = 0x80000
+
+records = []
+for line in open(sys.argv[1], "r"):
+  line = line.strip()
+  if not line or line.startswith("#"):
+    continue
+  t, sensor, value = line.split(",")[:3]
+  records.append((int(round(float(t) * 1000)), int(sensor), float(value)))
+
+records.sort(key=lambda r: r[0])
+t0 = records[0][0] if records else 0
+
+out = struct.pack("<LL", MAGIC, len(records))
+for t, sensor, value in records:
+  out += struct.pack("<LB3xf", t - t0, sensor, value)
+
+if len(out) > PART_SIZE:
+  sys.exit("trace is %d bytes, the partition holds %d" % (len(out), PART_SIZE))
+
+open(sys.argv[2], "wb").write(out)
@@ -0,0 +1,155 @@
+# Encodes and decodes the packed telemetry records sent in the
+# packed_reports field of DeviceReport (see src/app_mt/telemetry_codec.h).
+#
+#   python telemetry_codec.py <hex bytes>
+#
+# decodes a hex dump of the field and prints one "time,controller,value,
+# setpoint,outputs" line per record. decode() and encode() are meant to be
+# imported by the server and by tests.
+
+import sys
+
+VERSION = 1
+MAX_CONTROLLERS = 16
+
+TAG_CONTROLLER_MASK = 0x0F
+TAG_SETPOINT = 0x10
+TAG_OUTPUTS = 0x20
+TAG_NO_SETPOINT = 0x40
+
+
+def _zigzag(v):
+  return ((v << 1) ^ (v >> 31)) & 0xFFFFFFFF
+
+
+def _unzigzag(v):
+  return (v >> 1) ^ -(v & 1)
+
+
+def _put_varint(out, v):
+  while v >= 0x80:
+    out.append((v & 0x7F) | 0x80)
+    v >>= 7
+  out.append(v)
+
+
+def _get_varint(buf, pos):
+  v = 0
+  for shift in range(0, 35, 7):
+    if pos >= len(buf):
+      raise ValueError("truncated varint")
+    b = buf[pos]
+    pos += 1
+    v |= (b & 0x7F) << shift
+    if not b & 0x80:
+      return v & 0xFFFFFFFF, pos
+  raise ValueError("varint too long")
+
+
+def _to_int32(v):
+  v &= 0xFFFFFFFF
+  return v - 0x100000000 if v & 0x80000000 else v
+
+
+def _to_centi(v):
+  return int(v * 100 + (-0.5 if v < 0 else 0.5))
+
+
+class _State(object):
+  def __init__(self, base_time):
+    self.time = base_time
+    self.time_delta = 0
+    self.value = 0
+    self.setpoint = 0
+    self.has_setpoint = False
+    self.outputs = 0
+
+
+def encode(records, base_time=None):
+  """Packs (time, controller, value, setpoint, outputs) tuples, setpoint
+  None if there is none. Values are in deg F."""
+  if base_time is None:
+    base_time = records[0][0] if records else 0
+  out = bytearray()
+  _put_varint(out, VERSION)
+  _put_varint(out, base_time)
+  states = [_State(base_time) for _ in range(MAX_CONTROLLERS)]
+
+  for time, controller, value, setpoint, outputs in records:
+    s = states[controller]
+    tag = controller
+    body = bytearray()
+
+    time_delta = _to_int32(time - s.time)
+    _put_varint(body, _zigzag(_to_int32(time_delta - s.time_delta)))
+    value = _to_centi(value)
+    _put_varint(body, _zigzag(_to_int32(value - s.value)))
+
+    has_setpoint = setpoint is not None
+    setpoint = _to_centi(setpoint) if has_setpoint else s.setpoint
+    if has_setpoint != s.has_setpoint or setpoint != s.setpoint:
+      tag |= TAG_SETPOINT
+      if has_setpoint:
+        _put_varint(body, _zigzag(_to_int32(setpoint - s.setpoint)))
+      else:
+        tag |= TAG_NO_SETPOINT
+
+    if outputs != s.outputs:
+      tag |= TAG_OUTPUTS
+      _put_varint(body, outputs)
+
+    out.append(tag)
+    out += body
+    s.time, s.time_delta, s.value = time, time_delta, value
+    s.setpoint, s.has_setpoint, s.outputs = setpoint, has_setpoint, outputs
+
+  return bytes(out)
+
+
+def decode(buf):
+  """Returns a list of (time, controller, value, setpoint, outputs) tuples,
+  setpoint None if there was none."""
+  buf = bytearray(buf)
+  version, pos = _get_varint(buf, 0)
+  if version != VERSION:
+    raise ValueError("unknown format version %d" % version)
+  base_time, pos = _get_varint(buf, pos)
+  states = [_State(base_time) for _ in range(MAX_CONTROLLERS)]
+  records = []
+
+  while pos < len(buf):
+    tag = buf[pos]
+    pos += 1
+    if tag & 0x80:
+      raise ValueError("bad tag 0x%02x" % tag)
+    controller = tag & TAG_CONTROLLER_MASK
+    s = states[controller]
+
+    v, pos = _get_varint(buf, pos)
+    s.time_delta = _to_int32(s.time_delta + _unzigzag(v))
+    s.time = (s.time + s.time_delta) & 0xFFFFFFFF
+    v, pos = _get_varint(buf, pos)
+    s.value = _to_int32(s.value + _unzigzag(v))
+
+    if tag & TAG_SETPOINT:
+      if tag & TAG_NO_SETPOINT:
+        s.has_setpoint = False
+      else:
+        v, pos = _get_varint(buf, pos)
+        s.setpoint = _to_int32(s.setpoint + _unzigzag(v))
+        s.has_setpoint = True
+
+    if tag & TAG_OUTPUTS:
+      s.outputs, pos = _get_varint(buf, pos)
+
+    records.append((s.time, controller, s.value / 100.0,
+                    s.setpoint / 100.0 if s.has_setpoint else None,
+                    s.outputs))
+
+  return records
+
+
+if __name__ == "__main__":
+  for time, controller, value, setpoint, outputs in decode(bytearray.fromhex(sys.argv[1])):
+    print("%d,%d,%.2f,%s,%d" % (time, controller, value,
+                                "" if setpoint is None else "%.2f" % setpoint, outputs))
@@ -18,6 +18,8 @@ typedef struct {
   quantity_t hysteresis;
   matrix_t touch_calib;
   controller_settings_t controller_settings[NUM_CONTROLLERS];
+  sensor_device_t sensor_devices[NUM_SENSORS];
+  sensor_filter_settings_t sensor_filters[NUM_SENSORS];
   temp_profile_t temp_profiles[NUM_CONTROLLERS];
   temp_profile_checkpoint_t temp_profile_checkpoints[NUM_CONTROLLERS];
   char auth_token[64];
@@ -31,6 +33,11 @@ typedef struct {
 } app_cfg_rec_t;
 
 
+static sensor_id_t find_sensor_device(const uint8_t* rom);
+static bool sensor_found(sensor_id_t sensor, const sensor_id_t* sensors, uint8_t num_sensors);
+static sensor_id_t new_sensor_slot(uint8_t port);
+
+
 /* app_cfg stored in flash */
 __attribute__ ((section("app_cfg")))
 app_cfg_rec_t app_cfg_stored;
@@ -40,10 +47,15 @@ static app_cfg_rec_t app_cfg_local;
 static Mutex app_cfg_mtx;
 static systime_t last_idle;
 
+/* Probes the last complete search of their port didn't find */
+static bool sensor_missing[NUM_SENSORS];
+
 
 void
 app_cfg_init()
 {
+  int i, j;
+
   chMtxInit(&app_cfg_mtx);
 
   uint32_t calc_crc = crc32_block(0, &app_cfg_stored.data, sizeof(app_cfg_data_t));
@@ -69,35 +81,31 @@ app_cfg_init()
 
     touch_calib_reset();
 
-    app_cfg_local.data.controller_settings[CONTROLLER_1].controller = CONTROLLER_1;
-    app_cfg_local.data.controller_settings[CONTROLLER_1].setpoint_type = SP_STATIC;
-    app_cfg_local.data.controller_settings[CONTROLLER_1].static_setpoint.value = 68;
-    app_cfg_local.data.controller_settings[CONTROLLER_1].static_setpoint.unit = UNIT_TEMP_DEG_F;
+    memset(app_cfg_local.data.sensor_devices, 0, sizeof(app_cfg_local.data.sensor_devices));
+
+    for (i = 0; i < NUM_SENSORS; ++i)
+      sensor_filter_get_default_settings(&app_cfg_local.data.sensor_filters[i]);
 
-    app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_1].enabled = false;
-    app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_1].function = OUTPUT_FUNC_COOLING;
-    app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_1].cycle_delay.unit = UNIT_TIME_MIN;
-    app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_1].cycle_delay.value = 3;
+    for (i = 0; i < NUM_CONTROLLERS; ++i) {
+      controller_settings_t* cs = &app_cfg_local.data.controller_settings[i];
 
-    app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_2].enabled = false;
-    app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_2].function = OUTPUT_FUNC_HEATING;
-    app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_2].cycle_delay.unit = UNIT_TIME_MIN;
-    app_cfg_local.data.controller_settings[CONTROLLER_1].output_settings[OUTPUT_2].cycle_delay.value = 3;
+      cs->controller = i;
+      cs->sensor = (i < NUM_SENSORS) ? (sensor_id_t)i : SENSOR_NONE;
+      cs->setpoint_type = SP_STATIC;
+      cs->static_setpoint.value = 68;
+      cs->static_setpoint.unit = UNIT_TEMP_DEG_F;
 
-    app_cfg_local.data.controller_settings[CONTROLLER_2].controller = CONTROLLER_2;
-    app_cfg_local.data.controller_settings[CONTROLLER_2].setpoint_type = SP_STATIC;
-    app_cfg_local.data.controller_settings[CONTROLLER_2].static_setpoint.value = 68;
-    app_cfg_local.data.controller_settings[CONTROLLER_2].static_setpoint.unit = UNIT_TEMP_DEG_F;
+      for (j = 0; j < NUM_OUTPUTS; ++j) {
+        output_settings_t* os = &cs->output_settings[j];
 
-    app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_1].enabled = false;
-    app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_1].function = OUTPUT_FUNC_COOLING;
-    app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_1].cycle_delay.unit = UNIT_TIME_MIN;
-    app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_1].cycle_delay.value = 3;
+        os->enabled = false;
+        os->function = (j % 2) ? OUTPUT_FUNC_HEATING : OUTPUT_FUNC_COOLING;
+        os->cycle_delay.unit = UNIT_TIME_MIN;
+        os->cycle_delay.value = 3;
+      }
 
-    app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_2].enabled = false;
-    app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_2].function = OUTPUT_FUNC_HEATING;
-    app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_2].cycle_delay.unit = UNIT_TIME_MIN;
-    app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_2].cycle_delay.value = 3;
+      pid_get_default_settings(&cs->pid_settings);
+    }
 
     app_cfg_local.crc = crc32_block(0, &app_cfg_local.data, sizeof(app_cfg_data_t));
   }
@@ -132,7 +140,7 @@ app_cfg_set_temp_unit(unit_t temp_unit)
 
   chMtxLock(&app_cfg_mtx);
 
-  for (i = 0; i < NUM_SENSORS; ++i) {
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
     controller_settings_t* s = &app_cfg_local.data.controller_settings[i];
     s->static_setpoint = quantity_convert(s->static_setpoint, temp_unit);
   }
@@ -220,6 +228,10 @@ app_cfg_set_controller_settings(
   if (controller >= NUM_CONTROLLERS)
     return;
 
+  if (settings->sensor < SENSOR_NONE ||
+      settings->sensor >= NUM_SENSORS)
+    settings->sensor = SENSOR_NONE;
+
   if ((source == SS_SERVER) ||
       memcmp(settings, &app_cfg_local.data.controller_settings[controller], sizeof(controller_settings_t)) != 0) {
     chMtxLock(&app_cfg_mtx);
@@ -236,6 +248,178 @@ app_cfg_set_controller_settings(
   }
 }
 
+void
+app_cfg_set_pid_settings(temp_controller_id_t controller, const pid_settings_t* settings)
+{
+  if (controller >= NUM_CONTROLLERS)
+    return;
+
+  chMtxLock(&app_cfg_mtx);
+  app_cfg_local.data.controller_settings[controller].pid_settings = *settings;
+  chMtxUnlock();
+}
+
+const sensor_device_t*
+app_cfg_get_sensor_device(sensor_id_t sensor)
+{
+  if (sensor <= SENSOR_NONE || sensor >= NUM_SENSORS)
+    return NULL;
+
+  if (app_cfg_local.data.sensor_devices[sensor].rom[0] == 0)
+    return NULL;
+
+  return &app_cfg_local.data.sensor_devices[sensor];
+}
+
+/* Maps the probes found by a search of a port to sensor ids, adding new
+ * ones to the device table. The ids are written to sensors in the order
+ * found, leaving out probes there was no room for, and their number is
+ * returned.
+ *
+ * After a complete search, probes of the port it didn't find are missing.
+ * A new probe on the port takes a missing probe's slot first, so the
+ * controllers reading it move over to its replacement, and one on any port
+ * takes it rather than find the table full.
+ */
+uint8_t
+app_cfg_register_sensor_devices(uint8_t port, const uint8_t (*roms)[8], uint8_t num_roms,
+    bool complete, sensor_id_t* sensors)
+{
+  int i;
+  uint8_t n = 0;
+  sensor_device_t* devices = app_cfg_local.data.sensor_devices;
+
+  chMtxLock(&app_cfg_mtx);
+
+  /* Probes seen before keep their ids, even if they moved port */
+  for (i = 0; i < num_roms; ++i) {
+    sensors[i] = find_sensor_device(roms[i]);
+    if (sensors[i] != SENSOR_NONE) {
+      devices[sensors[i]].port = port;
+      sensor_missing[sensors[i]] = false;
+    }
+  }
+
+  if (complete) {
+    for (i = 0; i < NUM_SENSORS; ++i) {
+      if (devices[i].rom[0] != 0 && devices[i].port == port &&
+          !sensor_found(i, sensors, num_roms))
+        sensor_missing[i] = true;
+    }
+  }
+
+  for (i = 0; i < num_roms; ++i) {
+    sensor_id_t sensor = sensors[i];
+
+    if (sensor == SENSOR_NONE && roms[i][0] != 0) {
+      sensor = new_sensor_slot(port);
+      if (sensor != SENSOR_NONE) {
+        memcpy(devices[sensor].rom, roms[i], sizeof(devices[sensor].rom));
+        devices[sensor].port = port;
+        devices[sensor].resolution = SENSOR_RESOLUTION_MAX;
+        sensor_missing[sensor] = false;
+      }
+    }
+
+    if (sensor != SENSOR_NONE)
+      sensors[n++] = sensor;
+  }
+
+  chMtxUnlock();
+
+  return n;
+}
+
+static sensor_id_t
+find_sensor_device(const uint8_t* rom)
+{
+  int i;
+
+  if (rom[0] == 0)
+    return SENSOR_NONE;
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    if (memcmp(app_cfg_local.data.sensor_devices[i].rom, rom, 8) == 0)
+      return i;
+  }
+  return SENSOR_NONE;
+}
+
+static bool
+sensor_found(sensor_id_t sensor, const sensor_id_t* sensors, uint8_t num_sensors)
+{
+  int i;
+
+  for (i = 0; i < num_sensors; ++i) {
+    if (sensors[i] == sensor)
+      return true;
+  }
+  return false;
+}
+
+/* Picks the slot for a new probe on a port: one of the port's missing
+ * probes, else the port's own slot while that is free so one probe per
+ * port keeps the sensor id it always had, else any free slot, else any
+ * missing probe's.
+ */
+static sensor_id_t
+new_sensor_slot(uint8_t port)
+{
+  int i;
+  const sensor_device_t* devices = app_cfg_local.data.sensor_devices;
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    if (sensor_missing[i] && devices[i].port == port)
+      return i;
+  }
+
+  if (port < NUM_SENSORS && devices[port].rom[0] == 0)
+    return port;
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    if (devices[i].rom[0] == 0)
+      return i;
+  }
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    if (sensor_missing[i])
+      return i;
+  }
+
+  return SENSOR_NONE;
+}
+
+void
+app_cfg_set_sensor_resolution(sensor_id_t sensor, uint8_t resolution)
+{
+  if (app_cfg_get_sensor_device(sensor) == NULL)
+    return;
+
+  chMtxLock(&app_cfg_mtx);
+  app_cfg_local.data.sensor_devices[sensor].resolution =
+      LIMIT(resolution, SENSOR_RESOLUTION_MIN, SENSOR_RESOLUTION_MAX);
+  chMtxUnlock();
+}
+
+const sensor_filter_settings_t*
+app_cfg_get_sensor_filter_settings(sensor_id_t sensor)
+{
+  if (sensor <= SENSOR_NONE || sensor >= NUM_SENSORS)
+    return NULL;
+
+  return &app_cfg_local.data.sensor_filters[sensor];
+}
+
+void
+app_cfg_set_sensor_filter_settings(sensor_id_t sensor, const sensor_filter_settings_t* settings)
+{
+  if (sensor <= SENSOR_NONE || sensor >= NUM_SENSORS)
+    return;
+
+  chMtxLock(&app_cfg_mtx);
+  app_cfg_local.data.sensor_filters[sensor] = *settings;
+  chMtxUnlock();
+}
 
 const temp_profile_checkpoint_t*
 app_cfg_get_temp_profile_checkpoint(temp_controller_id_t controller)
@@ -297,7 +481,7 @@ const temp_profile_t*
 app_cfg_get_temp_profile(uint32_t temp_profile_id)
 {
   int i;
-  for (i = 0; i < NUM_SENSORS; ++i) {
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
     temp_profile_t* profile = &app_cfg_local.data.temp_profiles[i];
     if (profile->id == temp_profile_id)
       return profile;
@@ -309,7 +493,7 @@ app_cfg_get_temp_profile(uint32_t temp_profile_id)
 void
 app_cfg_set_temp_profile(const temp_profile_t* profile, uint32_t index)
 {
-  if (index >= 2)
+  if (index >= NUM_CONTROLLERS)
     return;
 
   chMtxLock(&app_cfg_mtx);
@@ -56,6 +56,25 @@ app_cfg_set_controller_settings(
     settings_source_t source,
     controller_settings_t* settings);
 
+void
+app_cfg_set_pid_settings(temp_controller_id_t controller, const pid_settings_t* settings);
+
+const sensor_device_t*
+app_cfg_get_sensor_device(sensor_id_t sensor);
+
+uint8_t
+app_cfg_register_sensor_devices(uint8_t port, const uint8_t (*roms)[8], uint8_t num_roms,
+    bool complete, sensor_id_t* sensors);
+
+void
+app_cfg_set_sensor_resolution(sensor_id_t sensor, uint8_t resolution);
+
+const sensor_filter_settings_t*
+app_cfg_get_sensor_filter_settings(sensor_id_t sensor);
+
+void
+app_cfg_set_sensor_filter_settings(sensor_id_t sensor, const sensor_filter_settings_t* settings);
+
 const temp_profile_checkpoint_t*
 app_cfg_get_temp_profile_checkpoint(temp_controller_id_t controller);
 
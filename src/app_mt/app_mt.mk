@@ -9,6 +9,71 @@ WEB_API_PORT = 31337
 
 BOARD = II-MT-CONTROLLER
 
+# Set MSG_TRACE=1 to record message bus latency histograms
+MSG_TRACE ?= 0
+
+# Set SENSOR_REPLAY=1 to replace the probes with a trace recorded in the
+# sensor replay partition of the external flash (see scripts/build_replay_trace.py).
+# SENSOR_REPLAY_SPEED plays it back that many times faster than real time.
+SENSOR_REPLAY ?= 0
+SENSOR_REPLAY_SPEED ?= 1
+
+# Set WEB_API_AUTOTUNE=1 when the protobuf messages (BBMT_MSGS) define
+# AutotuneStatus and AutotuneCommand
+WEB_API_AUTOTUNE ?= 0
+
+# Set WEB_API_TELEMETRY=1 when the protobuf messages define
+# DeviceReport.sequence, ControllerReport.timestamp/output_status and
+# DEVICE_REPORT_ACK. Controller samples are then queued every
+# TELEMETRY_SAMPLE_INTERVAL seconds, kept in external flash while offline and
+# sent in batches of up to TELEMETRY_BATCH_SIZE (no more than the max_count of
+# controller_reports) at least every TELEMETRY_REPORT_INTERVAL seconds.
+WEB_API_TELEMETRY ?= 0
+TELEMETRY_SAMPLE_INTERVAL ?= 30
+TELEMETRY_REPORT_INTERVAL ?= 300
+TELEMETRY_BATCH_SIZE ?= 32
+
+# Set WEB_API_TELEMETRY_PACKED=1 (with WEB_API_TELEMETRY=1) when DeviceReport
+# also defines a packed_reports bytes field with a max_size. Report records are
+# then coded with telemetry_codec.c, about 3 bytes each instead of 20+, and
+# TELEMETRY_BATCH_SIZE is limited by max_size rather than controller_reports.
+WEB_API_TELEMETRY_PACKED ?= 0
+
+# Channel counts (max 16 each). The on-board hardware has 2 probe ports and
+# 2 relays; NUM_SENSORS is the total number of probes across both ports.
+NUM_SENSORS ?= 6
+NUM_CONTROLLERS ?= 2
+NUM_OUTPUTS ?= 2
+
+# Bytes of heap the GUI may use for glyphs pre-blended over solid backgrounds
+# (see glyph_cache.h). 0 blends every glyph as it is drawn.
+GLYPH_CACHE_SIZE ?= 4096
+
+# Bytes of heap for the alpha of glyphs too large for the cache above. The
+# default holds the digits and point of the 62 px font.
+GLYPH_ALPHA_CACHE_SIZE ?= 16384
+
+# Rows of the screen the GUI composes in RAM before sending them to the LCD
+# (see gfx_compose_begin()), in two buffers of DISP_WIDTH pixels per row.
+GFX_COMPOSE_ROWS ?= 8
+
+PROJECT_DEFS = \
+       -DMSG_TRACE=$(MSG_TRACE) \
+       -DSENSOR_REPLAY=$(SENSOR_REPLAY) \
+       -DSENSOR_REPLAY_SPEED=$(SENSOR_REPLAY_SPEED) \
+       -DWEB_API_AUTOTUNE=$(WEB_API_AUTOTUNE) \
+       -DWEB_API_TELEMETRY=$(WEB_API_TELEMETRY) \
+       -DTELEMETRY_SAMPLE_INTERVAL=$(TELEMETRY_SAMPLE_INTERVAL) \
+       -DTELEMETRY_REPORT_INTERVAL=$(TELEMETRY_REPORT_INTERVAL) \
+       -DTELEMETRY_BATCH_SIZE=$(TELEMETRY_BATCH_SIZE) \
+       -DWEB_API_TELEMETRY_PACKED=$(WEB_API_TELEMETRY_PACKED) \
+       -DNUM_SENSORS=$(NUM_SENSORS) \
+       -DNUM_CONTROLLERS=$(NUM_CONTROLLERS) \
+       -DNUM_OUTPUTS=$(NUM_OUTPUTS) \
+       -DGLYPH_CACHE_SIZE=$(GLYPH_CACHE_SIZE) \
+       -DGLYPH_ALPHA_CACHE_SIZE=$(GLYPH_ALPHA_CACHE_SIZE) \
+       -DGFX_COMPOSE_ROWS=$(GFX_COMPOSE_ROWS)
+
 DEPS = NANOPB
 
 PROJECT_INCDIR = \
@@ -25,9 +90,12 @@ PROJECT_AUTOGEN_CSRC = \
 PROJECT_CSRC = \
        app_cfg.c \
        app_hdr.c \
+       autotune.c \
+       blend.c \
        fault.c \
        font.c \
        gfx.c \
+       glyph_cache.c \
        image.c \
        lcd.c \
        main.c \
@@ -37,8 +105,13 @@ PROJECT_CSRC = \
        ota_update.c \
        pid.c \
        quantity_widget.c \
+       sample_store.c \
        sensor.c \
+       sensor_filter.c \
+       sensor_replay.c \
        sntp.c \
+       telemetry.c \
+       telemetry_codec.c \
        temp_control.c \
        temp_profile.c \
        thread_watchdog.c \
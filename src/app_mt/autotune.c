@@ -0,0 +1,159 @@
+
+#include "autotune.h"
+#include "common.h"
+
+#include <math.h>
+
+/*
+ * Relay feedback autotuning after Astrom and Hagglund [1].
+ *
+ * The relay is switched around the setpoint with a small dead band, which
+ * drives the process into a limit cycle. The amplitude a and period Tu of
+ * that cycle give the ultimate gain of the loop
+ *
+ *   Ku = 4d / (pi * sqrt(a^2 - e^2))
+ *
+ * where d is the relay output swing and e is half the dead band. The PID
+ * gains then follow from the Ziegler-Nichols ultimate cycle rules.
+ *
+ * The relays are still subject to the output cycle delay, so a compressor
+ * is never short cycled. That only stretches the measured period.
+ *
+ * [1] K. J. Astrom and T. Hagglund, "Automatic tuning of simple regulators
+ *     with specifications on phase and amplitude margins", Automatica 1984
+ */
+
+/* The first full cycle is discarded while the process settles */
+#define SETTLING_CYCLES   1
+#define MEASURED_CYCLES   3
+#define AUTOTUNE_TIMEOUT  S2ST(24 * 60 * 60)
+
+
+static void finish(autotune_t* at);
+
+
+void
+autotune_start(autotune_t* at, float setpoint, float sample, float band, float amplitude)
+{
+  at->state = AT_RUNNING;
+  at->setpoint = setpoint;
+  at->band = band;
+  at->amplitude = amplitude;
+  at->drive_up = (sample < setpoint);
+
+  at->peak_max = sample;
+  at->peak_min = sample;
+  at->switches = 0;
+  at->sum_amplitude = 0;
+  at->sum_period = 0;
+
+  at->start_time = chTimeNow();
+  at->last_switch = at->start_time;
+
+  at->ku = at->tu = 0;
+  at->kp = at->ki = at->kd = 0;
+}
+
+void
+autotune_cancel(autotune_t* at)
+{
+  at->state = AT_IDLE;
+}
+
+bool
+autotune_update(autotune_t* at, float sample)
+{
+  systime_t now = chTimeNow();
+
+  if (at->state != AT_RUNNING)
+    return false;
+
+  if ((now - at->start_time) > AUTOTUNE_TIMEOUT) {
+    at->state = AT_FAILED;
+    return true;
+  }
+
+  at->peak_max = MAX(at->peak_max, sample);
+  at->peak_min = MIN(at->peak_min, sample);
+
+  if (!at->drive_up && sample <= (at->setpoint - at->band)) {
+    at->drive_up = true;
+    return false;
+  }
+
+  if (!at->drive_up || sample < (at->setpoint + at->band))
+    return false;
+
+  /* Upward crossing: one full cycle since the last one */
+  at->drive_up = false;
+
+  if (at->switches > SETTLING_CYCLES) {
+    at->sum_amplitude += (at->peak_max - at->peak_min) / 2;
+    at->sum_period += (float)(now - at->last_switch) / CH_FREQUENCY;
+  }
+
+  at->switches++;
+  at->last_switch = now;
+  at->peak_max = sample;
+  at->peak_min = sample;
+
+  if (autotune_get_cycles(at) >= MEASURED_CYCLES)
+    finish(at);
+
+  return true;
+}
+
+static void
+finish(autotune_t* at)
+{
+  float a = at->sum_amplitude / MEASURED_CYCLES;
+
+  /* An oscillation no bigger than the dead band carries no gain information */
+  if (a <= at->band) {
+    at->state = AT_FAILED;
+    return;
+  }
+
+  at->ku = (4 * at->amplitude) / (M_PI * sqrtf((a * a) - (at->band * at->band)));
+  at->tu = at->sum_period / MEASURED_CYCLES;
+
+  /* Ziegler-Nichols: Kp = 0.6 Ku, Ti = Tu / 2, Td = Tu / 8 */
+  at->kp = 0.6f * at->ku;
+  at->ki = at->kp / (at->tu / 2);
+  at->kd = at->kp * (at->tu / 8);
+
+  if (!(at->kp <= PID_GAIN_MAX && at->ki <= PID_GAIN_MAX && at->kd <= PID_GAIN_MAX)) {
+    at->state = AT_FAILED;
+    return;
+  }
+
+  at->state = AT_DONE;
+}
+
+float
+autotune_get_output(const autotune_t* at, int8_t output_sign)
+{
+  float out = at->drive_up ? at->amplitude : -at->amplitude;
+
+  return (output_sign == NEGATIVE) ? -out : out;
+}
+
+uint8_t
+autotune_get_cycles(const autotune_t* at)
+{
+  if (at->switches <= SETTLING_CYCLES + 1)
+    return 0;
+
+  return at->switches - SETTLING_CYCLES - 1;
+}
+
+void
+autotune_get_settings(const autotune_t* at, pid_settings_t* settings)
+{
+  settings->kp = at->kp;
+  settings->ki = at->ki;
+  settings->kd = at->kd;
+
+  /* Measured gains replace the adaptive ones */
+  settings->auto_tune = false;
+}
@@ -0,0 +1,64 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ch.h"
+#include "types.h"
+#include "pid.h"
+
+
+typedef enum {
+  AT_IDLE,
+  AT_RUNNING,
+  AT_DONE,
+  AT_FAILED
+} autotune_state_t;
+
+typedef struct {
+  autotune_state_t state;
+
+  float setpoint;
+  float band;               // relay switches at setpoint +/- band
+  float amplitude;          // relay output swing, in PID output units
+  bool drive_up;            // relay is currently pushing the process up
+
+  float peak_max;
+  float peak_min;
+  uint8_t switches;         // upward crossings seen so far
+  float sum_amplitude;
+  float sum_period;         // seconds
+
+  systime_t start_time;
+  systime_t last_switch;
+
+  /* Results, valid in AT_DONE */
+  float ku;
+  float tu;                 // seconds
+  float kp;
+  float ki;
+  float kd;
+} autotune_t;
+
+/* Published as MSG_AUTOTUNE_STATUS, keyed by controller. Must stay within
+ * the message bus publish size (32 bytes).
+ */
+typedef struct {
+  uint8_t controller;
+  uint8_t state;
+  uint8_t cycles;           // measured cycles completed
+  float ku;
+  float tu;
+  float kp;
+  float ki;
+  float kd;
+} autotune_status_t;
+
+void autotune_start(autotune_t* at, float setpoint, float sample, float band, float amplitude);
+bool autotune_update(autotune_t* at, float sample);
+void autotune_cancel(autotune_t* at);
+float autotune_get_output(const autotune_t* at, int8_t output_sign);
+uint8_t autotune_get_cycles(const autotune_t* at);
+void autotune_get_settings(const autotune_t* at, pid_settings_t* settings);
+
+#endif
@@ -0,0 +1,115 @@
+
+#include "blend.h"
+
+#include <string.h>
+
+
+/* Two pixels stored as one word, first pixel in the low half */
+#define PAIR(p0, p1) ((uint32_t)(p0) | ((uint32_t)(p1) << 16))
+
+typedef uint32_t __attribute__((__may_alias__)) pair_t;
+
+
+/* Sets n pixels to color */
+void
+blend_fill(uint16_t* dst, uint16_t color, int n)
+{
+  uint32_t pair = PAIR(color, color);
+  pair_t* d;
+
+  if ((n > 0) && ((uintptr_t)dst & 2)) {
+    *dst++ = color;
+    n--;
+  }
+
+  for (d = (pair_t*)dst; n >= 2; n -= 2)
+    *d++ = pair;
+
+  if (n > 0)
+    *(uint16_t*)d = color;
+}
+
+/* Writes fcolor over bcolor in alpha to dst */
+void
+blend_solid(uint16_t* dst, const uint8_t* alpha, int n, uint16_t fcolor, uint16_t bcolor)
+{
+  uint32_t f = blend_spread(fcolor);
+  uint32_t b = blend_spread(bcolor);
+  pair_t* d;
+  int i = 0;
+
+  if ((n > 0) && ((uintptr_t)dst & 2)) {
+    dst[0] = blend_pack(blend_spread_pixel(f, b, alpha[0]));
+    i = 1;
+  }
+
+  d = (pair_t*)&dst[i];
+  for (; (i + 1) < n; i += 2) {
+    uint8_t a0 = alpha[i];
+    uint8_t a1 = alpha[i + 1];
+
+    if ((a0 | a1) == 0)
+      *d++ = PAIR(bcolor, bcolor);
+    else if ((a0 & a1) == 255)
+      *d++ = PAIR(fcolor, fcolor);
+    else
+      *d++ = PAIR(blend_pack(blend_spread_pixel(f, b, a0)),
+                  blend_pack(blend_spread_pixel(f, b, a1)));
+  }
+
+  if (i < n)
+    dst[i] = blend_pack(blend_spread_pixel(f, b, alpha[i]));
+}
+
+/* Blends fcolor in alpha over the pixels already in dst. Transparent runs
+ * are left alone.
+ */
+void
+blend_over(uint16_t* dst, const uint8_t* alpha, int n, uint16_t fcolor)
+{
+  uint32_t f = blend_spread(fcolor);
+  int i = 0;
+
+  while (i < n) {
+    if (alpha[i] == 0) {
+      while ((++i < n) && (alpha[i] == 0))
+        ;
+    }
+    else if (alpha[i] == 255) {
+      int run = i;
+      while ((++i < n) && (alpha[i] == 255))
+        ;
+      blend_fill(&dst[run], fcolor, i - run);
+    }
+    else {
+      dst[i] = blend_pack(blend_spread_pixel(f, blend_spread(dst[i]), alpha[i]));
+      i++;
+    }
+  }
+}
+
+/* Blends the pixels px with their alpha over the pixels already in dst.
+ * Transparent runs are left alone and opaque runs copied.
+ */
+void
+blend_rgba_over(uint16_t* dst, const uint16_t* px, const uint8_t* alpha, int n)
+{
+  int i = 0;
+
+  while (i < n) {
+    if (alpha[i] == 0) {
+      while ((++i < n) && (alpha[i] == 0))
+        ;
+    }
+    else if (alpha[i] == 255) {
+      int run = i;
+      while ((++i < n) && (alpha[i] == 255))
+        ;
+      memcpy(&dst[run], &px[run], (i - run) * sizeof(uint16_t));
+    }
+    else {
+      dst[i] = blend_pack(blend_spread_pixel(blend_spread(px[i]), blend_spread(dst[i]), alpha[i]));
+      i++;
+    }
+  }
+}
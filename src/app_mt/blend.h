@@ -0,0 +1,61 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <stdint.h>
+
+/* Alpha blending of RGB565 pixels without divides. A pixel is spread out
+ * to 32 bits as 00000GGGGGG00000RRRRR000000BBBBB so that all three
+ * components can be blended with one multiply, and alpha is cut down to
+ * 0-32 for that. Results are within 2 of
+ *
+ *   (fg * alpha / 255) + (bg * (255 - alpha) / 255)
+ *
+ * in each component, and exact for alpha 0 and 255.
+ *
+ * The row kernels take alpha values for n pixels, go through runs of fully
+ * transparent or opaque pixels without blending and store two pixels at a
+ * time where they can.
+ */
+
+#define BLEND_SPREAD_MASK 0x07E0F81F
+
+static inline uint32_t
+blend_spread(uint16_t c)
+{
+  return (c | ((uint32_t)c << 16)) & BLEND_SPREAD_MASK;
+}
+
+static inline uint16_t
+blend_pack(uint32_t v)
+{
+  return (uint16_t)(v | (v >> 16));
+}
+
+/* Blends spread colours, alpha 0-255 */
+static inline uint32_t
+blend_spread_pixel(uint32_t fg, uint32_t bg, uint8_t alpha)
+{
+  uint32_t a = ((uint32_t)alpha + 4) >> 3;
+  return ((((fg - bg) * a) >> 5) + bg) & BLEND_SPREAD_MASK;
+}
+
+static inline uint16_t
+blend_pixel(uint16_t fg, uint16_t bg, uint8_t alpha)
+{
+  return blend_pack(blend_spread_pixel(blend_spread(fg), blend_spread(bg), alpha));
+}
+
+
+void
+blend_fill(uint16_t* dst, uint16_t color, int n);
+
+void
+blend_solid(uint16_t* dst, const uint8_t* alpha, int n, uint16_t fcolor, uint16_t bcolor);
+
+void
+blend_over(uint16_t* dst, const uint8_t* alpha, int n, uint16_t fcolor);
+
+void
+blend_rgba_over(uint16_t* dst, const uint16_t* px, const uint8_t* alpha, int n);
+
+#endif
@@ -453,8 +453,6 @@
  */
 /*===========================================================================*/
 
-#define MAX_THREAD_MAILBOX_MSGS 64
-
 /**
  * @brief   Threads descriptor structure extension.
  * @details User fields added to the end of the @p Thread structure.
@@ -462,8 +460,6 @@
 #if !defined(THREAD_EXT_FIELDS) || defined(__DOXYGEN__)
 #define THREAD_EXT_FIELDS                                                   \
   /* Add threads custom fields here.*/                                      \
-  Mailbox mb;                                                               \
-  msg_t mb_buf[MAX_THREAD_MAILBOX_MSGS];                                    \
   Semaphore mb_sem;                                                         \
   int local_errno;
 #endif
@@ -478,7 +474,6 @@
 #if !defined(THREAD_EXT_INIT_HOOK) || defined(__DOXYGEN__)
 #define THREAD_EXT_INIT_HOOK(tp) {                                          \
   /* Add threads initialization code here.*/                                \
-  chMBInit(&tp->mb, tp->mb_buf, MAX_THREAD_MAILBOX_MSGS);                   \
   chSemInit(&tp->mb_sem, 0);                                                \
 }
 #endif
@@ -15,6 +15,9 @@
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define LIMIT(val, min, max) MIN(MAX(val, min), max)
 
+/* Upper bound on the build-time sensor/controller/output counts */
+#define MAX_CHANNELS 16
+
 #ifdef REQUIRE_PRINTF_FLOAT
 asm (".global _printf_float");
 #endif
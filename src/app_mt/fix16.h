@@ -0,0 +1,67 @@
+#ifndef FIX16_H
+#define FIX16_H
+
+#include <stdint.h>
+
+/* Signed Q16.16 fixed point */
+typedef int32_t fix16_t;
+
+#define FIX16_ONE     ((fix16_t)0x00010000)
+#define FIX16_MAX     ((fix16_t)0x7FFFFFFF)
+#define FIX16_MIN     ((fix16_t)0x80000000)
+
+#define F2FIX16(f)    ((fix16_t)((f) * FIX16_ONE + (((f) >= 0) ? 0.5f : -0.5f)))
+#define FIX16_2F(x)   ((float)(x) / FIX16_ONE)
+
+
+static inline fix16_t
+fix16_sat(int64_t v)
+{
+  if (v > FIX16_MAX)
+    return FIX16_MAX;
+  if (v < FIX16_MIN)
+    return FIX16_MIN;
+  return (fix16_t)v;
+}
+
+static inline fix16_t
+fix16_add(fix16_t a, fix16_t b)
+{
+  return fix16_sat((int64_t)a + b);
+}
+
+static inline fix16_t
+fix16_sub(fix16_t a, fix16_t b)
+{
+  return fix16_sat((int64_t)a - b);
+}
+
+static inline fix16_t
+fix16_mul(fix16_t a, fix16_t b)
+{
+  int64_t p = (int64_t)a * b;
+
+  /* round to nearest */
+  return fix16_sat((p + (FIX16_ONE / 2)) >> 16);
+}
+
+static inline fix16_t
+fix16_div(fix16_t a, fix16_t b)
+{
+  if (b == 0)
+    return (a >= 0) ? FIX16_MAX : FIX16_MIN;
+
+  return fix16_sat(((int64_t)a << 16) / b);
+}
+
+static inline fix16_t
+fix16_limit(fix16_t v, fix16_t min, fix16_t max)
+{
+  if (v < min)
+    return min;
+  if (v > max)
+    return max;
+  return v;
+}
+
+#endif
@@ -1,6 +1,8 @@
 
 #include "gfx.h"
 #include "lcd.h"
+#include "glyph_cache.h"
+#include "blend.h"
 #include "common.h"
 
 #include <limits.h>
@@ -8,18 +10,6 @@
 #include <stdio.h>
 
 
-// Alpha blending support
-#define RED_COMPONENT(color) (((color) >> 11) & 0x1F)
-#define GREEN_COMPONENT(color) (((color) >> 5) & 0x3F)
-#define BLUE_COMPONENT(color) ((color) & 0x1F)
-
-#define BLENDED_COMPONENT(fg, bg, alpha) (((fg) * (alpha) / 255) + ((bg) * (255-(alpha)) / 255))
-
-#define BLENDED_COLOR(fg, bg, alpha) COLOR16( \
-        BLENDED_COMPONENT(RED_COMPONENT(fg), RED_COMPONENT(bg), alpha), \
-        BLENDED_COMPONENT(GREEN_COMPONENT(fg), GREEN_COMPONENT(bg), alpha), \
-        BLENDED_COMPONENT(BLUE_COMPONENT(fg), BLUE_COMPONENT(bg), alpha))
-
 #define swap(type, a, b) { type SWAP_tmp = a; a = b; b = SWAP_tmp; }
 
 
@@ -29,11 +19,23 @@ typedef enum {
 } BackgroundType;
 
 
+static bool clip_rect(rect_t* rect);
+static bool clip_image(int x, int y, int width, int height, rect_t* src);
 static void draw_horiz_line(int x, int y, int l);
 static void draw_vert_line(int x, int y, int l);
-static uint16_t get_tile_color(const Image_t* img, int x, int y);
-static uint16_t get_bg_color(int x, int y);
+static void draw_run(int x, int y, int w, int h);
+static void tile_row(uint16_t* line, const Image_t* img, int x, int y, int n);
+static void get_bg_row(uint16_t* line, int x, int y, int n);
+static void blend_row(uint16_t* line, const uint8_t* alpha, int x, int y, int n, uint16_t fcolor);
 static void fill_rect(rect_t rect, uint16_t color);
+static bool draw_cached_glyph(const glyph_t* g, rect_t src);
+static bool draw_cached_glyph_alpha(const glyph_t* g, rect_t src);
+static void read_alpha_row(image_alpha_decoder_t* d, uint8_t* alpha, int width, rect_t src, int i);
+static void open_window(rect_t r);
+static void close_window(void);
+static uint16_t* row_buf(int i);
+static void write_px(const uint16_t* buf, uint32_t n);
+static void fill_px(uint16_t color, uint32_t n);
 
 typedef struct gfx_ctx_s {
   uint16_t fcolor;
@@ -43,12 +45,35 @@ typedef struct gfx_ctx_s {
   point_t bg_anchor;
   const font_t* cfont;
   point_t translation;
+  rect_t clip;              // screen coordinates
 
   struct gfx_ctx_s* next;
 } gfx_ctx_t;
 
 gfx_ctx_t* ctx;
 
+/* Rows of pixels are put together here before they are sent to the LCD.
+ * Consecutive rows alternate between the two, so the next row can be built
+ * while the last one is still being sent. While composing, each holds a
+ * band of rows instead.
+ */
+static uint16_t lines[2][GFX_COMPOSE_ROWS * DISP_WIDTH];
+
+/* Band of the screen being composed in lines[buf], and the window opened
+ * in it by the last draw, with the pixels written into that so far
+ */
+static struct {
+  bool active;
+  int buf;
+  rect_t rect;
+  rect_t win;
+  uint32_t pos;
+} band;
+
+/* Image and glyph data is decoded a row at a time into these */
+static uint8_t alpha_line[DISP_WIDTH];
+static uint16_t px_line[DISP_WIDTH];
+
 
 void
 gfx_init()
@@ -60,6 +85,7 @@ gfx_init()
   ctx->fcolor = GREEN;
   ctx->bcolor = BLACK;
   ctx->bg_type = BG_COLOR;
+  ctx->clip = display_rect;
 
   gfx_clear_screen();
 }
@@ -85,6 +111,37 @@ gfx_ctx_pop()
   }
 }
 
+/* Starts composing rect, in screen coordinates and at most
+ * GFX_COMPOSE_ROWS rows high. Until gfx_compose_end() drawing goes into a
+ * buffer instead of to the LCD, so pixels drawn over each other there
+ * reach the LCD once. Drawing must be clipped to rect.
+ */
+void
+gfx_compose_begin(rect_t rect)
+{
+  band.active = true;
+  band.buf ^= 1;
+  band.rect = rect;
+  band.win = rect;
+  band.pos = 0;
+}
+
+/* Sends the composed band to the LCD in one transfer. The next band is
+ * composed in the other buffer while it goes out.
+ */
+void
+gfx_compose_end()
+{
+  rect_t r = band.rect;
+
+  band.active = false;
+  if (rect_empty(r))
+    return;
+
+  lcd_set_cursor(r.x, r.y, r.x + r.width - 1, r.y + r.height - 1);
+  lcd_write_buf(lines[band.buf], r.width * r.height);
+}
+
 void
 gfx_push_translation(uint16_t x, uint16_t y)
 {
@@ -92,14 +149,44 @@ gfx_push_translation(uint16_t x, uint16_t y)
   ctx->translation.y += y;
 }
 
-static void
-gfx_set_cursor(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2)
+/* Limits drawing to rect, given in the current translation, until the
+ * context is popped. The clip can only shrink.
+ */
+void
+gfx_push_clip(rect_t rect)
 {
-  lcd_set_cursor(
-      ctx->translation.x + x1,
-      ctx->translation.y + y1,
-      ctx->translation.x + x2,
-      ctx->translation.y + y2);
+  ctx->clip = rect_intersect(ctx->clip, rect_offset(rect, ctx->translation));
+}
+
+/* Moves rect to screen coordinates and clips it. Returns false if none of
+ * it is left to draw.
+ */
+static bool
+clip_rect(rect_t* rect)
+{
+  *rect = rect_intersect(ctx->clip, rect_offset(*rect, ctx->translation));
+  return !rect_empty(*rect);
+}
+
+/* Clips an image drawn at x, y and opens an LCD window on what is left of
+ * it. src is set to the visible part in image coordinates.
+ */
+static bool
+clip_image(int x, int y, int width, int height, rect_t* src)
+{
+  rect_t r = { x, y, width, height };
+
+  if (!clip_rect(&r))
+    return false;
+
+  src->x = r.x - ctx->translation.x - x;
+  src->y = r.y - ctx->translation.y - y;
+  src->width = r.width;
+  src->height = r.height;
+
+  open_window(r);
+
+  return true;
 }
 
 void
@@ -120,12 +207,11 @@ gfx_fill_rect(rect_t rect)
 static void
 fill_rect(rect_t rect, uint16_t color)
 {
-  int i;
+  if (!clip_rect(&rect))
+    return;
 
-  gfx_set_cursor(rect.x, rect.y, rect.x + rect.width - 1, rect.y + rect.height - 1);
-  for (i = 0; i < (rect.width * rect.height); ++i) {
-    lcd_write_data(color);
-  }
+  open_window(rect);
+  fill_px(color, rect.width * rect.height);
 }
 
 void
@@ -172,127 +258,166 @@ gfx_set_font(const font_t* font)
   ctx->cfont = font;
 }
 
+/* Integer Bresenham. Pixels that share a row (shallow lines) or a column
+ * (steep lines) go out as one run through a single LCD window rather than
+ * a cursor move per pixel.
+ */
 void
 gfx_draw_line(int x1, int y1, int x2, int y2)
 {
-  double delta, tx, ty;
-
-  if (((x2 - x1) < 0)) {
-    swap(int, x1, x2);
-    swap(int, y1, y2);
-  }
-  if (((y2 - y1) < 0)) {
-    swap(int, x1, x2);
-    swap(int, y1, y2);
-  }
+  int dx = abs(x2 - x1);
+  int dy = abs(y2 - y1);
+  int step, err, run, i;
 
-  if (y1 == y2) {
+  if (dx >= dy) {
     if (x1 > x2) {
       swap(int, x1, x2);
-    }
-    draw_horiz_line(x1, y1, x2 - x1);
-  }
-  else if (x1 == x2) {
-    if (y1 > y2) {
       swap(int, y1, y2);
     }
-    draw_vert_line(x1, y1, y2 - y1);
-  }
-  else if (abs(x2 - x1) > abs(y2 - y1)) {
-    delta = ((double) (y2 - y1)) / ((double) (x2 - x1));
-    ty = (double) (y1);
-    if (x1 > x2) {
-      int i;
-      for (i = x1; i >= x2; i--) {
-        gfx_set_cursor(i, (int) (ty + 0.5), i, (int) (ty + 0.5));
-        lcd_write_data(ctx->fcolor);
-        ty = ty - delta;
-      }
-    }
-    else {
-      int i;
-      for (i = x1; i <= x2; i++) {
-        gfx_set_cursor(i, (int) (ty + 0.5), i, (int) (ty + 0.5));
-        lcd_write_data(ctx->fcolor);
-        ty = ty + delta;
+    step = (y2 > y1) ? 1 : -1;
+    err = dx / 2;
+    run = x1;
+
+    for (i = x1; i <= x2; ++i) {
+      err -= dy;
+      if (err < 0) {
+        draw_run(run, y1, i - run + 1, 1);
+        y1 += step;
+        err += dx;
+        run = i + 1;
       }
     }
+    if (run <= x2)
+      draw_run(run, y1, x2 - run + 1, 1);
   }
   else {
-    delta = ((float) (x2 - x1)) / ((float) (y2 - y1));
-    tx = (float) (x1);
     if (y1 > y2) {
-      int i;
-      for (i = y2 + 1; i > y1; i--) {
-        gfx_set_cursor((int) (tx + 0.5), i, (int) (tx + 0.5), i);
-        lcd_write_data(ctx->fcolor);
-        tx = tx + delta;
-      }
+      swap(int, x1, x2);
+      swap(int, y1, y2);
     }
-    else {
-      int i;
-      for (i = y1; i < y2 + 1; i++) {
-        gfx_set_cursor((int) (tx + 0.5), i, (int) (tx + 0.5), i);
-        lcd_write_data(ctx->fcolor);
-        tx = tx + delta;
+    step = (x2 > x1) ? 1 : -1;
+    err = dy / 2;
+    run = y1;
+
+    for (i = y1; i <= y2; ++i) {
+      err -= dx;
+      if (err < 0) {
+        draw_run(x1, run, 1, i - run + 1);
+        x1 += step;
+        err += dy;
+        run = i + 1;
       }
     }
+    if (run <= y2)
+      draw_run(x1, run, 1, y2 - run + 1);
   }
 
-  lcd_clr_cursor();
+  close_window();
 }
 
 static void
-draw_horiz_line(int x, int y, int l)
+draw_run(int x, int y, int w, int h)
 {
-  int i;
+  rect_t r = { x, y, w, h };
+  fill_rect(r, ctx->fcolor);
+}
 
-  gfx_set_cursor(x, y, x + l, y);
-  for (i = 0; i < l + 1; i++) {
-    lcd_write_data(ctx->fcolor);
-  }
-  lcd_clr_cursor();
+static void
+draw_horiz_line(int x, int y, int l)
+{
+  draw_run(x, y, l + 1, 1);
+  close_window();
 }
 
 void
 draw_vert_line(int x, int y, int l)
 {
-  int i;
-
-  gfx_set_cursor(x, y, x, y + l);
-  for (i = 0; i < l; i++) {
-    lcd_write_data(ctx->fcolor);
-  }
-  lcd_clr_cursor();
+  draw_run(x, y, 1, l);
+  close_window();
 }
 
 void
 gfx_draw_glyph(const glyph_t* g, int x, int y)
 {
-  uint16_t j;
+  image_alpha_decoder_t d;
+  rect_t src;
+  int i;
 
-  gfx_set_cursor(x, y, x + g->width - 1, y + g->height - 1);
+  if (!clip_image(x, y, g->width, g->height, &src))
+    return;
 
-  for (j = 0; j < (g->width * g->height); j++) {
-    uint8_t alpha = g->data[j];
-    if (alpha == 255) {
-      lcd_write_data(ctx->fcolor);
+  if ((ctx->bg_type != BG_COLOR) || !draw_cached_glyph(g, src)) {
+    image_alpha_start(&d, g->data);
+    for (i = src.y; i < (src.y + src.height); i++) {
+      uint16_t* line = row_buf(i);
+      read_alpha_row(&d, alpha_line, g->width, src, i);
+      blend_row(line, alpha_line, x + src.x, y + i, src.width, ctx->fcolor);
+      write_px(line, src.width);
     }
-    else {
-      uint16_t by = y + (j / g->width);
-      uint16_t bx = x + (j % g->width);
-      uint16_t bcolor = get_bg_color(bx, by);
+  }
 
-      if (alpha == 0) {
-        lcd_write_data(bcolor);
-      }
-      else {
-        lcd_write_data(BLENDED_COLOR(ctx->fcolor, ctx->bcolor, alpha));
-      }
+  close_window();
+}
+
+/* Over a solid background a glyph comes out the same every time it is
+ * drawn in the same colours, so it is taken from the glyph cache, or its
+ * alpha is if it is a large one. Returns false if it does not fit there.
+ */
+static bool
+draw_cached_glyph(const glyph_t* g, rect_t src)
+{
+  image_alpha_decoder_t d;
+  uint16_t* px;
+  bool filled;
+  int i;
+
+  px = glyph_cache_get(g, ctx->fcolor, ctx->bcolor, &filled);
+  if (px == NULL)
+    return draw_cached_glyph_alpha(g, src);
+
+  if (!filled) {
+    image_alpha_start(&d, g->data);
+    for (i = 0; i < g->height; i++) {
+      image_alpha_read(&d, alpha_line, g->width);
+      blend_solid(&px[i * g->width], alpha_line, g->width, ctx->fcolor, ctx->bcolor);
     }
   }
 
-  lcd_clr_cursor();
+  if (src.width == g->width) {
+    write_px(&px[src.y * g->width], src.width * src.height);
+  }
+  else {
+    for (i = src.y; i < (src.y + src.height); i++)
+      write_px(&px[(i * g->width) + src.x], src.width);
+  }
+
+  return true;
+}
+
+static bool
+draw_cached_glyph_alpha(const glyph_t* g, rect_t src)
+{
+  image_alpha_decoder_t d;
+  uint8_t* alpha;
+  bool filled;
+  int i;
+
+  alpha = glyph_cache_get_alpha(g, &filled);
+  if (alpha == NULL)
+    return false;
+
+  if (!filled) {
+    image_alpha_start(&d, g->data);
+    image_alpha_read(&d, alpha, g->width * g->height);
+  }
+
+  for (i = src.y; i < (src.y + src.height); i++) {
+    uint16_t* line = row_buf(i);
+    blend_solid(line, &alpha[(i * g->width) + src.x], src.width, ctx->fcolor, ctx->bcolor);
+    write_px(line, src.width);
+  }
+
+  return true;
 }
 
 void
@@ -313,113 +438,235 @@ gfx_draw_str(const char *str, int n, int x, int y)
 }
 
 static void
-draw_img_rgba(int x, int y, const Image_t* img)
+draw_img_rgba(int x, int y, const Image_t* img, rect_t src)
 {
+  image_alpha_decoder_t d;
   int i;
-  for (i = 0; i < (img->width * img->height); i++) {
-    uint8_t alpha = img->alpha[i];
-    uint16_t fcolor = img->px[i];
 
-    if (alpha == 255) {
-      lcd_write_data(fcolor);
-    }
-    else {
-      uint16_t by = y + (i / img->width);
-      uint16_t bx = x + (i % img->width);
-
-      uint16_t bcolor = get_bg_color(bx, by);
+  image_alpha_start(&d, img->alpha);
+  for (i = src.y; i < (src.y + src.height); i++) {
+    uint16_t* line = row_buf(i);
 
-      if (alpha == 0) {
-        lcd_write_data(bcolor);
-      }
-      else {
-        lcd_write_data(BLENDED_COLOR(fcolor, bcolor, alpha));
-      }
-    }
+    read_alpha_row(&d, alpha_line, img->width, src, i);
+    image_read_px(img, src.x, i, px_line, src.width);
+    get_bg_row(line, x + src.x, y + i, src.width);
+    blend_rgba_over(line, px_line, alpha_line, src.width);
+    write_px(line, src.width);
   }
 }
 
 static void
-draw_img_a(int x, int y, const Image_t* img)
+draw_img_a(int x, int y, const Image_t* img, rect_t src)
 {
+  image_alpha_decoder_t d;
   int i;
-  for (i = 0; i < (img->width * img->height); i++) {
-    uint8_t alpha = img->alpha[i];
-
-    if (alpha == 255) {
-      lcd_write_data(ctx->fcolor);
-    }
-    else {
-      uint16_t by = y + (i / img->width);
-      uint16_t bx = x + (i % img->width);
 
-      uint16_t bcolor = get_bg_color(bx, by);
-
-      if (alpha == 0) {
-        lcd_write_data(bcolor);
-      }
-      else {
-        lcd_write_data(BLENDED_COLOR(ctx->fcolor, bcolor, alpha));
-      }
-    }
+  image_alpha_start(&d, img->alpha);
+  for (i = src.y; i < (src.y + src.height); i++) {
+    uint16_t* line = row_buf(i);
+    read_alpha_row(&d, alpha_line, img->width, src, i);
+    blend_row(line, alpha_line, x + src.x, y + i, src.width, ctx->fcolor);
+    write_px(line, src.width);
   }
 }
 
+/* Rows of the source window are contiguous when it spans the whole image,
+ * so unclipped bitmaps go out in one transfer. Run length coded ones are
+ * decoded a row at a time.
+ */
 static void
-draw_img_rgb(const Image_t* img)
+draw_img_rgb(const Image_t* img, rect_t src)
 {
   int i;
-  for (i = 0; i < (img->width * img->height); i++) {
-    lcd_write_data(img->px[i]);
+
+  if (img->px == NULL) {
+    for (i = src.y; i < (src.y + src.height); i++) {
+      uint16_t* line = row_buf(i);
+      image_read_px(img, src.x, i, line, src.width);
+      write_px(line, src.width);
+    }
+    return;
   }
+
+  if (src.width == img->width) {
+    write_px(&img->px[src.y * img->width], src.width * src.height);
+    return;
+  }
+
+  for (i = src.y; i < (src.y + src.height); i++)
+    write_px(&img->px[(i * img->width) + src.x], src.width);
 }
 
 void
 gfx_draw_bitmap(int x, int y, const Image_t* img)
 {
-  gfx_set_cursor(x, y, x + img->width - 1, y + img->height - 1);
+  rect_t src;
+  bool has_px = (img->px != NULL) || (img->px_rle != NULL);
 
-  if (img->px != NULL && img->alpha != NULL)
-    draw_img_rgba(x, y, img);
-  else if (img->px != NULL)
-    draw_img_rgb(img);
+  if (!clip_image(x, y, img->width, img->height, &src))
+    return;
+
+  if (has_px && img->alpha != NULL)
+    draw_img_rgba(x, y, img, src);
+  else if (has_px)
+    draw_img_rgb(img, src);
   else if (img->alpha != NULL)
-    draw_img_a(x, y, img);
+    draw_img_a(x, y, img, src);
 
-  lcd_clr_cursor();
+  close_window();
 }
 
-static uint16_t
-get_tile_color(const Image_t* img, int x, int y)
+/* Fills line with n pixels of img, tiled from 0, 0, starting at x, y */
+static void
+tile_row(uint16_t* line, const Image_t* img, int x, int y, int n)
 {
-  uint16_t imx = x % img->width;
-  uint16_t imy = y % img->height;
-  uint16_t col = img->px[imx + (imy * img->width)];
-  return col;
+  int row = y % img->height;
+  int col = x % img->width;
+  int j;
+
+  if (row < 0)
+    row += img->height;
+  if (col < 0)
+    col += img->width;
+
+  for (j = 0; j < n; ) {
+    int run = MIN(img->width - col, n - j);
+    image_read_px(img, col, row, &line[j], run);
+    j += run;
+    col = 0;
+  }
 }
 
-static uint16_t
-get_bg_color(int x, int y)
+/* Fills line with n pixels of the background starting at x, y */
+static void
+get_bg_row(uint16_t* line, int x, int y, int n)
+{
+  if (ctx->bg_type == BG_IMAGE)
+    tile_row(line, ctx->bg_img, x - ctx->bg_anchor.x, y - ctx->bg_anchor.y, n);
+  else
+    blend_fill(line, ctx->bcolor, n);
+}
+
+/* Fills line with n pixels of fcolor in alpha over the background starting
+ * at x, y.
+ */
+static void
+blend_row(uint16_t* line, const uint8_t* alpha, int x, int y, int n, uint16_t fcolor)
 {
   if (ctx->bg_type == BG_IMAGE) {
-    return get_tile_color(ctx->bg_img, x - ctx->bg_anchor.x, y - ctx->bg_anchor.y);
+    get_bg_row(line, x, y, n);
+    blend_over(line, alpha, n, fcolor);
   }
   else {
-    return ctx->bcolor;
+    blend_solid(line, alpha, n, fcolor, ctx->bcolor);
   }
 }
 
+/* Decodes row i of the src window of width pixels wide alpha data. Rows
+ * have to be read in order starting from src.y.
+ */
+static void
+read_alpha_row(image_alpha_decoder_t* d, uint8_t* alpha, int width, rect_t src, int i)
+{
+  if (i == src.y)
+    image_alpha_read(d, NULL, (src.y * width) + src.x);
+  else
+    image_alpha_read(d, NULL, width - src.width);
+
+  image_alpha_read(d, alpha, src.width);
+}
+
+/* Tiles img over rect from its top left corner */
 void
 gfx_tile_bitmap(const Image_t* img, rect_t rect)
 {
-  int i, j;
+  rect_t src;
+  int i;
+
+  if (!clip_image(rect.x, rect.y, rect.width, rect.height, &src))
+    return;
+
+  for (i = src.y; i < (src.y + src.height); ++i) {
+    uint16_t* line = row_buf(i);
+    tile_row(line, img, src.x, i, src.width);
+    write_px(line, src.width);
+  }
+  close_window();
+}
+
+/* Sets where the pixels of the next draw go, r in screen coordinates */
+static void
+open_window(rect_t r)
+{
+  if (band.active) {
+    band.win = r;
+    band.pos = 0;
+  }
+  else {
+    lcd_set_cursor(r.x, r.y, r.x + r.width - 1, r.y + r.height - 1);
+  }
+}
+
+static void
+close_window()
+{
+  if (!band.active)
+    lcd_clr_cursor();
+}
 
-  gfx_set_cursor(rect.x, rect.y, rect.x + rect.width - 1, rect.y + rect.height - 1);
-  for (i = 0; i < rect.height; ++i) {
-    for (j = 0; j < rect.width; ++j) {
-      lcd_write_data(get_tile_color(img, j, i));
-    }
+/* Where row i of the window is built: in place in the band while composing,
+ * otherwise in one of lines[] to be sent
+ */
+static uint16_t*
+row_buf(int i)
+{
+  if (band.active) {
+    uint32_t row = band.pos / band.win.width;
+    return &lines[band.buf][((band.win.y - band.rect.y + row) * band.rect.width) +
+                            (band.win.x - band.rect.x)];
   }
-  lcd_clr_cursor();
+
+  return lines[i & 1];
 }
 
+/* Writes n pixels at the window's cursor, which wraps like the LCD's */
+static void
+write_px(const uint16_t* buf, uint32_t n)
+{
+  if (!band.active) {
+    lcd_write_buf(buf, n);
+    return;
+  }
+
+  while (n > 0) {
+    uint16_t* dst = row_buf(0) + (band.pos % band.win.width);
+    uint32_t run = MIN(n, band.win.width - (band.pos % band.win.width));
+
+    /* Rows built by row_buf() are already in place */
+    if (dst != buf)
+      memcpy(dst, buf, run * sizeof(uint16_t));
+
+    buf += run;
+    n -= run;
+    band.pos = (band.pos + run) % (band.win.width * band.win.height);
+  }
+}
+
+static void
+fill_px(uint16_t color, uint32_t n)
+{
+  if (!band.active) {
+    lcd_fill(color, n);
+    return;
+  }
+
+  while (n > 0) {
+    uint16_t* dst = row_buf(0) + (band.pos % band.win.width);
+    uint32_t run = MIN(n, band.win.width - (band.pos % band.win.width));
+
+    blend_fill(dst, color, run);
+
+    n -= run;
+    band.pos = (band.pos + run) % (band.win.width * band.win.height);
+  }
+}
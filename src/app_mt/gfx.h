@@ -42,6 +42,11 @@
 #define TAUPE      COLOR24(135, 121, 78)
 #define PURPLE     COLOR24(167, 0, 174)
 
+/* Rows of the screen composed at a time, see gfx_compose_begin() */
+#ifndef GFX_COMPOSE_ROWS
+#define GFX_COMPOSE_ROWS 8
+#endif
+
 
 void
 gfx_init(void);
@@ -52,9 +57,18 @@ gfx_ctx_push(void);
 void
 gfx_ctx_pop(void);
 
+void
+gfx_compose_begin(rect_t rect);
+
+void
+gfx_compose_end(void);
+
 void
 gfx_push_translation(uint16_t x, uint16_t y);
 
+void
+gfx_push_clip(rect_t rect);
+
 void
 gfx_clear_screen(void);
 
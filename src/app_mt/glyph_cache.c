@@ -0,0 +1,165 @@
+
+#include "glyph_cache.h"
+
+#include <stdlib.h>
+
+
+#ifndef GLYPH_CACHE_SIZE
+#define GLYPH_CACHE_SIZE 4096
+#endif
+
+/* Holds the digit set of the 62 px font, 0-9 and the point */
+#ifndef GLYPH_ALPHA_CACHE_SIZE
+#define GLYPH_ALPHA_CACHE_SIZE 16384
+#endif
+
+
+typedef struct glyph_entry_s {
+  const glyph_t* glyph;
+  uint16_t fcolor;
+  uint16_t bcolor;
+  uint32_t size;            // of the whole entry
+  struct glyph_entry_s* prev;
+  struct glyph_entry_s* next;
+  uint16_t px[];
+} glyph_entry_t;
+
+typedef struct {
+  /* Most recently used first */
+  glyph_entry_t* head;
+  glyph_entry_t* tail;
+  uint32_t limit;           // bytes
+  glyph_cache_stats_t stats;
+} cache_t;
+
+
+static glyph_entry_t* get_entry(cache_t* c, const glyph_t* g,
+    uint16_t fcolor, uint16_t bcolor, uint32_t px_size, bool* filled);
+static void unlink_entry(cache_t* c, glyph_entry_t* e);
+static void push_front(cache_t* c, glyph_entry_t* e);
+
+
+static cache_t blended = { .limit = GLYPH_CACHE_SIZE };
+static cache_t alpha = { .limit = GLYPH_ALPHA_CACHE_SIZE };
+
+
+/* Returns the pixels of g in fcolor over bcolor, g->width * g->height of
+ * them in rows. *filled is false if the entry is new and the caller has to
+ * render the glyph into it before using it. Returns NULL if the glyph is
+ * too large for this cache, see glyph_cache_get_alpha().
+ *
+ * The pixels stay valid until the next call.
+ */
+uint16_t*
+glyph_cache_get(const glyph_t* g, uint16_t fcolor, uint16_t bcolor, bool* filled)
+{
+  uint32_t px_size = g->width * g->height * sizeof(uint16_t);
+  glyph_entry_t* e;
+
+  if ((sizeof(glyph_entry_t) + px_size) > (GLYPH_CACHE_SIZE / 4))
+    return NULL;
+
+  e = get_entry(&blended, g, fcolor, bcolor, px_size, filled);
+
+  return (e != NULL) ? e->px : NULL;
+}
+
+/* Returns the alpha of g, 0-255 for each of its g->width * g->height pixels
+ * in rows, for the glyphs glyph_cache_get() turns away. *filled is as
+ * above. Returns NULL if the glyph does not fit in the cache at all.
+ *
+ * The alpha stays valid until the next call.
+ */
+uint8_t*
+glyph_cache_get_alpha(const glyph_t* g, bool* filled)
+{
+  glyph_entry_t* e = get_entry(&alpha, g, 0, 0, g->width * g->height, filled);
+
+  return (e != NULL) ? (uint8_t*)e->px : NULL;
+}
+
+void
+glyph_cache_get_stats(glyph_cache_stats_t* s)
+{
+  *s = blended.stats;
+}
+
+void
+glyph_cache_get_alpha_stats(glyph_cache_stats_t* s)
+{
+  *s = alpha.stats;
+}
+
+static glyph_entry_t*
+get_entry(cache_t* c, const glyph_t* g,
+    uint16_t fcolor, uint16_t bcolor, uint32_t px_size, bool* filled)
+{
+  glyph_entry_t* e;
+  uint32_t size;
+
+  for (e = c->head; e != NULL; e = e->next) {
+    if ((e->glyph == g) && (e->fcolor == fcolor) && (e->bcolor == bcolor)) {
+      if (e != c->head) {
+        unlink_entry(c, e);
+        push_front(c, e);
+      }
+      c->stats.hits++;
+      *filled = true;
+      return e;
+    }
+  }
+
+  c->stats.misses++;
+
+  size = sizeof(glyph_entry_t) + px_size;
+  if (size > c->limit)
+    return NULL;
+
+  while ((c->stats.bytes + size) > c->limit) {
+    e = c->tail;
+    unlink_entry(c, e);
+    c->stats.bytes -= e->size;
+    c->stats.evictions++;
+    free(e);
+  }
+
+  e = malloc(size);
+  if (e == NULL)
+    return NULL;
+
+  e->glyph = g;
+  e->fcolor = fcolor;
+  e->bcolor = bcolor;
+  e->size = size;
+  push_front(c, e);
+  c->stats.bytes += size;
+
+  *filled = false;
+  return e;
+}
+
+static void
+unlink_entry(cache_t* c, glyph_entry_t* e)
+{
+  if (e->prev != NULL)
+    e->prev->next = e->next;
+  else
+    c->head = e->next;
+
+  if (e->next != NULL)
+    e->next->prev = e->prev;
+  else
+    c->tail = e->prev;
+}
+
+static void
+push_front(cache_t* c, glyph_entry_t* e)
+{
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head != NULL)
+    c->head->prev = e;
+  else
+    c->tail = e;
+  c->head = e;
+}
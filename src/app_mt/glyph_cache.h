@@ -0,0 +1,44 @@
+#ifndef GLYPH_CACHE_H
+#define GLYPH_CACHE_H
+
+#include "font.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Glyphs pre-blended to RGB565 for a given foreground and background
+ * colour, so that text over a solid background can be sent straight to the
+ * LCD. The glyph pointer stands for the font and character. Entries are
+ * allocated from the heap, no more than GLYPH_CACHE_SIZE bytes of them, and
+ * the least recently used ones are dropped to make room.
+ *
+ * A glyph that would take more than a quarter of that, like the digits of
+ * the 62 px font, would flush the rest of the text out, and the same digit
+ * is shown over each channel's colour. Those are kept instead as decoded
+ * alpha in a cache of their own, GLYPH_ALPHA_CACHE_SIZE bytes that all
+ * colours share, and blended as they are drawn.
+ *
+ * Only for use by the GUI thread.
+ */
+
+typedef struct {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t evictions;
+  uint32_t bytes;           // in use
+} glyph_cache_stats_t;
+
+
+uint16_t*
+glyph_cache_get(const glyph_t* g, uint16_t fcolor, uint16_t bcolor, bool* filled);
+
+uint8_t*
+glyph_cache_get_alpha(const glyph_t* g, bool* filled);
+
+void
+glyph_cache_get_stats(glyph_cache_stats_t* stats);
+
+void
+glyph_cache_get_alpha_stats(glyph_cache_stats_t* stats);
+
+#endif
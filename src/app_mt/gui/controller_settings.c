@@ -21,36 +21,45 @@
 #define MAX_TEMP_F (950)
 #define MIN_TEMP_F (-58)
 
+/* Sensor, resolution, filter, setpoint type and setpoint, autotune, and a
+ * use and a settings button per output
+ */
+#define MAX_BUTTONS (6 + (2 * NUM_OUTPUTS))
 
-typedef enum {
-  SELECT_NONE,
-  SELECT_1,
-  SELECT_2,
-  SELECT_1_2,
+#define OUTPUT_TEXT_LEN 24
 
-  NUM_OUTPUT_SELECTIONS
-} output_selection_t;
 
+struct controller_settings_screen_s;
 
 typedef struct {
+  struct controller_settings_screen_s* screen;
+  output_id_t output;
+} output_button_t;
+
+typedef struct controller_settings_screen_s {
   widget_t* screen;
   widget_t* button_list;
 
   temp_controller_id_t controller;
   controller_settings_t settings;
 
-  uint8_t output_selection;
-  output_selection_t output_selection_valid[NUM_OUTPUT_SELECTIONS];
+  uint16_t outputs_taken;   // by other controllers, one bit each
+  output_button_t output_buttons[NUM_OUTPUTS];
 } controller_settings_screen_t;
 
 
 static void controller_settings_screen_destroy(widget_t* w);
 static void set_controller_settings(controller_settings_screen_t* s);
-static void output_selection_button_clicked(button_event_t* event);
+static void sensor_button_clicked(button_event_t* event);
+static void resolution_button_clicked(button_event_t* event);
+static void filter_button_clicked(button_event_t* event);
+static sensor_filter_preset_t get_filter_preset(sensor_id_t sensor);
+static void output_button_clicked(button_event_t* event);
 static void temp_profile_button_clicked(button_event_t* event);
 static void setpoint_type_button_clicked(button_event_t* event);
 static void static_setpoint_button_clicked(button_event_t* event);
 static void output_settings_button_clicked(button_event_t* event);
+static void autotune_button_clicked(button_event_t* event);
 static void update_static_setpoint(quantity_t delay, void* user_data);
 static void back_button_clicked(button_event_t* event);
 
@@ -68,48 +77,33 @@ controller_settings_screen_create(temp_controller_id_t controller)
   s->screen = widget_create(NULL, &controller_settings_widget_class, s, display_rect);
   widget_set_background(s->screen, BLACK, FALSE);
 
-  char* title;
-  temp_controller_id_t other_controller;
-  if (controller == CONTROLLER_1) {
-    title = "Controller 1 Setup";
-    other_controller = CONTROLLER_2;
-  }
-  else {
-    title = "Controller 2 Setup";
-    other_controller = CONTROLLER_1;
-  }
+  int i;
+  char title[32];
+  snprintf(title, sizeof(title), "Controller %d Setup", controller + 1);
   s->button_list = button_list_screen_create(s->screen, title, back_button_clicked, s);
 
   s->controller = controller;
   s->settings = *app_cfg_get_controller_settings(controller);
 
-  /* Convert enabled flags to selection enum */
-  if (s->settings.output_settings[OUTPUT_1].enabled &&
-      s->settings.output_settings[OUTPUT_2].enabled)
-    s->output_selection = SELECT_1_2;
-  else if (s->settings.output_settings[OUTPUT_1].enabled)
-    s->output_selection = SELECT_1;
-  else if (s->settings.output_settings[OUTPUT_2].enabled)
-    s->output_selection = SELECT_2;
-  else
-    s->output_selection = SELECT_NONE;
+  /* Outputs being controlled by the other controllers can't be used */
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    const controller_settings_t* other_controller_settings = app_cfg_get_controller_settings(i);
+    int j;
 
-  /* Figure out which output selections are allowed by checking which outputs are currently
-   * being controlled by the other controller.
-   */
-  const controller_settings_t* other_controller_settings = app_cfg_get_controller_settings(other_controller);
-  s->output_selection_valid[SELECT_NONE] = true;
-  if (!other_controller_settings->output_settings[OUTPUT_1].enabled)
-    s->output_selection_valid[SELECT_1] = true;
-  if (!other_controller_settings->output_settings[OUTPUT_2].enabled)
-    s->output_selection_valid[SELECT_2] = true;
-  if (!other_controller_settings->output_settings[OUTPUT_1].enabled &&
-      !other_controller_settings->output_settings[OUTPUT_2].enabled)
-    s->output_selection_valid[SELECT_1_2] = true;
-
-  /* If the current output selection is not valid, set it to none */
-  if (!s->output_selection_valid[s->output_selection])
-    s->output_selection = SELECT_NONE;
+    if (i == (int)controller)
+      continue;
+    for (j = 0; j < NUM_OUTPUTS; ++j) {
+      if (other_controller_settings->output_settings[j].enabled)
+        SETBIT(&s->outputs_taken, j);
+    }
+  }
+
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    s->output_buttons[i].screen = s;
+    s->output_buttons[i].output = i;
+    if (TESTBIT(&s->outputs_taken, i))
+      s->settings.output_settings[i].enabled = false;
+  }
 
   set_controller_settings(s);
 
@@ -147,10 +141,41 @@ static void
 set_controller_settings(controller_settings_screen_t* s)
 {
   uint32_t num_buttons = 0;
-  button_spec_t buttons[16];
+  button_spec_t buttons[MAX_BUTTONS];
+  bool any_output = false;
+  int i;
 
   char* subtext;
   char* setpoint_subtext;
+  char* sensor_subtext;
+  char* resolution_subtext;
+  char (*output_text)[OUTPUT_TEXT_LEN];
+
+  sensor_subtext = malloc(128);
+  const sensor_device_t* dev = app_cfg_get_sensor_device(s->settings.sensor);
+  if (dev != NULL)
+    snprintf(sensor_subtext, 128, "Probe %d on port %d (%02X%02X%02X%02X%02X%02X)",
+        s->settings.sensor + 1, dev->port + 1,
+        dev->rom[6], dev->rom[5], dev->rom[4], dev->rom[3], dev->rom[2], dev->rom[1]);
+  else if (s->settings.sensor != SENSOR_NONE)
+    snprintf(sensor_subtext, 128, "Probe %d (not found yet)", s->settings.sensor + 1);
+  else
+    snprintf(sensor_subtext, 128, "No probe");
+
+  add_button_spec(buttons, &num_buttons, sensor_button_clicked, img_temp_med, CYAN,
+      "Sensor", sensor_subtext, s);
+
+  resolution_subtext = malloc(128);
+  if (dev != NULL && dev->rom[0] == 0x28) {
+    snprintf(resolution_subtext, 128, "%d bit - %d ms per conversion",
+        dev->resolution, 94 << (dev->resolution - SENSOR_RESOLUTION_MIN));
+    add_button_spec(buttons, &num_buttons, resolution_button_clicked, img_temp_med, CYAN,
+        "Sensor Resolution", resolution_subtext, s);
+  }
+
+  if (s->settings.sensor != SENSOR_NONE)
+    add_button_spec(buttons, &num_buttons, filter_button_clicked, img_temp_med, CYAN,
+        "Sensor Filter", sensor_filter_get_preset_name(get_filter_preset(s->settings.sensor)), s);
 
   switch (s->settings.setpoint_type) {
     case SP_STATIC:
@@ -205,80 +230,137 @@ set_controller_settings(controller_settings_screen_t* s)
       break;
   }
 
-  switch (s->output_selection) {
-    case SELECT_1:
-      subtext = "Use Output #1";
-      break;
+  /* A button to use or release each output the other controllers don't
+   * use, followed by the settings of the used ones
+   */
+  output_text = malloc(2 * NUM_OUTPUTS * OUTPUT_TEXT_LEN);
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    bool enabled = s->settings.output_settings[i].enabled;
 
-    case SELECT_2:
-      subtext = "Use Output #2";
-      break;
+    if (TESTBIT(&s->outputs_taken, i))
+      continue;
 
-    case SELECT_1_2:
-      subtext = "Use Output #1 & #2";
-      break;
-
-    default:
-    case SELECT_NONE:
-      subtext = "No output";
-      break;
+    snprintf(output_text[i], OUTPUT_TEXT_LEN, "Output %d", i + 1);
+    add_button_spec(buttons, &num_buttons, output_button_clicked, img_plug, CYAN,
+        output_text[i], enabled ? "Used by this controller" : "Not used",
+        &s->output_buttons[i]);
   }
 
-  add_button_spec(buttons, &num_buttons, output_selection_button_clicked, img_plug, CYAN,
-      "Output Selection", subtext, s);
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    if (!s->settings.output_settings[i].enabled)
+      continue;
 
-  if (s->settings.output_settings[OUTPUT_1].enabled)
+    snprintf(output_text[NUM_OUTPUTS + i], OUTPUT_TEXT_LEN, "Output %d Settings", i + 1);
     add_button_spec(buttons, &num_buttons, output_settings_button_clicked, img_plug, CYAN,
-        "Output 1 Settings", "Set settings for output 1", &s->settings.output_settings[OUTPUT_1]);
+        output_text[NUM_OUTPUTS + i], "Set settings for this output", &s->settings.output_settings[i]);
+    any_output = true;
+  }
 
-  if (s->settings.output_settings[OUTPUT_2].enabled)
-    add_button_spec(buttons, &num_buttons, output_settings_button_clicked, img_plug, CYAN,
-        "Output 2 Settings", "Set settings for output 2", &s->settings.output_settings[OUTPUT_2]);
+  if (any_output)
+    add_button_spec(buttons, &num_buttons, autotune_button_clicked, img_graph_signal, CYAN,
+        "PID Autotune", "Measure PID gains with a relay test", s);
 
   button_list_set_buttons(s->button_list, buttons, num_buttons);
+  free(output_text);
   free(setpoint_subtext);
+  free(sensor_subtext);
+  free(resolution_subtext);
 }
 
 static void
-output_selection_button_clicked(button_event_t* event)
+sensor_button_clicked(button_event_t* event)
 {
   if (event->id == EVT_BUTTON_CLICK) {
     controller_settings_screen_t* s = widget_get_user_data(event->widget);
+    int sensor = s->settings.sensor;
 
-    /* Find the next valid output selection */
+    /* Step through the discovered probes, then no probe */
     do {
-      if (++s->output_selection >= NUM_OUTPUT_SELECTIONS)
-        s->output_selection = 0;
-    } while (!s->output_selection_valid[s->output_selection]);
-
-    /* Set output enabled flags accordingly */
-    switch (s->output_selection) {
-      case SELECT_1:
-        s->settings.output_settings[OUTPUT_1].enabled = true;
-        s->settings.output_settings[OUTPUT_2].enabled = false;
+      if (++sensor >= NUM_SENSORS) {
+        sensor = SENSOR_NONE;
         break;
+      }
+    } while (app_cfg_get_sensor_device(sensor) == NULL);
 
-      case SELECT_2:
-        s->settings.output_settings[OUTPUT_1].enabled = false;
-        s->settings.output_settings[OUTPUT_2].enabled = true;
-        break;
+    s->settings.sensor = sensor;
+    set_controller_settings(s);
+  }
+}
 
-      case SELECT_1_2:
-        s->settings.output_settings[OUTPUT_1].enabled = true;
-        s->settings.output_settings[OUTPUT_2].enabled = true;
-        break;
+static void
+resolution_button_clicked(button_event_t* event)
+{
+  if (event->id == EVT_BUTTON_CLICK) {
+    controller_settings_screen_t* s = widget_get_user_data(event->widget);
+    const sensor_device_t* dev = app_cfg_get_sensor_device(s->settings.sensor);
 
-      default:
-      case SELECT_NONE:
-        s->settings.output_settings[OUTPUT_1].enabled = false;
-        s->settings.output_settings[OUTPUT_2].enabled = false;
-        break;
-    }
+    if (dev == NULL)
+      return;
 
+    /* Step down from full resolution, then wrap */
+    uint8_t resolution = dev->resolution - 1;
+    if (resolution < SENSOR_RESOLUTION_MIN)
+      resolution = SENSOR_RESOLUTION_MAX;
+
+    /* Resolution belongs to the probe and applies right away */
+    app_cfg_set_sensor_resolution(s->settings.sensor, resolution);
     set_controller_settings(s);
   }
 }
 
+/* NUM_FILTER_PRESETS if the chain isn't one of the presets */
+static sensor_filter_preset_t
+get_filter_preset(sensor_id_t sensor)
+{
+  const sensor_filter_settings_t* fs = app_cfg_get_sensor_filter_settings(sensor);
+  sensor_filter_settings_t preset_settings;
+  int i;
+
+  if (fs == NULL)
+    return NUM_FILTER_PRESETS;
+
+  for (i = 0; i < NUM_FILTER_PRESETS; ++i) {
+    sensor_filter_get_preset_settings(i, &preset_settings);
+    if (memcmp(fs, &preset_settings, sizeof(preset_settings)) == 0)
+      return i;
+  }
+
+  return NUM_FILTER_PRESETS;
+}
+
+static void
+filter_button_clicked(button_event_t* event)
+{
+  if (event->id == EVT_BUTTON_CLICK) {
+    controller_settings_screen_t* s = widget_get_user_data(event->widget);
+    sensor_filter_settings_t fs;
+
+    /* Next preset, or the default from a custom chain */
+    sensor_filter_preset_t preset = get_filter_preset(s->settings.sensor) + 1;
+    if (preset >= NUM_FILTER_PRESETS)
+      preset = FILTER_PRESET_DEFAULT;
+
+    /* Like the resolution, the chain belongs to the probe and applies with
+     * its next sample
+     */
+    sensor_filter_get_preset_settings(preset, &fs);
+    app_cfg_set_sensor_filter_settings(s->settings.sensor, &fs);
+    set_controller_settings(s);
+  }
+}
+
+static void
+output_button_clicked(button_event_t* event)
+{
+  if (event->id == EVT_BUTTON_CLICK) {
+    output_button_t* b = widget_get_user_data(event->widget);
+    output_settings_t* os = &b->screen->settings.output_settings[b->output];
+
+    os->enabled = !os->enabled;
+    set_controller_settings(b->screen);
+  }
+}
+
 static void
 setpoint_type_button_clicked(button_event_t* event)
 {
@@ -321,11 +403,8 @@ static_setpoint_button_clicked(button_event_t* event)
   float min;
   float max;
 
-  char* title;
-  if (s->controller == CONTROLLER_1)
-    title = "Controller 1 Setpoint";
-  else
-    title = "Controller 2 Setpoint";
+  char title[32];
+  snprintf(title, sizeof(title), "Controller %d Setpoint", s->controller + 1);
 
   float velocity_steps[] = {
       0.1f, 0.5f, 1.0f
@@ -358,6 +437,22 @@ output_settings_button_clicked(button_event_t* event)
   gui_push_screen(settings_screen);
 }
 
+static void
+autotune_button_clicked(button_event_t* event)
+{
+  if (event->id != EVT_BUTTON_CLICK)
+    return;
+
+  controller_settings_screen_t* s = widget_get_user_data(event->widget);
+
+  /* Apply any pending changes first, they would cancel the autotune */
+  s->settings.pid_settings = app_cfg_get_controller_settings(s->controller)->pid_settings;
+  app_cfg_set_controller_settings(s->controller, SS_DEVICE, &s->settings);
+  temp_control_autotune(s->controller, true);
+
+  gui_pop_screen();
+}
+
 static void
 update_static_setpoint(quantity_t setpoint, void* user_data)
 {
@@ -373,6 +468,8 @@ back_button_clicked(button_event_t* event)
   if (event->id == EVT_BUTTON_CLICK) {
     controller_settings_screen_t* s = widget_get_user_data(event->widget);
 
+    /* Gains may have been autotuned while this screen was open */
+    s->settings.pid_settings = app_cfg_get_controller_settings(s->controller)->pid_settings;
     app_cfg_set_controller_settings(s->controller, SS_DEVICE, &s->settings);
 
     gui_pop_screen();
@@ -1,34 +1,177 @@
 
 #include "scatter_plot.h"
 #include "gfx.h"
+#include "gui.h"
+#include "app_cfg.h"
+#include "temp_control.h"
+#include "sample_store.h"
 
 #include <string.h>
+#include <stdio.h>
+#include <math.h>
 
+/*
+ * Temperature history of one probe: the min-max range and mean of each
+ * column, the controller's setpoint, and a band per relay showing when it
+ * was on.
+ *
+ * The plot is split into columns of col_period seconds, chosen so a span
+ * divides evenly into columns and grid lines land on the same x every time
+ * the view wraps. Data older than the plot comes from the sample store, at
+ * whichever tier fits the span. After that the live view accumulates
+ * MSG_SENSOR_SAMPLE into the current column itself.
+ *
+ * The panel can only scroll as a whole, so the live view does not shift.
+ * Each finished column is composed in a line buffer and written through a
+ * one pixel wide LCD window at a cursor that sweeps left to right over the
+ * oldest column; the column after it is blanked to mark the sweep. Only a
+ * pan, a zoom or a value outside the y range repaints the whole plot.
+ */
+
+#define AXIS_WIDTH      30        // y labels
+#define LABEL_WIDTH     32        // x labels
+#define BAND_HEIGHT     3         // per relay, below the curves
+#define MAX_PLOT_HEIGHT 240
+#define TAP_DISTANCE    10        // touch movement below this is a tap
+
+#define COL_EMPTY       INT16_MIN
+
+#define MEAN_COLOR      AMBER
+#define RANGE_COLOR     BROWN
+#define SETPOINT_COLOR  WHITE
+#define GRID_COLOR      DARK_GRAY
+#define LABEL_COLOR     LIGHT_GRAY
+#define PLOT_BG_COLOR   BLACK
+
+
+typedef struct {
+  uint32_t span;            // seconds across the plot
+  uint32_t tick;            // seconds between grid lines
+  const char* name;
+} span_info_t;
+
+/* One column, in tenths of a degree in the display unit */
+typedef struct {
+  int16_t mean;             // COL_EMPTY if there is no data
+  int16_t min;
+  int16_t max;
+  int16_t setpoint;         // COL_EMPTY if no controller uses the probe
+  uint16_t count;           // samples behind mean
+  uint16_t outputs;         // relays on during the column
+} plot_col_t;
+
+/* Live samples of the column in progress, in degrees F like the samples */
+typedef struct {
+  uint32_t col;
+  uint16_t count;
+  uint16_t outputs;
+  float sum;
+  float min;
+  float max;
+  float setpoint;
+} live_col_t;
 
 typedef struct {
   widget_t* widget;
-} scatter_plot_t;
+  rect_t area;              // plot area, relative to the widget
+  int data_height;          // rows above the relay bands
+  int max_cols;
+  plot_col_t* cols;         // cols[col % num_cols]
 
+  sensor_id_t sensor;
+  unit_t unit;
+  uint8_t span;
+  bool live;                // view follows the newest data
+  uint32_t col_period;      // seconds per column
+  int num_cols;
+  uint32_t end_time;        // end of the newest column in the view
+  uint32_t end_col;         // newest column in the view
+  uint32_t origin_col;      // column at the left edge at the last full paint
+  uint32_t drawn_col;       // newest column on screen
+  uint32_t load_period;     // record period of the tier being loaded
+  int16_t y_min;
+  int16_t y_max;
+  int16_t y_step;
 
-static void
-scatter_plot_paint(paint_event_t* event);
+  live_col_t acc;
+  uint16_t outputs_on;
+
+  bool touch_down;
+  int touch_x;
+} scatter_plot_t;
 
-static void
-scatter_plot_destroy(widget_t* w);
+
+static void scatter_plot_paint(paint_event_t* event);
+static void scatter_plot_update(paint_event_t* event);
+static void scatter_plot_msg(msg_event_t* event);
+static void scatter_plot_touch(touch_event_t* event);
+static void scatter_plot_destroy(widget_t* w);
+static void dispatch_sensor_sample(scatter_plot_t* s, sensor_msg_t* msg);
+static void load(scatter_plot_t* s);
+static void load_record(const sample_record_t* rec, void* user_data);
+static void commit_acc(scatter_plot_t* s);
+static void clear_col(plot_col_t* pc);
+static void merge_col(scatter_plot_t* s, uint32_t col, const plot_col_t* src);
+static bool col_in_range(scatter_plot_t* s, const plot_col_t* pc);
+static void update_y_range(scatter_plot_t* s);
+static int value_y(scatter_plot_t* s, int16_t value);
+static int16_t to_tenths(scatter_plot_t* s, float value);
+static bool is_tick(scatter_plot_t* s, uint32_t col);
+static void draw_column(scatter_plot_t* s, rect_t r, uint32_t col);
+static void draw_cursor(scatter_plot_t* s, rect_t r, int x);
+static void draw_strip(scatter_plot_t* s, rect_t r, int x, const uint16_t* px);
+static void draw_tick_label(scatter_plot_t* s, rect_t r, uint32_t col, int x);
+static void fill_run(uint16_t* px, int y0, int y1, uint16_t color);
+static sensor_id_t next_sensor(sensor_id_t sensor);
 
 
 static const widget_class_t scatter_plot_widget_class = {
     .on_paint   = scatter_plot_paint,
+    .on_update  = scatter_plot_update,
+    .on_msg     = scatter_plot_msg,
+    .on_touch   = scatter_plot_touch,
     .on_destroy = scatter_plot_destroy
 };
 
+static const span_info_t spans[] = {
+    { .span = 3600,      .tick = 900,      .name = "1 h" },
+    { .span = 6 * 3600,  .tick = 3600,     .name = "6 h" },
+    { .span = 24 * 3600, .tick = 6 * 3600, .name = "24 h" },
+    { .span = 3 * 86400, .tick = 86400,    .name = "3 days" },
+    { .span = 7 * 86400, .tick = 86400,    .name = "7 days" },
+};
+#define NUM_SPANS (sizeof(spans) / sizeof(spans[0]))
+
 
 widget_t*
 scatter_plot_create(widget_t* parent, rect_t rect)
 {
   scatter_plot_t* s = calloc(1, sizeof(scatter_plot_t));
+  int line_height = font_opensans_regular_12->line_height;
 
   s->widget = widget_create(parent, &scatter_plot_widget_class, s, rect);
+  widget_set_background(s->widget, PLOT_BG_COLOR, false);
+
+  /* Legend above, time labels below, temperature labels to the left */
+  s->area.x = AXIS_WIDTH;
+  s->area.y = line_height;
+  s->area.width = rect.width - AXIS_WIDTH - 1;
+  s->area.height = MIN(rect.height - (2 * line_height), MAX_PLOT_HEIGHT);
+  s->data_height = s->area.height - (NUM_OUTPUTS * BAND_HEIGHT) - 2;
+
+  s->max_cols = s->area.width;
+  s->cols = calloc(s->max_cols, sizeof(plot_col_t));
+
+  s->sensor = next_sensor(SENSOR_NONE);
+  s->unit = app_cfg_get_temp_unit();
+  s->live = true;
+
+  gui_msg_subscribe_latest(MSG_SENSOR_SAMPLE, s->widget);
+  gui_msg_subscribe(MSG_SENSOR_TIMEOUT, s->widget);
+  gui_msg_subscribe_latest(MSG_OUTPUT_STATUS, s->widget);
+  gui_msg_subscribe(MSG_TEMP_UNIT, s->widget);
+
+  load(s);
 
   return s->widget;
 }
@@ -37,14 +180,607 @@ static void
 scatter_plot_destroy(widget_t* w)
 {
   scatter_plot_t* s = widget_get_instance_data(w);
+
+  gui_msg_unsubscribe(MSG_SENSOR_SAMPLE, w);
+  gui_msg_unsubscribe(MSG_SENSOR_TIMEOUT, w);
+  gui_msg_unsubscribe(MSG_OUTPUT_STATUS, w);
+  gui_msg_unsubscribe(MSG_TEMP_UNIT, w);
+
+  free(s->cols);
   free(s);
 }
 
+void
+scatter_plot_set_sensor(widget_t* w, sensor_id_t sensor)
+{
+  scatter_plot_t* s = widget_get_instance_data(w);
+
+  if (s->sensor != sensor) {
+    s->sensor = sensor;
+    s->acc.count = 0;
+    load(s);
+  }
+}
+
+void
+scatter_plot_zoom(widget_t* w, int dir)
+{
+  scatter_plot_t* s = widget_get_instance_data(w);
+  int span = LIMIT(s->span + dir, 0, (int)NUM_SPANS - 1);
+
+  /* Zoom around the end of the view, which stays put */
+  if (span != s->span) {
+    s->span = span;
+    s->end_time = MAX(s->end_time, spans[span].span);
+    load(s);
+  }
+}
+
+static void
+scatter_plot_msg(msg_event_t* event)
+{
+  scatter_plot_t* s = widget_get_instance_data(event->widget);
+
+  switch (event->msg_id) {
+  case MSG_SENSOR_SAMPLE:
+    dispatch_sensor_sample(s, event->msg_data);
+    break;
+
+  case MSG_SENSOR_TIMEOUT:
+    if (((sensor_timeout_msg_t*)event->msg_data)->sensor == s->sensor)
+      commit_acc(s);
+    break;
+
+  case MSG_OUTPUT_STATUS:
+  {
+    output_status_t* status = event->msg_data;
+    if (status->output < NUM_OUTPUTS) {
+      ASSIGNBIT(&s->outputs_on, status->output, status->enabled);
+    }
+    break;
+  }
+
+  case MSG_TEMP_UNIT:
+    s->unit = *((unit_t*)event->msg_data);
+    load(s);
+    break;
+
+  default:
+    break;
+  }
+}
+
+/* A tap shows the next probe; a drag pans by one column per pixel, right
+ * towards older data.
+ */
+static void
+scatter_plot_touch(touch_event_t* event)
+{
+  scatter_plot_t* s = widget_get_instance_data(event->widget);
+
+  if (event->id == EVT_TOUCH_DOWN) {
+    if (!s->touch_down) {
+      s->touch_down = true;
+      s->touch_x = event->pos.x;
+      gui_acquire_touch_capture(event->widget);
+    }
+    return;
+  }
+
+  if (!s->touch_down)
+    return;
+
+  s->touch_down = false;
+  gui_release_touch_capture();
+
+  int dx = event->pos.x - s->touch_x;
+  if (abs(dx) < TAP_DISTANCE) {
+    scatter_plot_set_sensor(event->widget, next_sensor(s->sensor));
+    return;
+  }
+
+  uint32_t shift = abs(dx) * s->col_period;
+  uint32_t span = spans[s->span].span;
+  if (dx > 0)
+    s->end_time = (s->end_time > (shift + span)) ? (s->end_time - shift) : span;
+  else
+    s->end_time += shift;
+
+  s->live = false;
+  load(s);
+}
+
+static void
+dispatch_sensor_sample(scatter_plot_t* s, sensor_msg_t* msg)
+{
+  live_col_t* a = &s->acc;
+  float setpoint = NAN;
+  uint16_t outputs = 0;
+  int i, j;
+
+  if (msg->sensor != s->sensor)
+    return;
+
+  uint32_t col = sample_store_now() / s->col_period;
+  if (a->count > 0 && a->col != col)
+    commit_acc(s);
+
+  /* Setpoint and relays of the controller fed by this probe */
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    const controller_settings_t* cs = app_cfg_get_controller_settings(i);
+    if (cs->sensor != s->sensor)
+      continue;
+
+    if (isnan(setpoint))
+      setpoint = temp_control_get_current_setpoint(i);
+
+    for (j = 0; j < NUM_OUTPUTS; ++j) {
+      if (cs->output_settings[j].enabled && TESTBIT(&s->outputs_on, j))
+        SETBIT(&outputs, j);
+    }
+  }
+
+  float value = quantity_convert(msg->sample, UNIT_TEMP_DEG_F).value;
+
+  if (a->count == 0) {
+    a->col = col;
+    a->sum = 0;
+    a->min = value;
+    a->max = value;
+    a->outputs = 0;
+  }
+
+  a->sum += value;
+  a->min = MIN(a->min, value);
+  a->max = MAX(a->max, value);
+  a->outputs |= outputs;
+  a->setpoint = setpoint;
+  a->count++;
+}
+
+/* Fills the view from the sample store and repaints it */
+static void
+load(scatter_plot_t* s)
+{
+  const span_info_t* si = &spans[s->span];
+  int i;
+
+  /* Smallest column period that divides the span and fits the plot */
+  s->col_period = (si->span + s->max_cols - 1) / s->max_cols;
+  while ((si->span % s->col_period) != 0)
+    s->col_period++;
+  s->num_cols = si->span / s->col_period;
+
+  uint32_t now_col = MAX(sample_store_now() / s->col_period, (uint32_t)s->num_cols);
+
+  if (!s->live) {
+    s->end_col = (s->end_time / s->col_period) - 1;
+    if (s->end_col >= (now_col - 1))
+      s->live = true;
+  }
+  if (s->live)
+    s->end_col = now_col - 1;
+  s->end_time = (s->end_col + 1) * s->col_period;
+
+  for (i = 0; i < s->num_cols; ++i)
+    clear_col(&s->cols[i]);
+
+  uint32_t start = s->end_time - si->span;
+  sample_tier_t tier = sample_store_pick_tier(start, s->end_time - 1, s->num_cols);
+  s->load_period = sample_store_tier_period(tier);
+  sample_store_query(tier, s->sensor, start, s->end_time - 1, load_record, s);
+
+  widget_invalidate(s->widget);
+}
+
+/* A record of a coarse tier covers several columns */
+static void
+load_record(const sample_record_t* rec, void* user_data)
+{
+  scatter_plot_t* s = user_data;
+  uint32_t first_col = s->end_col + 1 - s->num_cols;
+  uint32_t col = MAX(rec->time / s->col_period, first_col);
+  uint32_t last = MIN((rec->time + s->load_period - 1) / s->col_period, s->end_col);
+
+  plot_col_t pc = {
+      .mean = to_tenths(s, rec->mean),
+      .min = to_tenths(s, rec->min),
+      .max = to_tenths(s, rec->max),
+      .setpoint = isnan(rec->setpoint) ? COL_EMPTY : to_tenths(s, rec->setpoint),
+      .count = rec->count,
+      .outputs = rec->outputs
+  };
+
+  for (; col <= last; ++col)
+    merge_col(s, col, &pc);
+}
+
+/* Adds the finished live column to the view, drawing it at the next paint */
+static void
+commit_acc(scatter_plot_t* s)
+{
+  live_col_t* a = &s->acc;
+  uint32_t col = a->col;
+  uint32_t c;
+
+  if (a->count == 0)
+    return;
+
+  /* Columns up to end_col came from the store */
+  if (!s->live || col <= s->end_col) {
+    a->count = 0;
+    return;
+  }
+
+  plot_col_t pc = {
+      .mean = to_tenths(s, a->sum / a->count),
+      .min = to_tenths(s, a->min),
+      .max = to_tenths(s, a->max),
+      .setpoint = isnan(a->setpoint) ? COL_EMPTY : to_tenths(s, a->setpoint),
+      .count = a->count,
+      .outputs = a->outputs
+  };
+  a->count = 0;
+
+  /* Columns without samples stay empty */
+  for (c = s->end_col + 1; c <= col && (c - s->end_col) <= (uint32_t)s->num_cols; ++c)
+    clear_col(&s->cols[c % s->num_cols]);
+  merge_col(s, col, &pc);
+
+  s->end_col = col;
+  s->end_time = (col + 1) * s->col_period;
+
+  if (col_in_range(s, &pc))
+    widget_update(s->widget);
+  else
+    widget_invalidate(s->widget);
+}
+
+static void
+clear_col(plot_col_t* pc)
+{
+  pc->mean = COL_EMPTY;
+  pc->min = COL_EMPTY;
+  pc->max = COL_EMPTY;
+  pc->setpoint = COL_EMPTY;
+  pc->count = 0;
+  pc->outputs = 0;
+}
+
+static void
+merge_col(scatter_plot_t* s, uint32_t col, const plot_col_t* src)
+{
+  plot_col_t* pc = &s->cols[col % s->num_cols];
+
+  if (pc->mean == COL_EMPTY) {
+    *pc = *src;
+    return;
+  }
+
+  uint32_t count = pc->count + src->count;
+  pc->mean = (((int32_t)pc->mean * pc->count) + ((int32_t)src->mean * src->count)) / (int32_t)MAX(count, 1);
+  pc->min = MIN(pc->min, src->min);
+  pc->max = MAX(pc->max, src->max);
+  if (src->setpoint != COL_EMPTY)
+    pc->setpoint = src->setpoint;
+  pc->outputs |= src->outputs;
+  pc->count = MIN(count, UINT16_MAX);
+}
+
+static bool
+col_in_range(scatter_plot_t* s, const plot_col_t* pc)
+{
+  if (pc->mean != COL_EMPTY &&
+      (pc->min < s->y_min || pc->max > s->y_max))
+    return false;
+
+  if (pc->setpoint != COL_EMPTY &&
+      (pc->setpoint < s->y_min || pc->setpoint > s->y_max))
+    return false;
+
+  return true;
+}
+
+/* Rounds the y range out to at most four grid steps */
+static void
+update_y_range(scatter_plot_t* s)
+{
+  static const int16_t steps[] = { 5, 10, 20, 50, 100, 200, 500, 1000 };
+  int32_t lo = INT16_MAX;
+  int32_t hi = INT16_MIN;
+  int32_t step;
+  int i;
+
+  for (i = 0; i < s->num_cols; ++i) {
+    const plot_col_t* pc = &s->cols[i];
+    if (pc->mean != COL_EMPTY) {
+      lo = MIN(lo, pc->min);
+      hi = MAX(hi, pc->max);
+    }
+    if (pc->setpoint != COL_EMPTY) {
+      lo = MIN(lo, pc->setpoint);
+      hi = MAX(hi, pc->setpoint);
+    }
+  }
+
+  if (lo > hi) {
+    lo = 600;
+    hi = 700;
+  }
+
+  /* Leave some room so the next live sample rarely forces a repaint */
+  lo -= 5;
+  hi += 5;
+
+  for (i = 0; i < (int)(sizeof(steps) / sizeof(steps[0])) - 1; ++i) {
+    if (((hi - lo) / steps[i]) < 4)
+      break;
+  }
+  step = steps[i];
+
+  lo = (lo >= 0) ? ((lo / step) * step) : -(((step - lo - 1) / step) * step);
+  hi = (hi >= 0) ? (((hi + step - 1) / step) * step) : -((-hi / step) * step);
+  if (hi <= lo)
+    hi = lo + step;
+
+  s->y_min = LIMIT(lo, -32000, 32000);
+  s->y_max = LIMIT(hi, -32000, 32000);
+  s->y_step = step;
+}
+
+/* Row of a value within the plot area */
+static int
+value_y(scatter_plot_t* s, int16_t value)
+{
+  int32_t y = ((int32_t)(value - s->y_min) * (s->data_height - 1)) / (s->y_max - s->y_min);
+
+  return (s->data_height - 1) - LIMIT(y, 0, s->data_height - 1);
+}
+
+static int16_t
+to_tenths(scatter_plot_t* s, float value)
+{
+  quantity_t q = {
+      .value = value,
+      .unit = UNIT_TEMP_DEG_F
+  };
+  q = quantity_convert(q, s->unit);
+
+  return LIMIT(lroundf(q.value * 10), -32000, 32000);
+}
+
+/* True if a grid line falls within the column */
+static bool
+is_tick(scatter_plot_t* s, uint32_t col)
+{
+  uint32_t tick = spans[s->span].tick;
+  uint32_t t = col * s->col_period;
+
+  return ((((t + tick - 1) / tick) * tick) < (t + s->col_period));
+}
+
 static void
 scatter_plot_paint(paint_event_t* event)
 {
-  rect_t rect = widget_get_rect(event->widget);
+  scatter_plot_t* s = widget_get_instance_data(event->widget);
+  rect_t r = widget_get_rect(event->widget);
+  int line_height = font_opensans_regular_12->line_height;
+  char str[32];
+  uint32_t col;
+  int32_t v;
+
+  update_y_range(s);
+
+  /* Newest column at the right edge; live columns sweep from the left */
+  s->origin_col = s->end_col + 1 - s->num_cols;
+
+  gfx_set_font(font_opensans_regular_12);
 
   gfx_set_fg_color(WHITE);
-  gfx_draw_rect(rect);
+  snprintf(str, sizeof(str), "Probe %d - %s%s", s->sensor + 1,
+      s->live ? "last " : "", spans[s->span].name);
+  gfx_draw_str(str, -1, r.x + s->area.x, r.y);
+
+  gfx_set_fg_color(LABEL_COLOR);
+  for (v = s->y_min; v <= s->y_max; v += s->y_step) {
+    int32_t a = abs(v);
+    if ((s->y_step % 10) == 0)
+      snprintf(str, sizeof(str), "%s%d", (v < 0) ? "-" : "", (int)(a / 10));
+    else
+      snprintf(str, sizeof(str), "%s%d.%d", (v < 0) ? "-" : "", (int)(a / 10), (int)(a % 10));
+
+    Extents_t e = font_text_extents(font_opensans_regular_12, str);
+    gfx_draw_str(str, -1,
+        r.x + s->area.x - 4 - e.width,
+        r.y + s->area.y + value_y(s, v) - (line_height / 2));
+  }
+
+  gfx_set_fg_color(GRID_COLOR);
+  gfx_draw_line(
+      r.x + s->area.x - 1, r.y + s->area.y,
+      r.x + s->area.x - 1, r.y + s->area.y + s->area.height - 1);
+
+  for (col = s->origin_col; col <= s->end_col; ++col)
+    draw_column(s, r, col);
+
+  s->drawn_col = s->end_col;
+}
+
+static void
+scatter_plot_update(paint_event_t* event)
+{
+  scatter_plot_t* s = widget_get_instance_data(event->widget);
+  rect_t r = widget_get_rect(event->widget);
+  uint32_t col;
+
+  if ((s->end_col - s->drawn_col) >= (uint32_t)s->num_cols) {
+    widget_invalidate(event->widget);
+    return;
+  }
+
+  for (col = s->drawn_col + 1; col <= s->end_col; ++col)
+    draw_column(s, r, col);
+  s->drawn_col = s->end_col;
+
+  draw_cursor(s, r, (s->end_col + 1 - s->origin_col) % s->num_cols);
+}
+
+/* Composes one column top to bottom and writes it as a single strip */
+static void
+draw_column(scatter_plot_t* s, rect_t r, uint32_t col)
+{
+  uint16_t px[MAX_PLOT_HEIGHT];
+  const plot_col_t* pc = &s->cols[col % s->num_cols];
+  int x = (col - s->origin_col) % s->num_cols;
+  bool tick = is_tick(s, col);
+  int32_t v;
+  int i, y;
+
+  for (y = 0; y < s->area.height; ++y)
+    px[y] = PLOT_BG_COLOR;
+
+  for (v = s->y_min; v <= s->y_max; v += s->y_step)
+    px[value_y(s, v)] = GRID_COLOR;
+  if (tick) {
+    for (y = 0; y < s->data_height; y += 3)
+      px[y] = GRID_COLOR;
+  }
+
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    if (!TESTBIT(&pc->outputs, i))
+      continue;
+
+    uint16_t color;
+    switch (temp_control_get_output_function(i)) {
+    case OUTPUT_FUNC_HEATING:
+      color = RED;
+      break;
+    case OUTPUT_FUNC_COOLING:
+      color = CYAN;
+      break;
+    default:
+      color = LIME;
+      break;
+    }
+
+    y = s->data_height + 2 + (i * BAND_HEIGHT);
+    fill_run(px, y, y + BAND_HEIGHT - 2, color);
+  }
+
+  /* Curves join the previous column unless the sweep just wrapped */
+  const plot_col_t* prev = (x > 0) ? &s->cols[(col - 1) % s->num_cols] : NULL;
+
+  if (pc->mean != COL_EMPTY) {
+    fill_run(px, value_y(s, pc->max), value_y(s, pc->min), RANGE_COLOR);
+
+    y = value_y(s, pc->mean);
+    fill_run(px, (prev && prev->mean != COL_EMPTY) ? value_y(s, prev->mean) : y, y, MEAN_COLOR);
+  }
+
+  if (pc->setpoint != COL_EMPTY) {
+    y = value_y(s, pc->setpoint);
+    fill_run(px, (prev && prev->setpoint != COL_EMPTY) ? value_y(s, prev->setpoint) : y, y, SETPOINT_COLOR);
+  }
+
+  draw_strip(s, r, x, px);
+
+  if (tick)
+    draw_tick_label(s, r, col, x);
+}
+
+static void
+draw_cursor(scatter_plot_t* s, rect_t r, int x)
+{
+  uint16_t px[MAX_PLOT_HEIGHT];
+  int y;
+
+  for (y = 0; y < s->area.height; ++y)
+    px[y] = ((y % 2) == 0 && y < s->data_height) ? GRID_COLOR : PLOT_BG_COLOR;
+
+  draw_strip(s, r, x, px);
+}
+
+static void
+draw_strip(scatter_plot_t* s, rect_t r, int x, const uint16_t* px)
+{
+  const Image_t strip = {
+      .width = 1,
+      .height = s->area.height,
+      .px = px,
+      .alpha = NULL
+  };
+
+  gfx_draw_bitmap(r.x + s->area.x + x, r.y + s->area.y, &strip);
+}
+
+/* Time of the grid line in the column, in the store clock (UTC once SNTP
+ * has set it). The label box is cleared first since the sweep redraws
+ * labels in place.
+ */
+static void
+draw_tick_label(scatter_plot_t* s, rect_t r, uint32_t col, int x)
+{
+  uint32_t tick = spans[s->span].tick;
+  uint32_t t = (((col * s->col_period) + tick - 1) / tick) * tick;
+  char str[8];
+
+  if (tick >= 86400) {
+    /* Civil date from days since 1970-01-01, valid until 2100 */
+    uint32_t days = (t / 86400) + 719468;
+    uint32_t era = days / 146097;
+    uint32_t doe = days - (era * 146097);
+    uint32_t yoe = (doe - (doe / 1460) + (doe / 36524) - (doe / 146096)) / 365;
+    uint32_t doy = doe - ((365 * yoe) + (yoe / 4) - (yoe / 100));
+    uint32_t mp = ((5 * doy) + 2) / 153;
+    int day = doy - (((153 * mp) + 2) / 5) + 1;
+    int month = (mp < 10) ? (mp + 3) : (mp - 9);
+
+    snprintf(str, sizeof(str), "%d/%d", month, day);
+  }
+  else
+    snprintf(str, sizeof(str), "%02d:%02d", (int)((t / 3600) % 24), (int)((t / 60) % 60));
+
+  rect_t label_rect = {
+      .x = LIMIT(r.x + s->area.x + x - (LABEL_WIDTH / 2), r.x, r.x + r.width - LABEL_WIDTH),
+      .y = r.y + s->area.y + s->area.height + 1,
+      .width = LABEL_WIDTH,
+      .height = font_opensans_regular_12->line_height
+  };
+  gfx_clear_rect(label_rect);
+
+  Extents_t e = font_text_extents(font_opensans_regular_12, str);
+  gfx_set_font(font_opensans_regular_12);
+  gfx_set_fg_color(LABEL_COLOR);
+  gfx_draw_str(str, -1, label_rect.x + ((LABEL_WIDTH - e.width) / 2), label_rect.y);
+}
+
+/* Vertical run between two rows, inclusive: the dx = 1 case of Bresenham */
+static void
+fill_run(uint16_t* px, int y0, int y1, uint16_t color)
+{
+  int y;
+
+  if (y0 > y1) {
+    y = y0;
+    y0 = y1;
+    y1 = y;
+  }
+
+  for (y = y0; y <= y1; ++y)
+    px[y] = color;
+}
+
+/* The next registered probe after sensor, wrapping around */
+static sensor_id_t
+next_sensor(sensor_id_t sensor)
+{
+  int i;
+
+  for (i = 1; i <= NUM_SENSORS; ++i) {
+    sensor_id_t next = (sensor + i) % NUM_SENSORS;
+    if (app_cfg_get_sensor_device(next) != NULL)
+      return next;
+  }
+
+  return (sensor == SENSOR_NONE) ? SENSOR_1 : sensor;
 }
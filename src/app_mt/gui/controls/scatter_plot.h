@@ -3,8 +3,16 @@
 #define SCATTER_PLOT_H
 
 #include "widget.h"
+#include "sensor.h"
 
 widget_t*
 scatter_plot_create(widget_t* parent, rect_t rect);
 
+void
+scatter_plot_set_sensor(widget_t* w, sensor_id_t sensor);
+
+// Steps through the time spans, from 1 h (dir < 0) up to 7 days (dir > 0)
+void
+scatter_plot_zoom(widget_t* w, int dir);
+
 #endif
@@ -9,6 +9,8 @@
 
 #define CALL_WC(w, m)   if ((w)->widget_class != NULL && (w)->widget_class->m != NULL) (w)->widget_class->m
 
+#define MAX_DAMAGE_RECTS 8
+
 
 typedef struct widget_s {
   const widget_class_t* widget_class;
@@ -26,6 +28,7 @@ typedef struct widget_s {
   rect_t rect;
   bool needs_layout;
   bool needs_paint;
+  bool needs_update;
   bool visible;
   bool enabled;
 
@@ -33,6 +36,24 @@ typedef struct widget_s {
   color_t bg_color;
 } widget_t;
 
+/* Screen areas to repaint in a frame, in screen coordinates. They never
+ * overlap, so no pixel is repainted twice.
+ */
+typedef struct {
+  rect_t rects[MAX_DAMAGE_RECTS];
+  int num_rects;
+} damage_t;
+
+
+/* Asks for an on_update call at the next paint instead of a full repaint.
+ * The widget draws only what changed, without the background being cleared
+ * first. A pending full repaint takes precedence.
+ */
+void
+widget_update(widget_t* w)
+{
+  w->needs_update = true;
+}
 
 static void
 widget_invalidate_predicate(widget_t* w, widget_traversal_event_t event, void* data);
@@ -41,7 +62,28 @@ static void
 widget_layout_predicate(widget_t* w, widget_traversal_event_t event, void* data);
 
 static void
-widget_paint_predicate(widget_t* w, widget_traversal_event_t event, void* data);
+collect_damage(widget_t* w, point_t origin, damage_t* damage);
+
+static bool
+grow_damage(widget_t* w, point_t origin, damage_t* damage);
+
+static void
+add_damage(damage_t* damage, rect_t rect);
+
+static bool
+in_damage(const damage_t* damage, rect_t rect);
+
+static void
+paint_damage(widget_t* w, point_t origin, rect_t clip);
+
+static void
+paint_updates(widget_t* w, point_t origin, rect_t clip, const damage_t* damage);
+
+static void
+clear_background(rect_t r, point_t origin, widget_t* child, point_t child_origin);
+
+static rect_t
+unoccluded(widget_t* w, point_t origin, rect_t clip);
 
 static void
 widget_destroy_predicate(widget_t* w, widget_traversal_event_t event, void* data);
@@ -293,11 +335,45 @@ dispatch_touch(widget_t* w, touch_event_t* event)
   }
 }
 
+/* Repaints what has changed since the last call.
+ *
+ * The rects of invalidated widgets are collected into a damage list, and
+ * only those parts of the screen are repainted, a band of rows at a time
+ * composed off screen, so each pixel is sent to the LCD once. A widget
+ * only clears the background that its opaque children do not cover, and
+ * parts hidden behind an opaque later sibling are not painted at all.
+ * Widgets asking for an on_update outside the damage get it, clipped to
+ * their own rect, drawn straight to the LCD.
+ */
 void
 widget_paint(widget_t* w)
 {
+  damage_t damage = { .num_rects = 0 };
+  point_t origin = { 0, 0 };
+  int i;
+
   widget_for_each(w, widget_layout_predicate, NULL);
-  widget_for_each(w, widget_paint_predicate, NULL);
+
+  collect_damage(w, origin, &damage);
+  while (grow_damage(w, origin, &damage))
+    ;
+
+  paint_updates(w, origin, display_rect, &damage);
+
+  /* Each band of a damage rect is composed off screen and sent once, so
+   * the background and what is drawn over it don't both reach the LCD
+   */
+  for (i = 0; i < damage.num_rects; ++i) {
+    rect_t r = damage.rects[i];
+    rect_t band = { r.x, r.y, r.width, 0 };
+
+    for (; band.y < (r.y + r.height); band.y += band.height) {
+      band.height = MIN(GFX_COMPOSE_ROWS, (r.y + r.height) - band.y);
+      gfx_compose_begin(band);
+      paint_damage(w, origin, band);
+      gfx_compose_end();
+    }
+  }
 }
 
 static void
@@ -313,35 +389,277 @@ widget_layout_predicate(widget_t* w, widget_traversal_event_t event, void* data)
   }
 }
 
+/* Adds the screen rects of visible widgets needing a paint. origin is the
+ * screen position of w's parent.
+ */
 static void
-widget_paint_predicate(widget_t* w, widget_traversal_event_t event, void* data)
+collect_damage(widget_t* w, point_t origin, damage_t* damage)
 {
-  (void)data;
+  widget_t* child;
 
-  if (event == WIDGET_TRAVERSAL_BEFORE_CHILDREN) {
-    gfx_ctx_push();
+  if (!w->visible)
+    return;
+
+  rect_t r = rect_offset(w->rect, origin);
+
+  if (w->needs_paint) {
+    add_damage(damage, rect_intersect(r, display_rect));
+    w->needs_paint = false;
+    w->needs_update = false;
+  }
+
+  point_t child_origin = { r.x, r.y };
+  for (child = w->first_child; child != NULL; child = child->next_sibling)
+    collect_damage(child, child_origin, damage);
+}
+
+/* Widgets drawn incrementally keep track of what is on screen, so a partial
+ * repaint would leave them out of step with it. Any that are partly damaged
+ * are added whole. Returns true if the damage grew.
+ */
+static bool
+grow_damage(widget_t* w, point_t origin, damage_t* damage)
+{
+  widget_t* child;
+  int i;
+
+  if (!w->visible)
+    return false;
+
+  rect_t r = rect_intersect(rect_offset(w->rect, origin), display_rect);
+
+  if (w->widget_class != NULL && w->widget_class->on_update != NULL &&
+      !rect_empty(r) && !in_damage(damage, r)) {
+    for (i = 0; i < damage->num_rects; ++i) {
+      if (!rect_empty(rect_intersect(damage->rects[i], r))) {
+        add_damage(damage, r);
+        return true;
+      }
+    }
+  }
+
+  point_t child_origin = { w->rect.x + origin.x, w->rect.y + origin.y };
+  for (child = w->first_child; child != NULL; child = child->next_sibling) {
+    if (grow_damage(child, child_origin, damage))
+      return true;
+  }
+
+  return false;
+}
+
+/* Merges rect with every damage rect it overlaps. When the list is full it
+ * is merged with the rect it grows the least instead.
+ */
+static void
+add_damage(damage_t* damage, rect_t rect)
+{
+  int i;
+
+  if (rect_empty(rect))
+    return;
+
+  for (i = 0; i < damage->num_rects; ++i) {
+    if (!rect_empty(rect_intersect(damage->rects[i], rect))) {
+      rect = rect_union(damage->rects[i], rect);
+      damage->rects[i] = damage->rects[--damage->num_rects];
+      add_damage(damage, rect);
+      return;
+    }
+  }
+
+  if (damage->num_rects < MAX_DAMAGE_RECTS) {
+    damage->rects[damage->num_rects++] = rect;
+    return;
+  }
 
-    if (!w->bg_transparent)
-      gfx_set_bg_color(w->bg_color);
+  int best = 0;
+  int32_t best_growth = INT32_MAX;
+  for (i = 0; i < damage->num_rects; ++i) {
+    rect_t u = rect_union(damage->rects[i], rect);
+    int32_t growth = (u.width * u.height) - (damage->rects[i].width * damage->rects[i].height);
+    if (growth < best_growth) {
+      best = i;
+      best_growth = growth;
+    }
+  }
+  rect = rect_union(damage->rects[best], rect);
+  damage->rects[best] = damage->rects[--damage->num_rects];
+  add_damage(damage, rect);
+}
+
+static bool
+in_damage(const damage_t* damage, rect_t rect)
+{
+  int i;
+
+  for (i = 0; i < damage->num_rects; ++i) {
+    if (rect_contains(damage->rects[i], rect))
+      return true;
+  }
+
+  return false;
+}
+
+/* Paints the part of w and its children inside clip, in screen coordinates.
+ * The gfx translation is at origin, the screen position of w's parent.
+ */
+static void
+paint_damage(widget_t* w, point_t origin, rect_t clip)
+{
+  widget_t* child;
+
+  if (!w->visible)
+    return;
+
+  rect_t r = rect_offset(w->rect, origin);
+  clip = rect_intersect(clip, r);
+  if (rect_empty(clip))
+    return;
+
+  gfx_ctx_push();
+
+  if (!w->bg_transparent)
+    gfx_set_bg_color(w->bg_color);
+
+  point_t neg_origin = { -origin.x, -origin.y };
+  gfx_push_clip(rect_offset(clip, neg_origin));
+
+  point_t child_origin = { r.x, r.y };
+
+  /* Transparent widgets show their parent's background */
+  if (!w->bg_transparent)
+    clear_background(clip, origin, w->first_child, child_origin);
+
+  paint_event_t event = {
+      .id = EVT_PAINT,
+      .widget = w,
+  };
+  CALL_WC(w, on_paint)(&event);
+
+  gfx_push_translation(w->rect.x, w->rect.y);
+
+  for (child = w->first_child; child != NULL; child = child->next_sibling)
+    paint_damage(child, child_origin, unoccluded(child, child_origin, clip));
+
+  gfx_ctx_pop();
+}
+
+/* Calls on_update on widgets that asked for it and are outside the damage */
+static void
+paint_updates(widget_t* w, point_t origin, rect_t clip, const damage_t* damage)
+{
+  widget_t* child;
+
+  if (!w->visible)
+    return;
+
+  rect_t r = rect_offset(w->rect, origin);
+  clip = rect_intersect(clip, r);
+  if (rect_empty(clip))
+    return;
+
+  gfx_ctx_push();
+
+  if (!w->bg_transparent)
+    gfx_set_bg_color(w->bg_color);
 
-    if (w->needs_paint && widget_is_visible(w)) {
+  if (w->needs_update) {
+    w->needs_update = false;
+
+    if (!in_damage(damage, clip)) {
       paint_event_t event = {
           .id = EVT_PAINT,
           .widget = w,
       };
 
-      gfx_clear_rect(w->rect);
+      point_t neg_origin = { -origin.x, -origin.y };
+      gfx_ctx_push();
+      gfx_push_clip(rect_offset(clip, neg_origin));
+      CALL_WC(w, on_update)(&event);
+      gfx_ctx_pop();
+    }
+  }
 
-      CALL_WC(w, on_paint)(&event);
+  gfx_push_translation(w->rect.x, w->rect.y);
 
-      w->needs_paint = false;
-    }
+  point_t child_origin = { r.x, r.y };
+  for (child = w->first_child; child != NULL; child = child->next_sibling)
+    paint_updates(child, child_origin, unoccluded(child, child_origin, clip), damage);
 
-    gfx_push_translation(w->rect.x, w->rect.y);
+  gfx_ctx_pop();
+}
+
+/* Clears the part of r not under an opaque child from child on; those clear
+ * their own background. r is in screen coordinates, the gfx translation is
+ * at origin.
+ */
+static void
+clear_background(rect_t r, point_t origin, widget_t* child, point_t child_origin)
+{
+  for (; child != NULL; child = child->next_sibling) {
+    if (!child->visible || child->bg_transparent)
+      continue;
+
+    rect_t c = rect_intersect(r, rect_offset(child->rect, child_origin));
+    if (rect_empty(c))
+      continue;
+
+    /* Clear the bands above, below, left and right of the child */
+    rect_t bands[4] = {
+        { r.x, r.y, r.width, c.y - r.y },
+        { r.x, c.y + c.height, r.width, (r.y + r.height) - (c.y + c.height) },
+        { r.x, c.y, c.x - r.x, c.height },
+        { c.x + c.width, c.y, (r.x + r.width) - (c.x + c.width), c.height },
+    };
+    int i;
+    for (i = 0; i < 4; ++i) {
+      if (!rect_empty(bands[i]))
+        clear_background(bands[i], origin, child->next_sibling, child_origin);
+    }
+    return;
   }
-  else {
-    gfx_ctx_pop();
+
+  point_t neg_origin = { -origin.x, -origin.y };
+  gfx_clear_rect(rect_offset(r, neg_origin));
+}
+
+/* Shrinks clip by the opaque siblings painted over w. Only a sibling that
+ * covers a whole side of clip can shrink it.
+ */
+static rect_t
+unoccluded(widget_t* w, point_t origin, rect_t clip)
+{
+  widget_t* s;
+
+  for (s = w->next_sibling; s != NULL && !rect_empty(clip); s = s->next_sibling) {
+    if (!s->visible || s->bg_transparent)
+      continue;
+
+    rect_t o = rect_offset(s->rect, origin);
+    int32_t clip_right = clip.x + clip.width;
+    int32_t clip_bottom = clip.y + clip.height;
+    int32_t o_right = o.x + o.width;
+    int32_t o_bottom = o.y + o.height;
+
+    if (o.x <= clip.x && o_right >= clip_right) {
+      if (o.y <= clip.y && o_bottom > clip.y) {
+        clip.height = clip_bottom - MIN(o_bottom, clip_bottom);
+        clip.y = MIN(o_bottom, clip_bottom);
+      }
+      else if (o_bottom >= clip_bottom && o.y < clip_bottom)
+        clip.height = MAX(o.y, clip.y) - clip.y;
+    }
+    else if (o.y <= clip.y && o_bottom >= clip_bottom) {
+      if (o.x <= clip.x && o_right > clip.x) {
+        clip.width = clip_right - MIN(o_right, clip_right);
+        clip.x = MIN(o_right, clip_right);
+      }
+      else if (o_right >= clip_right && o.x < clip_right)
+        clip.width = MAX(o.x, clip.x) - clip.x;
+    }
   }
+
+  return clip;
 }
 
 void
@@ -13,6 +13,7 @@ typedef enum {
 typedef struct {
   void (*on_layout)(widget_t* w);
   void (*on_paint)(paint_event_t* event);
+  void (*on_update)(paint_event_t* event);   // partial repaint requested with widget_update()
   void (*on_touch)(touch_event_t* event);
   void (*on_msg)(msg_event_t* event);
   void (*on_enable)(enable_event_t* event);
@@ -73,6 +74,9 @@ widget_paint(widget_t* screen);
 void
 widget_invalidate(widget_t* screen);
 
+void
+widget_update(widget_t* w);
+
 void
 widget_hide(widget_t* w);
 
@@ -27,7 +27,7 @@ static systime_t last_paint_time;
 void
 gui_init()
 {
-  gui_msg_listener = msg_listener_create("gui", 2048, gui_dispatch, NULL);
+  gui_msg_listener = msg_listener_create("gui", 2048, MSG_PRIO_UI, 16, gui_dispatch, NULL);
   msg_listener_set_idle_timeout(gui_msg_listener, 100);
 
   msg_subscribe(gui_msg_listener, MSG_TOUCH_INPUT, NULL);
@@ -77,6 +77,15 @@ gui_msg_subscribe(msg_id_t id, widget_t* w)
   msg_subscribe(gui_msg_listener, id, w);
 }
 
+void
+gui_msg_subscribe_latest(msg_id_t id, widget_t* w)
+{
+  if (w == NULL)
+    return;
+
+  msg_subscribe_latest(gui_msg_listener, id, w);
+}
+
 void
 gui_msg_unsubscribe(msg_id_t id, widget_t* w)
 {
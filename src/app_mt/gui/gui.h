@@ -25,6 +25,9 @@ gui_release_touch_capture(void);
 void
 gui_msg_subscribe(msg_id_t id, widget_t* w);
 
+void
+gui_msg_subscribe_latest(msg_id_t id, widget_t* w);
+
 void
 gui_msg_unsubscribe(msg_id_t id, widget_t* w);
 
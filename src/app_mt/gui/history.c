@@ -10,11 +10,13 @@
 
 typedef struct {
   widget_t* widget;
+  widget_t* plot;
 } history_screen_t;
 
 
 static void history_screen_destroy(widget_t* w);
 static void back_button_clicked(button_event_t* event);
+static void zoom_button_clicked(button_event_t* event);
 
 static const widget_class_t history_widget_class = {
     .on_destroy = history_screen_destroy,
@@ -35,16 +37,25 @@ history_screen_create()
   };
   button_create(s->widget, rect, img_left, WHITE, BLACK, back_button_clicked);
 
+  /* Zoom out to longer spans, in to shorter ones */
+  rect.x = 190;
+  widget_t* btn = button_create(s->widget, rect, img_down, WHITE, STEEL, zoom_button_clicked);
+  widget_set_user_data(btn, (void*)1);
+
+  rect.x = 250;
+  btn = button_create(s->widget, rect, img_up, WHITE, STEEL, zoom_button_clicked);
+  widget_set_user_data(btn, (void*)-1);
+
   rect.x = 85;
   rect.y = 26;
-  rect.width = 220;
-  label_create(s->widget, rect, "Temp History", font_opensans_regular_22, WHITE, 1);
+  rect.width = 100;
+  label_create(s->widget, rect, "History", font_opensans_regular_22, WHITE, 1);
 
   rect.x = 5;
   rect.y = 80;
   rect.width = DISP_WIDTH - 10;
   rect.height = DISP_HEIGHT - 88;
-  scatter_plot_create(s->widget, rect);
+  s->plot = scatter_plot_create(s->widget, rect);
 
   return s->widget;
 }
@@ -62,3 +73,12 @@ back_button_clicked(button_event_t* event)
   if (event->id == EVT_BUTTON_CLICK)
     gui_pop_screen();
 }
+
+static void
+zoom_button_clicked(button_event_t* event)
+{
+  if (event->id == EVT_BUTTON_CLICK) {
+    history_screen_t* s = widget_get_instance_data(widget_get_parent(event->widget));
+    scatter_plot_zoom(s->plot, (int)widget_get_user_data(event->widget));
+  }
+}
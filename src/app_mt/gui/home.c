@@ -28,23 +28,30 @@
 #define TILE_X(pos) (TILE_POS(pos) + 1)
 #define TILE_Y(pos) TILE_POS(pos)
 
+/* Controllers and outputs shown at once. Tapping the stage flips to the
+ * next page when there are more.
+ */
+#define CHANNELS_PER_PAGE 2
+#define NUM_PAGES MAX((NUM_CONTROLLERS + CHANNELS_PER_PAGE - 1) / CHANNELS_PER_PAGE, \
+                      (NUM_OUTPUTS + CHANNELS_PER_PAGE - 1) / CHANNELS_PER_PAGE)
+
 typedef struct {
   widget_t* quantity_widget;
   widget_t* button;
   bool enabled;
-} sensor_info_t;
+} channel_info_t;
 
 typedef struct {
   systime_t sample_timestamp;
 
   widget_t* screen;
   widget_t* stage_widget;
-  sensor_info_t sensors[NUM_SENSORS];
+  channel_info_t channels[NUM_CONTROLLERS];
+  int page;
   net_state_t net_state;
   api_state_t api_state;
 
-  widget_t* output1_icon;
-  widget_t* output2_icon;
+  widget_t* output_icons[NUM_OUTPUTS];
   widget_t* conn_button;
   widget_t* settings_button;
 } home_screen_t;
@@ -52,6 +59,7 @@ typedef struct {
 
 static void home_screen_destroy(widget_t* w);
 static void home_screen_msg(msg_event_t* event);
+static void stage_touch(touch_event_t* event);
 
 static void click_sensor_button(button_event_t* event);
 static void click_conn_button(button_event_t* event);
@@ -64,10 +72,14 @@ static void dispatch_sensor_timeout(home_screen_t* s, sensor_timeout_msg_t* msg)
 static void dispatch_net_status(home_screen_t* s, net_status_t* msg);
 static void dispatch_api_status(home_screen_t* s, api_status_t* msg);
 static void dispatch_controller_settings(home_screen_t* s, controller_settings_t* msg);
+static void set_channel_sample(home_screen_t* s, temp_controller_id_t controller, quantity_t sample);
+static void set_channel_timeout(home_screen_t* s, temp_controller_id_t controller);
 
 static void set_output_settings(home_screen_t* s, output_id_t output, output_function_t function);
 static void set_conn_status(home_screen_t* s);
 static void place_quantity_widgets(home_screen_t* s);
+static void show_page(home_screen_t* s, int page);
+static bool on_page(home_screen_t* s, int index);
 
 
 static const widget_class_t home_widget_class = {
@@ -75,9 +87,19 @@ static const widget_class_t home_widget_class = {
     .on_msg     = home_screen_msg
 };
 
+static const widget_class_t stage_widget_class = {
+    .on_touch   = stage_touch
+};
+
+static const color_t channel_colors[CHANNELS_PER_PAGE] = {
+    AMBER,
+    PURPLE
+};
+
 widget_t*
 home_screen_create()
 {
+  int i;
   home_screen_t* s = calloc(1, sizeof(home_screen_t));
 
   s->sample_timestamp = chTimeNow();
@@ -91,23 +113,23 @@ home_screen_create()
       .width  = TILE_SPAN(3),
       .height = TILE_SPAN(2),
   };
-  s->stage_widget = widget_create(s->screen, NULL, NULL, rect);
+  s->stage_widget = widget_create(s->screen, &stage_widget_class, s, rect);
   widget_set_background(s->stage_widget, GREEN, false);
 
   rect.x = TILE_X(3);
   rect.width = TILE_SPAN(1);
   rect.height = TILE_SPAN(1);
-  s->sensors[SENSOR_1].button = button_create(s->screen, rect, img_temp_med, WHITE, STEEL, click_sensor_button);
-
-  rect.y = TILE_Y(1);
-  s->sensors[SENSOR_2].button = button_create(s->screen, rect, img_temp_med, WHITE, STEEL, click_sensor_button);
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    rect.y = TILE_Y(i % CHANNELS_PER_PAGE);
+    s->channels[i].button = button_create(s->screen, rect, img_temp_med, WHITE, STEEL, click_sensor_button);
+    widget_set_user_data(s->channels[i].button, (void*)i);
+  }
 
-  rect.x = TILE_X(0);
   rect.y = TILE_Y(2);
-  s->output1_icon = icon_create(s->screen, rect, img_plug, WHITE, STEEL);
-
-  rect.x = TILE_X(1);
-  s->output2_icon = icon_create(s->screen, rect, img_plug, WHITE, STEEL);
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    rect.x = TILE_X(i % CHANNELS_PER_PAGE);
+    s->output_icons[i] = icon_create(s->screen, rect, img_plug, WHITE, STEEL);
+  }
 
   rect.x = TILE_X(2);
   s->conn_button = button_create(s->screen, rect, img_signal, RED, STEEL, click_conn_button);
@@ -117,20 +139,18 @@ home_screen_create()
 
   rect.x = 0;
   rect.width = TILE_SPAN(3);
-  s->sensors[SENSOR_1].quantity_widget = quantity_widget_create(s->stage_widget, rect, app_cfg_get_temp_unit());
+  for (i = 0; i < NUM_CONTROLLERS; ++i)
+    s->channels[i].quantity_widget = quantity_widget_create(s->stage_widget, rect, app_cfg_get_temp_unit());
 
-  s->sensors[SENSOR_2].quantity_widget = quantity_widget_create(s->stage_widget, rect, app_cfg_get_temp_unit());
-
-  place_quantity_widgets(s);
+  show_page(s, 0);
 
-  set_output_settings(s, OUTPUT_1,
-      temp_control_get_output_function(OUTPUT_1));
-  set_output_settings(s, OUTPUT_2,
-      temp_control_get_output_function(OUTPUT_2));
+  for (i = 0; i < NUM_OUTPUTS; ++i)
+    set_output_settings(s, i,
+        temp_control_get_output_function(i));
 
-  gui_msg_subscribe(MSG_SENSOR_SAMPLE, s->screen);
+  gui_msg_subscribe_latest(MSG_SENSOR_SAMPLE, s->screen);
   gui_msg_subscribe(MSG_SENSOR_TIMEOUT, s->screen);
-  gui_msg_subscribe(MSG_OUTPUT_STATUS, s->screen);
+  gui_msg_subscribe_latest(MSG_OUTPUT_STATUS, s->screen);
   gui_msg_subscribe(MSG_TEMP_UNIT, s->screen);
   gui_msg_subscribe(MSG_NET_STATUS, s->screen);
   gui_msg_subscribe(MSG_API_STATUS, s->screen);
@@ -200,33 +220,43 @@ home_screen_msg(msg_event_t* event)
 static void
 dispatch_sensor_sample(home_screen_t* s, sensor_msg_t* msg)
 {
+  int i;
+
+  /* Every controller fed by this sensor shows the sample */
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (app_cfg_get_controller_settings(i)->sensor == msg->sensor)
+      set_channel_sample(s, i, msg->sample);
+  }
+}
+
+static void
+set_channel_sample(home_screen_t* s, temp_controller_id_t controller, quantity_t sample)
+{
+  channel_info_t* channel = &s->channels[controller];
+
   /* Update the sensor button icons based on the current sample/setpoint */
-  widget_t* btn = s->sensors[msg->sensor].button;
-  float setpoint = temp_control_get_current_setpoint(msg->sensor);
-  if (msg->sample.value > setpoint)
+  widget_t* btn = channel->button;
+  float setpoint = temp_control_get_current_setpoint(controller);
+  if (sample.value > setpoint)
     button_set_icon(btn, img_temp_hi);
-  else if (msg->sample.value < setpoint)
+  else if (sample.value < setpoint)
     button_set_icon(btn, img_temp_low);
   else
     button_set_icon(btn, img_temp_med);
 
   /* Update the quantity display widget */
-  widget_t* w = s->sensors[msg->sensor].quantity_widget;
-  if (msg->sample.value > 999.9)
-    msg->sample.value = 999.9;
-  else if (msg->sample.value < -99.9)
-    msg->sample.value = -99.9;
-  quantity_widget_set_value(w, msg->sample);
+  widget_t* w = channel->quantity_widget;
+  if (sample.value > 999.9)
+    sample.value = 999.9;
+  else if (sample.value < -99.9)
+    sample.value = -99.9;
+  quantity_widget_set_value(w, sample);
 
   /* Enable the sensor button and adjust the placement of the quantity display widgets */
-  s->sensors[msg->sensor].enabled = true;
-  if (s->sensors[msg->sensor].enabled) {
-    widget_enable(s->sensors[msg->sensor].button, TRUE);
-
-    if (msg->sensor == SENSOR_1)
-      button_set_color(s->sensors[msg->sensor].button, AMBER);
-    else
-      button_set_color(s->sensors[msg->sensor].button, PURPLE);
+  channel->enabled = true;
+  if (channel->enabled) {
+    widget_enable(channel->button, TRUE);
+    button_set_color(channel->button, channel_colors[controller % CHANNELS_PER_PAGE]);
 
     place_quantity_widgets(s);
   }
@@ -235,13 +265,25 @@ dispatch_sensor_sample(home_screen_t* s, sensor_msg_t* msg)
 static void
 dispatch_sensor_timeout(home_screen_t* s, sensor_timeout_msg_t* msg)
 {
-  widget_t* w = s->sensors[msg->sensor].quantity_widget;
+  int i;
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (app_cfg_get_controller_settings(i)->sensor == msg->sensor)
+      set_channel_timeout(s, i);
+  }
+}
 
-  s->sensors[msg->sensor].enabled = false;
+static void
+set_channel_timeout(home_screen_t* s, temp_controller_id_t controller)
+{
+  channel_info_t* channel = &s->channels[controller];
+  widget_t* w = channel->quantity_widget;
 
-  if (widget_is_enabled(s->sensors[msg->sensor].button)) {
-    button_set_icon(s->sensors[msg->sensor].button, img_temp_low);
-    button_set_color(s->sensors[msg->sensor].button, STEEL);
+  channel->enabled = false;
+
+  if (widget_is_enabled(channel->button)) {
+    button_set_icon(channel->button, img_temp_low);
+    button_set_color(channel->button, STEEL);
     quantity_t sample = {
         .unit = UNIT_NONE,
         .value = NAN
@@ -284,35 +326,83 @@ set_conn_status(home_screen_t* s)
   }
 }
 
+static bool
+on_page(home_screen_t* s, int index)
+{
+  return (index / CHANNELS_PER_PAGE) == s->page;
+}
+
+static void
+show_page(home_screen_t* s, int page)
+{
+  int i;
+
+  s->page = page;
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (on_page(s, i))
+      widget_show(s->channels[i].button);
+    else
+      widget_hide(s->channels[i].button);
+  }
+
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    if (on_page(s, i))
+      widget_show(s->output_icons[i]);
+    else
+      widget_hide(s->output_icons[i]);
+  }
+
+  place_quantity_widgets(s);
+}
+
+static void
+stage_touch(touch_event_t* event)
+{
+  home_screen_t* s = widget_get_instance_data(event->widget);
+
+  if (event->id == EVT_TOUCH_UP && NUM_PAGES > 1)
+    show_page(s, (s->page + 1) % NUM_PAGES);
+}
+
 static void
 place_quantity_widgets(home_screen_t* s)
 {
   int i;
   rect_t rect = widget_get_rect(s->stage_widget);
 
-  sensor_info_t* active_sensors[NUM_SENSORS];
-  int num_active_sensors = 0;
-  for (i = 0; i < NUM_SENSORS; ++i) {
-    if (s->sensors[i].enabled) {
-      widget_show(s->sensors[i].quantity_widget);
-      active_sensors[num_active_sensors++] = &s->sensors[i];
+  channel_info_t* active_channels[CHANNELS_PER_PAGE];
+  int num_active_channels = 0;
+  int first_on_page = -1;
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (!on_page(s, i)) {
+      widget_hide(s->channels[i].quantity_widget);
+      continue;
+    }
+
+    if (first_on_page < 0)
+      first_on_page = i;
+
+    if (s->channels[i].enabled) {
+      widget_show(s->channels[i].quantity_widget);
+      active_channels[num_active_channels++] = &s->channels[i];
     }
     else
-      widget_hide(s->sensors[i].quantity_widget);
+      widget_hide(s->channels[i].quantity_widget);
   }
 
-  if (num_active_sensors == 0) {
-    widget_show(s->sensors[SENSOR_1].quantity_widget);
-    active_sensors[num_active_sensors++] = &s->sensors[SENSOR_1];
+  if (num_active_channels == 0 && first_on_page >= 0) {
+    widget_show(s->channels[first_on_page].quantity_widget);
+    active_channels[num_active_channels++] = &s->channels[first_on_page];
   }
 
-  for (i = 0; i < num_active_sensors; ++i) {
-    rect_t wrect = widget_get_rect(active_sensors[i]->quantity_widget);
+  for (i = 0; i < num_active_channels; ++i) {
+    rect_t wrect = widget_get_rect(active_channels[i]->quantity_widget);
 
-    int spacing = (rect.height - (num_active_sensors * wrect.height)) / (num_active_sensors + 1);
+    int spacing = (rect.height - (num_active_channels * wrect.height)) / (num_active_channels + 1);
     wrect.y = (spacing * (i + 1)) + (wrect.height * i);
 
-    widget_set_rect(active_sensors[i]->quantity_widget, wrect);
+    widget_set_rect(active_channels[i]->quantity_widget, wrect);
   }
 }
 
@@ -331,12 +421,10 @@ dispatch_controller_settings(home_screen_t* s, controller_settings_t* settings)
 static void
 dispatch_output_status(home_screen_t* s, output_status_t* msg)
 {
-  widget_t* icon;
+  if (msg->output < 0 || msg->output >= NUM_OUTPUTS)
+    return;
 
-  if (msg->output == OUTPUT_1)
-    icon = s->output1_icon;
-  else
-    icon = s->output2_icon;
+  widget_t* icon = s->output_icons[msg->output];
 
   if (msg->enabled)
     icon_set_color(icon, LIME);
@@ -348,20 +436,15 @@ static void
 dispatch_temp_unit(home_screen_t* s, unit_t unit)
 {
   int i;
-  for (i = 0; i < NUM_SENSORS; ++i) {
-    quantity_widget_set_unit(s->sensors[i].quantity_widget, unit);
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    quantity_widget_set_unit(s->channels[i].quantity_widget, unit);
   }
 }
 
 static void
 set_output_settings(home_screen_t* s, output_id_t output, output_function_t function)
 {
-  widget_t* icon;
-
-  if (output == OUTPUT_1)
-    icon = s->output1_icon;
-  else
-    icon = s->output2_icon;
+  widget_t* icon = s->output_icons[output];
 
   color_t color = 0;
   switch (function) {
@@ -390,16 +473,9 @@ click_sensor_button(button_event_t* event)
   if (event->id != EVT_BUTTON_CLICK)
     return;
 
-  widget_t* parent = widget_get_parent(event->widget);
-  home_screen_t* s = widget_get_instance_data(parent);
-
-  sensor_id_t sensor;
-  if (event->widget == s->sensors[SENSOR_1].button)
-    sensor = SENSOR_1;
-  else
-    sensor = SENSOR_2;
+  temp_controller_id_t controller = (temp_controller_id_t)widget_get_user_data(event->widget);
 
-  widget_t* settings_screen = controller_settings_screen_create(sensor);
+  widget_t* settings_screen = controller_settings_screen_create(controller);
   gui_push_screen(settings_screen);
 }
 
@@ -127,7 +127,7 @@ self_test_screen_create()
   s->touch_status = label_create(widget, rect, "NO DATA", font_opensans_regular_12, WHITE, 1);
 
   gui_msg_subscribe(MSG_TOUCH_INPUT, widget);
-  gui_msg_subscribe(MSG_SENSOR_SAMPLE, widget);
+  gui_msg_subscribe_latest(MSG_SENSOR_SAMPLE, widget);
   gui_msg_subscribe(MSG_RECOVERY_IMG_STATUS, widget);
   gui_msg_subscribe(MSG_NET_STATUS, widget);
   gui_msg_subscribe(MSG_WLAN_PING_REPORT, widget);
@@ -240,6 +240,12 @@ static void
 dispatch_sensor_sample(self_test_screen_t* s, sensor_msg_t* msg)
 {
   char str[32];
+
+  if (msg->sensor < SENSOR_1 ||
+      msg->sensor >= NUM_SENSORS ||
+      s->sensor_test_status[msg->sensor] == NULL)
+    return;
+
   snprintf(str, 32, "%f", msg->sample.value);
   label_set_text(s->sensor_test_status[msg->sensor], str);
   label_set_color(s->sensor_test_status[msg->sensor], GREEN);
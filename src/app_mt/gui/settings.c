@@ -9,6 +9,7 @@
 #include "gui/calib.h"
 #include "ota_update.h"
 #include "gui/info.h"
+#include "gui/history.h"
 #include "gui/button_list.h"
 #include "quantity_select.h"
 
@@ -32,6 +33,7 @@ static void unit_button_clicked(button_event_t* event);
 static void update_button_clicked(button_event_t* event);
 static void calibrate_button_clicked(button_event_t* event);
 static void info_button_clicked(button_event_t* event);
+static void history_button_clicked(button_event_t* event);
 static void control_mode_button_clicked(button_event_t* event);
 static void rebuild_settings_screen(settings_screen_t* s);
 static void hysteresis_button_clicked(button_event_t* event);
@@ -114,6 +116,16 @@ info_button_clicked(button_event_t* event)
   }
 }
 
+static void
+history_button_clicked(button_event_t* event)
+{
+  if (event->id == EVT_BUTTON_CLICK) {
+    widget_t* history_screen = history_screen_create();
+
+    gui_push_screen(history_screen);
+  }
+}
+
 static void
 calibrate_button_clicked(button_event_t* event)
 {
@@ -254,6 +266,11 @@ rebuild_settings_screen(settings_screen_t* s)
         "Hysteresis", hysteresis_subtext, s);
   }
 
+  text = "Temp History";
+  subtext = "Temperature, setpoint and relay history";
+  add_button_spec(buttons, &num_buttons, history_button_clicked, img_stopwatch, TEAL,
+      text, subtext, s);
+
   text = "Model-T Updates";
   subtext = "Check for Model-T software updates";
   add_button_spec(buttons, &num_buttons, update_button_clicked, img_update, GREEN,
@@ -1,2 +1,123 @@
 #include "image.h"
+#include "common.h"
 
+#include <string.h>
+
+
+#define ALPHA_OP_MASK     0xC0
+#define ALPHA_OP_CLEAR    0x00
+#define ALPHA_OP_OPAQUE   0x40
+#define ALPHA_OP_LITERAL  0x80
+#define ALPHA_OP_RUN      0xC0
+#define ALPHA_COUNT_MASK  0x3F
+
+#define PX_LITERAL        0x80
+#define PX_COUNT_MASK     0x7F
+
+#define EXPAND_ALPHA(a)   ((a) * 17)
+#define GET_PX(p)         ((uint16_t)((p)[0] | ((p)[1] << 8)))
+
+
+void
+image_alpha_start(image_alpha_decoder_t* d, const uint8_t* data)
+{
+  d->p = data;
+  d->count = 0;
+}
+
+/* Decodes the next n alpha values into alpha, or skips over them if alpha
+ * is NULL.
+ */
+void
+image_alpha_read(image_alpha_decoder_t* d, uint8_t* alpha, int n)
+{
+  while (n > 0) {
+    int k;
+
+    if (d->count == 0) {
+      uint8_t code = *d->p++;
+
+      d->op = code & ALPHA_OP_MASK;
+      d->count = (code & ALPHA_COUNT_MASK) + 1;
+      d->low = false;
+
+      if (d->op == ALPHA_OP_CLEAR)
+        d->value = 0;
+      else if (d->op == ALPHA_OP_OPAQUE)
+        d->value = 255;
+      else if (d->op == ALPHA_OP_RUN)
+        d->value = EXPAND_ALPHA(*d->p++ & 0x0F);
+    }
+
+    k = MIN(d->count, n);
+    d->count -= k;
+    n -= k;
+
+    if (d->op != ALPHA_OP_LITERAL) {
+      if (alpha != NULL) {
+        memset(alpha, d->value, k);
+        alpha += k;
+      }
+      continue;
+    }
+
+    while (k-- > 0) {
+      uint8_t v;
+
+      if (d->low)
+        v = *d->p++ & 0x0F;
+      else
+        v = *d->p >> 4;
+      d->low = !d->low;
+
+      if (alpha != NULL)
+        *alpha++ = EXPAND_ALPHA(v);
+    }
+
+    /* An odd number of literals leaves the last low nibble unused */
+    if ((d->count == 0) && d->low)
+      d->p++;
+  }
+}
+
+/* Reads n pixels of row y of img, starting at x */
+void
+image_read_px(const Image_t* img, int x, int y, uint16_t* px, int n)
+{
+  const uint8_t* p;
+
+  if (img->px != NULL) {
+    memcpy(px, &img->px[(y * img->width) + x], n * sizeof(uint16_t));
+    return;
+  }
+
+  p = &img->px_rle[img->px_rows[y]];
+  while (n > 0) {
+    uint8_t code = *p++;
+    int count = (code & PX_COUNT_MASK) + 1;
+    int size = (code & PX_LITERAL) ? (count * 2) : 2;
+    int i, k;
+
+    if (x >= count) {
+      x -= count;
+      p += size;
+      continue;
+    }
+
+    k = MIN(count - x, n);
+    if (code & PX_LITERAL) {
+      for (i = 0; i < k; ++i)
+        px[i] = GET_PX(&p[(x + i) * 2]);
+    }
+    else {
+      uint16_t c = GET_PX(p);
+      for (i = 0; i < k; ++i)
+        px[i] = c;
+    }
+
+    px += k;
+    n -= k;
+    x = 0;
+    p += size;
+  }
+}
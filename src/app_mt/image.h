@@ -3,4 +3,31 @@
 
 #include "image_resources.h"
 
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Image alpha and glyph data are run length coded 4 bit alpha, and images
+ * with px_rle rather than px have their pixels run length coded a row at a
+ * time (see scripts/asset_codec.py). They are decoded a row at a time as
+ * they are drawn.
+ */
+
+typedef struct {
+  const uint8_t* p;
+  uint8_t op;
+  uint8_t count;            // pixels left in the current op
+  uint8_t value;            // of a run
+  bool low;                 // next literal is in the low nibble
+} image_alpha_decoder_t;
+
+
+void
+image_alpha_start(image_alpha_decoder_t* d, const uint8_t* data);
+
+void
+image_alpha_read(image_alpha_decoder_t* d, uint8_t* alpha, int n);
+
+void
+image_read_px(const Image_t* img, int x, int y, uint16_t* px, int n);
+
 #endif
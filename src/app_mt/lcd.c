@@ -6,14 +6,64 @@
 #include "common.h"
 
 
+/* The host test puts a model of the controller on the bus in place of
+ * these
+ */
+#ifndef LCD_REG
 #define LCD_REG              (*((volatile uint16_t *) 0x60000000)) /* RS = 0 */
 #define LCD_RAM              (*((volatile uint16_t *) 0x60020000)) /* RS = 1 */
+#define LCD_RAM_ADDR         (&LCD_RAM)
+#endif
 
 #define rst_low() palClearPad(PORT_TFT_RST, PAD_TFT_RST)
 #define rst_high() palSetPad(PORT_TFT_RST, PAD_TFT_RST)
 
 #define swap(type, a, b) { type SWAP_tmp = a; a = b; b = SWAP_tmp; }
 
+/* Fills and bitmaps are streamed into LCD_RAM by a memory to memory DMA
+ * transfer (only DMA2 can do those). The source goes in the peripheral
+ * address register so that the LCD_RAM address can stay fixed.
+ */
+#ifndef LCD_DMA_STREAM
+#define LCD_DMA_STREAM       STM32_DMA_STREAM_ID(2, 0)
+#endif
+
+#ifndef LCD_DMA_PRIORITY
+#define LCD_DMA_PRIORITY     1
+#endif
+
+#ifndef LCD_DMA_IRQ_PRIORITY
+#define LCD_DMA_IRQ_PRIORITY 6
+#endif
+
+#define DMA_MODE (STM32_DMA_CR_PL(LCD_DMA_PRIORITY) | STM32_DMA_CR_DIR_M2M | \
+                  STM32_DMA_CR_PSIZE_HWORD | STM32_DMA_CR_MSIZE_HWORD | \
+                  STM32_DMA_CR_TCIE | STM32_DMA_CR_TEIE)
+
+/* Transfers shorter than this are quicker to write out by hand */
+#define DMA_MIN_PIXELS       32
+
+/* Longest transfer a stream can be programmed with */
+#define DMA_MAX_CHUNK        0xFFFF
+
+
+static void start_transfer(const uint16_t* src, uint32_t count, uint32_t mode);
+static void start_chunk(void);
+static void dma_complete(void* p, uint32_t flags);
+
+
+static const stm32_dma_stream_t* dma;
+static uint16_t fill_color;
+static const uint16_t* xfer_src;
+static uint32_t xfer_remaining;
+static uint32_t xfer_mode;
+static volatile bool xfer_busy;
+
+/* Held for the length of every LCD transfer, and by anything else that
+ * uses DMA2 for an APB2 peripheral (see lcd_dma_lock()).
+ */
+static SEMAPHORE_DECL(dma_sem, 1);
+
 
 const rect_t display_rect = {
     .x = 0,
@@ -100,14 +150,24 @@ lcd_init()
   //-----Display on-----------------------
   lcd_write_param(0x07, 0x0173);
   chThdSleepMilliseconds(50);
+
+  dma = STM32_DMA_STREAM(LCD_DMA_STREAM);
+  bool b = dmaStreamAllocate(dma, LCD_DMA_IRQ_PRIORITY, dma_complete, NULL);
+  chDbgAssert(!b, "lcd_init(), #1", "stream already allocated");
+  dmaStreamSetFIFO(dma, STM32_DMA_FCR_DMDIS | STM32_DMA_FCR_FTH_FULL);
 }
 
 void
 lcd_write_cmd(uint8_t cmd)
 {
+  lcd_wait();
   LCD_REG = cmd;
 }
 
+/* Must not be called while a transfer is in flight. Setting the cursor
+ * waits for one to finish, so this only matters to code that writes pixels
+ * after an lcd_fill() or lcd_write_buf() without setting it again.
+ */
 void
 lcd_write_data(uint16_t val)
 {
@@ -153,3 +213,117 @@ lcd_clr_cursor()
 {
   lcd_set_cursor(0, 0, DISP_WIDTH - 1, DISP_HEIGHT - 1);
 }
+
+/* Writes count pixels of color at the cursor. Returns as soon as the
+ * transfer has been started.
+ */
+void
+lcd_fill(uint16_t color, uint32_t count)
+{
+  lcd_wait();
+
+  if (count < DMA_MIN_PIXELS) {
+    while (count--)
+      LCD_RAM = color;
+    return;
+  }
+
+  fill_color = color;
+  start_transfer(&fill_color, count, DMA_MODE);
+}
+
+/* Writes count pixels from buf at the cursor. Returns as soon as the
+ * transfer has been started; buf has to be left alone until lcd_wait()
+ * returns (or the cursor is set again).
+ */
+void
+lcd_write_buf(const uint16_t* buf, uint32_t count)
+{
+  lcd_wait();
+
+  if (count < DMA_MIN_PIXELS) {
+    while (count--)
+      LCD_RAM = *buf++;
+    return;
+  }
+
+  start_transfer(buf, count, DMA_MODE | STM32_DMA_CR_PINC);
+}
+
+/* Blocks until the last lcd_fill() or lcd_write_buf() has finished */
+void
+lcd_wait()
+{
+  if (xfer_busy) {
+    chSemWait(&dma_sem);
+    chSemSignal(&dma_sem);
+  }
+}
+
+/* DMA2 can corrupt data when it serves the FSMC and an APB2 peripheral at
+ * the same time (see the STM32F20x errata sheet), so the touch ADC and the
+ * 1-Wire USART hold this lock around their transfers. It waits for any LCD
+ * transfer to finish and keeps new ones from starting until
+ * lcd_dma_unlock().
+ */
+void
+lcd_dma_lock()
+{
+  chSemWait(&dma_sem);
+}
+
+void
+lcd_dma_unlock()
+{
+  chSemSignal(&dma_sem);
+}
+
+static void
+start_transfer(const uint16_t* src, uint32_t count, uint32_t mode)
+{
+  chSemWait(&dma_sem);
+
+  xfer_src = src;
+  xfer_remaining = count;
+  xfer_mode = mode;
+  xfer_busy = true;
+
+  chSysLock();
+  start_chunk();
+  chSysUnlock();
+}
+
+static void
+start_chunk()
+{
+  uint32_t n = MIN(xfer_remaining, DMA_MAX_CHUNK);
+
+  dmaStreamSetPeripheral(dma, xfer_src);
+  dmaStreamSetMemory0(dma, LCD_RAM_ADDR);
+  dmaStreamSetTransactionSize(dma, n);
+  dmaStreamSetMode(dma, xfer_mode);
+  dmaStreamEnable(dma);
+
+  xfer_remaining -= n;
+  if (xfer_mode & STM32_DMA_CR_PINC)
+    xfer_src += n;
+}
+
+/* Chains the next chunk of a transfer, or releases the stream once the
+ * last one is done. A transfer error drops the rest of the transfer.
+ */
+static void
+dma_complete(void* p, uint32_t flags)
+{
+  (void)p;
+
+  chSysLockFromIsr();
+  if (((flags & STM32_DMA_ISR_TEIF) == 0) && (xfer_remaining > 0)) {
+    start_chunk();
+  }
+  else {
+    xfer_busy = false;
+    chSemSignalI(&dma_sem);
+  }
+  chSysUnlockFromIsr();
+}
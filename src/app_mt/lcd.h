@@ -29,5 +29,10 @@ void lcd_write_data(uint16_t VL);
 void lcd_write_param(uint8_t cmd, uint16_t val);
 void lcd_set_cursor(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2);
 void lcd_clr_cursor(void);
+void lcd_fill(uint16_t color, uint32_t count);
+void lcd_write_buf(const uint16_t* buf, uint32_t count);
+void lcd_wait(void);
+void lcd_dma_lock(void);
+void lcd_dma_unlock(void);
 
 #endif
@@ -19,6 +19,8 @@
 #include "ota_update.h"
 #include "thread_watchdog.h"
 #include "app_hdr.h"
+#include "sensor_replay.h"
+#include "sample_store.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -26,6 +28,12 @@
 
 char device_id[32];
 
+/* On-board 1-Wire probe ports */
+static UARTDriver* const sensor_ports[] = {
+    UART_OW1,
+    UART_OW2
+};
+
 
 static void
 ensure_recovery_image_loaded(void)
@@ -119,6 +127,8 @@ print_device_stats(void)
       (unsigned int)hs->num_sent_packets,
       (unsigned int)hs->num_released_packets,
       (unsigned int)hs->num_timeouts);
+
+  msg_trace_print();
 }
 
 static void
@@ -130,6 +140,18 @@ toggle_LED1(void)
   chThdSleepMilliseconds(1000);
 }
 
+static void
+start_sensors(void)
+{
+#if SENSOR_REPLAY
+  sensor_replay_init();
+#else
+  int i;
+  for (i = 0; i < (int)(sizeof(sensor_ports) / sizeof(sensor_ports[0])); ++i)
+    sensor_init(i, sensor_ports[i]);
+#endif
+}
+
 static void
 create_home_screen(void)
 {
@@ -156,6 +178,8 @@ main(void)
   halInit();
   chSysInit();
 
+  msg_init();
+
   get_device_id();
 
   /* start stdout port */
@@ -170,11 +194,10 @@ main(void)
   gfx_init();
   touch_init();
 
-  sensor_init(SENSOR_1, SD_OW1);
-  sensor_init(SENSOR_2, SD_OW2);
+  start_sensors();
 
-  temp_control_init(CONTROLLER_1);
-  temp_control_init(CONTROLLER_2);
+  temp_control_init();
+  sample_store_init();
 
   net_init();
   ota_update_init();
@@ -5,8 +5,92 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 
+/* Number of pooled envelopes shared by msg_post() and msg_publish(). Posters
+ * wait up to MSG_POST_TIMEOUT if the pool is exhausted, publishers drop the
+ * message instead (see msg_publish()), so a stalled listener can't hold up
+ * the control path.
+ */
+#define MSG_POOL_SIZE           16
+
+/* A listener that posts while its own queue holds the pool would wait for
+ * itself, so posters give up after this long.
+ */
+#define MSG_POST_TIMEOUT        MS2ST(100)
+
+/* Largest payload that msg_publish() can copy into an envelope */
+#define MSG_MAX_PUBLISH_SIZE    32
+
+/* Maximum number of listener threads */
+#define MAX_MSG_LISTENERS       12
+
+/* Maximum number of subscriptions with sub_data (i.e. GUI widgets) */
+#define MAX_MSG_SUB_DATA        48
+
+#define MSG_MASK_SIZE           ((NUM_THREAD_MSGS + 7) / 8)
+
+#ifndef MSG_TRACE
+#define MSG_TRACE               0
+#endif
+
+/* Number of log2 buckets in each trace histogram */
+#define MSG_TRACE_BUCKETS       16
+
+
+typedef enum {
+  MSG_OVERFLOW_BLOCK,       // wait for the listener to free a slot
+  MSG_OVERFLOW_DROP_OLDEST, // evict the oldest queued message with the same id
+  MSG_OVERFLOW_COALESCE     // replace the newest queued message with the same id
+} msg_overflow_policy_t;
+
+typedef struct {
+  msg_id_t id;
+  uint32_t key;
+  void* msg_data;
+  Thread* waiting_thd;
+  tprio_t prio;       // priority the listener must run at to process the message
+  bool published;     // copied by msg_publish(), never waited for
+  uint32_t refs;
+  uint8_t data[MSG_MAX_PUBLISH_SIZE];
+} thread_msg_t;
+
+typedef struct {
+  thread_msg_t* msg;
+  void* sub_data;
+#if MSG_TRACE
+  halrtcnt_t enqueue_time;
+#endif
+} msg_queue_entry_t;
+
+#if MSG_TRACE
+typedef struct {
+  uint16_t bucket[MSG_TRACE_BUCKETS];
+} msg_hist_t;
+
+typedef struct {
+  msg_hist_t queue_latency; // usec between enqueue and dequeue
+  msg_hist_t dispatch_time; // usec spent in the dispatch callback
+  msg_hist_t depth;         // messages already queued at enqueue
+  uint32_t num_dispatched;
+  uint32_t num_dropped;     // published messages that found no room
+  uint32_t max_dispatch_time;
+  msg_id_t max_dispatch_id;             // listener traces: the slowest message
+  const char* max_dispatch_listener;    // message traces: the slowest listener
+} msg_trace_t;
+#endif
+
+typedef struct {
+  msg_queue_entry_t* entries;
+  uint16_t depth;
+  uint16_t head;
+  uint16_t count;
+  Semaphore msgs;   // number of queued messages
+  Semaphore slots;  // number of free slots
+  Thread* owner;    // listener thread, boosted while a sender waits for a slot
+} msg_queue_t;
+
 typedef struct msg_listener_s {
   Thread* thread;
   const char* name;
@@ -14,33 +98,125 @@ typedef struct msg_listener_s {
   systime_t timeout;
   void* user_data;
   bool watchdog_enabled;
+  msg_queue_t queue;
+
+  uint8_t sub_mask[MSG_MASK_SIZE];    // any subscription to the msg id
+  uint8_t direct_mask[MSG_MASK_SIZE]; // subscription without sub_data
+  uint8_t latest_mask[MSG_MASK_SIZE]; // direct subscription is latest-value
+  uint8_t num_sub_data;               // entries in sub_data_table
+
+#if MSG_TRACE
+  msg_trace_t trace;
+#endif
 } msg_listener_t;
 
-typedef struct msg_subscription_s {
+typedef struct {
   msg_listener_t* listener;
   void* user_data;
-  struct msg_subscription_s* next;
-} msg_subscription_t;
+  uint8_t id;
+  bool latest;
+} msg_sub_data_t;
 
 
 static msg_t
 msg_thread_func(void* arg);
 
 static void
-msg_broadcast(msg_id_t id, void* msg_data, bool wait);
+msg_broadcast(thread_msg_t* msg);
+
+static void
+msg_queue_init(msg_queue_t* q, uint16_t depth);
+
+static void
+msg_subscribe_mode(msg_listener_t* l, msg_id_t id, void* user_data, bool latest);
+
+static void
+msg_deliver(msg_listener_t* l, thread_msg_t* msg, void* sub_data, bool latest);
+
+static void
+msg_update_sub_mask(msg_listener_t* l, msg_id_t id);
+
+static bool
+msg_queue_put(msg_queue_t* q, thread_msg_t* msg, void* sub_data, bool latest);
+
+static bool
+msg_queue_get(msg_queue_t* q, msg_queue_entry_t* entry, systime_t timeout);
+
+static void
+msg_queue_append(msg_queue_t* q, thread_msg_t* msg, void* sub_data);
+
+static void
+msg_queue_remove_at(msg_queue_t* q, uint16_t i);
+
+static void
+msg_boost_prio(Thread* tp, tprio_t prio);
+
+static void
+msg_update_prio(msg_queue_t* q, tprio_t prio);
 
 static thread_msg_t*
-msg_get(msg_listener_t* l);
+msg_alloc(systime_t timeout);
 
 static void
 msg_release(thread_msg_t* msg);
 
+static uint32_t
+msg_ref_add(thread_msg_t* msg, int32_t delta);
+
+static void
+msg_count_drop(msg_listener_t* l, msg_id_t id);
+
+#if MSG_TRACE
+static uint32_t
+msg_trace_usec_since(halrtcnt_t start);
+
+static void
+msg_trace_record(msg_hist_t* hist, uint32_t value);
+
+static void
+msg_print_hist(const char* label, msg_hist_t* hist);
+
+static void
+msg_trace_print_one(const char* name, msg_trace_t* trace, const char* slowest);
+#endif
 
-static msg_subscription_t* subs[NUM_THREAD_MSGS];
 
+static const msg_overflow_policy_t overflow_policy[NUM_THREAD_MSGS] = {
+  [MSG_SENSOR_SAMPLE]       = MSG_OVERFLOW_DROP_OLDEST,
+  [MSG_WLAN_PING_REPORT]    = MSG_OVERFLOW_DROP_OLDEST,
+  [MSG_NET_NETWORK_UPDATED] = MSG_OVERFLOW_DROP_OLDEST,
+
+  [MSG_WLAN_FLUSHED]         = MSG_OVERFLOW_COALESCE,
+  [MSG_NET_NETWORK_SETTINGS] = MSG_OVERFLOW_COALESCE,
+  [MSG_OTAU_CHECK]           = MSG_OVERFLOW_COALESCE,
+  [MSG_API_FW_UPDATE_CHECK]  = MSG_OVERFLOW_COALESCE,
+};
+
+static msg_listener_t* listeners[MAX_MSG_LISTENERS];
+static uint8_t num_listeners;
+
+static msg_sub_data_t sub_data_table[MAX_MSG_SUB_DATA];
+
+#if MSG_TRACE
+static msg_trace_t msg_id_trace[NUM_THREAD_MSGS];
+#endif
+
+static thread_msg_t msg_pool_buf[MSG_POOL_SIZE];
+static MemoryPool msg_pool;
+static Semaphore msg_pool_sem;
+
+
+void
+msg_init()
+{
+  chPoolInit(&msg_pool, sizeof(thread_msg_t), NULL);
+  chPoolLoadArray(&msg_pool, msg_pool_buf, MSG_POOL_SIZE);
+  chSemInit(&msg_pool_sem, MSG_POOL_SIZE);
+}
 
 msg_listener_t*
-msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t dispatch, void* user_data)
+msg_listener_create(const char* name, int stack_size, msg_prio_t prio, int queue_depth,
+    thread_msg_dispatch_t dispatch, void* user_data)
 {
   msg_listener_t* l = calloc(1, sizeof(msg_listener_t));
   l->name = name;
@@ -48,7 +224,16 @@ msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t disp
   l->timeout = TIME_INFINITE;
   l->user_data = user_data;
   l->watchdog_enabled = false;
-  l->thread = chThdCreateFromHeap(NULL, stack_size, NORMALPRIO, msg_thread_func, l);
+  msg_queue_init(&l->queue, queue_depth);
+
+  chSysLock();
+  if (num_listeners >= MAX_MSG_LISTENERS)
+    chDbgPanic("too many message listeners");
+  listeners[num_listeners++] = l;
+  chSysUnlock();
+
+  l->thread = chThdCreateFromHeap(NULL, stack_size, prio, msg_thread_func, l);
+  l->queue.owner = l->thread;
   return l;
 }
 
@@ -62,7 +247,10 @@ msg_listener_enable_watchdog(msg_listener_t* l, uint32_t period)
 void
 msg_listener_set_idle_timeout(msg_listener_t* l, uint32_t idle_timeout)
 {
-  l->timeout = MS2ST(idle_timeout);
+  if (idle_timeout == TIME_INFINITE)
+    l->timeout = TIME_INFINITE;
+  else
+    l->timeout = MS2ST(idle_timeout);
 }
 
 static msg_t
@@ -75,10 +263,38 @@ msg_thread_func(void* arg)
   l->dispatch(MSG_INIT, NULL, l->user_data, NULL);
 
   while (1) {
-    thread_msg_t* msg = msg_get(l);
+    msg_queue_entry_t entry;
+
+    if (msg_queue_get(&l->queue, &entry, l->timeout)) {
+      thread_msg_t* msg = entry.msg;
+#if MSG_TRACE
+      halrtcnt_t dispatch_start = halGetCounterValue();
+      uint32_t queue_latency = msg_trace_usec_since(entry.enqueue_time);
+#endif
+
+      l->dispatch(msg->id, msg->msg_data, l->user_data, entry.sub_data);
+
+#if MSG_TRACE
+      uint32_t dispatch_time = msg_trace_usec_since(dispatch_start);
+
+      chSysLock();
+      l->trace.num_dispatched++;
+      msg_id_trace[msg->id].num_dispatched++;
+      msg_trace_record(&l->trace.queue_latency, queue_latency);
+      msg_trace_record(&l->trace.dispatch_time, dispatch_time);
+      msg_trace_record(&msg_id_trace[msg->id].queue_latency, queue_latency);
+      msg_trace_record(&msg_id_trace[msg->id].dispatch_time, dispatch_time);
+      if (dispatch_time > l->trace.max_dispatch_time) {
+        l->trace.max_dispatch_time = dispatch_time;
+        l->trace.max_dispatch_id = msg->id;
+      }
+      if (dispatch_time > msg_id_trace[msg->id].max_dispatch_time) {
+        msg_id_trace[msg->id].max_dispatch_time = dispatch_time;
+        msg_id_trace[msg->id].max_dispatch_listener = l->name;
+      }
+      chSysUnlock();
+#endif
 
-    if (msg != NULL) {
-      l->dispatch(msg->id, msg->msg_data, l->user_data, msg->user_data);
       msg_release(msg);
     }
     else {
@@ -94,113 +310,487 @@ msg_thread_func(void* arg)
 void
 msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data)
 {
+  msg_subscribe_mode(l, id, user_data, false);
+}
+
+void
+msg_subscribe_latest(msg_listener_t* l, msg_id_t id, void* user_data)
+{
+  msg_subscribe_mode(l, id, user_data, true);
+}
+
+static void
+msg_subscribe_mode(msg_listener_t* l, msg_id_t id, void* user_data, bool latest)
+{
+  int i;
+
   if (id >= NUM_THREAD_MSGS)
     return;
 
-  msg_subscription_t* sub = calloc(1, sizeof(msg_subscription_t));
-  sub->listener = l;
-  sub->user_data = user_data;
-
   chSysLock();
-  sub->next = subs[id];
-  subs[id] = sub;
+  if (user_data == NULL) {
+    SETBIT(l->direct_mask, id);
+    ASSIGNBIT(l->latest_mask, id, latest);
+  }
+  else {
+    msg_sub_data_t* free_entry = NULL;
+    for (i = 0; i < MAX_MSG_SUB_DATA; ++i) {
+      msg_sub_data_t* e = &sub_data_table[i];
+      if (e->listener == NULL) {
+        if (free_entry == NULL)
+          free_entry = e;
+      }
+      else if ((e->listener == l) &&
+               (e->id == id) &&
+               (e->user_data == user_data)) {
+        // already subscribed, just update the mode
+        e->latest = latest;
+        break;
+      }
+    }
+
+    if (i == MAX_MSG_SUB_DATA) {
+      if (free_entry == NULL)
+        chDbgPanic("message subscription table full");
+
+      free_entry->listener = l;
+      free_entry->user_data = user_data;
+      free_entry->id = id;
+      free_entry->latest = latest;
+      l->num_sub_data++;
+    }
+  }
+  SETBIT(l->sub_mask, id);
   chSysUnlock();
 }
 
 void
 msg_unsubscribe(msg_listener_t* l, msg_id_t id, void* user_data)
 {
+  int i;
+
   if (id >= NUM_THREAD_MSGS)
     return;
 
-  msg_subscription_t* sub;
-  msg_subscription_t* prev_sub = NULL;
-  for (sub = subs[id]; sub != NULL; sub = sub->next) {
-    if ((sub->listener == l) &&
-        (sub->user_data == user_data)) {
-      if (prev_sub != NULL) {
-        prev_sub->next = sub->next;
+  chSysLock();
+  if (user_data == NULL) {
+    CLRBIT(l->direct_mask, id);
+    CLRBIT(l->latest_mask, id);
+  }
+  else {
+    for (i = 0; i < MAX_MSG_SUB_DATA; ++i) {
+      msg_sub_data_t* e = &sub_data_table[i];
+      if ((e->listener == l) &&
+          (e->id == id) &&
+          (e->user_data == user_data)) {
+        e->listener = NULL;
+        l->num_sub_data--;
+        break;
       }
-      else {
-        subs[id] = sub->next;
+    }
+  }
+  msg_update_sub_mask(l, id);
+  chSysUnlock();
+}
+
+/* Recomputes whether the listener still has any subscription to the
+ * given id. Must be called from within a lock zone.
+ */
+static void
+msg_update_sub_mask(msg_listener_t* l, msg_id_t id)
+{
+  int i;
+
+  if (TESTBIT(l->direct_mask, id)) {
+    SETBIT(l->sub_mask, id);
+    return;
+  }
+
+  if (l->num_sub_data > 0) {
+    for (i = 0; i < MAX_MSG_SUB_DATA; ++i) {
+      msg_sub_data_t* e = &sub_data_table[i];
+      if ((e->listener == l) && (e->id == id)) {
+        SETBIT(l->sub_mask, id);
+        return;
       }
-      free(sub);
-      break;
     }
-    prev_sub = sub;
   }
+
+  CLRBIT(l->sub_mask, id);
 }
 
 void
 msg_send(msg_id_t id, void* msg_data)
 {
-  msg_broadcast(id, msg_data, true);
+  // The sender blocks until every listener has processed the message, so
+  // the envelope can live on its stack.
+  thread_msg_t msg = {
+      .id = id,
+      .key = 0,
+      .msg_data = msg_data,
+      .waiting_thd = chThdSelf(),
+      .prio = chThdGetPriority(),
+      .published = false,
+      .refs = 0
+  };
+  msg_broadcast(&msg);
 }
 
-void
+/* Returns false if no envelope became free within MSG_POST_TIMEOUT. The
+ * message is dropped then, and msg_data freed as a listener would have.
+ */
+bool
 msg_post(msg_id_t id, void* msg_data)
 {
-  msg_broadcast(id, msg_data, false);
+  if (id >= NUM_THREAD_MSGS)
+    return false;
+
+  thread_msg_t* msg = msg_alloc(MSG_POST_TIMEOUT);
+  if (msg == NULL) {
+    msg_count_drop(NULL, id);
+    if (msg_data != NULL)
+      free(msg_data);
+    return false;
+  }
+
+  msg->id = id;
+  msg->key = 0;
+  msg->msg_data = msg_data;
+  msg->waiting_thd = NULL;
+  msg->prio = LOWPRIO;
+  msg->published = false;
+
+  // The poster holds a reference until the broadcast is complete so that
+  // fast listeners cannot release the message out from under it.
+  msg->refs = 1;
+  msg_broadcast(msg);
+  msg_release(msg);
+
+  return true;
+}
+
+/* Never blocks. If the pool is empty the message is dropped, and a
+ * listener whose queue is full (and can't make room under the message's
+ * overflow policy) misses it. Drops are counted in the trace.
+ */
+bool
+msg_publish(msg_id_t id, uint32_t key, const void* msg_data, size_t size)
+{
+  if ((id >= NUM_THREAD_MSGS) ||
+      (size > MSG_MAX_PUBLISH_SIZE))
+    return false;
+
+  thread_msg_t* msg = msg_alloc(TIME_IMMEDIATE);
+  if (msg == NULL) {
+    msg_count_drop(NULL, id);
+    return false;
+  }
+
+  msg->id = id;
+  msg->key = key;
+  msg->waiting_thd = NULL;
+  msg->prio = LOWPRIO;
+  msg->published = true;
+  if (msg_data != NULL) {
+    memcpy(msg->data, msg_data, size);
+    msg->msg_data = msg->data;
+  }
+  else {
+    msg->msg_data = NULL;
+  }
+
+  msg->refs = 1;
+  msg_broadcast(msg);
+  msg_release(msg);
+
+  return true;
 }
 
 static void
-msg_broadcast(msg_id_t id, void* msg_data, bool wait)
+msg_broadcast(thread_msg_t* msg)
 {
-  msg_subscription_t* sub;
+  int i, j;
 
-  if (id >= NUM_THREAD_MSGS)
+  if (msg->id >= NUM_THREAD_MSGS)
     return;
 
-  uint32_t* thread_count = NULL;
-  if (!wait) {
-    thread_count = malloc(sizeof(int));
-    *thread_count = 0;
+  for (i = 0; i < num_listeners; ++i) {
+    msg_listener_t* l = listeners[i];
+
+    if (!TESTBIT(l->sub_mask, msg->id))
+      continue;
+
+    if (TESTBIT(l->direct_mask, msg->id))
+      msg_deliver(l, msg, NULL, TESTBIT(l->latest_mask, msg->id));
+
+    for (j = 0; (l->num_sub_data > 0) && (j < MAX_MSG_SUB_DATA); ++j) {
+      void* sub_data = NULL;
+      bool latest = false;
 
-    // count subs
-    for (sub = subs[id]; sub != NULL; sub = sub->next) {
-      if (sub->listener->thread != chThdSelf())
-        *thread_count += 1;
+      // Copy the entry out under lock so that a concurrent unsubscribe
+      // cannot hand us a half-updated entry.
+      chSysLock();
+      msg_sub_data_t* e = &sub_data_table[j];
+      if ((e->listener == l) && (e->id == msg->id)) {
+        sub_data = e->user_data;
+        latest = e->latest;
+      }
+      chSysUnlock();
+
+      if (sub_data != NULL)
+        msg_deliver(l, msg, sub_data, latest);
     }
-    if (*thread_count == 0)
-      free(thread_count);
   }
+}
 
-  for (sub = subs[id]; sub != NULL; sub = sub->next) {
-    if (sub->listener->thread == chThdSelf()) {
-      if (sub->listener->dispatch != NULL)
-        sub->listener->dispatch(id, msg_data, sub->listener->user_data, sub->user_data);
-      else
-        chDbgPanic("message broadcast to self, but no dispatch method provided");
+static void
+msg_deliver(msg_listener_t* l, thread_msg_t* msg, void* sub_data, bool latest)
+{
+  if (l->thread == chThdSelf()) {
+    if (l->dispatch != NULL)
+      l->dispatch(msg->id, msg->msg_data, l->user_data, sub_data);
+    else
+      chDbgPanic("message broadcast to self, but no dispatch method provided");
+  }
+  else {
+#if MSG_TRACE
+    chSysLock();
+    msg_trace_record(&l->trace.depth, l->queue.count);
+    msg_trace_record(&msg_id_trace[msg->id].depth, l->queue.count);
+    chSysUnlock();
+#endif
+
+    msg_ref_add(msg, 1);
+
+    // A reference to msg is transferred to the listener here. Posted
+    // messages must not be referenced again unless the caller holds its
+    // own reference.
+    if (!msg_queue_put(&l->queue, msg, sub_data, latest)) {
+      msg_count_drop(l, msg->id);
+      msg_release(msg);
+      return;
     }
-    else {
 
-      thread_msg_t* msg = malloc(sizeof(thread_msg_t));
-      msg->id = id;
-      msg->msg_data = msg_data;
-      msg->user_data = sub->user_data;
-      msg->waiting_thd = wait ? chThdSelf() : NULL;
-      msg->thread_count = thread_count;
+    if (msg->waiting_thd != NULL) {
+      // Priority inheritance: the listener (and anything it is still
+      // working through ahead of this message) runs at no less than our
+      // priority until the message has been processed.
+      chSysLock();
+      msg_boost_prio(l->thread, msg->prio);
+      chSchRescheduleS();
+      chSysUnlock();
+
+      chSemWait(&msg->waiting_thd->mb_sem);
+    }
+  }
+}
+
+static void
+msg_queue_init(msg_queue_t* q, uint16_t depth)
+{
+  q->entries = calloc(depth, sizeof(msg_queue_entry_t));
+  q->depth = depth;
+  q->head = 0;
+  q->count = 0;
+  chSemInit(&q->msgs, 0);
+  chSemInit(&q->slots, depth);
+}
+
+/* Returns false without queueing a published message that finds the queue
+ * full. Anything else waits for a free slot.
+ */
+static bool
+msg_queue_put(msg_queue_t* q, thread_msg_t* msg, void* sub_data, bool latest)
+{
+  thread_msg_t* evicted = NULL;
+  bool queued = false;
+  int i;
+
+  chSysLock();
+
+  // Latest-value subscriptions replace a still unconsumed message for the
+  // same key rather than queueing behind it.
+  if (latest) {
+    for (i = q->count - 1; i >= 0; --i) {
+      msg_queue_entry_t* e = &q->entries[(q->head + i) % q->depth];
+      if ((e->msg->id == msg->id) &&
+          (e->msg->key == msg->key) &&
+          (e->sub_data == sub_data)) {
+        evicted = e->msg;
+        e->msg = msg;
+        queued = true;
+        break;
+      }
+    }
+  }
+
+  if (!queued && (chSemGetCounterI(&q->slots) <= 0)) {
+    switch (overflow_policy[msg->id]) {
+      case MSG_OVERFLOW_DROP_OLDEST:
+        for (i = 0; i < q->count; ++i) {
+          msg_queue_entry_t* e = &q->entries[(q->head + i) % q->depth];
+          if (e->msg->id == msg->id) {
+            // the evicted entry's slot is reused for the new message
+            evicted = e->msg;
+            msg_queue_remove_at(q, i);
+            msg_queue_append(q, msg, sub_data);
+            queued = true;
+            break;
+          }
+        }
+        break;
+
+      case MSG_OVERFLOW_COALESCE:
+        for (i = q->count - 1; i >= 0; --i) {
+          msg_queue_entry_t* e = &q->entries[(q->head + i) % q->depth];
+          if ((e->msg->id == msg->id) &&
+              (e->sub_data == sub_data)) {
+            evicted = e->msg;
+            e->msg = msg;
+            queued = true;
+            break;
+          }
+        }
+        break;
+
+      default:
+        break;
+    }
+  }
 
-      // Ownership of msg is transferred to the thread it was sent to here.
-      // Do not reference it again because it might not exist anymore!
-      chMBPost(&sub->listener->thread->mb, (msg_t)msg, TIME_INFINITE);
+  if (!queued) {
+    if (msg->published && (chSemGetCounterI(&q->slots) <= 0)) {
+      chSysUnlock();
+      return false;
+    }
 
-      if (wait)
-        chSemWait(&chThdSelf()->mb_sem);
+    // No room was made, so wait for the listener to consume a message.
+    // Until it does, it runs at no less than our priority (see
+    // msg_update_prio()), or a background listener behind on its queue
+    // could hold up a control thread indefinitely.
+    if (q->owner != NULL) {
+      msg_boost_prio(q->owner, chThdSelf()->p_prio);
+      chSchRescheduleS();
     }
+    chSemWaitS(&q->slots);
+    msg_queue_append(q, msg, sub_data);
+    chSemSignalI(&q->msgs);
+    chSchRescheduleS();
+  }
+
+  chSysUnlock();
+
+  // Evicted messages are released as if they had been dispatched so that
+  // blocked senders are woken and posted data is freed.
+  if (evicted != NULL)
+    msg_release(evicted);
+
+  return true;
+}
+
+static bool
+msg_queue_get(msg_queue_t* q, msg_queue_entry_t* entry, systime_t timeout)
+{
+  // Drop any inherited priority before going idle
+  chSysLock();
+  msg_update_prio(q, LOWPRIO);
+  chSchRescheduleS();
+  chSysUnlock();
+
+  if (chSemWaitTimeout(&q->msgs, timeout) != RDY_OK)
+    return false;
+
+  chSysLock();
+  *entry = q->entries[q->head];
+  q->head = (q->head + 1) % q->depth;
+  q->count--;
+  chSemSignalI(&q->slots);
+  msg_update_prio(q, entry->msg->prio);
+  chSchRescheduleS();
+  chSysUnlock();
+
+  return true;
+}
+
+/* Sets the calling listener's priority to the highest of its own base
+ * priority, the priority of the message being processed, that of any
+ * sender still waiting in the queue and that of any thread waiting for a
+ * free slot. Must be called from within a lock zone.
+ */
+static void
+msg_update_prio(msg_queue_t* q, tprio_t prio)
+{
+  Thread* tp = chThdSelf();
+  Thread* waiter;
+  int i;
+
+  prio = MAX(prio, tp->p_realprio);
+  for (i = 0; i < q->count; ++i)
+    prio = MAX(prio, q->entries[(q->head + i) % q->depth].msg->prio);
+
+  for (waiter = q->slots.s_queue.p_next;
+       waiter != (Thread*)&q->slots.s_queue;
+       waiter = waiter->p_next)
+    prio = MAX(prio, waiter->p_prio);
+
+  tp->p_prio = prio;
+}
+
+/* Raises the priority of another thread, re-inserting it in the ready list
+ * if necessary. Must be called from within a lock zone.
+ */
+static void
+msg_boost_prio(Thread* tp, tprio_t prio)
+{
+  if (tp->p_prio >= prio)
+    return;
+
+  tp->p_prio = prio;
+  if (tp->p_state == THD_STATE_READY) {
+#if CH_DBG_ENABLE_ASSERTS
+    /* Prevents an assertion in chSchReadyI().*/
+    tp->p_state = THD_STATE_CURRENT;
+#endif
+    chSchReadyI(dequeue(tp));
   }
 }
 
+/* Removes the i'th queued entry (relative to head) by shifting the entries
+ * behind it forward. Must be called from within a lock zone.
+ */
+static void
+msg_queue_remove_at(msg_queue_t* q, uint16_t i)
+{
+  for (; i + 1 < q->count; ++i) {
+    q->entries[(q->head + i) % q->depth] =
+        q->entries[(q->head + i + 1) % q->depth];
+  }
+  q->count--;
+}
+
+/* Adds an entry at the tail of the queue. The caller must have reserved a
+ * slot and must be within a lock zone.
+ */
+static void
+msg_queue_append(msg_queue_t* q, thread_msg_t* msg, void* sub_data)
+{
+  msg_queue_entry_t* e = &q->entries[(q->head + q->count) % q->depth];
+  e->msg = msg;
+  e->sub_data = sub_data;
+#if MSG_TRACE
+  e->enqueue_time = halGetCounterValue();
+#endif
+  q->count++;
+}
+
+/* Returns NULL if no envelope became free within timeout */
 static thread_msg_t*
-msg_get(msg_listener_t* l)
+msg_alloc(systime_t timeout)
 {
-  Thread* curThread = chThdSelf();
-  thread_msg_t* msg;
-  msg_t rdy = chMBFetch(&curThread->mb, (msg_t*)&msg, l->timeout);
-  if (rdy == RDY_OK)
-    return msg;
+  if (chSemWaitTimeout(&msg_pool_sem, timeout) != RDY_OK)
+    return NULL;
 
-  return NULL;
+  return chPoolAlloc(&msg_pool);
 }
 
 static void
@@ -214,24 +804,117 @@ msg_release(thread_msg_t* msg)
   if (msg->waiting_thd != NULL) {
     chSemSignal(&msg->waiting_thd->mb_sem);
   }
-  else {
-    // atomic decrement
-    uint32_t result;
-    uint32_t thd_cnt;
-    do {
-      thd_cnt = __LDREXW(msg->thread_count) - 1;
-      result = __STREXW(thd_cnt, msg->thread_count);
-    } while (result != 0);
-
+  else if (msg_ref_add(msg, -1) == 0) {
     // This is the last thread to process the message, so we have to clean
     // it up
-    if (thd_cnt == 0) {
-      if (msg->msg_data != NULL)
-        free(msg->msg_data);
+    if ((msg->msg_data != NULL) &&
+        (msg->msg_data != msg->data))
+      free(msg->msg_data);
 
-      free(msg->thread_count);
-    }
+    chPoolFree(&msg_pool, msg);
+    chSemSignal(&msg_pool_sem);
+  }
+}
+
+static uint32_t
+msg_ref_add(thread_msg_t* msg, int32_t delta)
+{
+  // atomic add
+  uint32_t result;
+  uint32_t refs;
+  do {
+    refs = __LDREXW(&msg->refs) + delta;
+    result = __STREXW(refs, &msg->refs);
+  } while (result != 0);
+
+  return refs;
+}
+
+/* l is NULL if the message was dropped for want of an envelope */
+static void
+msg_count_drop(msg_listener_t* l, msg_id_t id)
+{
+#if MSG_TRACE
+  chSysLock();
+  if (l != NULL)
+    l->trace.num_dropped++;
+  msg_id_trace[id].num_dropped++;
+  chSysUnlock();
+#else
+  (void)l;
+  (void)id;
+#endif
+}
+
+void
+msg_trace_print()
+{
+#if MSG_TRACE
+  int i;
+
+  printf("MSG TRACE (log2 usec / depth buckets)\r\n");
+  for (i = 0; i < num_listeners; ++i) {
+    char slowest[12];
+    sprintf(slowest, "msg %d", listeners[i]->trace.max_dispatch_id);
+    msg_trace_print_one(listeners[i]->name, &listeners[i]->trace, slowest);
   }
 
-  free(msg);
+  for (i = 0; i < NUM_THREAD_MSGS; ++i) {
+    char name[12];
+    sprintf(name, "msg %d", i);
+    msg_trace_print_one(name, &msg_id_trace[i], msg_id_trace[i].max_dispatch_listener);
+  }
+#endif
+}
+
+#if MSG_TRACE
+static uint32_t
+msg_trace_usec_since(halrtcnt_t start)
+{
+  halrtcnt_t elapsed = halGetCounterValue() - start;
+  return elapsed / (halGetCounterFrequency() / 1000000);
+}
+
+static void
+msg_trace_record(msg_hist_t* hist, uint32_t value)
+{
+  uint32_t bucket = 0;
+  if (value > 0)
+    bucket = MIN(32 - __builtin_clz(value), MSG_TRACE_BUCKETS - 1);
+
+  // saturate rather than wrap so that the histogram shape is preserved
+  if (hist->bucket[bucket] < UINT16_MAX)
+    hist->bucket[bucket]++;
+}
+
+static void
+msg_print_hist(const char* label, msg_hist_t* hist)
+{
+  int i;
+
+  printf("  %s:", label);
+  for (i = 0; i < MSG_TRACE_BUCKETS; ++i)
+    printf(" %u", hist->bucket[i]);
+  printf("\r\n");
+}
+
+/* slowest names what the longest dispatch was for: the message for a
+ * listener's trace, the listener for a message's.
+ */
+static void
+msg_trace_print_one(const char* name, msg_trace_t* trace, const char* slowest)
+{
+  if ((trace->num_dispatched == 0) && (trace->num_dropped == 0))
+    return;
+
+  printf(" %s n %u dropped %u max %u usec (%s)\r\n",
+      name,
+      (unsigned int)trace->num_dispatched,
+      (unsigned int)trace->num_dropped,
+      (unsigned int)trace->max_dispatch_time,
+      (slowest != NULL) ? slowest : "-");
+  msg_print_hist("queue", &trace->queue_latency);
+  msg_print_hist("dispatch", &trace->dispatch_time);
+  msg_print_hist("depth", &trace->depth);
 }
+#endif
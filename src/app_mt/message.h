@@ -4,6 +4,8 @@
 
 #include "ch.h"
 
+#include <stdbool.h>
+
 typedef enum {
   MSG_INIT,
   MSG_IDLE,
@@ -15,6 +17,8 @@ typedef enum {
 
   MSG_CONTROLLER_SETTINGS,
   MSG_OUTPUT_STATUS,
+  MSG_AUTOTUNE_CMD,
+  MSG_AUTOTUNE_STATUS,
 
   MSG_GUI_PUSH_SCREEN,
   MSG_GUI_POP_SCREEN,
@@ -54,14 +58,6 @@ typedef enum {
 } msg_id_t;
 
 
-typedef struct {
-  Thread* waiting_thd;
-  uint32_t* thread_count;
-  msg_id_t id;
-  void* user_data;
-  void* msg_data;
-} thread_msg_t;
-
 typedef enum {
   RECOVERY_IMG_CHECKING,
   RECOVERY_IMG_LOADING,
@@ -72,30 +68,65 @@ typedef enum {
 struct msg_listener_s;
 typedef struct msg_listener_s msg_listener_t;
 
+/* Thread priority classes for message listeners (and the threads that feed
+ * them). Control work must never wait behind GUI or network work.
+ */
+typedef enum {
+  MSG_PRIO_BACKGROUND = NORMALPRIO - 8, // network, OTA, time sync
+  MSG_PRIO_UI         = NORMALPRIO - 4, // GUI
+  MSG_PRIO_NORMAL     = NORMALPRIO,
+  MSG_PRIO_CONTROL    = NORMALPRIO + 8  // sensors, temp control, relays
+} msg_prio_t;
+
 
 typedef void (*thread_msg_dispatch_t)(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
 
+void
+msg_init(void);
+
 msg_listener_t*
-msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t dispatch, void* user_data);
+msg_listener_create(const char* name, int stack_size, msg_prio_t prio, int queue_depth,
+    thread_msg_dispatch_t dispatch, void* user_data);
 
 void
 msg_listener_enable_watchdog(msg_listener_t* l, uint32_t period);
 
+/* idle_timeout is in ms, or TIME_INFINITE to disable MSG_IDLE */
 void
 msg_listener_set_idle_timeout(msg_listener_t* l, uint32_t idle_timeout);
 
 void
 msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data);
 
+// subscribe to only the most recent value of a message; a newly published
+// message replaces one with the same key that has not been dispatched yet
+void
+msg_subscribe_latest(msg_listener_t* l, msg_id_t id, void* user_data);
+
 void
 msg_unsubscribe(msg_listener_t* l, msg_id_t id, void* user_data);
 
-// send a message and wait for it to be processed
+// send a message and wait for it to be processed; listeners run at no less
+// than the sender's priority until they have processed it
 void
 msg_send(msg_id_t id, void* msg_data);
 
-// send a message but don't wait for it to be processed
-void
+// send a message but don't wait for it to be processed; if a listener's
+// queue is full, wait for a free slot with the listener running at no less
+// than the poster's priority. Returns false if the message was dropped for
+// lack of an envelope; msg_data is freed then
+bool
 msg_post(msg_id_t id, void* msg_data);
 
+// print the message bus latency histograms (requires MSG_TRACE=1)
+void
+msg_trace_print(void);
+
+// send a copy of a small message without waiting for it to be processed;
+// key identifies the source (e.g. a sensor or output) for latest-value
+// subscribers. Never blocks: returns false if the message was dropped for
+// lack of an envelope, listeners with a full queue miss it
+bool
+msg_publish(msg_id_t id, uint32_t key, const void* msg_data, size_t size);
+
 #endif
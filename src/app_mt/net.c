@@ -88,7 +88,7 @@ net_init()
 {
   wlan_init();
 
-  msg_listener_t* l = msg_listener_create("net", 2048, dispatch_net_msg, NULL);
+  msg_listener_t* l = msg_listener_create("net", 2048, MSG_PRIO_BACKGROUND, 8, dispatch_net_msg, NULL);
   msg_listener_set_idle_timeout(l, 500);
   msg_subscribe(l, MSG_NET_NETWORK_SETTINGS, NULL);
   msg_subscribe(l, MSG_WLAN_CONNECT, NULL);
@@ -1,127 +1,350 @@
 
 #include "onewire.h"
+#include "lcd.h"
 #include "common.h"
 #include "crc/crc8.h"
 
-static const SerialConfig cfg_115k = {
-    .sc_speed = 115200,
-    .sc_cr1 = 0,
-    .sc_cr2 = USART_CR2_STOP1_BITS,
-    .sc_cr3 = USART_CR3_HDSEL,
-};
+#include <string.h>
+
+#define SLOT_BAUD     115200
+#define RESET_BAUD    9600
+
+/* UART frames as seen on the bus. A read slot is a write-1 slot whose echo
+ * is pulled low by the device for a 0.
+ */
+#define SLOT_0        0x00
+#define SLOT_1        0xFF
+#define RESET_PULSE   0xF0
+
+#define XFER_TIMEOUT  MS2ST(100)
+
+
+static void rx_end(UARTDriver* uartp);
+static void tx_end(UARTDriver* uartp);
+static void set_baud(UARTDriver* uartp, uint32_t baud);
+static bool on_dma2(UARTDriver* uartp);
+static uint16_t encode_slots(uint8_t* slots, const uint8_t* tx, uint8_t tx_len, uint8_t rx_len);
+static void decode_slots(const uint8_t* slots, uint8_t* rx, uint8_t rx_len);
+static bool run_slots(onewire_bus_t* ob, bool reset, uint16_t num_slots);
+static bool search_triplet(onewire_bus_t* ob, int bit, onewire_search_t* search, int8_t* last_zero);
+
+static const uint8_t reset_pulse = RESET_PULSE;
 
-static const SerialConfig cfg_9600 = {
-    .sc_speed = 9600,
-    .sc_cr1 = 0,
-    .sc_cr2 = USART_CR2_STOP1_BITS,
-    .sc_cr3 = USART_CR3_HDSEL,
-};
 
 void
-onewire_init(onewire_bus_t* ob)
+onewire_init(onewire_bus_t* ob, UARTDriver* uart)
 {
-  sdStop(ob);
-  sdStart(ob, &cfg_115k);
+  memset(&ob->cfg, 0, sizeof(ob->cfg));
+  ob->cfg.rxend_cb = rx_end;
+  ob->cfg.txend2_cb = tx_end;
+  ob->cfg.speed = SLOT_BAUD;
+  ob->cfg.cr1 = 0;
+  ob->cfg.cr2 = USART_CR2_STOP1_BITS;
+  ob->cfg.cr3 = USART_CR3_HDSEL;
+
+  ob->uart = uart;
+  chBSemInit(&ob->done, TRUE);
+
+  uartStart(ob->uart, &ob->cfg);
 }
 
 bool
-onewire_reset(onewire_bus_t* ob)
+onewire_transaction(onewire_bus_t* ob, bool reset,
+    const uint8_t* tx, uint8_t tx_len, uint8_t* rx, uint8_t rx_len)
 {
-  sdStop(ob);
-  sdStart(ob, &cfg_9600);
-
-  sdPut(ob, 0xF0);
-  msg_t recv = sdGetTimeout(ob, MS2ST(100));
+  if ((tx_len + rx_len) > ONEWIRE_MAX_XFER)
+    return false;
 
-  sdStop(ob);
-  sdStart(ob, &cfg_115k);
+  uint16_t num_slots = encode_slots(ob->tx_slots, tx, tx_len, rx_len);
 
-  if (recv < 0) {
-    return false;
-  }
-  if (recv == 0xF0) {
+  if (!run_slots(ob, reset, num_slots))
     return false;
-  }
-  else {
-    return true;
-  }
+
+  decode_slots(&ob->rx_slots[tx_len * 8], rx, rx_len);
+  return true;
+}
+
+bool
+onewire_reset(onewire_bus_t* ob)
+{
+  return onewire_transaction(ob, true, NULL, 0, NULL, 0);
 }
 
-// Reads the ROM from the device on the bus.
+// Resets the bus and reads the ROM from the device on it.
 bool
 onewire_read_rom(onewire_bus_t* ob, uint8_t* addr)
 {
-  int i;
+  static const uint8_t cmd[] = { READ_ROM };
 
-  if (!onewire_send_byte(ob, READ_ROM))
+  if (!onewire_transaction(ob, true, cmd, sizeof(cmd), addr, 8))
     return false;
 
-  for (i = 0; i < 8; ++i) {
-    if (!onewire_recv_byte(ob, &addr[i]))
-      return false;
-  }
-
   uint8_t crc = crc8_block(0, addr, 7);
   return (crc == addr[7]);
 }
 
+void
+onewire_search_init(onewire_search_t* search)
+{
+  memset(search->rom, 0, sizeof(search->rom));
+  search->last_discrepancy = -1;
+  search->last_device = false;
+}
+
+// ROM search as described in Maxim application note 187.
 bool
-onewire_send_byte(onewire_bus_t* ob, uint8_t b)
+onewire_search_next(onewire_bus_t* ob, onewire_search_t* search, uint8_t* addr)
 {
-  int i;
-  for (i = 0; i < 8; ++i) {
-    if (!onewire_send_bit(ob, TESTBIT(&b, i)))
+  static const uint8_t cmd[] = { SEARCH_ROM };
+  int8_t last_zero = -1;
+  int bit;
+
+  if (search->last_device)
+    return false;
+
+  if (!onewire_transaction(ob, true, cmd, sizeof(cmd), NULL, 0)) {
+    onewire_search_init(search);
+    return false;
+  }
+
+  for (bit = 0; bit < 64; ++bit) {
+    if (!search_triplet(ob, bit, search, &last_zero)) {
+      onewire_search_init(search);
       return false;
+    }
   }
 
+  search->last_discrepancy = last_zero;
+  search->last_device = (last_zero < 0);
+
+  if (crc8_block(0, search->rom, 7) != search->rom[7]) {
+    onewire_search_init(search);
+    return false;
+  }
+
+  memcpy(addr, search->rom, sizeof(search->rom));
   return true;
 }
 
-bool
-onewire_recv_byte(onewire_bus_t* ob, uint8_t* b)
+/* Reads a ROM bit and its complement from every device still in the
+ * search, then writes the direction taken.
+ */
+static bool
+search_triplet(onewire_bus_t* ob, int bit, onewire_search_t* search, int8_t* last_zero)
 {
-  int i;
-  uint8_t v = 0;
-  for (i = 0; i < 8; ++i) {
-    uint8_t bit;
-    if (!onewire_recv_bit(ob, &bit))
-      return false;
-    ASSIGNBIT(&v, i, bit);
+  bool dir;
+
+  ob->tx_slots[0] = SLOT_1;
+  ob->tx_slots[1] = SLOT_1;
+  if (!run_slots(ob, false, 2))
+    return false;
+
+  bool id_bit = (ob->rx_slots[0] == SLOT_1);
+  bool cmp_bit = (ob->rx_slots[1] == SLOT_1);
+
+  /* No device answered */
+  if (id_bit && cmp_bit)
+    return false;
+
+  if (id_bit != cmp_bit)
+    dir = id_bit;
+  else {
+    /* Devices disagree on this bit */
+    if (bit < search->last_discrepancy)
+      dir = TESTBIT(search->rom, bit);
+    else
+      dir = (bit == search->last_discrepancy);
+
+    if (!dir)
+      *last_zero = bit;
   }
 
-  *b = v;
-  return true;
+  ASSIGNBIT(search->rom, bit, dir);
+
+  return onewire_send_bit(ob, dir);
+}
+
+bool
+onewire_send_byte(onewire_bus_t* ob, uint8_t b)
+{
+  return onewire_transaction(ob, false, &b, 1, NULL, 0);
+}
+
+bool
+onewire_recv_byte(onewire_bus_t* ob, uint8_t* b)
+{
+  return onewire_transaction(ob, false, NULL, 0, b, 1);
 }
 
 bool
 onewire_recv_bit(onewire_bus_t* ob, uint8_t* bit)
 {
-  sdPut(ob, 0xFF);
-  msg_t ret = sdGetTimeout(ob, MS2ST(100));
-  if (ret < 0) {
+  ob->tx_slots[0] = SLOT_1;
+  if (!run_slots(ob, false, 1))
     return false;
-  }
-
-  if (ret == 0xFF)
-    *bit = 1;
-  else
-    *bit = 0;
 
+  *bit = (ob->rx_slots[0] == SLOT_1);
   return true;
 }
 
 bool
 onewire_send_bit(onewire_bus_t* ob, uint8_t b)
 {
-  if (b)
-    sdPut(ob, 0xFF);
-  else
-    sdPut(ob, 0x00);
+  ob->tx_slots[0] = b ? SLOT_1 : SLOT_0;
+  return run_slots(ob, false, 1);
+}
 
-  msg_t ret = sdGetTimeout(ob, MS2ST(100));
-  if (ret < 0) {
-    return false;
+static uint16_t
+encode_slots(uint8_t* slots, const uint8_t* tx, uint8_t tx_len, uint8_t rx_len)
+{
+  int i, j;
+  uint16_t n = 0;
+
+  /* LSB first */
+  for (i = 0; i < tx_len; ++i) {
+    for (j = 0; j < 8; ++j)
+      slots[n++] = TESTBIT(&tx[i], j) ? SLOT_1 : SLOT_0;
   }
 
-  return true;
+  memset(&slots[n], SLOT_1, rx_len * 8);
+  return n + (rx_len * 8);
+}
+
+static void
+decode_slots(const uint8_t* slots, uint8_t* rx, uint8_t rx_len)
+{
+  int i, j;
+
+  for (i = 0; i < rx_len; ++i) {
+    uint8_t v = 0;
+    for (j = 0; j < 8; ++j)
+      ASSIGNBIT(&v, j, (slots[(i * 8) + j] == SLOT_1));
+    rx[i] = v;
+  }
+}
+
+static bool
+run_slots(onewire_bus_t* ob, bool reset, uint16_t num_slots)
+{
+  bool done;
+  bool dma2 = on_dma2(ob->uart);
+
+  chBSemReset(&ob->done, TRUE);
+
+  ob->reset = reset;
+  ob->presence = false;
+  ob->num_slots = num_slots;
+
+  if (reset) {
+    set_baud(ob->uart, RESET_BAUD);
+    /* Left set by the last transfer, tx_end() must only see this one */
+    ob->uart->usart->SR = ~USART_SR_TC;
+  }
+
+  /* DMA2 can't serve a peripheral while it streams to the LCD, so a port on
+   * it waits for the LCD's transfers to finish and holds them off until its
+   * own are done. Ports on DMA1 don't need to.
+   */
+  if (dma2)
+    lcd_dma_lock();
+
+  /* The UART is half duplex, so every frame sent is echoed back with
+   * whatever the devices did to the line.
+   */
+  if (reset) {
+    uartStartReceive(ob->uart, 1, &ob->reset_slot);
+    uartStartSend(ob->uart, 1, &reset_pulse);
+  }
+  else {
+    uartStartReceive(ob->uart, num_slots, ob->rx_slots);
+    uartStartSend(ob->uart, num_slots, ob->tx_slots);
+  }
+
+  done = (chBSemWaitTimeout(&ob->done, XFER_TIMEOUT) == RDY_OK);
+  if (!done) {
+    chSysLock();
+    ob->reset = false;
+    ob->uart->usart->CR1 &= ~USART_CR1_TCIE;
+    chSysUnlock();
+
+    uartStopReceive(ob->uart);
+    uartStopSend(ob->uart);
+  }
+
+  if (dma2)
+    lcd_dma_unlock();
+
+  if (!done)
+    set_baud(ob->uart, SLOT_BAUD);
+
+  return (done && (!reset || ob->presence));
+}
+
+/* Runs in the DMA interrupt when the echo of a whole transfer is in */
+static void
+rx_end(UARTDriver* uartp)
+{
+  onewire_bus_t* ob = (onewire_bus_t*)uartp->config;
+
+  chSysLockFromIsr();
+
+  if (ob->reset) {
+    ob->presence = (ob->reset_slot != RESET_PULSE);
+
+    /* The echo lands half way through the stop bit, 52 us before the
+     * pulse is out. The baud can't change until then, so tx_end() does it
+     * from the transmission complete interrupt.
+     */
+    uartp->usart->CR1 |= USART_CR1_TCIE;
+  }
+  else {
+    chBSemSignalI(&ob->done);
+  }
+
+  chSysUnlockFromIsr();
+}
+
+/* Runs in the UART interrupt when the reset pulse has been sent */
+static void
+tx_end(UARTDriver* uartp)
+{
+  onewire_bus_t* ob = (onewire_bus_t*)uartp->config;
+
+  chSysLockFromIsr();
+
+  uartp->usart->CR1 &= ~USART_CR1_TCIE;
+
+  /* Nothing to do if the transfer has timed out */
+  if (ob->reset) {
+    ob->reset = false;
+    set_baud(uartp, SLOT_BAUD);
+
+    if (ob->presence && ob->num_slots > 0) {
+      uartStartReceiveI(uartp, ob->num_slots, ob->rx_slots);
+      uartStartSendI(uartp, ob->num_slots, ob->tx_slots);
+    }
+    else {
+      chBSemSignalI(&ob->done);
+    }
+  }
+
+  chSysUnlockFromIsr();
+}
+
+static void
+set_baud(UARTDriver* uartp, uint32_t baud)
+{
+  USART_TypeDef* u = uartp->usart;
+  uint32_t clk = ((u == USART1) || (u == USART6)) ? STM32_PCLK2 : STM32_PCLK1;
+
+  u->BRR = clk / baud;
+}
+
+/* USART1 and 6 move their data on DMA2, the others on DMA1 */
+static bool
+on_dma2(UARTDriver* uartp)
+{
+  USART_TypeDef* u = uartp->usart;
+
+  return ((u == USART1) || (u == USART6));
 }
@@ -7,8 +7,6 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-typedef SerialDriver onewire_bus_t;
-
 #define READ_ROM            0x33 // Identification
 #define SKIP_ROM            0xCC // Skip addressing
 #define MATCH_ROM           0x55 // Address specific device
@@ -16,8 +14,44 @@ typedef SerialDriver onewire_bus_t;
 #define OVERDRIVE_SKIP_ROM  0x3C // Overdrive version of SKIP ROM
 #define OVERDRIVE_MATCH_ROM 0x69 // Overdriver version of MATCH ROM
 
+/* Largest transaction, in bytes written plus bytes read */
+#define ONEWIRE_MAX_XFER    24
+
+/* A 1-Wire bus on a half-duplex UART. Every bit slot is one UART frame at
+ * 115200 baud; the reset pulse is one frame at 9600 baud. A transaction is
+ * encoded into a slot buffer and run by DMA, switching baud from the
+ * transmission complete interrupt between the reset and the slots.
+ */
+typedef struct {
+  UARTConfig cfg;           // must be first, the UART callbacks cast back from it
+  UARTDriver* uart;
+  BinarySemaphore done;
+
+  bool reset;
+  bool presence;
+  uint16_t num_slots;
+  uint8_t reset_slot;
+  uint8_t tx_slots[ONEWIRE_MAX_XFER * 8];
+  uint8_t rx_slots[ONEWIRE_MAX_XFER * 8];
+} onewire_bus_t;
+
+/* State of a ROM search across calls to onewire_search_next() */
+typedef struct {
+  uint8_t rom[8];
+  int8_t last_discrepancy;
+  bool last_device;
+} onewire_search_t;
+
 void
-onewire_init(onewire_bus_t* ob);
+onewire_init(onewire_bus_t* ob, UARTDriver* uart);
+
+// Runs reset (optional), writes tx_len bytes and then reads rx_len bytes as
+// a single transfer. The calling thread sleeps until it completes. Returns
+// false on a transfer error or if reset was requested and no device
+// answered.
+bool
+onewire_transaction(onewire_bus_t* ob, bool reset,
+    const uint8_t* tx, uint8_t tx_len, uint8_t* rx, uint8_t rx_len);
 
 bool
 onewire_reset(onewire_bus_t* ob);
@@ -25,6 +59,14 @@ onewire_reset(onewire_bus_t* ob);
 bool
 onewire_read_rom(onewire_bus_t* ob, uint8_t* addr);
 
+void
+onewire_search_init(onewire_search_t* search);
+
+// Finds the next device on the bus. Returns false when every device has
+// been found or on a bus error.
+bool
+onewire_search_next(onewire_bus_t* ob, onewire_search_t* search, uint8_t* addr);
+
 bool
 onewire_send_bit(onewire_bus_t* ob, uint8_t b);
 
@@ -43,7 +43,7 @@ ota_update_init()
 {
   status.state = OU_IDLE;
 
-  msg_listener_t* l = msg_listener_create("ota_update", 2048, ota_update_dispatch, NULL);
+  msg_listener_t* l = msg_listener_create("ota_update", 2048, MSG_PRIO_BACKGROUND, 4, ota_update_dispatch, NULL);
 
   msg_subscribe(l, MSG_OTAU_CHECK, NULL);
   msg_subscribe(l, MSG_OTAU_START, NULL);
@@ -1,96 +1,211 @@
 
 #include "pid.h"
 
+#include <math.h>
+
 /*
  * This code is based on Brett Beauregard's Improved Beginner PID series of
  * blog posts [1] with additions for self-tuning behavior based on the paper
  * "Self-Tuning of PID Controllers by Adaptive Interaction." by Feng Lin,
  * Robert D Brandt, and George Saikalis [2]
  *
+ * All of the per-step math is Q16.16 fixed point. The gains are kept as
+ * positive magnitudes and the output sign is applied to the error, so
+ * a cooling loop produces a positive output when it is too warm.
+ *
  * [1] http://brettbeauregard.com/blog/2011/04/improving-the-beginners-pid-introduction/
  * [2] http://www.ece.eng.wayne.edu/~flin/Conference/AI-PID.pdf
  */
 
+#define GAMMA       F2FIX16(0.005f)
+#define KP_MAX      F2FIX16(50.0f)
+#define KI_MAX      F2FIX16(5.0f)
+#define KD_MAX      F2FIX16(5.0f)
+
+static void tune_gains(pid_t* pid, fix16_t err_p, fix16_t err_d);
+static void scale_gains(pid_t* pid);
+
+
+void
+pid_get_default_settings(pid_settings_t* settings)
+{
+  settings->kp = 10;
+  settings->ki = .05;
+  settings->kd = .05;
+  settings->sample_time = 2000;
+  settings->anti_windup = PID_AW_CLAMP;
+  settings->d_filter = .5;
+  settings->auto_tune = true;
+}
+
 void
 pid_init(pid_t* pid)
 {
-  pid->sample_time = MS2ST(2000);
-  pid->last_time   = (chTimeNow() - pid->sample_time);
+  pid_settings_t settings;
+
+  pid_get_default_settings(&settings);
+
   pid->enabled     = false;
+  pid->primed      = false;
+  pid->bumpless    = false;
+  pid->out         = 0;
+  pid->err_i       = 0;
+  pid->err_i_tune  = 0;
+  pid->d_term      = 0;
+  pid->last_err    = 0;
 
-  pid_set_gains(pid, 10, .05, .05);
+  pid_apply_settings(pid, &settings);
+  pid->last_time   = (chTimeNow() - pid->sample_time);
 }
 
 void
-pid_exec(pid_t* pid, float setpoint, float sample)
+pid_apply_settings(pid_t* pid, const pid_settings_t* settings)
+{
+  pid->auto_mode = settings->auto_tune;
+  pid->anti_windup = settings->anti_windup;
+  pid->d_alpha = F2FIX16(LIMIT(settings->d_filter, 0.01f, 1.0f));
+  pid->sample_time = MS2ST(MAX(settings->sample_time, 100));
+  pid_set_gains(pid, settings->kp, settings->ki, settings->kd);
+}
+
+/* rate is the sensor's own estimate of d(sample)/dt, per second. The
+ * derivative term uses it rather than differencing samples taken at
+ * whatever time the PID timer happens to fire.
+ *
+ * The setpoint is NAN while there is none and the rate until the sensor
+ * has an estimate. Neither converts to Q16.16, so the step is skipped and
+ * the last output held until both are known.
+ */
+void
+pid_exec(pid_t* pid, float setpoint, float sample, float rate)
 {
   if (!pid->enabled)
     return;
 
+  if (isnan(setpoint) || isnan(sample) || isnan(rate))
+    return;
+
   systime_t now = chTimeNow();
   systime_t time_diff = (now - pid->last_time);
 
   if (time_diff >= pid->sample_time) {
-    float err_p = (setpoint - sample);
-    float err_d = (sample - pid->last_sample);
-    float err_d_tune = (err_p - pid->last_err)/time_diff;
+    fix16_t pv = F2FIX16(sample);
+    fix16_t err_p = fix16_sub(F2FIX16(setpoint), pv);
+    fix16_t sample_time_s = (fix16_t)(((uint64_t)pid->sample_time * FIX16_ONE) / CH_FREQUENCY);
+    fix16_t d_input = fix16_mul(F2FIX16(rate), sample_time_s);
+
+    if (pid->output_sign == NEGATIVE) {
+      err_p = -err_p;
+      d_input = -d_input;
+    }
+
+    pid->err_i_tune = fix16_limit(fix16_add(pid->err_i_tune, err_p), pid->out_min, pid->out_max);
+
+    if (pid->auto_mode)
+      tune_gains(pid, err_p, fix16_sub(err_p, pid->last_err));
+
+    /* Derivative on measurement, low-pass filtered so probe noise does
+     * not reach the relay.
+     */
+    fix16_t d_raw = -fix16_mul(pid->kd, d_input);
+    pid->d_term = fix16_add(pid->d_term,
+        fix16_mul(pid->d_alpha, fix16_sub(d_raw, pid->d_term)));
 
-    pid->err_i += (pid->ki * err_p);
-    pid->err_i = LIMIT(pid->err_i, pid->out_min, pid->out_max);
-    pid->err_i_tune += err_p;
-    pid->err_i_tune = LIMIT(pid->err_i_tune, pid->out_min, pid->out_max);
+    fix16_t p_term = fix16_mul(pid->kp, err_p);
+    fix16_t i_step = fix16_mul(pid->ki, err_p);
 
-    tune_gains(pid, err_p, err_d_tune);
+    /* Resuming after a pause: back the integrator out of the last output
+     * so this step picks up where the loop left off.
+     */
+    if (pid->bumpless) {
+      pid->err_i = fix16_limit(fix16_sub(pid->out, p_term), pid->out_min, pid->out_max);
+      pid->bumpless = false;
+    }
 
-    pid->out = (pid->kp * err_p) + pid->err_i - (pid->kd * err_d);
-    pid->out = LIMIT(pid->out, pid->out_min, pid->out_max);
+    switch (pid->anti_windup) {
+    case PID_AW_BACK_CALC:
+    {
+      fix16_t err_i = fix16_add(pid->err_i, i_step);
+      fix16_t out = fix16_add(fix16_add(p_term, err_i), pid->d_term);
+      fix16_t out_sat = fix16_limit(out, pid->out_min, pid->out_max);
 
+      pid->err_i = fix16_add(err_i, fix16_mul(pid->kb, fix16_sub(out_sat, out)));
+      break;
+    }
+
+    case PID_AW_CLAMP:
+    default:
+    {
+      fix16_t out = fix16_add(fix16_add(p_term, fix16_add(pid->err_i, i_step)), pid->d_term);
+
+      if (!(out > pid->out_max && i_step > 0) &&
+          !(out < pid->out_min && i_step < 0))
+        pid->err_i = fix16_add(pid->err_i, i_step);
+      pid->err_i = fix16_limit(pid->err_i, pid->out_min, pid->out_max);
+      break;
+    }
+    }
+
+    pid->out = fix16_add(fix16_add(p_term, pid->err_i), pid->d_term);
+    pid->out = fix16_limit(pid->out, pid->out_min, pid->out_max);
+
+    pid->primed = true;
     pid->last_err  = err_p;
-    pid->last_sample = sample;
+    pid->last_sample = pv;
     pid->last_time = now;
   }
 }
 
-#define GAMMA 0.005
-void
-tune_gains(pid_t* pid, float err_p, float err_d)
+static void
+tune_gains(pid_t* pid, fix16_t err_p, fix16_t err_d)
 {
-  if (pid->output_sign == NEGATIVE) {
-    pid->kp = pid->kp *-1;
-    pid->ki = pid->ki *-1;
-    pid->kd = pid->kd *-1;
-  }
+  fix16_t step = fix16_mul(GAMMA, err_p);
 
-  pid->kp += -GAMMA * err_p;
-  pid->kp = LIMIT(pid->kp, 0, 50);
+  pid->kp = fix16_limit(fix16_sub(pid->kp, step), 0, KP_MAX);
+  pid->ki = fix16_limit(fix16_sub(pid->ki, fix16_mul(step, pid->err_i_tune)), 0, KI_MAX);
+  pid->kd = fix16_limit(fix16_sub(pid->kd, fix16_mul(step, err_d)), 0, KD_MAX);
+}
 
-  pid->ki += -GAMMA * err_p * pid->err_i_tune;
-  pid->ki = LIMIT(pid->ki, 0, 5);
+void
+pid_set_gains(pid_t* pid, float kp, float ki, float kd)
+{
+  if (kp < 0 || ki < 0 || kd < 0)
+    return;
 
-  pid->kd += -GAMMA * err_p * err_d;
-  pid->kd = LIMIT(pid->kd, 0, 5);
+  if (kp > PID_GAIN_MAX || ki > PID_GAIN_MAX || kd > PID_GAIN_MAX)
+    return;
 
-  pid_set_output_sign(pid, pid->output_sign);
+  pid->gain_p = F2FIX16(kp);
+  pid->gain_i = F2FIX16(ki);
+  pid->gain_d = F2FIX16(kd);
 
-  printf("kp, %f\r\nki, %f\r\nkd, %f\r\n",pid->kp, pid->ki, pid->kd);
+  scale_gains(pid);
 }
 
 void
-pid_set_gains(pid_t* pid, float kp, float ki, float kd)
+pid_set_sample_time(pid_t* pid, uint32_t sample_time_ms)
 {
-  if (kp < 0 || ki < 0 || kd < 0)
+  if (sample_time_ms == 0)
     return;
 
-  uint32_t sample_time_s = pid->sample_time / CH_FREQUENCY;
-  pid->kp = kp;
-  pid->ki = ki * sample_time_s;
-  pid->kd = kd / sample_time_s;
+  pid->sample_time = MS2ST(sample_time_ms);
+  scale_gains(pid);
+}
 
-  if (pid->output_sign == NEGATIVE) {
-    pid->kp = -pid->kp;
-    pid->ki = -pid->ki;
-    pid->kd = -pid->kd;
-  }
+static void
+scale_gains(pid_t* pid)
+{
+  fix16_t sample_time_s = (fix16_t)(((uint64_t)pid->sample_time * FIX16_ONE) / CH_FREQUENCY);
+
+  pid->kp = pid->gain_p;
+  pid->ki = fix16_mul(pid->gain_i, sample_time_s);
+  pid->kd = fix16_div(pid->gain_d, sample_time_s);
+
+  /* Back-calculation tracks at the integral rate (Tt = Ti) */
+  if (pid->kp > 0)
+    pid->kb = fix16_limit(fix16_div(pid->ki, pid->kp), 0, FIX16_ONE);
+  else
+    pid->kb = FIX16_ONE;
 }
 
 void
@@ -105,20 +220,22 @@ pid_enable(pid_t* pid, float sample, bool enabled)
 void
 pid_reinit(pid_t* pid, float sample)
 {
-  pid->last_sample = sample;
-  pid->err_i = 0;
+  /* Bumpless transfer: pick up from the last output instead of kicking
+   * the relay with a fresh integrator or a derivative spike.
+   */
+  pid->last_sample = F2FIX16(sample);
+  pid->last_err = 0;
+  pid->d_term = 0;
+  pid->bumpless = pid->primed;
+  if (!pid->primed)
+    pid->err_i = 0;
+  pid->last_time = (chTimeNow() - pid->sample_time);
 }
 
 void
 pid_set_output_sign(pid_t* pid, uint8_t sign)
 {
    pid->output_sign = sign;
-
-   if (pid->output_sign == NEGATIVE) {
-     pid->kp = -pid->kp;
-     pid->ki = -pid->ki;
-     pid->kd = -pid->kd;
-   }
 }
 
 void
@@ -127,11 +244,17 @@ pid_set_output_limits(pid_t* pid, float min, float max)
   if (min >= max)
    return;
 
-  pid->out_min = min;
-  pid->out_max = max;
+  pid->out_min = F2FIX16(min);
+  pid->out_max = F2FIX16(max);
 
   if (pid->enabled) {
-    pid->out = LIMIT(pid->out, pid->out_min, pid->out_max);
-    pid->err_i = LIMIT(pid->err_i, pid->out_min, pid->out_max);
+    pid->out = fix16_limit(pid->out, pid->out_min, pid->out_max);
+    pid->err_i = fix16_limit(pid->err_i, pid->out_min, pid->out_max);
   }
 }
+
+float
+pid_get_output(const pid_t* pid)
+{
+  return FIX16_2F(pid->out);
+}
@@ -8,6 +8,7 @@
 #include "ch.h"
 #include "types.h"
 #include "sensor.h"
+#include "fix16.h"
 
 
 typedef enum {
@@ -15,22 +16,53 @@ typedef enum {
   NEGATIVE
 } PidOutputSign;
 
+/* Largest gain that fits in Q16.16 */
+#define PID_GAIN_MAX 32767.0f
+
+typedef enum {
+  PID_AW_CLAMP,       // stop integrating while the output is saturated
+  PID_AW_BACK_CALC    // bleed the integrator by the saturation error
+} pid_anti_windup_t;
+
+/* Persistent tuning, stored per controller in app_cfg */
+typedef struct {
+  float kp;
+  float ki;                 // per second
+  float kd;                 // seconds
+  uint32_t sample_time;     // ms
+  pid_anti_windup_t anti_windup;
+  float d_filter;           // weight of the newest derivative sample, (0, 1]
+  bool auto_tune;           // adaptive interaction gain tuning
+} pid_settings_t;
+
 typedef struct {
   bool enabled;
   bool auto_mode;
+  bool primed;              // has produced an output since pid_init()
+  bool bumpless;            // seed the integrator on the next step
+  pid_anti_windup_t anti_windup;
 
-  float kp;
-  float ki;
-  float kd;
+  /* Gains as configured, in per second units */
+  fix16_t gain_p;
+  fix16_t gain_i;
+  fix16_t gain_d;
+
+  /* Gains scaled to the sample time */
+  fix16_t kp;
+  fix16_t ki;
+  fix16_t kd;
+  fix16_t kb;
+  fix16_t d_alpha;
 
-  float err_i;
-  float err_i_tune;
-  float last_err;
-  float last_sample;
+  fix16_t err_i;
+  fix16_t err_i_tune;
+  fix16_t d_term;
+  fix16_t last_err;
+  fix16_t last_sample;
 
-  float out;
-  float out_min;
-  float out_max;
+  fix16_t out;
+  fix16_t out_min;
+  fix16_t out_max;
   int8_t output_sign;
 
   /* Time is in system ticks */
@@ -40,12 +72,15 @@ typedef struct {
 
 
 void pid_init(pid_t* pid);
-void pid_exec(pid_t* pid, float setpoint, float sample);
+void pid_exec(pid_t* pid, float setpoint, float sample, float rate);
+void pid_apply_settings(pid_t* pid, const pid_settings_t* settings);
 void pid_set_gains(pid_t* pid, float Kp, float Ki, float Kd);
-void tune_gains(pid_t* pid, float err_p, float err_d);
+void pid_set_sample_time(pid_t* pid, uint32_t sample_time_ms);
 void pid_enable(pid_t* pid, float sample, bool enabled);
 void pid_reinit(pid_t* pid, float sample);
 void pid_set_output_sign(pid_t* pid, uint8_t direction);
 void pid_set_output_limits(pid_t* pid, float Min, float Max);
+float pid_get_output(const pid_t* pid);
+void pid_get_default_settings(pid_settings_t* settings);
 
 #endif
@@ -0,0 +1,585 @@
+
+#include "ch.h"
+#include "sample_store.h"
+#include "temp_control.h"
+#include "app_cfg.h"
+#include "message.h"
+#include "sntp.h"
+#include "sxfs.h"
+#include "xflash.h"
+#include "common.h"
+#include "crc/crc16.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * Append-only time-series store in the SP_SAMPLE_STORE partition.
+ *
+ * Each tier owns a ring of flash sectors. A sector starts with a header
+ * holding a sequence number and the time of its first record, followed by
+ * fixed size records in time order. The sector with the highest sequence
+ * number is the head; when it fills, the next sector of the ring is erased
+ * and becomes the head, so all sectors of a tier wear evenly.
+ *
+ * Records carry a CRC and are only ever programmed into erased slots, so
+ * losing power mid-write leaves at most one torn record, which fails its
+ * CRC and is skipped. At mount the write position is found by a binary
+ * search for the first erased slot of the head sector.
+ *
+ * Time is the store clock: SNTP time once it is known, otherwise counted
+ * on from the newest record in the store, and never going backwards. That
+ * keeps every tier sorted by time, so a range query finds its start with a
+ * binary search and reads only the records it returns.
+ *
+ * The headers of started sectors are kept in RAM, and store_mtx guards
+ * only that index. Erases and writes run outside it, on a sector or slot
+ * no query reads until the index is updated, so a query never waits for
+ * more than the update.
+ */
+
+#define STORE_MAGIC       0x32535453 // "STS2"
+#define SECTOR_SIZE       XFLASH_SECTOR_SIZE
+#define SLOTS_PER_SECTOR  ((SECTOR_SIZE - sizeof(sector_hdr_t)) / sizeof(sample_record_t))
+#define READ_BATCH        16
+#define MAX_TIER_SECTORS  8
+
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t first_time;
+  uint8_t tier;
+  uint8_t reserved;
+  uint16_t crc;
+} sector_hdr_t;
+
+typedef struct {
+  uint32_t period;          // seconds per record
+  uint8_t first_sector;
+  uint8_t num_sectors;
+} tier_info_t;
+
+typedef struct {
+  bool open;                // the head sector has been started
+  uint8_t head;             // sector within the tier
+  uint32_t head_seq;
+  uint32_t next_slot;
+  uint8_t started;                          // sectors with a valid header, one bit each
+  uint32_t first_time[MAX_TIER_SECTORS];    // of each started sector
+} tier_state_t;
+
+typedef struct {
+  uint32_t bucket;
+  uint16_t count;
+  uint16_t outputs;
+  float sum;
+  float min;
+  float max;
+  float setpoint;
+} accumulator_t;
+
+
+static void dispatch_store_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+static void dispatch_sensor_sample(const sensor_msg_t* msg);
+static void dispatch_sensor_timeout(const sensor_timeout_msg_t* msg);
+static void accumulate(sample_tier_t tier, sensor_id_t sensor, uint32_t now, float value, float setpoint, uint16_t outputs);
+static void flush(sample_tier_t tier, sensor_id_t sensor);
+static void mount(void);
+static void mount_tier(sample_tier_t tier);
+static void append_record(sample_tier_t tier, sample_record_t* rec);
+static uint32_t first_slot_at(sample_tier_t tier, uint8_t sector, uint32_t num_slots, uint32_t time);
+static uint32_t oldest_time(sample_tier_t tier);
+static bool read_hdr(sample_tier_t tier, uint8_t sector, sector_hdr_t* hdr);
+static bool slot_erased(sample_tier_t tier, uint8_t sector, uint32_t slot);
+static bool record_valid(const sample_record_t* rec);
+static uint32_t sector_addr(sample_tier_t tier, uint8_t sector);
+static uint32_t slot_addr(sample_tier_t tier, uint8_t sector, uint32_t slot);
+
+
+/* 19 sectors, 1.1875 MB. With two probes the raw tier holds about a day,
+ * 1 min four days, 15 min seven weeks and 1 h five months.
+ */
+static const tier_info_t tier_info[NUM_SAMPLE_TIERS] = {
+    [SAMPLE_TIER_RAW]   = { .period = 10,   .first_sector = 0,  .num_sectors = 7 },
+    [SAMPLE_TIER_1MIN]  = { .period = 60,   .first_sector = 7,  .num_sectors = 5 },
+    [SAMPLE_TIER_15MIN] = { .period = 900,  .first_sector = 12, .num_sectors = 4 },
+    [SAMPLE_TIER_1H]    = { .period = 3600, .first_sector = 16, .num_sectors = 3 },
+};
+
+static tier_state_t tiers[NUM_SAMPLE_TIERS];
+static accumulator_t accumulators[NUM_SENSORS][NUM_SAMPLE_TIERS];
+static uint16_t outputs_on;
+static uint32_t clock_base;
+static uint32_t last_time;
+static Mutex store_mtx;
+
+
+void
+sample_store_init()
+{
+  chMtxInit(&store_mtx);
+
+  msg_listener_t* l = msg_listener_create("sample_store", 1024, MSG_PRIO_BACKGROUND, 8, dispatch_store_msg, NULL);
+
+  /* Writes can wait behind a sector erase; only the newest sample of each
+   * sensor matters.
+   */
+  msg_subscribe_latest(l, MSG_SENSOR_SAMPLE, NULL);
+  msg_subscribe(l, MSG_SENSOR_TIMEOUT, NULL);
+  msg_subscribe_latest(l, MSG_OUTPUT_STATUS, NULL);
+}
+
+uint32_t
+sample_store_now()
+{
+  uint32_t now;
+
+  if (sntp_time_available())
+    now = sntp_get_time();
+  else
+    now = clock_base + (chTimeNow() / CH_FREQUENCY);
+
+  return MAX(now, last_time);
+}
+
+uint32_t
+sample_store_tier_period(sample_tier_t tier)
+{
+  if (tier >= NUM_SAMPLE_TIERS)
+    return 0;
+
+  return tier_info[tier].period;
+}
+
+/* Returns the finest tier that covers the range back to start in no more
+ * than max_points records per sensor.
+ */
+sample_tier_t
+sample_store_pick_tier(uint32_t start, uint32_t end, uint32_t max_points)
+{
+  int tier;
+
+  chMtxLock(&store_mtx);
+
+  for (tier = 0; tier < (NUM_SAMPLE_TIERS - 1); ++tier) {
+    if (((end - start) / tier_info[tier].period) > max_points)
+      continue;
+
+    if (oldest_time(tier) <= start)
+      break;
+  }
+
+  chMtxUnlock();
+
+  return tier;
+}
+
+/* Calls cb for every record of sensor (or all sensors for SENSOR_NONE) in
+ * [start, end], oldest first. Returns the number of records passed to cb.
+ */
+uint32_t
+sample_store_query(sample_tier_t tier, sensor_id_t sensor, uint32_t start, uint32_t end,
+    sample_store_cb_t cb, void* user_data)
+{
+  sample_record_t recs[READ_BATCH];
+  uint8_t order[MAX_TIER_SECTORS];
+  uint8_t num_sectors = 0;
+  int begin = 0;
+  uint32_t count = 0;
+  uint32_t slot;
+  bool done = false;
+  int i, j;
+
+  if (tier >= NUM_SAMPLE_TIERS)
+    return 0;
+
+  chMtxLock(&store_mtx);
+
+  const tier_info_t* ti = &tier_info[tier];
+  tier_state_t* ts = &tiers[tier];
+
+  if (!ts->open) {
+    chMtxUnlock();
+    return 0;
+  }
+
+  /* Started sectors from oldest to newest; the head is the newest. The
+   * first times of the index give the sector the range starts in.
+   */
+  for (i = 1; i <= ti->num_sectors; ++i) {
+    uint8_t sector = (ts->head + i) % ti->num_sectors;
+
+    if (!TESTBIT(&ts->started, sector))
+      continue;
+
+    if (ts->first_time[sector] <= start)
+      begin = num_sectors;
+    order[num_sectors++] = sector;
+  }
+
+  for (i = begin; i < num_sectors && !done; ++i) {
+    uint8_t sector = order[i];
+    uint32_t num_slots = (sector == ts->head) ? ts->next_slot : SLOTS_PER_SECTOR;
+
+    slot = (i == begin) ? first_slot_at(tier, sector, num_slots, start) : 0;
+
+    for (; slot < num_slots && !done; slot += READ_BATCH) {
+      uint32_t n = MIN(READ_BATCH, num_slots - slot);
+      sxfs_read(SP_SAMPLE_STORE, slot_addr(tier, sector, slot), (uint8_t*)recs, n * sizeof(sample_record_t));
+
+      for (j = 0; j < (int)n; ++j) {
+        if (!record_valid(&recs[j]))
+          continue;
+
+        if (recs[j].time > end) {
+          done = true;
+          break;
+        }
+
+        if (recs[j].time >= start &&
+            (sensor == SENSOR_NONE || recs[j].sensor == sensor)) {
+          cb(&recs[j], user_data);
+          count++;
+        }
+      }
+    }
+  }
+
+  chMtxUnlock();
+
+  return count;
+}
+
+static void
+dispatch_store_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  (void)listener_data;
+  (void)sub_data;
+
+  switch (id) {
+  case MSG_INIT:
+    mount();
+    break;
+
+  case MSG_SENSOR_SAMPLE:
+    dispatch_sensor_sample(msg_data);
+    break;
+
+  case MSG_SENSOR_TIMEOUT:
+    dispatch_sensor_timeout(msg_data);
+    break;
+
+  case MSG_OUTPUT_STATUS:
+  {
+    output_status_t* status = msg_data;
+    if (status->output < NUM_OUTPUTS) {
+      ASSIGNBIT(&outputs_on, status->output, status->enabled);
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+static void
+dispatch_sensor_sample(const sensor_msg_t* msg)
+{
+  float setpoint = NAN;
+  uint16_t outputs = 0;
+  int i, j;
+
+  if (msg->sensor < SENSOR_1 || msg->sensor >= NUM_SENSORS)
+    return;
+
+  /* Setpoint and relays of the controller fed by this sensor */
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    const controller_settings_t* cs = app_cfg_get_controller_settings(i);
+    if (cs->sensor != msg->sensor)
+      continue;
+
+    if (isnan(setpoint))
+      setpoint = temp_control_get_current_setpoint(i);
+
+    for (j = 0; j < NUM_OUTPUTS; ++j) {
+      if (cs->output_settings[j].enabled && TESTBIT(&outputs_on, j))
+        SETBIT(&outputs, j);
+    }
+  }
+
+  uint32_t now = sample_store_now();
+  last_time = now;
+
+  for (i = 0; i < NUM_SAMPLE_TIERS; ++i)
+    accumulate(i, msg->sensor, now, msg->sample.value, setpoint, outputs);
+}
+
+/* Close the open intervals so the gap shows up in the history */
+static void
+dispatch_sensor_timeout(const sensor_timeout_msg_t* msg)
+{
+  int i;
+
+  if (msg->sensor < SENSOR_1 || msg->sensor >= NUM_SENSORS)
+    return;
+
+  for (i = 0; i < NUM_SAMPLE_TIERS; ++i)
+    flush(i, msg->sensor);
+}
+
+static void
+accumulate(sample_tier_t tier, sensor_id_t sensor, uint32_t now, float value, float setpoint, uint16_t outputs)
+{
+  accumulator_t* a = &accumulators[sensor][tier];
+  uint32_t bucket = now - (now % tier_info[tier].period);
+
+  if (a->count > 0 && a->bucket != bucket)
+    flush(tier, sensor);
+
+  if (a->count == 0) {
+    a->bucket = bucket;
+    a->sum = 0;
+    a->min = value;
+    a->max = value;
+    a->outputs = 0;
+  }
+
+  a->sum += value;
+  a->min = MIN(a->min, value);
+  a->max = MAX(a->max, value);
+  a->outputs |= outputs;
+  a->setpoint = setpoint;
+  a->count++;
+}
+
+static void
+flush(sample_tier_t tier, sensor_id_t sensor)
+{
+  accumulator_t* a = &accumulators[sensor][tier];
+
+  if (a->count == 0)
+    return;
+
+  sample_record_t rec = {
+      .time = a->bucket,
+      .sensor = sensor,
+      .outputs = a->outputs,
+      .mean = a->sum / a->count,
+      .min = a->min,
+      .max = a->max,
+      .setpoint = a->setpoint,
+      .count = a->count
+  };
+
+  append_record(tier, &rec);
+
+  a->count = 0;
+}
+
+static void
+mount()
+{
+  int i;
+  sample_record_t rec;
+
+  chMtxLock(&store_mtx);
+
+  /* Without SNTP the clock carries on from the newest record */
+  for (i = 0; i < NUM_SAMPLE_TIERS; ++i) {
+    tier_state_t* ts = &tiers[i];
+
+    mount_tier(i);
+
+    if (ts->open && ts->next_slot > 0) {
+      sxfs_read(SP_SAMPLE_STORE, slot_addr(i, ts->head, ts->next_slot - 1), (uint8_t*)&rec, sizeof(rec));
+      if (record_valid(&rec))
+        clock_base = MAX(clock_base, rec.time + tier_info[i].period);
+    }
+  }
+
+  chMtxUnlock();
+}
+
+static void
+mount_tier(sample_tier_t tier)
+{
+  tier_state_t* ts = &tiers[tier];
+  sector_hdr_t hdr;
+  uint8_t i;
+
+  memset(ts, 0, sizeof(*ts));
+
+  for (i = 0; i < tier_info[tier].num_sectors; ++i) {
+    if (!read_hdr(tier, i, &hdr))
+      continue;
+
+    SETBIT(&ts->started, i);
+    ts->first_time[i] = hdr.first_time;
+
+    if (!ts->open || hdr.seq > ts->head_seq) {
+      ts->open = true;
+      ts->head = i;
+      ts->head_seq = hdr.seq;
+    }
+  }
+
+  if (!ts->open)
+    return;
+
+  /* Slots fill in order, so the erased ones are all at the end */
+  uint32_t lo = 0;
+  uint32_t hi = SLOTS_PER_SECTOR;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (slot_erased(tier, ts->head, mid))
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  ts->next_slot = lo;
+}
+
+/* Only the store's listener thread writes, so it reads the index without
+ * the lock and takes it just to change it.
+ */
+static void
+append_record(sample_tier_t tier, sample_record_t* rec)
+{
+  tier_state_t* ts = &tiers[tier];
+  uint8_t next;
+
+  rec->crc = crc16_block(0, (uint8_t*)rec, offsetof(sample_record_t, crc));
+
+  if (ts->open && ts->next_slot < SLOTS_PER_SECTOR) {
+    sxfs_write(SP_SAMPLE_STORE, slot_addr(tier, ts->head, ts->next_slot), (uint8_t*)rec, sizeof(*rec));
+
+    chMtxLock(&store_mtx);
+    ts->next_slot++;
+    chMtxUnlock();
+    return;
+  }
+
+  /* Rotate to the next sector of the ring, dropping its oldest records.
+   * Queries stop reading it before the erase.
+   */
+  next = ts->open ? ((ts->head + 1) % tier_info[tier].num_sectors) : ts->head;
+
+  chMtxLock(&store_mtx);
+  CLRBIT(&ts->started, next);
+  chMtxUnlock();
+
+  struct {
+    sector_hdr_t hdr;
+    sample_record_t rec;
+  } first = {
+      .hdr = {
+          .magic = STORE_MAGIC,
+          .seq = ts->head_seq + 1,
+          .first_time = rec->time,
+          .tier = tier,
+      },
+      .rec = *rec
+  };
+  first.hdr.crc = crc16_block(0, (uint8_t*)&first.hdr, offsetof(sector_hdr_t, crc));
+
+  sxfs_erase_sector(SP_SAMPLE_STORE, sector_addr(tier, next));
+  sxfs_write(SP_SAMPLE_STORE, sector_addr(tier, next), (uint8_t*)&first, sizeof(first));
+
+  chMtxLock(&store_mtx);
+  ts->open = true;
+  ts->head = next;
+  ts->head_seq++;
+  ts->next_slot = 1;
+  SETBIT(&ts->started, next);
+  ts->first_time[next] = rec->time;
+  chMtxUnlock();
+}
+
+/* Binary search for the first slot at or after time */
+static uint32_t
+first_slot_at(sample_tier_t tier, uint8_t sector, uint32_t num_slots, uint32_t time)
+{
+  uint32_t lo = 0;
+  uint32_t hi = num_slots;
+
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    uint32_t t;
+
+    sxfs_read(SP_SAMPLE_STORE, slot_addr(tier, sector, mid), (uint8_t*)&t, sizeof(t));
+    if (t < time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+static uint32_t
+oldest_time(sample_tier_t tier)
+{
+  const tier_info_t* ti = &tier_info[tier];
+  tier_state_t* ts = &tiers[tier];
+  int i;
+
+  if (!ts->open)
+    return UINT32_MAX;
+
+  for (i = 1; i <= ti->num_sectors; ++i) {
+    uint8_t sector = (ts->head + i) % ti->num_sectors;
+
+    if (TESTBIT(&ts->started, sector))
+      return ts->first_time[sector];
+  }
+
+  return UINT32_MAX;
+}
+
+static bool
+read_hdr(sample_tier_t tier, uint8_t sector, sector_hdr_t* hdr)
+{
+  sxfs_read(SP_SAMPLE_STORE, sector_addr(tier, sector), (uint8_t*)hdr, sizeof(*hdr));
+
+  return (hdr->magic == STORE_MAGIC &&
+          hdr->tier == tier &&
+          hdr->crc == crc16_block(0, (uint8_t*)hdr, offsetof(sector_hdr_t, crc)));
+}
+
+static bool
+slot_erased(sample_tier_t tier, uint8_t sector, uint32_t slot)
+{
+  uint32_t buf[sizeof(sample_record_t) / sizeof(uint32_t)];
+  uint32_t i;
+
+  sxfs_read(SP_SAMPLE_STORE, slot_addr(tier, sector, slot), (uint8_t*)buf, sizeof(buf));
+
+  for (i = 0; i < (sizeof(buf) / sizeof(buf[0])); ++i) {
+    if (buf[i] != 0xFFFFFFFF)
+      return false;
+  }
+
+  return true;
+}
+
+static bool
+record_valid(const sample_record_t* rec)
+{
+  return (rec->time != 0xFFFFFFFF &&
+          rec->crc == crc16_block(0, (uint8_t*)rec, offsetof(sample_record_t, crc)));
+}
+
+static uint32_t
+sector_addr(sample_tier_t tier, uint8_t sector)
+{
+  return (tier_info[tier].first_sector + sector) * SECTOR_SIZE;
+}
+
+static uint32_t
+slot_addr(sample_tier_t tier, uint8_t sector, uint32_t slot)
+{
+  return sector_addr(tier, sector) + sizeof(sector_hdr_t) + (slot * sizeof(sample_record_t));
+}
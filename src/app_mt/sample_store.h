@@ -0,0 +1,57 @@
+#ifndef SAMPLE_STORE_H
+#define SAMPLE_STORE_H
+
+#include "sensor.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/* Tiers from finest to coarsest. The finest holds the most recent data;
+ * each rollup keeps the min/max/mean of a longer interval for longer.
+ */
+typedef enum {
+  SAMPLE_TIER_RAW,          // 10 s
+  SAMPLE_TIER_1MIN,
+  SAMPLE_TIER_15MIN,
+  SAMPLE_TIER_1H,
+
+  NUM_SAMPLE_TIERS
+} sample_tier_t;
+
+/* One interval of one sensor. Stored as is in flash, so the layout must
+ * not change without bumping the store magic.
+ */
+typedef struct {
+  uint32_t time;            // start of the interval, store clock seconds
+  uint8_t sensor;
+  uint8_t reserved;
+  uint16_t outputs;         // outputs of the sensor's controller that were on during the interval
+  float mean;
+  float min;
+  float max;
+  float setpoint;           // at the end of the interval, NAN if none
+  uint16_t count;           // samples in the interval
+  uint16_t crc;             // crc16 of everything above
+} sample_record_t;
+
+typedef void (*sample_store_cb_t)(const sample_record_t* rec, void* user_data);
+
+
+void
+sample_store_init(void);
+
+uint32_t
+sample_store_now(void);
+
+uint32_t
+sample_store_tier_period(sample_tier_t tier);
+
+sample_tier_t
+sample_store_pick_tier(uint32_t start, uint32_t end, uint32_t max_points);
+
+uint32_t
+sample_store_query(sample_tier_t tier, sensor_id_t sensor, uint32_t start, uint32_t end,
+    sample_store_cb_t cb, void* user_data);
+
+#endif
@@ -9,46 +9,78 @@
 
 
 #define SENSOR_TIMEOUT S2ST (2)
-#define SENSOR_SAMPLE_SIZE  (10)
-#define MAX_SAMPLE_DELTA    (40)
 
+#define FAMILY_DS18B20      0x28
+#define FAMILY_MAX31850     0x3B
 
-typedef struct sensor_port_s {
-  sensor_id_t sensor;
-  float sample_filter[SENSOR_SAMPLE_SIZE];
-  uint8_t sample_filter_index;
-  uint8_t sample_size;
-  onewire_bus_t* bus;
-  Thread* thread;
-  float last_sample;
+#define CONVERT_T           0x44
+#define WRITE_SCRATCHPAD    0x4E
+#define READ_SCRATCHPAD     0xBE
+
+/* DS18B20 configuration register: resolution in bits 5 and 6 */
+#define CONFIG_RESOLUTION(bits) ((((bits) - 9) << 5) | 0x1F)
+#define CONFIG_BITS(config)     ((((config) >> 5) & 0x3) + 9)
+
+
+/* Filter and timeout state of one probe */
+typedef struct {
+  sensor_filter_t filter;
+  uint32_t seq;
   systime_t last_sample_time;
   bool connected;
+} sensor_t;
+
+typedef struct sensor_port_s {
+  uint8_t port;
+  onewire_bus_t bus;
+  Thread* thread;
+
+  /* Probes found by the last search, cached until a bus fault */
+  bool scanned;
+  uint8_t num_devices;
+  sensor_id_t devices[NUM_SENSORS];
+
+  /* When the last conversion round completed, the acquisition time of
+   * every sample read back from it
+   */
+  systime_t conversion_done;
 } sensor_port_t;
 
 
 static msg_t sensor_thread(void* arg);
-static bool sensor_get_sample(sensor_port_t* tp, quantity_t* sample);
-static void filter_sample(sensor_port_t* tp, quantity_t* sample);
-static void send_sensor_msg(sensor_port_t* tp, quantity_t* sample);
-static void send_timeout_msg(sensor_port_t* tp);
+static void scan_bus(sensor_port_t* tp);
+static bool convert_all(sensor_port_t* tp);
+static void read_all(sensor_port_t* tp);
+static void check_timeouts(sensor_port_t* tp);
+static systime_t conversion_time(const sensor_device_t* dev);
+static bool sensor_get_sample(sensor_port_t* tp, sensor_id_t sensor, quantity_t* sample);
+static void send_sensor_msg(sensor_id_t sensor, sensor_t* ts, quantity_t* sample, systime_t period);
+static void send_timeout_msg(sensor_id_t sensor);
+
+static bool read_maxim_temp_sensor(sensor_port_t* tp, const sensor_device_t* dev, quantity_t* sample);
+static bool set_maxim_resolution(sensor_port_t* tp, const sensor_device_t* dev, const uint8_t* scratchpad);
+
 
-static bool read_maxim_temp_sensor(sensor_port_t* tp, quantity_t* sample);
+static sensor_t sensors[NUM_SENSORS];
 
 
 sensor_port_t*
-sensor_init(sensor_id_t sensor, onewire_bus_t* port)
+sensor_init(uint8_t port, UARTDriver* uart)
 {
   sensor_port_t* tp = calloc(1, sizeof(sensor_port_t));
 
-  tp->sensor = sensor;
-  tp->bus = port;
-  onewire_init(tp->bus);
+  tp->port = port;
+  onewire_init(&tp->bus, uart);
 
-  tp->thread = chThdCreateFromHeap(NULL, 1024, NORMALPRIO, sensor_thread, tp);
+  tp->thread = chThdCreateFromHeap(NULL, 1024, MSG_PRIO_CONTROL, sensor_thread, tp);
 
   return tp;
 }
 
+/* Each port runs its own conversion rounds, so the conversion wait
+ * overlaps across ports. Within a port one Convert T starts every probe at
+ * once and the scratchpads are read back to back when the slowest is done.
+ */
 static msg_t
 sensor_thread(void* arg)
 {
@@ -57,88 +89,177 @@ sensor_thread(void* arg)
   chRegSetThreadName("sensor");
 
   while (1) {
-    quantity_t sample;
-
-    if (sensor_get_sample(tp, &sample)) {
-      filter_sample(tp, &sample);
-      tp->connected = true;
-      tp->last_sample_time = chTimeNow();
-      send_sensor_msg(tp, &sample);
+    if (!tp->scanned)
+      scan_bus(tp);
+
+    if (tp->scanned) {
+      if (convert_all(tp))
+        read_all(tp);
+      else
+        tp->scanned = false;
     }
-    else {
-      if ((chTimeNow() - tp->last_sample_time) > SENSOR_TIMEOUT) {
-        if (tp->connected) {
-          tp->connected = false;
-          send_timeout_msg(tp);
-        }
-      }
+
+    check_timeouts(tp);
+
+    if (!tp->scanned)
       chThdSleepMilliseconds(100);
-    }
   }
 
   return 0;
 }
 
 static void
-filter_sample(sensor_port_t* tp, quantity_t* sample)
+scan_bus(sensor_port_t* tp)
+{
+  onewire_search_t search;
+  uint8_t roms[NUM_SENSORS][8];
+  uint8_t num_roms = 0;
+
+  onewire_search_init(&search);
+  while (num_roms < NUM_SENSORS &&
+         onewire_search_next(&tp->bus, &search, roms[num_roms]))
+    num_roms++;
+
+  /* Only a search that got to the last device shows which probes are gone */
+  tp->num_devices = app_cfg_register_sensor_devices(tp->port, roms, num_roms,
+      search.last_device, tp->devices);
+
+  tp->scanned = (tp->num_devices > 0);
+}
+
+static bool
+convert_all(sensor_port_t* tp)
 {
-  float filtered_sample = 0;
-  uint8_t i;
+  static const uint8_t convert_t[] = { SKIP_ROM, CONVERT_T };
+  systime_t wait = 0;
+  int i;
 
-  if ((fabs(sample->value - tp->last_sample) > MAX_SAMPLE_DELTA) &&
-      (tp->sample_size == SENSOR_SAMPLE_SIZE)) {
-    sample->value = tp->last_sample;
+  for (i = 0; i < tp->num_devices; ++i) {
+    const sensor_device_t* dev = app_cfg_get_sensor_device(tp->devices[i]);
+    if (dev != NULL)
+      wait = MAX(wait, conversion_time(dev));
   }
-  else {
-    tp->sample_filter[tp->sample_filter_index] = sample->value;
-    if (++tp->sample_filter_index >= SENSOR_SAMPLE_SIZE)
-      tp->sample_filter_index = 0;
 
-    if (tp->sample_size < SENSOR_SAMPLE_SIZE)
-      tp->sample_size++;
+  if (!onewire_transaction(&tp->bus, true, convert_t, sizeof(convert_t), NULL, 0))
+    return false;
+
+  // wait for every device to signal conversion complete
+  chThdSleep(wait);
+  while (1) {
+    uint8_t bit;
+    if (!onewire_recv_bit(&tp->bus, &bit))
+      return false;
+
+    if (bit) {
+      tp->conversion_done = chTimeNow();
+      return true;
+    }
 
-    for (i = 0; i < SENSOR_SAMPLE_SIZE; i++) {
-      filtered_sample += tp->sample_filter[i];
+    chThdSleepMilliseconds(10);
+  }
+}
+
+static void
+read_all(sensor_port_t* tp)
+{
+  int i;
+
+  for (i = 0; i < tp->num_devices; ++i) {
+    sensor_id_t sensor = tp->devices[i];
+    sensor_t* ts = &sensors[sensor];
+    quantity_t sample;
+
+    if (sensor_get_sample(tp, sensor, &sample)) {
+      systime_t now = tp->conversion_done;
+      systime_t period = ts->connected ? (now - ts->last_sample_time) : 0;
+      const sensor_filter_settings_t* fs = app_cfg_get_sensor_filter_settings(sensor);
+
+      /* Start over on reconnect or when the chain has been reconfigured */
+      if (!ts->connected ||
+          memcmp(fs, &ts->filter.settings, sizeof(*fs)) != 0)
+        sensor_filter_init(&ts->filter, fs);
+
+      sample.value = sensor_filter_apply(&ts->filter, sample.value, (float)period / CH_FREQUENCY);
+      ts->connected = true;
+      ts->last_sample_time = now;
+      send_sensor_msg(sensor, ts, &sample, period);
+    }
+    else {
+      /* A probe that stops answering was unplugged or the bus is in
+       * trouble; search again before the next round.
+       */
+      tp->scanned = false;
     }
-    sample->value = filtered_sample / tp->sample_size;
-    tp->last_sample = sample->value;
   }
 }
 
+/* Times out every probe last seen on this port, whether or not the last
+ * search found it.
+ */
 static void
-send_sensor_msg(sensor_port_t* tp, quantity_t* sample)
+check_timeouts(sensor_port_t* tp)
+{
+  int i;
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    const sensor_device_t* dev = app_cfg_get_sensor_device(i);
+    sensor_t* ts = &sensors[i];
+
+    if (dev == NULL || dev->port != tp->port)
+      continue;
+
+    if (ts->connected && (chTimeNow() - ts->last_sample_time) > SENSOR_TIMEOUT) {
+      ts->connected = false;
+      send_timeout_msg(i);
+    }
+  }
+}
+
+static systime_t
+conversion_time(const sensor_device_t* dev)
+{
+  if (dev->rom[0] == FAMILY_MAX31850)
+    return MS2ST(100);
+
+  /* 94 ms at 9 bits, doubling with every extra bit */
+  uint8_t bits = LIMIT(dev->resolution, SENSOR_RESOLUTION_MIN, SENSOR_RESOLUTION_MAX);
+  return MS2ST(94 << (bits - SENSOR_RESOLUTION_MIN));
+}
+
+static void
+send_sensor_msg(sensor_id_t sensor, sensor_t* ts, quantity_t* sample, systime_t period)
 {
   sensor_msg_t msg = {
-      .sensor = tp->sensor,
-      .sample = *sample
+      .sensor = sensor,
+      .sample = *sample,
+      .timestamp = ts->last_sample_time,
+      .seq = ts->seq++,
+      .rate = sensor_filter_get_rate(&ts->filter),
+      .sample_period = MIN(period * 1000 / CH_FREQUENCY, UINT16_MAX)
   };
-  msg_send(MSG_SENSOR_SAMPLE, &msg);
+  msg_publish(MSG_SENSOR_SAMPLE, sensor, &msg, sizeof(msg));
 }
 
 static void
-send_timeout_msg(sensor_port_t* tp)
+send_timeout_msg(sensor_id_t sensor)
 {
   sensor_timeout_msg_t msg = {
-      .sensor = tp->sensor
+      .sensor = sensor
   };
-  msg_send(MSG_SENSOR_TIMEOUT, &msg);
+  msg_publish(MSG_SENSOR_TIMEOUT, sensor, &msg, sizeof(msg));
 }
 
 static bool
-sensor_get_sample(sensor_port_t* tp, quantity_t* sample)
+sensor_get_sample(sensor_port_t* tp, sensor_id_t sensor, quantity_t* sample)
 {
-  uint8_t addr[8];
-  if (!onewire_reset(tp->bus)) {
-    return false;
-  }
-  if (!onewire_read_rom(tp->bus, addr)) {
+  const sensor_device_t* dev = app_cfg_get_sensor_device(sensor);
+  if (dev == NULL)
     return false;
-  }
 
-  switch (addr[0]) {
-  case 0x3B: // MAX31850
-  case 0x28: // DS18B20
-    return read_maxim_temp_sensor(tp, sample);
+  switch (dev->rom[0]) {
+  case FAMILY_MAX31850:
+  case FAMILY_DS18B20:
+    return read_maxim_temp_sensor(tp, dev, sample);
 
   default:
     return false;
@@ -148,44 +269,19 @@ sensor_get_sample(sensor_port_t* tp, quantity_t* sample)
 }
 
 static bool
-read_maxim_temp_sensor(sensor_port_t* tp, quantity_t* sample)
+read_maxim_temp_sensor(sensor_port_t* tp, const sensor_device_t* dev, quantity_t* sample)
 {
-  int i;
+  uint8_t cmd[10];
 
-  // issue a T convert command
-  if (!onewire_reset(tp->bus))
-    return false;
-  if (!onewire_send_byte(tp->bus, SKIP_ROM))
-    return false;
-  if (!onewire_send_byte(tp->bus, 0x44))
-    return false;
-
-  // wait for device to signal conversion complete
-  chThdSleepMilliseconds(700);
-  while (1) {
-    uint8_t bit;
-    if (!onewire_recv_bit(tp->bus, &bit))
-      return false;
-
-    if (bit)
-      break;
-    else
-      chThdSleepMilliseconds(100);
-  }
-
-  // read the scratchpad register
-  if (!onewire_reset(tp->bus))
-    return false;
-  if (!onewire_send_byte(tp->bus, SKIP_ROM))
-    return false;
-  if (!onewire_send_byte(tp->bus, 0xBE))
-    return false;
+  // read the scratchpad register of this probe
+  cmd[0] = MATCH_ROM;
+  memcpy(&cmd[1], dev->rom, 8);
+  cmd[9] = READ_SCRATCHPAD;
 
   uint8_t scratchpad[9];
-  for (i = 0; i < (int)sizeof(scratchpad); ++i) {
-    if (!onewire_recv_byte(tp->bus, &scratchpad[i]))
-      return false;
-  }
+  if (!onewire_transaction(&tp->bus, true, cmd, sizeof(cmd),
+      scratchpad, sizeof(scratchpad)))
+    return false;
 
   uint8_t crc = crc8_block(0, scratchpad, 8);
   if (crc != scratchpad[8])
@@ -194,9 +290,40 @@ read_maxim_temp_sensor(sensor_port_t* tp, quantity_t* sample)
   // two unsigned data bytes need to be combined and converted to a signed short
   int16_t t = (scratchpad[1] << 8) + scratchpad[0];
 
+  if (dev->rom[0] == FAMILY_DS18B20) {
+    // low bits are undefined below 12 bit resolution
+    uint8_t bits = CONFIG_BITS(scratchpad[4]);
+    t &= ~((1 << (12 - bits)) - 1);
+
+    // the new resolution applies from the next conversion
+    if (bits != dev->resolution &&
+        !set_maxim_resolution(tp, dev, scratchpad))
+      return false;
+  }
+
   // convert from 16ths of a degree Celsius to degrees Fahrenheit
   sample->unit = UNIT_TEMP_DEG_F;
   sample->value = ((t / 16.0f) * 1.8f) + 32;
 
   return true;
 }
+
+/* Writes the configured resolution to the scratchpad, keeping the alarm
+ * thresholds. It is not copied to EEPROM; every power up starts at 12 bits
+ * and is set again after the first read.
+ */
+static bool
+set_maxim_resolution(sensor_port_t* tp, const sensor_device_t* dev, const uint8_t* scratchpad)
+{
+  uint8_t cmd[13];
+  uint8_t bits = LIMIT(dev->resolution, SENSOR_RESOLUTION_MIN, SENSOR_RESOLUTION_MAX);
+
+  cmd[0] = MATCH_ROM;
+  memcpy(&cmd[1], dev->rom, 8);
+  cmd[9] = WRITE_SCRATCHPAD;
+  cmd[10] = scratchpad[2];  // TH
+  cmd[11] = scratchpad[3];  // TL
+  cmd[12] = CONFIG_RESOLUTION(bits);
+
+  return onewire_transaction(&tp->bus, true, cmd, sizeof(cmd), NULL, 0);
+}
@@ -2,25 +2,53 @@
 #define SENSOR_H
 
 #include "onewire.h"
+#include "sensor_filter.h"
 #include "common.h"
 #include <stdint.h>
 
 
+/* Number of temperature probes across all ports, set at build time (see
+ * app_mt.mk). Each discovered probe takes one slot in the device table.
+ */
+#ifndef NUM_SENSORS
+#define NUM_SENSORS 6
+#endif
+
+#if NUM_SENSORS > MAX_CHANNELS
+#error "NUM_SENSORS exceeds MAX_CHANNELS"
+#endif
+
 typedef enum {
   SENSOR_NONE = -1,
   SENSOR_1,
   SENSOR_2,
-
-  NUM_SENSORS
 } sensor_id_t;
 
 
+/* DS18B20 conversion resolution, in bits. Each bit less halves the
+ * conversion time, from 750 ms at 12 bits down to 94 ms at 9 bits.
+ */
+#define SENSOR_RESOLUTION_MIN 9
+#define SENSOR_RESOLUTION_MAX 12
+
+/* Entry in the persistent device table. A zero family code marks a free slot. */
+typedef struct {
+  uint8_t rom[8];
+  uint8_t port;
+  uint8_t resolution;
+} sensor_device_t;
+
 struct sensor_port_s;
 typedef struct sensor_port_s sensor_port_t;
 
+/* Published with msg_publish, so must stay within 32 bytes */
 typedef struct {
   sensor_id_t sensor;
   quantity_t sample;
+  systime_t timestamp;      // when the probe was read
+  uint32_t seq;             // counts samples of this probe, gaps mean dropped samples
+  float rate;               // filtered rate of change, sample units per second
+  uint16_t sample_period;   // ms since the previous sample of this probe, 0 if none
 } sensor_msg_t;
 
 typedef struct {
@@ -29,6 +57,6 @@ typedef struct {
 
 
 sensor_port_t*
-sensor_init(sensor_id_t sensor, onewire_bus_t* port);
+sensor_init(uint8_t port, UARTDriver* uart);
 
 #endif
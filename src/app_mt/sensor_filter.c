@@ -0,0 +1,275 @@
+
+#include "sensor_filter.h"
+#include "common.h"
+
+#include <string.h>
+
+/*
+ * Per-probe sample filter chain. Each stage is one of
+ *
+ *   mean    moving average, kept as a running sum so a sample costs O(1)
+ *   median  median of a short window, drops single sample spikes without
+ *           the lag of a wide mean
+ *   ema     exponential moving average, y += alpha * (x - y)
+ *   kalman  constant rate model over [temperature, rate], which also gives
+ *           an estimate of the rate of change
+ *
+ * Windows only average over the samples they have actually seen, so a
+ * filter that has just been reset does not pull towards zero.
+ */
+
+/* Initial rate uncertainty of the Kalman filter, (deg/s)^2 */
+#define KALMAN_RATE_VARIANCE  1.0f
+
+/* Weight of each new difference in the rate estimate of non-Kalman chains */
+#define RATE_ALPHA            0.1f
+
+
+static float stage_mean(filter_stage_t* st, uint8_t taps, float sample);
+static float stage_median(filter_stage_t* st, uint8_t taps, float sample);
+static float stage_ema(filter_stage_t* st, float alpha, float sample);
+static float stage_kalman(filter_stage_t* st, const filter_stage_settings_t* s, float sample, float dt);
+static void push_tap(filter_stage_t* st, uint8_t taps, float sample);
+
+
+void
+sensor_filter_init(sensor_filter_t* f, const sensor_filter_settings_t* settings)
+{
+  f->settings = *settings;
+  sensor_filter_reset(f);
+}
+
+void
+sensor_filter_reset(sensor_filter_t* f)
+{
+  memset(f->stages, 0, sizeof(f->stages));
+  f->primed = false;
+  f->rate = 0;
+}
+
+float
+sensor_filter_apply(sensor_filter_t* f, float sample, float dt)
+{
+  int i;
+
+  for (i = 0; i < FILTER_MAX_STAGES; ++i) {
+    const filter_stage_settings_t* s = &f->settings.stages[i];
+    filter_stage_t* st = &f->stages[i];
+    uint8_t taps = LIMIT(s->taps, 1, FILTER_MAX_TAPS);
+
+    switch (s->type) {
+      case FILTER_MEAN:
+        sample = stage_mean(st, taps, sample);
+        break;
+
+      case FILTER_MEDIAN:
+        sample = stage_median(st, taps, sample);
+        break;
+
+      case FILTER_EMA:
+        sample = stage_ema(st, s->alpha, sample);
+        break;
+
+      case FILTER_KALMAN:
+        sample = stage_kalman(st, s, sample, dt);
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  if (f->primed && dt > 0)
+    f->rate += RATE_ALPHA * (((sample - f->last_output) / dt) - f->rate);
+  f->primed = true;
+  f->last_output = sample;
+
+  return sample;
+}
+
+/* Returns the rate of change in sample units per second. The Kalman stage
+ * estimates it directly; otherwise it is a smoothed difference of the
+ * filter output.
+ */
+float
+sensor_filter_get_rate(const sensor_filter_t* f)
+{
+  int i;
+
+  for (i = 0; i < FILTER_MAX_STAGES; ++i) {
+    if (f->settings.stages[i].type == FILTER_KALMAN &&
+        f->stages[i].primed)
+      return f->stages[i].rate;
+  }
+
+  return f->rate;
+}
+
+void
+sensor_filter_get_default_settings(sensor_filter_settings_t* settings)
+{
+  sensor_filter_get_preset_settings(FILTER_PRESET_DEFAULT, settings);
+}
+
+void
+sensor_filter_get_preset_settings(sensor_filter_preset_t preset, sensor_filter_settings_t* settings)
+{
+  memset(settings, 0, sizeof(*settings));
+
+  switch (preset) {
+  case FILTER_PRESET_NONE:
+    break;
+
+  case FILTER_PRESET_KALMAN:
+    settings->stages[0].type = FILTER_MEDIAN;
+    settings->stages[0].taps = 3;
+
+    settings->stages[1].type = FILTER_KALMAN;
+    settings->stages[1].process_noise = 1e-7f;
+    settings->stages[1].measurement_noise = 0.012f;
+    break;
+
+  case FILTER_PRESET_EMA:
+    settings->stages[0].type = FILTER_MEDIAN;
+    settings->stages[0].taps = 3;
+
+    settings->stages[1].type = FILTER_EMA;
+    settings->stages[1].alpha = 0.2f;
+    break;
+
+  case FILTER_PRESET_DEFAULT:
+  default:
+    /* Spike rejection, then the 10 sample average the probes always had */
+    settings->stages[0].type = FILTER_MEDIAN;
+    settings->stages[0].taps = 3;
+
+    settings->stages[1].type = FILTER_MEAN;
+    settings->stages[1].taps = 10;
+    break;
+  }
+}
+
+const char*
+sensor_filter_get_preset_name(sensor_filter_preset_t preset)
+{
+  switch (preset) {
+  case FILTER_PRESET_KALMAN:  return "Median + Kalman";
+  case FILTER_PRESET_EMA:     return "Median + EMA";
+  case FILTER_PRESET_NONE:    return "None";
+  case FILTER_PRESET_DEFAULT: return "Median + average";
+  default:                    return "Custom";
+  }
+}
+
+static void
+push_tap(filter_stage_t* st, uint8_t taps, float sample)
+{
+  st->taps[st->index] = sample;
+  if (++st->index >= taps)
+    st->index = 0;
+
+  if (st->count < taps)
+    st->count++;
+}
+
+static float
+stage_mean(filter_stage_t* st, uint8_t taps, float sample)
+{
+  int i;
+
+  if (st->count == taps)
+    st->sum -= st->taps[st->index];
+  st->sum += sample;
+
+  push_tap(st, taps, sample);
+
+  /* Re-add the window once per lap so rounding errors cannot build up */
+  if (st->index == 0) {
+    st->sum = 0;
+    for (i = 0; i < st->count; ++i)
+      st->sum += st->taps[i];
+  }
+
+  return st->sum / st->count;
+}
+
+static float
+stage_median(filter_stage_t* st, uint8_t taps, float sample)
+{
+  float sorted[FILTER_MAX_TAPS];
+  int i, j;
+
+  push_tap(st, taps, sample);
+
+  /* Insertion sort, the window is only a few samples */
+  for (i = 0; i < st->count; ++i) {
+    float v = st->taps[i];
+    for (j = i; j > 0 && sorted[j - 1] > v; --j)
+      sorted[j] = sorted[j - 1];
+    sorted[j] = v;
+  }
+
+  if (st->count % 2)
+    return sorted[st->count / 2];
+
+  return (sorted[(st->count / 2) - 1] + sorted[st->count / 2]) / 2;
+}
+
+static float
+stage_ema(filter_stage_t* st, float alpha, float sample)
+{
+  if (!st->primed) {
+    st->primed = true;
+    st->value = sample;
+  }
+  else
+    st->value += LIMIT(alpha, 0.0f, 1.0f) * (sample - st->value);
+
+  return st->value;
+}
+
+static float
+stage_kalman(filter_stage_t* st, const filter_stage_settings_t* s, float sample, float dt)
+{
+  float q = s->process_noise;
+  float r = MAX(s->measurement_noise, 1e-6f);
+
+  if (!st->primed) {
+    st->primed = true;
+    st->value = sample;
+    st->rate = 0;
+    st->p[0][0] = r;
+    st->p[0][1] = 0;
+    st->p[1][0] = 0;
+    st->p[1][1] = KALMAN_RATE_VARIANCE;
+    return st->value;
+  }
+
+  /* Predict: x = F x, P = F P F' + Q with F = [1 dt; 0 1] */
+  if (dt > 0) {
+    st->value += st->rate * dt;
+
+    st->p[0][0] += dt * (st->p[0][1] + st->p[1][0] + (dt * st->p[1][1])) + (q * dt * dt * dt / 3);
+    st->p[0][1] += (dt * st->p[1][1]) + (q * dt * dt / 2);
+    st->p[1][0] += (dt * st->p[1][1]) + (q * dt * dt / 2);
+    st->p[1][1] += q * dt;
+  }
+
+  /* Update with the sample, H = [1 0] */
+  float y = sample - st->value;
+  float s_inv = 1 / (st->p[0][0] + r);
+  float k0 = st->p[0][0] * s_inv;
+  float k1 = st->p[1][0] * s_inv;
+
+  st->value += k0 * y;
+  st->rate += k1 * y;
+
+  float p00 = st->p[0][0];
+  float p01 = st->p[0][1];
+  st->p[0][0] -= k0 * p00;
+  st->p[0][1] -= k0 * p01;
+  st->p[1][0] -= k1 * p00;
+  st->p[1][1] -= k1 * p01;
+
+  return st->value;
+}
@@ -0,0 +1,73 @@
+#ifndef SENSOR_FILTER_H
+#define SENSOR_FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define FILTER_MAX_STAGES   3
+#define FILTER_MAX_TAPS     16
+
+typedef enum {
+  FILTER_NONE,
+  FILTER_MEAN,              // moving average over taps samples
+  FILTER_MEDIAN,            // median of the last taps samples, rejects spikes
+  FILTER_EMA,               // exponential moving average with weight alpha
+  FILTER_KALMAN             // temperature and rate of change
+} filter_type_t;
+
+typedef struct {
+  uint8_t type;
+  uint8_t taps;             // FILTER_MEAN, FILTER_MEDIAN
+  float alpha;              // FILTER_EMA, 0 to 1
+  float process_noise;      // FILTER_KALMAN, variance of the rate change, (deg/s)^2 per s
+  float measurement_noise;  // FILTER_KALMAN, variance of a sample, deg^2
+} filter_stage_settings_t;
+
+/* Stages run in order, the output of one is the input of the next */
+typedef struct {
+  filter_stage_settings_t stages[FILTER_MAX_STAGES];
+} sensor_filter_settings_t;
+
+/* Chains offered on the controller settings screen */
+typedef enum {
+  FILTER_PRESET_DEFAULT,    // median of 3, then mean of 10
+  FILTER_PRESET_KALMAN,     // median of 3, then Kalman
+  FILTER_PRESET_EMA,        // median of 3, then ema 0.2
+  FILTER_PRESET_NONE,
+
+  NUM_FILTER_PRESETS
+} sensor_filter_preset_t;
+
+typedef struct {
+  float taps[FILTER_MAX_TAPS];
+  uint8_t index;
+  uint8_t count;
+  float sum;
+
+  bool primed;
+  float value;
+  float rate;
+  float p[2][2];            // Kalman error covariance
+} filter_stage_t;
+
+typedef struct {
+  sensor_filter_settings_t settings;
+  filter_stage_t stages[FILTER_MAX_STAGES];
+
+  /* Rate of change of the output, for chains without a Kalman stage */
+  bool primed;
+  float last_output;
+  float rate;
+} sensor_filter_t;
+
+
+void sensor_filter_init(sensor_filter_t* f, const sensor_filter_settings_t* settings);
+void sensor_filter_reset(sensor_filter_t* f);
+float sensor_filter_apply(sensor_filter_t* f, float sample, float dt);
+float sensor_filter_get_rate(const sensor_filter_t* f);
+void sensor_filter_get_default_settings(sensor_filter_settings_t* settings);
+void sensor_filter_get_preset_settings(sensor_filter_preset_t preset, sensor_filter_settings_t* settings);
+const char* sensor_filter_get_preset_name(sensor_filter_preset_t preset);
+
+#endif
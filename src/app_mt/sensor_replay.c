@@ -0,0 +1,130 @@
+#include "ch.h"
+#include "sensor_replay.h"
+#include "sensor.h"
+#include "sensor_filter.h"
+#include "message.h"
+#include "sxfs.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+#ifndef SENSOR_REPLAY_SPEED
+#define SENSOR_REPLAY_SPEED 1
+#endif
+
+/* Records read from flash at a time */
+#define RECORD_BATCH 16
+
+
+typedef struct {
+  sensor_filter_t filter;   // pass-through, only used for the rate estimate
+  uint32_t seq;
+  uint32_t last_time;
+  bool seen;
+} replay_sensor_t;
+
+
+static msg_t replay_thread(void* arg);
+static void replay_trace(const sensor_replay_hdr_t* hdr);
+static void publish_record(const sensor_replay_record_t* rec);
+
+
+static replay_sensor_t sensors[NUM_SENSORS];
+
+
+void
+sensor_replay_init()
+{
+  chThdCreateFromHeap(NULL, 1024, MSG_PRIO_CONTROL, replay_thread, NULL);
+}
+
+static msg_t
+replay_thread(void* arg)
+{
+  sensor_replay_hdr_t hdr;
+  sensor_filter_settings_t passthrough;
+  int i;
+
+  (void)arg;
+  chRegSetThreadName("replay");
+
+  sxfs_read(SP_SENSOR_REPLAY, 0, (uint8_t*)&hdr, sizeof(hdr));
+  if (hdr.magic != SENSOR_REPLAY_MAGIC || hdr.num_records == 0) {
+    printf("No sensor replay trace\r\n");
+    return 0;
+  }
+
+  memset(&passthrough, 0, sizeof(passthrough));
+
+  /* The trace loops until reset */
+  while (1) {
+    for (i = 0; i < NUM_SENSORS; ++i) {
+      sensor_filter_init(&sensors[i].filter, &passthrough);
+      sensors[i].seen = false;
+    }
+
+    replay_trace(&hdr);
+  }
+
+  return 0;
+}
+
+static void
+replay_trace(const sensor_replay_hdr_t* hdr)
+{
+  sensor_replay_record_t recs[RECORD_BATCH];
+  systime_t start = chTimeNow();
+  uint32_t i;
+
+  for (i = 0; i < hdr->num_records; ++i) {
+    sensor_replay_record_t* rec = &recs[i % RECORD_BATCH];
+
+    if ((i % RECORD_BATCH) == 0) {
+      uint32_t n = MIN(RECORD_BATCH, hdr->num_records - i);
+      if (!sxfs_read(SP_SENSOR_REPLAY, sizeof(*hdr) + (i * sizeof(*rec)),
+          (uint8_t*)recs, n * sizeof(*rec)))
+        return;
+    }
+
+    /* In seconds and the remainder, as MS2ST overflows past 4294967 ms */
+    uint32_t offset_ms = rec->time / SENSOR_REPLAY_SPEED;
+    systime_t due = start + S2ST(offset_ms / 1000) + MS2ST(offset_ms % 1000);
+    systime_t now = chTimeNow();
+    if ((int32_t)(due - now) > 0)
+      chThdSleep(due - now);
+
+    publish_record(rec);
+  }
+}
+
+static void
+publish_record(const sensor_replay_record_t* rec)
+{
+  if (rec->sensor >= NUM_SENSORS)
+    return;
+
+  replay_sensor_t* rs = &sensors[rec->sensor];
+
+  /* Periods and rates are in trace time, whatever the playback speed */
+  uint32_t period = rs->seen ? (rec->time - rs->last_time) : 0;
+  sensor_filter_apply(&rs->filter, rec->value, period / 1000.0f);
+
+  sensor_msg_t msg = {
+      .sensor = rec->sensor,
+      .sample = {
+          .unit = UNIT_TEMP_DEG_F,
+          .value = rec->value
+      },
+      .timestamp = chTimeNow(),
+      .seq = rs->seq++,
+      .rate = sensor_filter_get_rate(&rs->filter),
+      .sample_period = MIN(period, UINT16_MAX)
+  };
+
+  rs->seen = true;
+  rs->last_time = rec->time;
+
+  msg_publish(MSG_SENSOR_SAMPLE, rec->sensor, &msg, sizeof(msg));
+}
@@ -0,0 +1,30 @@
+#ifndef SENSOR_REPLAY_H
+#define SENSOR_REPLAY_H
+
+#include <stdint.h>
+
+/* Recorded temperature trace played back in place of the 1-Wire probes
+ * when the firmware is built with SENSOR_REPLAY=1. The trace lives in the
+ * SP_SENSOR_REPLAY partition of the external flash as a header followed by
+ * records in time order.
+ */
+
+#define SENSOR_REPLAY_MAGIC 0x4C505253 // "SRPL"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t num_records;
+} sensor_replay_hdr_t;
+
+typedef struct {
+  uint32_t time;            // ms from the start of the trace
+  uint8_t sensor;
+  uint8_t reserved[3];
+  float value;              // deg F
+} sensor_replay_record_t;
+
+
+void
+sensor_replay_init(void);
+
+#endif
@@ -256,7 +256,7 @@ dispatch_sntp_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_da
 void
 sntp_init(void)
 {
-  msg_listener_t* listener = msg_listener_create("sntp", 1024, dispatch_sntp_msg, NULL);
+  msg_listener_t* listener = msg_listener_create("sntp", 1024, MSG_PRIO_BACKGROUND, 4, dispatch_sntp_msg, NULL);
   msg_listener_set_idle_timeout(listener, SNTP_UPDATE_DELAY);
 
   msg_subscribe(listener, MSG_NET_STATUS, NULL);
@@ -0,0 +1,363 @@
+
+#include "telemetry.h"
+#include "sxfs.h"
+#include "xflash.h"
+#include "common.h"
+#include "crc/crc16.h"
+
+#include <stddef.h>
+
+/*
+ * The spill area is a ring of flash sectors laid out like a sample store
+ * tier: a header with a sequence number, then fixed size records in queue
+ * order. A sector's records have consecutive sequence numbers, starting
+ * at the one in its header. The tail is the oldest slot that may still
+ * hold an unacknowledged record; once the tail has moved past a sector,
+ * that sector is erased.
+ * If the ring fills up before the server catches up the oldest sector is
+ * overwritten, so a long outage loses its oldest samples, not its newest.
+ *
+ * Records only reach the flash once they are the oldest in the queue, so
+ * everything in the spill area is older than everything in RAM.
+ *
+ * Acknowledgements are not written to flash. After a reset the records of
+ * a partly acknowledged sector are sent again; the server drops them by
+ * controller and time.
+ */
+
+#define LOG_MAGIC         0x324D4C54 // "TLM2"
+#define SECTOR_SIZE       XFLASH_SECTOR_SIZE
+#define NUM_SECTORS       3
+#define SLOTS_PER_SECTOR  ((SECTOR_SIZE - sizeof(log_hdr_t)) / sizeof(telemetry_record_t))
+#define READ_BATCH        16
+
+#ifndef TELEMETRY_RAM_RECORDS
+#define TELEMETRY_RAM_RECORDS 64
+#endif
+
+/* Records moved to flash at once when the RAM queue is full */
+#define SPILL_RECORDS     16
+
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t first_seq;       // of the sector's first record
+  uint16_t reserved;
+  uint16_t crc;
+} log_hdr_t;
+
+
+static void spill(uint32_t num_recs);
+static void append_record(telemetry_record_t* rec);
+static void advance_tail(void);
+static void erase_log(void);
+static bool read_hdr(uint8_t sector, log_hdr_t* hdr);
+static bool slot_erased(uint8_t sector, uint32_t slot);
+static bool record_valid(const telemetry_record_t* rec);
+static uint32_t sector_addr(uint8_t sector);
+static uint32_t slot_addr(uint8_t sector, uint32_t slot);
+
+
+static telemetry_record_t ram_recs[TELEMETRY_RAM_RECORDS];
+static uint32_t ram_first;    // seq of the oldest record in RAM
+static uint32_t next_seq;
+static uint32_t ack_seq;      // every record before this has been acknowledged
+
+static bool log_open;         // the spill area holds records
+static uint8_t head;
+static uint32_t head_seq;
+static uint32_t next_slot;
+static uint8_t tail;
+static uint32_t tail_slot;
+
+
+/* Mounts the spill area. Records left in it are queued again, ahead of
+ * anything pushed from now on.
+ */
+void
+telemetry_init()
+{
+  telemetry_record_t rec;
+  log_hdr_t hdr;
+  uint32_t first_seq = 0;
+  uint8_t i;
+
+  log_open = false;
+
+  for (i = 0; i < NUM_SECTORS; ++i) {
+    if (read_hdr(i, &hdr) && (!log_open || hdr.seq > head_seq)) {
+      log_open = true;
+      head = i;
+      head_seq = hdr.seq;
+      first_seq = hdr.first_seq;
+    }
+  }
+
+  next_seq = 0;
+
+  if (log_open) {
+    /* Slots fill in order, so the erased ones are all at the end */
+    uint32_t lo = 0;
+    uint32_t hi = SLOTS_PER_SECTOR;
+    while (lo < hi) {
+      uint32_t mid = (lo + hi) / 2;
+      if (slot_erased(head, mid))
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    next_slot = lo;
+
+    /* The oldest started sector after the head is the tail */
+    for (i = 1; i <= NUM_SECTORS; ++i) {
+      tail = (head + i) % NUM_SECTORS;
+      if (read_hdr(tail, &hdr))
+        break;
+    }
+    tail_slot = 0;
+
+    /* Sequence numbers carry on after the head's last slot, even if the
+     * record in it is torn
+     */
+    next_seq = first_seq + next_slot;
+  }
+
+  /* Everything left in the spill area is still to be sent */
+  ram_first = next_seq;
+  ack_seq = 0;
+  if (telemetry_peek(0, &rec, 1) == 0)
+    ack_seq = next_seq;
+  else
+    ack_seq = rec.seq;
+}
+
+/* Queues rec, setting its sequence number */
+void
+telemetry_push(telemetry_record_t* rec)
+{
+  rec->seq = next_seq;
+
+  /* Acknowledged records never need to go to flash */
+  ram_first = MAX(ram_first, ack_seq);
+
+  if ((next_seq - ram_first) >= TELEMETRY_RAM_RECORDS)
+    spill(SPILL_RECORDS);
+
+  ram_recs[next_seq % TELEMETRY_RAM_RECORDS] = *rec;
+  next_seq++;
+}
+
+/* Copies out up to max_recs unacknowledged records, oldest first, starting
+ * at from_seq. Records lost to a torn write or to an overflowing spill
+ * area are skipped. Returns the number of records copied.
+ */
+uint32_t
+telemetry_peek(uint32_t from_seq, telemetry_record_t* recs, uint32_t max_recs)
+{
+  telemetry_record_t buf[READ_BATCH];
+  uint32_t count = 0;
+  uint32_t seq;
+  uint32_t i;
+
+  from_seq = MAX(from_seq, ack_seq);
+
+  if (log_open && from_seq < ram_first) {
+    uint8_t sector = tail;
+    uint32_t slot = tail_slot;
+
+    while (count < max_recs) {
+      uint32_t end = (sector == head) ? next_slot : SLOTS_PER_SECTOR;
+
+      if (slot >= end) {
+        if (sector == head)
+          break;
+        sector = (sector + 1) % NUM_SECTORS;
+        slot = 0;
+        continue;
+      }
+
+      uint32_t n = MIN(READ_BATCH, end - slot);
+      sxfs_read(SP_TELEMETRY, slot_addr(sector, slot), (uint8_t*)buf, n * sizeof(telemetry_record_t));
+      slot += n;
+
+      for (i = 0; i < n && count < max_recs; ++i) {
+        if (record_valid(&buf[i]) && buf[i].seq >= from_seq)
+          recs[count++] = buf[i];
+      }
+    }
+  }
+
+  for (seq = MAX(from_seq, ram_first); seq < next_seq && count < max_recs; ++seq)
+    recs[count++] = ram_recs[seq % TELEMETRY_RAM_RECORDS];
+
+  return count;
+}
+
+/* The server has every record before seq */
+void
+telemetry_ack(uint32_t seq)
+{
+  if (seq <= ack_seq || seq > next_seq)
+    return;
+
+  ack_seq = seq;
+
+  if (log_open)
+    advance_tail();
+}
+
+uint32_t
+telemetry_ack_seq()
+{
+  return ack_seq;
+}
+
+uint32_t
+telemetry_end_seq()
+{
+  return next_seq;
+}
+
+/* Moves the oldest records in RAM to the spill area */
+static void
+spill(uint32_t num_recs)
+{
+  while (num_recs-- > 0 && ram_first < next_seq) {
+    telemetry_record_t* rec = &ram_recs[ram_first % TELEMETRY_RAM_RECORDS];
+
+    rec->crc = crc16_block(0, (uint8_t*)rec, offsetof(telemetry_record_t, crc));
+    append_record(rec);
+    ram_first++;
+  }
+}
+
+static void
+append_record(telemetry_record_t* rec)
+{
+  if (log_open && next_slot < SLOTS_PER_SECTOR) {
+    sxfs_write(SP_TELEMETRY, slot_addr(head, next_slot), (uint8_t*)rec, sizeof(*rec));
+    next_slot++;
+    return;
+  }
+
+  if (log_open) {
+    head = (head + 1) % NUM_SECTORS;
+
+    /* Full, drop the oldest sector */
+    if (head == tail) {
+      tail = (tail + 1) % NUM_SECTORS;
+      tail_slot = 0;
+    }
+  }
+  else {
+    tail = head;
+    tail_slot = 0;
+  }
+  log_open = true;
+  head_seq++;
+  next_slot = 1;
+
+  struct {
+    log_hdr_t hdr;
+    telemetry_record_t rec;
+  } first = {
+      .hdr = {
+          .magic = LOG_MAGIC,
+          .seq = head_seq,
+          .first_seq = rec->seq,
+      },
+      .rec = *rec
+  };
+  first.hdr.crc = crc16_block(0, (uint8_t*)&first.hdr, offsetof(log_hdr_t, crc));
+
+  sxfs_erase_sector(SP_TELEMETRY, sector_addr(head));
+  sxfs_write(SP_TELEMETRY, sector_addr(head), (uint8_t*)&first, sizeof(first));
+}
+
+/* Moves the tail past acknowledged records, erasing the sectors it leaves */
+static void
+advance_tail()
+{
+  telemetry_record_t buf[READ_BATCH];
+  uint32_t i;
+
+  for (;;) {
+    uint32_t end = (tail == head) ? next_slot : SLOTS_PER_SECTOR;
+
+    if (tail_slot >= end) {
+      if (tail == head)
+        break;
+      sxfs_erase_sector(SP_TELEMETRY, sector_addr(tail));
+      tail = (tail + 1) % NUM_SECTORS;
+      tail_slot = 0;
+      continue;
+    }
+
+    uint32_t n = MIN(READ_BATCH, end - tail_slot);
+    sxfs_read(SP_TELEMETRY, slot_addr(tail, tail_slot), (uint8_t*)buf, n * sizeof(telemetry_record_t));
+
+    for (i = 0; i < n; ++i) {
+      if (record_valid(&buf[i]) && buf[i].seq >= ack_seq)
+        return;
+      tail_slot++;
+    }
+  }
+
+  /* All caught up, start afresh after the next outage */
+  erase_log();
+}
+
+static void
+erase_log()
+{
+  sxfs_erase_sector(SP_TELEMETRY, sector_addr(head));
+  log_open = false;
+  tail = head;
+  tail_slot = 0;
+  next_slot = 0;
+}
+
+static bool
+read_hdr(uint8_t sector, log_hdr_t* hdr)
+{
+  sxfs_read(SP_TELEMETRY, sector_addr(sector), (uint8_t*)hdr, sizeof(*hdr));
+
+  return (hdr->magic == LOG_MAGIC &&
+          hdr->crc == crc16_block(0, (uint8_t*)hdr, offsetof(log_hdr_t, crc)));
+}
+
+static bool
+slot_erased(uint8_t sector, uint32_t slot)
+{
+  uint32_t buf[sizeof(telemetry_record_t) / sizeof(uint32_t)];
+  uint32_t i;
+
+  sxfs_read(SP_TELEMETRY, slot_addr(sector, slot), (uint8_t*)buf, sizeof(buf));
+
+  for (i = 0; i < (sizeof(buf) / sizeof(buf[0])); ++i) {
+    if (buf[i] != 0xFFFFFFFF)
+      return false;
+  }
+
+  return true;
+}
+
+static bool
+record_valid(const telemetry_record_t* rec)
+{
+  return (rec->seq != 0xFFFFFFFF &&
+          rec->crc == crc16_block(0, (uint8_t*)rec, offsetof(telemetry_record_t, crc)));
+}
+
+static uint32_t
+sector_addr(uint8_t sector)
+{
+  return sector * SECTOR_SIZE;
+}
+
+static uint32_t
+slot_addr(uint8_t sector, uint32_t slot)
+{
+  return sector_addr(sector) + sizeof(log_hdr_t) + (slot * sizeof(telemetry_record_t));
+}
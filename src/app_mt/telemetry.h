@@ -0,0 +1,48 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Queue of timestamped controller samples waiting to be reported to the
+ * server. The newest records are kept in RAM; when that fills up (while
+ * the server is unreachable or slow to acknowledge) the oldest spill to the
+ * SP_TELEMETRY partition of the external flash. Records are read back
+ * oldest first and dropped once the server has acknowledged them.
+ *
+ * Every record gets a sequence number one higher than the previous one.
+ * The queue is owned by the web_api thread and is not thread safe.
+ */
+
+typedef struct {
+  uint32_t seq;
+  uint32_t time;            // store clock seconds, see sample_store_now()
+  uint8_t controller;
+  uint8_t reserved;
+  uint16_t outputs;         // outputs of the controller that were on
+  float value;              // deg F
+  float setpoint;           // deg F, NAN if none
+  uint16_t reserved2;
+  uint16_t crc;             // crc16 of everything above
+} telemetry_record_t;
+
+
+void
+telemetry_init(void);
+
+void
+telemetry_push(telemetry_record_t* rec);
+
+uint32_t
+telemetry_peek(uint32_t from_seq, telemetry_record_t* recs, uint32_t max_recs);
+
+void
+telemetry_ack(uint32_t seq);
+
+uint32_t
+telemetry_ack_seq(void);
+
+uint32_t
+telemetry_end_seq(void);
+
+#endif
@@ -0,0 +1,228 @@
+
+#include "telemetry_codec.h"
+
+#include <string.h>
+#include <math.h>
+
+
+#define TAG_CONTROLLER_MASK   0x0F
+#define TAG_SETPOINT          0x10
+#define TAG_OUTPUTS           0x20
+#define TAG_NO_SETPOINT       0x40
+
+/* tag and up to four 5 byte varints */
+#define MAX_RECORD_LEN        21
+
+
+static void reset_state(telemetry_codec_t* c, uint32_t base_time);
+static uint32_t put_varint(uint8_t* p, uint32_t v);
+static bool get_varint(telemetry_codec_t* c, uint32_t* v);
+static uint32_t zigzag(int32_t v);
+static int32_t unzigzag(uint32_t v);
+static int32_t to_centi(float v);
+
+
+void
+telemetry_encode_start(telemetry_codec_t* c, uint8_t* buf, uint32_t size, uint32_t base_time)
+{
+  uint8_t hdr[10];
+  uint32_t len;
+
+  c->buf = buf;
+  c->size = size;
+  c->len = 0;
+  reset_state(c, base_time);
+
+  len = put_varint(hdr, TELEMETRY_CODEC_VERSION);
+  len += put_varint(hdr + len, base_time);
+  if (len <= size) {
+    memcpy(buf, hdr, len);
+    c->len = len;
+  }
+}
+
+/* Appends rec, or returns false and leaves the buffer as it was if the
+ * record does not fit.
+ */
+bool
+telemetry_encode(telemetry_codec_t* c, const telemetry_record_t* rec)
+{
+  uint8_t out[MAX_RECORD_LEN];
+  uint32_t len = 1;
+
+  if (c->len == 0 || rec->controller >= TELEMETRY_CODEC_MAX_CONTROLLERS)
+    return false;
+
+  telemetry_codec_state_t* s = &c->state[rec->controller];
+  telemetry_codec_state_t next = *s;
+
+  next.time_delta = (int32_t)(rec->time - s->time);
+  next.time = rec->time;
+  next.value = to_centi(rec->value);
+  next.has_setpoint = !isnan(rec->setpoint);
+  next.setpoint = next.has_setpoint ? to_centi(rec->setpoint) : s->setpoint;
+  next.outputs = rec->outputs;
+
+  out[0] = rec->controller;
+  len += put_varint(out + len, zigzag(next.time_delta - s->time_delta));
+  len += put_varint(out + len, zigzag(next.value - s->value));
+
+  if (next.has_setpoint != s->has_setpoint ||
+      next.setpoint != s->setpoint) {
+    out[0] |= TAG_SETPOINT;
+    if (next.has_setpoint)
+      len += put_varint(out + len, zigzag(next.setpoint - s->setpoint));
+    else
+      out[0] |= TAG_NO_SETPOINT;
+  }
+
+  if (next.outputs != s->outputs) {
+    out[0] |= TAG_OUTPUTS;
+    len += put_varint(out + len, next.outputs);
+  }
+
+  if ((c->len + len) > c->size)
+    return false;
+
+  memcpy(c->buf + c->len, out, len);
+  c->len += len;
+  *s = next;
+
+  return true;
+}
+
+bool
+telemetry_decode_start(telemetry_codec_t* c, const uint8_t* buf, uint32_t len)
+{
+  uint32_t version;
+  uint32_t base_time;
+
+  c->buf = (uint8_t*)buf;
+  c->size = len;
+  c->len = 0;
+
+  if (!get_varint(c, &version) ||
+      version != TELEMETRY_CODEC_VERSION ||
+      !get_varint(c, &base_time))
+    return false;
+
+  reset_state(c, base_time);
+
+  return true;
+}
+
+/* Returns false at the end of the buffer or if it is malformed. The
+ * sequence numbers of decoded records are 0.
+ */
+bool
+telemetry_decode(telemetry_codec_t* c, telemetry_record_t* rec)
+{
+  uint32_t v;
+
+  if (c->len >= c->size)
+    return false;
+
+  uint8_t tag = c->buf[c->len++];
+  if (tag & 0x80)
+    return false;
+
+  telemetry_codec_state_t* s = &c->state[tag & TAG_CONTROLLER_MASK];
+
+  if (!get_varint(c, &v))
+    return false;
+  s->time_delta += unzigzag(v);
+  s->time += s->time_delta;
+
+  if (!get_varint(c, &v))
+    return false;
+  s->value += unzigzag(v);
+
+  if (tag & TAG_SETPOINT) {
+    if (tag & TAG_NO_SETPOINT) {
+      s->has_setpoint = false;
+    }
+    else {
+      if (!get_varint(c, &v))
+        return false;
+      s->setpoint += unzigzag(v);
+      s->has_setpoint = true;
+    }
+  }
+
+  if (tag & TAG_OUTPUTS) {
+    if (!get_varint(c, &v))
+      return false;
+    s->outputs = v;
+  }
+
+  memset(rec, 0, sizeof(*rec));
+  rec->time = s->time;
+  rec->controller = tag & TAG_CONTROLLER_MASK;
+  rec->outputs = s->outputs;
+  rec->value = s->value / 100.0f;
+  rec->setpoint = s->has_setpoint ? (s->setpoint / 100.0f) : NAN;
+
+  return true;
+}
+
+static void
+reset_state(telemetry_codec_t* c, uint32_t base_time)
+{
+  int i;
+
+  c->base_time = base_time;
+  memset(c->state, 0, sizeof(c->state));
+  for (i = 0; i < TELEMETRY_CODEC_MAX_CONTROLLERS; ++i)
+    c->state[i].time = base_time;
+}
+
+static uint32_t
+put_varint(uint8_t* p, uint32_t v)
+{
+  uint32_t len = 0;
+
+  while (v >= 0x80) {
+    p[len++] = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  p[len++] = v;
+
+  return len;
+}
+
+static bool
+get_varint(telemetry_codec_t* c, uint32_t* v)
+{
+  uint32_t shift;
+
+  *v = 0;
+  for (shift = 0; shift < 35; shift += 7) {
+    if (c->len >= c->size)
+      return false;
+
+    uint8_t b = c->buf[c->len++];
+    *v |= (uint32_t)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+static uint32_t
+zigzag(int32_t v)
+{
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t
+unzigzag(uint32_t v)
+{
+  return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static int32_t
+to_centi(float v)
+{
+  return (int32_t)((v * 100) + ((v < 0) ? -0.5f : 0.5f));
+}
@@ -0,0 +1,60 @@
+#ifndef TELEMETRY_CODEC_H
+#define TELEMETRY_CODEC_H
+
+#include "telemetry.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Compact encoding of a batch of telemetry records for the packed_reports
+ * bytes field of DeviceReport. Each controller's records are coded against
+ * its previous record in the batch:
+ *
+ *   header   varint format version, varint base time
+ *   record   tag byte: controller (bits 0-3), setpoint changed (bit 4),
+ *            outputs changed (bit 5), no setpoint (bit 6)
+ *            zig-zag varint  delta-of-delta of the time in seconds
+ *            zig-zag varint  delta of the reading in centidegrees F
+ *            zig-zag varint  delta of the setpoint   if setpoint changed
+ *            varint          outputs                 if outputs changed
+ *
+ * A controller's first record in a batch is coded against the base time,
+ * a reading and setpoint of 0 and no outputs on. Samples taken at a steady
+ * rate with small changes take 3 bytes. scripts/telemetry_codec.py is the
+ * matching decoder for the server side.
+ */
+
+#define TELEMETRY_CODEC_VERSION 1
+#define TELEMETRY_CODEC_MAX_CONTROLLERS 16
+
+typedef struct {
+  uint32_t time;
+  int32_t time_delta;
+  int32_t value;            // centidegrees
+  int32_t setpoint;         // centidegrees
+  bool has_setpoint;
+  uint16_t outputs;
+} telemetry_codec_state_t;
+
+typedef struct {
+  uint8_t* buf;
+  uint32_t size;
+  uint32_t len;
+  uint32_t base_time;
+  telemetry_codec_state_t state[TELEMETRY_CODEC_MAX_CONTROLLERS];
+} telemetry_codec_t;
+
+
+void
+telemetry_encode_start(telemetry_codec_t* c, uint8_t* buf, uint32_t size, uint32_t base_time);
+
+bool
+telemetry_encode(telemetry_codec_t* c, const telemetry_record_t* rec);
+
+bool
+telemetry_decode_start(telemetry_codec_t* c, const uint8_t* buf, uint32_t len);
+
+bool
+telemetry_decode(telemetry_codec_t* c, telemetry_record_t* rec);
+
+#endif
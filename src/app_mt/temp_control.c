@@ -1,14 +1,18 @@
-
 #include "ch.h"
 #include "temp_control.h"
 #include "sensor.h"
 #include "common.h"
 #include "message.h"
 #include "app_cfg.h"
-#include "pid.h"
 #include "temp_profile.h"
+#include "autotune.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* PID output is an offset from the setpoint, in degrees F */
+#define PID_OUTPUT_LIMIT 20
 
 typedef enum {
   TC_IDLE,
@@ -16,15 +20,28 @@ typedef enum {
   TC_SENSOR_TIMED_OUT
 } temp_controller_state_t;
 
+/* One-shot deadline serviced by the control listener. */
+typedef struct {
+  bool armed;
+  systime_t deadline;
+} control_timer_t;
+
 struct temp_controller_s;
 
+/* Relay pin for an output. Outputs without a port have no on-board relay. */
+typedef struct {
+  ioportid_t port;
+  uint32_t pad;
+} relay_pin_t;
+
 typedef struct {
   output_id_t id;
   pid_t pid_control;
   output_status_t status;
-  systime_t cycle_delay_start_time;
+  bool running;
+  control_timer_t cycle_delay_timer;
+  control_timer_t pid_timer;
   struct temp_controller_s* controller;
-  Thread* thread;
 } relay_output_t;
 
 typedef struct temp_controller_s {
@@ -32,18 +49,34 @@ typedef struct temp_controller_s {
   temp_controller_id_t controller;
   temp_controller_state_t state;
   quantity_t last_sample;
+  float last_rate;
   temp_profile_run_t temp_profile_run;
-  relay_output_t outputs[NUM_OUTPUTS];
+  autotune_t autotune;
+  relay_output_t* outputs[NUM_OUTPUTS];
+  uint8_t num_outputs;
 } temp_controller_t;
 
 
 static void dispatch_temp_input_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
 static void dispatch_controller_settings(temp_controller_t* tc, const controller_settings_t* msg, bool resume_profile);
-static void dispatch_init(temp_controller_t* tc);
+static void dispatch_init(void);
 static void dispatch_sensor_sample(temp_controller_t* tc, sensor_msg_t* msg);
 static void dispatch_sensor_timeout(temp_controller_t* tc, sensor_timeout_msg_t* msg);
+static void dispatch_autotune_cmd(temp_controller_t* tc, const autotune_cmd_t* cmd);
+static void autotune_finished(temp_controller_t* tc);
+static void publish_autotune_status(temp_controller_t* tc);
 static void output_init(temp_controller_t* tc, output_id_t id);
-static msg_t output_thread(void* arg);
+static void output_stop(relay_output_t* output);
+static void output_detach(relay_output_t* output);
+static void update_sensor_map(void);
+static void output_update(relay_output_t* output);
+static void controller_update(temp_controller_t* tc);
+static void timer_arm(control_timer_t* timer, systime_t delay);
+static bool timer_expired(control_timer_t* timer, systime_t now);
+static void run_timers(void);
+static void schedule_next_wakeup(void);
+static void cycle_delay_expired(relay_output_t* output);
+static void pid_step(relay_output_t* output);
 static void start_cycle_delay(relay_output_t* output);
 static void set_output_state(relay_output_t* output, output_state_t output_state);
 static void relay_control(relay_output_t* output);
@@ -51,33 +84,62 @@ static void enable_relay(relay_output_t* output, bool enabled);
 static float get_sp(temp_controller_t* tc);
 static const output_settings_t* get_output_settings(temp_controller_t* tc, output_id_t output);
 
-static const uint32_t out_gpio[NUM_OUTPUTS] = {
-    [OUTPUT_1] = PAD_RELAY1,
-    [OUTPUT_2] = PAD_RELAY2
+static const relay_pin_t out_gpio[NUM_OUTPUTS] = {
+    [OUTPUT_1] = { GPIOC, PAD_RELAY1 },
+    [OUTPUT_2] = { GPIOC, PAD_RELAY2 }
 };
 
-temp_controller_t* controllers[NUM_CONTROLLERS];
+static temp_controller_t controllers[NUM_CONTROLLERS];
+static relay_output_t outputs[NUM_OUTPUTS];
+
+/* Controllers fed by each sensor, as a bitmask of controller ids */
+static uint8_t sensor_controllers[NUM_SENSORS][(NUM_CONTROLLERS + 7) / 8];
+
+static msg_listener_t* temp_control_listener;
 
 
 void
-temp_control_init(temp_controller_id_t controller)
+temp_control_init()
 {
-  temp_controller_t* tc = calloc(1, sizeof(temp_controller_t));
-  controllers[controller] = tc;
-  tc->controller = controller;
-  if (controller == CONTROLLER_1)
-    tc->sensor = SENSOR_1;
-  else
-    tc->sensor = SENSOR_2;
+  int i;
 
-  tc->state = TC_SENSOR_TIMED_OUT;
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    temp_controller_t* tc = &controllers[i];
+    tc->controller = i;
+    tc->sensor = SENSOR_NONE;
+    tc->state = TC_SENSOR_TIMED_OUT;
+  }
 
-  msg_listener_t* l = msg_listener_create("temp_ctrl", 1024, dispatch_temp_input_msg, tc);
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    outputs[i].id = i;
+    outputs[i].status.output = i;
+  }
 
-  msg_subscribe(l, MSG_SENSOR_SAMPLE,   NULL);
-  msg_subscribe(l, MSG_SENSOR_TIMEOUT,  NULL);
-  msg_subscribe(l, MSG_API_CONTROLLER_SETTINGS, NULL);
-  msg_subscribe(l, MSG_CONTROLLER_SETTINGS, NULL);
+  /* All controllers and outputs are serviced by this one listener. Relay
+   * timing runs off the listener's idle timeout, which is re-armed for the
+   * nearest pending deadline after every message.
+   */
+  temp_control_listener = msg_listener_create("temp_ctrl", 1024, MSG_PRIO_CONTROL, 8, dispatch_temp_input_msg, NULL);
+
+  msg_subscribe_latest(temp_control_listener, MSG_SENSOR_SAMPLE, NULL);
+  msg_subscribe(temp_control_listener, MSG_SENSOR_TIMEOUT,  NULL);
+  msg_subscribe(temp_control_listener, MSG_API_CONTROLLER_SETTINGS, NULL);
+  msg_subscribe(temp_control_listener, MSG_CONTROLLER_SETTINGS, NULL);
+  msg_subscribe(temp_control_listener, MSG_AUTOTUNE_CMD, NULL);
+}
+
+/* Sent like the controller settings, so the command has been applied when
+ * this returns. A publish could be dropped with the pool exhausted.
+ */
+void
+temp_control_autotune(temp_controller_id_t controller, bool start)
+{
+  autotune_cmd_t cmd = {
+      .controller = controller,
+      .start = start
+  };
+
+  msg_send(MSG_AUTOTUNE_CMD, &cmd);
 }
 
 float
@@ -86,9 +148,7 @@ temp_control_get_current_setpoint(temp_controller_id_t controller)
   if (controller >= NUM_CONTROLLERS)
     return NAN;
 
-  temp_controller_t* tc = controllers[controller];
-
-  return get_sp(tc);
+  return get_sp(&controllers[controller]);
 }
 
 temp_controller_t*
@@ -104,7 +164,7 @@ temp_control_get_controller_for(output_id_t output)
         app_cfg_get_controller_settings(i);
 
     if (controller_settings->output_settings[output].enabled)
-      return controllers[i];
+      return &controllers[i];
   }
 
   return NULL;
@@ -127,95 +187,242 @@ get_output_settings(temp_controller_t* tc, output_id_t output)
   return &settings->output_settings[output];
 }
 
+static void
+timer_arm(control_timer_t* timer, systime_t delay)
+{
+  timer->armed = true;
+  timer->deadline = chTimeNow() + delay;
+}
+
+static bool
+timer_expired(control_timer_t* timer, systime_t now)
+{
+  if (timer->armed && (int32_t)(timer->deadline - now) <= 0) {
+    timer->armed = false;
+    return true;
+  }
+  return false;
+}
+
+static void
+run_timers()
+{
+  int i;
+  systime_t now = chTimeNow();
+
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    relay_output_t* output = &outputs[i];
+
+    if (timer_expired(&output->cycle_delay_timer, now))
+      cycle_delay_expired(output);
+
+    if (timer_expired(&output->pid_timer, now))
+      pid_step(output);
+  }
+}
+
+static void
+schedule_next_wakeup()
+{
+  int i, t;
+  bool pending = false;
+  systime_t now = chTimeNow();
+  systime_t next = 0;
+
+  /* MSG_INIT is dispatched before msg_listener_create() has returned the
+   * listener. The timers it arms are scheduled after the next message.
+   */
+  if (temp_control_listener == NULL)
+    return;
+
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    relay_output_t* output = &outputs[i];
+    control_timer_t* timers[] = {
+        &output->cycle_delay_timer,
+        &output->pid_timer
+    };
+
+    for (t = 0; t < (int)(sizeof(timers) / sizeof(timers[0])); ++t) {
+      if (!timers[t]->armed)
+        continue;
+
+      int32_t remaining = timers[t]->deadline - now;
+      systime_t delay = (remaining > 0) ? (systime_t)remaining : 1;
+      if (!pending || delay < next) {
+        next = delay;
+        pending = true;
+      }
+    }
+  }
+
+  if (pending)
+    msg_listener_set_idle_timeout(temp_control_listener,
+        MAX(1, (next * 1000 + CH_FREQUENCY - 1) / CH_FREQUENCY));
+  else
+    msg_listener_set_idle_timeout(temp_control_listener, TIME_INFINITE);
+}
+
 static void
 output_init(temp_controller_t* tc, output_id_t output)
 {
-  relay_output_t* out = &tc->outputs[output];
+  relay_output_t* out = &outputs[output];
   const output_settings_t* settings = get_output_settings(tc, output);
 
-  out->id = output;
+  /* An output is driven by one controller at a time */
+  output_detach(out);
+
   out->controller = tc;
+  out->running = true;
+  tc->outputs[tc->num_outputs++] = out;
 
   pid_init(&out->pid_control);
-  pid_set_output_limits(&out->pid_control, -20, 20);
+  pid_apply_settings(&out->pid_control, &app_cfg_get_controller_settings(tc->controller)->pid_settings);
+  pid_set_output_limits(&out->pid_control, -PID_OUTPUT_LIMIT, PID_OUTPUT_LIMIT);
 
   if (settings->function == OUTPUT_FUNC_COOLING)
     pid_set_output_sign(&out->pid_control, NEGATIVE);
   else
     pid_set_output_sign(&out->pid_control, POSITIVE);
 
-  out->thread = chThdCreateFromHeap(NULL, 1024, NORMALPRIO, output_thread, out);
+  pid_reinit(&out->pid_control, tc->last_sample.value);
+
+  /* Wait 1 cycle delay before starting window and PID */
+  start_cycle_delay(out);
+}
+
+static void
+output_stop(relay_output_t* output)
+{
+  output->cycle_delay_timer.armed = false;
+  output->pid_timer.armed = false;
+
+  if (output->running) {
+    output->running = false;
+    if (out_gpio[output->id].port != NULL)
+      palClearPad(out_gpio[output->id].port, out_gpio[output->id].pad);
+
+    if (output->status.enabled) {
+      output->status.enabled = false;
+      msg_publish(MSG_OUTPUT_STATUS, output->id, &output->status, sizeof(output->status));
+    }
+  }
+}
+
+static void
+output_detach(relay_output_t* output)
+{
+  int i;
+  temp_controller_t* tc = output->controller;
+
+  if (tc == NULL)
+    return;
+
+  output_stop(output);
+
+  for (i = 0; i < tc->num_outputs; ++i) {
+    if (tc->outputs[i] == output) {
+      tc->outputs[i] = tc->outputs[--tc->num_outputs];
+      break;
+    }
+  }
+  output->controller = NULL;
+}
+
+static void
+update_sensor_map()
+{
+  int i;
+
+  memset(sensor_controllers, 0, sizeof(sensor_controllers));
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    sensor_id_t sensor = controllers[i].sensor;
+    if (sensor > SENSOR_NONE && sensor < NUM_SENSORS)
+      SETBIT(sensor_controllers[sensor], i);
+  }
 }
 
-static msg_t
-output_thread(void* arg)
+static void
+output_update(relay_output_t* output)
 {
-  relay_output_t* output = arg;
-  chRegSetThreadName("output");
+  if (!output->running)
+    return;
 
   const output_settings_t* output_settings =
       get_output_settings(output->controller, output->id);
-  systime_t cycle_delay = S2ST(60 * output_settings->cycle_delay.value);
 
-  if (output_settings->function == OUTPUT_FUNC_COOLING)
-    pid_set_output_sign(&output->pid_control, NEGATIVE);
-  else if (output_settings->function == OUTPUT_FUNC_HEATING)
-    pid_set_output_sign(&output->pid_control, POSITIVE);
+  /* If the probe associated with this output is not active or if the output is set
+   * to disabled turn OFF the output
+   */
+  if (output->controller->state != TC_ACTIVE ||
+      !output_settings->enabled)
+    set_output_state(output, OUTPUT_CONTROL_DISABLED);
+
+  switch (output->status.state) {
+    case OUTPUT_CONTROL_DISABLED:
+      enable_relay(output, false);
+
+      if (output->controller->state == TC_ACTIVE &&
+          output_settings->enabled)
+        start_cycle_delay(output);
+      break;
+
+    case OUTPUT_CONTROL_ENABLED:
+      relay_control(output);
+      break;
+
+    case CYCLE_DELAY:
+      /* Left by cycle_delay_expired() */
+      break;
+  }
+}
 
-  pid_reinit(&output->pid_control,
-      output->controller->last_sample.value);
+static void
+controller_update(temp_controller_t* tc)
+{
+  int i;
 
-  /* Wait 1 cycle delay before starting window and PID */
-  start_cycle_delay(output);
+  for (i = 0; i < tc->num_outputs; ++i)
+    output_update(tc->outputs[i]);
+}
 
-  output->status.output = output->id;
+static void
+cycle_delay_expired(relay_output_t* output)
+{
+  if (output->status.state != CYCLE_DELAY)
+    return;
 
-  palSetPad(GPIOC, out_gpio[output->id]);
+  /* Restart PID after cycle delay, carrying on from its last output */
+  if (output->pid_control.enabled == false) {
+    pid_enable(&output->pid_control, output->controller->last_sample.value, true);
+    timer_arm(&output->pid_timer, 0);
+  }
 
-  while (!chThdShouldTerminate()) {
+  set_output_state(output, OUTPUT_CONTROL_ENABLED);
+  output_update(output);
+}
 
-    /* If the probe associated with this output is not active or if the output is set
-     * to disabled turn OFF the output
-     */
-    if (output->controller->state != TC_ACTIVE ||
-        !output_settings->enabled)
-      set_output_state(output, OUTPUT_CONTROL_DISABLED);
+static void
+pid_step(relay_output_t* output)
+{
+  temp_controller_t* tc = output->controller;
 
-    switch (output->status.state) {
-      case OUTPUT_CONTROL_DISABLED:
-        enable_relay(output, false);
+  if (!output->pid_control.enabled)
+    return;
 
-        if (output->controller->state == TC_ACTIVE &&
-            output_settings->enabled)
-          start_cycle_delay(output);
-        break;
-
-      case OUTPUT_CONTROL_ENABLED:
-        relay_control(output);
-        break;
-
-      case CYCLE_DELAY:
-        if (cycle_delay < 1) {
-          set_output_state(output, OUTPUT_CONTROL_ENABLED);
-          break;
-        }
-
-        if ((chTimeNow() - output->cycle_delay_start_time) > cycle_delay) {
-          /* Restart PID after cycle delay */
-          if (output->pid_control.enabled == false)
-            output->pid_control.enabled = true;
-
-          set_output_state(output, OUTPUT_CONTROL_ENABLED);
-        }
-        break;
-    }
+  if (app_cfg_get_control_mode() == PID &&
+      tc->state == TC_ACTIVE &&
+      tc->autotune.state != AT_RUNNING) {
+    pid_exec(&output->pid_control,
+        get_sp(tc),
+        tc->last_sample.value,
+        tc->last_rate);
 
-    chThdSleepSeconds(1);
+    if (output->status.state == OUTPUT_CONTROL_ENABLED)
+      relay_control(output);
   }
 
-  palClearPad(GPIOC, out_gpio[output->id]);
-
-  return 0;
+  timer_arm(&output->pid_timer, output->pid_control.sample_time);
 }
 
 static void
@@ -224,10 +431,22 @@ relay_control(relay_output_t* output)
   const output_settings_t* output_settings = get_output_settings(output->controller, output->id);
   float sample = output->controller->last_sample.value;
   float setpoint = get_sp(output->controller);
+  output_ctrl_t control_mode = app_cfg_get_control_mode();
+  float pid_out;
 
   output->status.output = output->id;
 
-  switch (app_cfg_get_control_mode()) {
+  /* Autotune drives the relays through the PID path with a forced output */
+  if (output->controller->autotune.state == AT_RUNNING) {
+    const autotune_t* at = &output->controller->autotune;
+    control_mode = PID;
+    setpoint = at->setpoint;
+    pid_out = autotune_get_output(at, output->pid_control.output_sign);
+  }
+  else
+    pid_out = pid_get_output(&output->pid_control);
+
+  switch (control_mode) {
   case ON_OFF:
   {
     float half_hysteresis = app_cfg_get_hysteresis().value / 2;
@@ -252,14 +471,14 @@ relay_control(relay_output_t* output)
 
   case PID:
     if (output_settings->function == OUTPUT_FUNC_HEATING) {
-      if (sample < (setpoint + output->pid_control.out))
+      if (sample < (setpoint + pid_out))
         enable_relay(output, true);
       else {
         enable_relay(output, false);
       }
     }
     else {
-      if (sample > (setpoint - output->pid_control.out))
+      if (sample > (setpoint - pid_out))
         enable_relay(output, true);
       else {
         enable_relay(output, false);
@@ -279,17 +498,27 @@ enable_relay(relay_output_t* output, bool enable)
   if (output->status.enabled && !enable)
     start_cycle_delay(output);
 
-  palWritePad(GPIOC, out_gpio[output->id], enable);
-  output->status.enabled = enable;
-  msg_send(MSG_OUTPUT_STATUS, &output->status);
+  if (out_gpio[output->id].port != NULL)
+    palWritePad(out_gpio[output->id].port, out_gpio[output->id].pad, enable);
+
+  /* Only notify listeners when the relay actually changes state */
+  if (output->status.enabled != enable) {
+    output->status.enabled = enable;
+    msg_publish(MSG_OUTPUT_STATUS, output->id, &output->status, sizeof(output->status));
+  }
 }
 
 static void
 start_cycle_delay(relay_output_t* output)
 {
+  const output_settings_t* output_settings =
+      get_output_settings(output->controller, output->id);
+  systime_t cycle_delay = S2ST(60 * output_settings->cycle_delay.value);
+
   output->pid_control.enabled = false;
-  output->cycle_delay_start_time = chTimeNow();
+  output->pid_timer.armed = false;
   set_output_state(output, CYCLE_DELAY);
+  timer_arm(&output->cycle_delay_timer, cycle_delay);
 }
 
 static void
@@ -297,37 +526,73 @@ set_output_state(relay_output_t* output, output_state_t output_state)
 {
   if (output->status.state != output_state) {
     output->status.state = output_state;
-    msg_send(MSG_OUTPUT_STATUS, &output->status);
+    msg_publish(MSG_OUTPUT_STATUS, output->id, &output->status, sizeof(output->status));
   }
 }
 
 static void
 dispatch_temp_input_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
 {
+  int i;
+
   (void)listener_data;
   (void)sub_data;
 
   switch (id) {
   case MSG_INIT:
-    dispatch_init(listener_data);
+    dispatch_init();
     break;
 
   case MSG_SENSOR_SAMPLE:
-    dispatch_sensor_sample(listener_data, msg_data);
+  {
+    sensor_msg_t* sample = msg_data;
+    if (sample->sensor < NUM_SENSORS) {
+      for (i = 0; i < NUM_CONTROLLERS; ++i) {
+        if (TESTBIT(sensor_controllers[sample->sensor], i))
+          dispatch_sensor_sample(&controllers[i], sample);
+      }
+    }
     break;
+  }
 
   case MSG_SENSOR_TIMEOUT:
-    dispatch_sensor_timeout(listener_data, msg_data);
+  {
+    sensor_timeout_msg_t* timeout = msg_data;
+    if (timeout->sensor < NUM_SENSORS) {
+      for (i = 0; i < NUM_CONTROLLERS; ++i) {
+        if (TESTBIT(sensor_controllers[timeout->sensor], i))
+          dispatch_sensor_timeout(&controllers[i], timeout);
+      }
+    }
     break;
+  }
+
+  case MSG_AUTOTUNE_CMD:
+  {
+    const autotune_cmd_t* cmd = msg_data;
+    if (cmd->controller < NUM_CONTROLLERS)
+      dispatch_autotune_cmd(&controllers[cmd->controller], cmd);
+    break;
+  }
 
   case MSG_CONTROLLER_SETTINGS:
   case MSG_API_CONTROLLER_SETTINGS:
-    dispatch_controller_settings(listener_data, msg_data, false);
+  {
+    const controller_settings_t* settings = msg_data;
+    if (settings->controller < NUM_CONTROLLERS)
+      dispatch_controller_settings(&controllers[settings->controller], settings, false);
     break;
+  }
 
   default:
     break;
   }
+
+  /* Service whatever came due while handling the message (or while idle)
+   * and sleep until the next deadline.
+   */
+  run_timers();
+  schedule_next_wakeup();
 }
 
 static float
@@ -345,37 +610,38 @@ get_sp(temp_controller_t* tc)
 }
 
 static void
-dispatch_init(temp_controller_t* tc)
+dispatch_init()
 {
-  const controller_settings_t* cs = app_cfg_get_controller_settings(tc->controller);
-  dispatch_controller_settings(tc, cs, true);
+  int i;
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    const controller_settings_t* cs = app_cfg_get_controller_settings(i);
+    dispatch_controller_settings(&controllers[i], cs, true);
+  }
 }
 
 static void
 dispatch_sensor_sample(temp_controller_t* tc, sensor_msg_t* msg)
 {
-  int i;
-
   if (msg->sensor != tc->sensor)
     return;
 
   tc->last_sample = msg->sample;
+  tc->last_rate = msg->rate;
   if (tc->state == TC_SENSOR_TIMED_OUT)
     tc->state = TC_ACTIVE;
 
   const controller_settings_t* cs = app_cfg_get_controller_settings(tc->controller);
   if (cs->setpoint_type == SP_TEMP_PROFILE)
-    temp_profile_update(&tc->temp_profile_run, msg->sample);
+    temp_profile_update(&tc->temp_profile_run, msg->sample, msg->timestamp);
 
-  for (i = 0; i < NUM_OUTPUTS; ++i) {
-    const output_settings_t* output_settings = get_output_settings(tc, tc->outputs[i].id);
-      if (app_cfg_get_control_mode() == PID &&
-          output_settings->enabled == true) {
-        pid_exec(&tc->outputs[i].pid_control,
-            get_sp(tc),
-            msg->sample.value);
-      }
+  if (autotune_update(&tc->autotune, msg->sample.value)) {
+    if (tc->autotune.state != AT_RUNNING)
+      autotune_finished(tc);
+    publish_autotune_status(tc);
   }
+
+  controller_update(tc);
 }
 
 static void
@@ -384,8 +650,83 @@ dispatch_sensor_timeout(temp_controller_t* tc, sensor_timeout_msg_t* msg)
   if (msg->sensor != tc->sensor)
     return;
 
-  if (tc->state == TC_ACTIVE)
+  if (tc->state == TC_ACTIVE) {
     tc->state = TC_SENSOR_TIMED_OUT;
+
+    if (tc->autotune.state == AT_RUNNING) {
+      tc->autotune.state = AT_FAILED;
+      publish_autotune_status(tc);
+    }
+
+    controller_update(tc);
+  }
+}
+
+static void
+dispatch_autotune_cmd(temp_controller_t* tc, const autotune_cmd_t* cmd)
+{
+  float sp = get_sp(tc);
+
+  if (!cmd->start) {
+    if (tc->autotune.state == AT_RUNNING) {
+      autotune_cancel(&tc->autotune);
+      publish_autotune_status(tc);
+    }
+    return;
+  }
+
+  /* Needs a live probe, a setpoint and something to drive */
+  if (tc->state != TC_ACTIVE || isnan(sp) || tc->num_outputs == 0) {
+    tc->autotune.state = AT_FAILED;
+    publish_autotune_status(tc);
+    return;
+  }
+
+  autotune_start(&tc->autotune, sp, tc->last_sample.value,
+      app_cfg_get_hysteresis().value / 2,
+      PID_OUTPUT_LIMIT);
+  publish_autotune_status(tc);
+
+  controller_update(tc);
+}
+
+static void
+autotune_finished(temp_controller_t* tc)
+{
+  int i;
+  pid_settings_t settings;
+
+  if (tc->autotune.state != AT_DONE)
+    return;
+
+  settings = app_cfg_get_controller_settings(tc->controller)->pid_settings;
+  autotune_get_settings(&tc->autotune, &settings);
+  app_cfg_set_pid_settings(tc->controller, &settings);
+
+  for (i = 0; i < tc->num_outputs; ++i) {
+    pid_t* pid = &tc->outputs[i]->pid_control;
+
+    pid_apply_settings(pid, &settings);
+    pid_reinit(pid, tc->last_sample.value);
+  }
+}
+
+static void
+publish_autotune_status(temp_controller_t* tc)
+{
+  const autotune_t* at = &tc->autotune;
+  autotune_status_t status = {
+      .controller = tc->controller,
+      .state = at->state,
+      .cycles = autotune_get_cycles(at),
+      .ku = at->ku,
+      .tu = at->tu,
+      .kp = at->kp,
+      .ki = at->ki,
+      .kd = at->kd
+  };
+
+  msg_publish(MSG_AUTOTUNE_STATUS, tc->controller, &status, sizeof(status));
 }
 
 static void
@@ -395,18 +736,23 @@ dispatch_controller_settings(temp_controller_t* tc, const controller_settings_t*
   if (tc->controller != settings->controller)
     return;
 
-  /* Stop output threads */
-  for (i = 0; i < NUM_OUTPUTS; ++i) {
-    relay_output_t* out = &tc->outputs[i];
-    if (out->thread != NULL) {
-      chThdTerminate(out->thread);
-      chThdWait(out->thread);
-      out->thread = NULL;
-    }
+  /* New settings invalidate a running autotune */
+  if (tc->autotune.state == AT_RUNNING) {
+    autotune_cancel(&tc->autotune);
+    publish_autotune_status(tc);
   }
 
+  /* Release the outputs this controller was driving */
+  while (tc->num_outputs > 0)
+    output_detach(tc->outputs[0]);
+
   tc->state = TC_IDLE;
 
+  if (tc->sensor != settings->sensor) {
+    tc->sensor = settings->sensor;
+    update_sensor_map();
+  }
+
   for (i = 0; i < NUM_OUTPUTS; ++i) {
     if (settings->output_settings[i].enabled)
       output_init(tc, i);
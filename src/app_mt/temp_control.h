@@ -5,20 +5,38 @@
 #include "common.h"
 #include "sensor.h"
 #include "types.h"
+#include "pid.h"
 
 
+/* Number of controllers and relay outputs, set at build time (see app_mt.mk).
+ * Outputs past the two on-board relays are driven by whatever external relay
+ * board follows MSG_OUTPUT_STATUS.
+ */
+#ifndef NUM_CONTROLLERS
+#define NUM_CONTROLLERS 2
+#endif
+
+#ifndef NUM_OUTPUTS
+#define NUM_OUTPUTS 2
+#endif
+
+#if NUM_CONTROLLERS > MAX_CHANNELS || NUM_OUTPUTS > MAX_CHANNELS
+#error "NUM_CONTROLLERS/NUM_OUTPUTS exceeds MAX_CHANNELS"
+#endif
+
+#if NUM_OUTPUTS < 2
+#error "NUM_OUTPUTS must cover the two on-board relays"
+#endif
+
 typedef enum {
   CONTROLLER_1,
   CONTROLLER_2,
-  NUM_CONTROLLERS
 } temp_controller_id_t;
 
 typedef enum {
   OUTPUT_NONE = -1,
   OUTPUT_1,
   OUTPUT_2,
-
-  NUM_OUTPUTS
 } output_id_t;
 
 typedef enum {
@@ -45,10 +63,12 @@ typedef struct {
 
 typedef struct {
   temp_controller_id_t controller;
+  sensor_id_t sensor;
   setpoint_type_t setpoint_type;
   quantity_t static_setpoint;
   uint32_t temp_profile_id;
   output_settings_t output_settings[NUM_OUTPUTS];
+  pid_settings_t pid_settings;
 } controller_settings_t;
 
 typedef enum {
@@ -63,9 +83,14 @@ typedef struct {
   output_state_t state;
 } output_status_t;
 
+typedef struct {
+  temp_controller_id_t controller;
+  bool start;               // false cancels a running autotune
+} autotune_cmd_t;
+
 
 void
-temp_control_init(temp_controller_id_t controller);
+temp_control_init(void);
 
 void
 temp_control_start(controller_settings_t* cmd);
@@ -79,4 +104,7 @@ temp_control_get_current_setpoint(temp_controller_id_t controller);
 output_ctrl_t
 temp_control_get_output_function(output_id_t output);
 
+void
+temp_control_autotune(temp_controller_id_t controller, bool start);
+
 #endif
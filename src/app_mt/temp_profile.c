@@ -53,7 +53,7 @@ temp_profile_resume(temp_profile_run_t* run, temp_controller_id_t controller)
 }
 
 void
-temp_profile_update(temp_profile_run_t* run, quantity_t sample)
+temp_profile_update(temp_profile_run_t* run, quantity_t sample, systime_t sample_time)
 {
   switch (run->state) {
     case TPS_SEEKING_START_VALUE:
@@ -61,9 +61,11 @@ temp_profile_update(temp_profile_run_t* run, quantity_t sample)
       const temp_profile_t* profile = app_cfg_get_temp_profile(run->temp_profile_id);
       float start_err = sample.value - profile->start_value.value;
 
+      /* The step starts when the probe reached the start value, not when
+       * the sample got here */
       if (start_err < 1 && start_err > -1) {
         run->current_step = 0;
-        run->current_step_start_time = chTimeNow();
+        run->current_step_start_time = sample_time;
         run->state = TPS_RUNNING;
       }
       break;
@@ -56,7 +56,7 @@ void
 temp_profile_resume(temp_profile_run_t* run, temp_controller_id_t controller);
 
 void
-temp_profile_update(temp_profile_run_t* run, quantity_t sample);
+temp_profile_update(temp_profile_run_t* run, quantity_t sample, systime_t sample_time);
 
 bool
 temp_profile_get_current_setpoint(temp_profile_run_t* run, float* sp);
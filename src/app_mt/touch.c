@@ -202,7 +202,9 @@ read_axis(const axis_cfg_t* axis_cfg)
 
   /* capture a number of samples from the read pin */
   adcAcquireBus(&ADCD1);
+  lcd_dma_lock();
   adcConvert(&ADCD1, axis_cfg->conv_grp, samples, NUM_SAMPLES);
+  lcd_dma_unlock();
   adcReleaseBus(&ADCD1);
 
   /* average and return the samples */
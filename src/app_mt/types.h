@@ -103,4 +103,50 @@ rect_center(rect_t r)
   return center;
 }
 
+static inline bool
+rect_empty(rect_t r)
+{
+  return ((r.width <= 0) || (r.height <= 0));
+}
+
+static inline rect_t
+rect_offset(rect_t r, point_t p)
+{
+  r.x += p.x;
+  r.y += p.y;
+  return r;
+}
+
+static inline rect_t
+rect_intersect(rect_t a, rect_t b)
+{
+  rect_t r;
+  r.x = (a.x > b.x) ? a.x : b.x;
+  r.y = (a.y > b.y) ? a.y : b.y;
+  r.width = (((a.x + a.width) < (b.x + b.width)) ? (a.x + a.width) : (b.x + b.width)) - r.x;
+  r.height = (((a.y + a.height) < (b.y + b.height)) ? (a.y + a.height) : (b.y + b.height)) - r.y;
+  return r;
+}
+
+static inline rect_t
+rect_union(rect_t a, rect_t b)
+{
+  rect_t r;
+  r.x = (a.x < b.x) ? a.x : b.x;
+  r.y = (a.y < b.y) ? a.y : b.y;
+  r.width = (((a.x + a.width) > (b.x + b.width)) ? (a.x + a.width) : (b.x + b.width)) - r.x;
+  r.height = (((a.y + a.height) > (b.y + b.height)) ? (a.y + a.height) : (b.y + b.height)) - r.y;
+  return r;
+}
+
+/* True if all of b lies within a */
+static inline bool
+rect_contains(rect_t a, rect_t b)
+{
+  return ((b.x >= a.x) &&
+          (b.y >= a.y) &&
+          ((b.x + b.width) <= (a.x + a.width)) &&
+          ((b.y + b.height) <= (a.y + a.height)));
+}
+
 #endif
@@ -18,6 +18,11 @@
 #include "temp_control.h"
 #include "app_cfg.h"
 #include "ota_update.h"
+#include "autotune.h"
+#include "telemetry.h"
+#include "telemetry_codec.h"
+#include "sample_store.h"
+#include "common.h"
 
 #ifndef WEB_API_HOST
 #define WEB_API_HOST_STR "dg.brewbit.com"
@@ -37,6 +42,45 @@
 #define RECV_TIMEOUT           S2ST(20)
 #define MAX_SEND_ERRS          25
 
+/* Autotune reports and commands need the AutotuneStatus/AutotuneCommand
+ * API messages, which older protobuf message sets do not define.
+ */
+#ifndef WEB_API_AUTOTUNE
+#define WEB_API_AUTOTUNE 0
+#endif
+
+/* Batched reports need DeviceReport.sequence, the timestamp and
+ * output_status of ControllerReport, and the DEVICE_REPORT_ACK message.
+ * Samples are then queued every TELEMETRY_SAMPLE_INTERVAL seconds, also
+ * while offline, and sent once a batch is full or TELEMETRY_REPORT_INTERVAL
+ * seconds after the last report.
+ */
+#ifndef WEB_API_TELEMETRY
+#define WEB_API_TELEMETRY 0
+#endif
+
+#ifndef TELEMETRY_SAMPLE_INTERVAL
+#define TELEMETRY_SAMPLE_INTERVAL 30
+#endif
+
+#ifndef TELEMETRY_REPORT_INTERVAL
+#define TELEMETRY_REPORT_INTERVAL 300
+#endif
+
+#ifndef TELEMETRY_BATCH_SIZE
+#define TELEMETRY_BATCH_SIZE 32
+#endif
+
+/* Sends the records of a report packed with telemetry_codec into the
+ * DeviceReport.packed_reports bytes field instead of as ControllerReports.
+ */
+#ifndef WEB_API_TELEMETRY_PACKED
+#define WEB_API_TELEMETRY_PACKED 0
+#endif
+
+#define TELEMETRY_WINDOW       2        // reports waiting for an ack
+#define TELEMETRY_ACK_TIMEOUT  S2ST(60)
+
 
 typedef enum {
   RECV_LEN,
@@ -46,7 +90,9 @@ typedef enum {
 typedef struct {
   bool new_sample;
   bool new_settings;
+  bool new_autotune_status;
   quantity_t last_sample;
+  autotune_status_t autotune_status;
 } api_controller_status_t;
 
 typedef struct {
@@ -63,13 +109,19 @@ typedef struct {
   int socket;
   api_status_t status;
   bool new_device_settings;
-  api_controller_status_t controller_status[NUM_SENSORS];
+  api_controller_status_t controller_status[NUM_CONTROLLERS];
   systime_t last_sensor_report_time;
   systime_t last_send_time;
   systime_t last_recv_time;
   uint32_t send_errors;
   msg_parser_t parser;
   msg_listener_t* msg_listener;
+#if WEB_API_TELEMETRY
+  uint16_t outputs_on;
+  systime_t last_telemetry_time;
+  uint32_t report_seq;      // next record to send
+  uint8_t reports_in_flight;
+#endif
 } web_api_t;
 
 
@@ -85,7 +137,7 @@ web_api_idle(web_api_t* api);
 static void
 socket_message_rx(web_api_t* api, const uint8_t* data, uint32_t data_len);
 
-static void
+static bool
 send_api_msg(web_api_t* api, ApiMessage* msg);
 
 static void
@@ -106,6 +158,9 @@ static void
 dispatch_controller_settings_from_device(web_api_t* api,
     controller_settings_t* controller_settings_msg);
 
+static void
+dispatch_autotune_status(web_api_t* api, autotune_status_t* status);
+
 static void
 send_device_settings(
     web_api_t* api);
@@ -129,6 +184,20 @@ dispatch_firmware_rqst(web_api_t* api, firmware_update_t* firmware_data);
 static void
 send_sensor_report(web_api_t* api);
 
+#if WEB_API_TELEMETRY
+static void
+queue_telemetry(web_api_t* api);
+
+static void
+send_telemetry(web_api_t* api);
+
+static bool
+send_telemetry_report(web_api_t* api);
+#endif
+
+static void
+send_autotune_status(web_api_t* api);
+
 static void
 dispatch_device_settings_from_server(DeviceSettings* settings);
 
@@ -154,15 +223,19 @@ web_api_init()
   api = calloc(1, sizeof(web_api_t));
   api->status.state = AS_AWAITING_NET_CONNECTION;
 
-  api->msg_listener = msg_listener_create("web_api", 2048, web_api_dispatch, api);
+  api->msg_listener = msg_listener_create("web_api", 2048, MSG_PRIO_BACKGROUND, 8, web_api_dispatch, api);
   msg_listener_set_idle_timeout(api->msg_listener, 500);
   msg_listener_enable_watchdog(api->msg_listener, 3 * 60 * 1000);
 
   msg_subscribe(api->msg_listener, MSG_NET_STATUS, NULL);
   msg_subscribe(api->msg_listener, MSG_API_FW_UPDATE_CHECK, NULL);
   msg_subscribe(api->msg_listener, MSG_API_FW_DNLD_RQST, NULL);
-  msg_subscribe(api->msg_listener, MSG_SENSOR_SAMPLE, NULL);
+  msg_subscribe_latest(api->msg_listener, MSG_SENSOR_SAMPLE, NULL);
   msg_subscribe(api->msg_listener, MSG_CONTROLLER_SETTINGS, NULL);
+  msg_subscribe_latest(api->msg_listener, MSG_AUTOTUNE_STATUS, NULL);
+#if WEB_API_TELEMETRY
+  msg_subscribe_latest(api->msg_listener, MSG_OUTPUT_STATUS, NULL);
+#endif
 }
 
 const api_status_t*
@@ -186,6 +259,21 @@ web_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_dat
   web_api_t* api = listener_data;
 
   switch (id) {
+#if WEB_API_TELEMETRY
+    case MSG_INIT:
+      telemetry_init();
+      break;
+
+    case MSG_OUTPUT_STATUS:
+    {
+      output_status_t* status = msg_data;
+      if (status->output < NUM_OUTPUTS) {
+        ASSIGNBIT(&api->outputs_on, status->output, status->enabled);
+      }
+      break;
+    }
+#endif
+
     case MSG_NET_STATUS:
       dispatch_net_status(api, msg_data);
       break;
@@ -194,6 +282,10 @@ web_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_dat
       dispatch_sensor_sample(api, msg_data);
       break;
 
+    case MSG_AUTOTUNE_STATUS:
+      dispatch_autotune_status(api, msg_data);
+      break;
+
     case MSG_IDLE:
       web_api_idle(api);
       break;
@@ -233,6 +325,14 @@ set_state(web_api_t* api, api_state_t state)
   if (api->status.state != state) {
     api->status.state = state;
 
+#if WEB_API_TELEMETRY
+    /* Reports the old connection did not get acked for are sent again */
+    if (state == AS_CONNECTED) {
+      api->report_seq = telemetry_ack_seq();
+      api->reports_in_flight = 0;
+    }
+#endif
+
     api_status_t status_msg = {
         .state = state
     };
@@ -243,6 +343,10 @@ set_state(web_api_t* api, api_state_t state)
 static void
 web_api_idle(web_api_t* api)
 {
+#if WEB_API_TELEMETRY
+  queue_telemetry(api);
+#endif
+
   switch (api->status.state) {
     case AS_AWAITING_NET_CONNECTION:
       /* do nothing, wait for net to come up */
@@ -276,10 +380,14 @@ web_api_idle(web_api_t* api)
       break;
 
     case AS_CONNECTED:
+#if WEB_API_TELEMETRY
+      send_telemetry(api);
+#else
       if ((chTimeNow() - api->last_sensor_report_time) > SENSOR_REPORT_INTERVAL) {
         send_sensor_report(api);
         api->last_sensor_report_time = chTimeNow();
       }
+#endif
 
       if (api->new_device_settings) {
         send_device_settings(api);
@@ -287,6 +395,7 @@ web_api_idle(web_api_t* api)
       }
 
       send_controller_settings(api);
+      send_autotune_status(api);
       break;
   }
 
@@ -407,7 +516,9 @@ send_sensor_report(web_api_t* api)
   msg->has_deviceReport = true;
   msg->deviceReport.controller_reports_count = 0;
 
-  for (i = 0; i < NUM_SENSORS; ++i) {
+  int max_reports = sizeof(msg->deviceReport.controller_reports) / sizeof(msg->deviceReport.controller_reports[0]);
+
+  for (i = 0; i < NUM_CONTROLLERS && (int)msg->deviceReport.controller_reports_count < max_reports; ++i) {
     if (api->controller_status[i].new_sample) {
       api->controller_status[i].new_sample = false;
       ControllerReport* pr = &msg->deviceReport.controller_reports[msg->deviceReport.controller_reports_count];
@@ -427,6 +538,183 @@ send_sensor_report(web_api_t* api)
   free(msg);
 }
 
+#if WEB_API_TELEMETRY
+/* Queues the latest sample of every controller, connected or not */
+static void
+queue_telemetry(web_api_t* api)
+{
+  int i, j;
+
+  if ((chTimeNow() - api->last_telemetry_time) < S2ST(TELEMETRY_SAMPLE_INTERVAL))
+    return;
+  api->last_telemetry_time = chTimeNow();
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    api_controller_status_t* s = &api->controller_status[i];
+    if (!s->new_sample)
+      continue;
+    s->new_sample = false;
+
+    telemetry_record_t rec = {
+        .time = sample_store_now(),
+        .controller = i,
+        .value = s->last_sample.value,
+        .setpoint = temp_control_get_current_setpoint(i)
+    };
+
+    const controller_settings_t* cs = app_cfg_get_controller_settings(i);
+    for (j = 0; j < NUM_OUTPUTS; ++j) {
+      if (cs->output_settings[j].enabled && TESTBIT(&api->outputs_on, j))
+        SETBIT(&rec.outputs, j);
+    }
+
+    telemetry_push(&rec);
+  }
+}
+
+/* Full batches go out as soon as the window allows, so a backlog from an
+ * outage is caught up in order, as fast as the server acks it. A partial
+ * batch waits for the report interval.
+ */
+static void
+send_telemetry(web_api_t* api)
+{
+  /* Nothing heard back, start again from the oldest unacked record */
+  if (api->reports_in_flight > 0 &&
+      (chTimeNow() - api->last_sensor_report_time) > TELEMETRY_ACK_TIMEOUT) {
+    printf("sensor report not acked, resending\r\n");
+    api->report_seq = telemetry_ack_seq();
+    api->reports_in_flight = 0;
+  }
+
+  while (api->reports_in_flight < TELEMETRY_WINDOW &&
+         api->status.state == AS_CONNECTED) {
+    uint32_t pending = telemetry_end_seq() - MAX(api->report_seq, telemetry_ack_seq());
+
+    if (pending == 0)
+      break;
+
+    if (pending < TELEMETRY_BATCH_SIZE &&
+        (chTimeNow() - api->last_sensor_report_time) < S2ST(TELEMETRY_REPORT_INTERVAL))
+      break;
+
+    if (!send_telemetry_report(api))
+      break;
+  }
+}
+
+static bool
+send_telemetry_report(web_api_t* api)
+{
+  uint32_t i;
+  bool sent = false;
+  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  msg->type = ApiMessage_Type_DEVICE_REPORT;
+  msg->has_deviceReport = true;
+
+#if WEB_API_TELEMETRY_PACKED
+  uint32_t max_reports = TELEMETRY_BATCH_SIZE;
+#else
+  uint32_t max_reports = sizeof(msg->deviceReport.controller_reports) / sizeof(msg->deviceReport.controller_reports[0]);
+  max_reports = MIN(max_reports, TELEMETRY_BATCH_SIZE);
+#endif
+
+  telemetry_record_t* recs = malloc(max_reports * sizeof(telemetry_record_t));
+  uint32_t num_recs = telemetry_peek(api->report_seq, recs, max_reports);
+
+  if (num_recs == 0) {
+    /* The rest was lost to a full spill area */
+    api->report_seq = telemetry_end_seq();
+  }
+  else {
+#if WEB_API_TELEMETRY_PACKED
+    /* As many records as fit in the bytes field */
+    telemetry_codec_t* codec = malloc(sizeof(telemetry_codec_t));
+    telemetry_encode_start(codec,
+        msg->deviceReport.packed_reports.bytes,
+        sizeof(msg->deviceReport.packed_reports.bytes),
+        recs[0].time);
+    for (i = 0; i < num_recs; ++i) {
+      if (!telemetry_encode(codec, &recs[i]))
+        break;
+    }
+    num_recs = i;
+    msg->deviceReport.has_packed_reports = (num_recs > 0);
+    msg->deviceReport.packed_reports.size = codec->len;
+    free(codec);
+#else
+    for (i = 0; i < num_recs; ++i) {
+      ControllerReport* pr = &msg->deviceReport.controller_reports[i];
+      pr->controller_index = recs[i].controller;
+      pr->sensor_reading = recs[i].value;
+      pr->setpoint = recs[i].setpoint;
+      pr->has_timestamp = true;
+      pr->timestamp = recs[i].time;
+      pr->has_output_status = true;
+      pr->output_status = recs[i].outputs;
+    }
+    msg->deviceReport.controller_reports_count = num_recs;
+#endif
+  }
+
+  if (num_recs > 0) {
+    /* The server acks a report by echoing its sequence number, which
+     * acknowledges every record before it.
+     */
+    msg->deviceReport.has_sequence = true;
+    msg->deviceReport.sequence = recs[num_recs - 1].seq + 1;
+
+    printf("sending sensor report %d\r\n", (int)num_recs);
+    sent = send_api_msg(api, msg);
+    if (sent) {
+      api->report_seq = msg->deviceReport.sequence;
+      api->reports_in_flight++;
+      api->last_sensor_report_time = chTimeNow();
+    }
+  }
+
+  free(recs);
+  free(msg);
+
+  return sent;
+}
+#endif
+
+static void
+send_autotune_status(web_api_t* api)
+{
+#if WEB_API_AUTOTUNE
+  int i;
+  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  msg->type = ApiMessage_Type_AUTOTUNE_STATUS;
+  msg->has_autotuneStatus = true;
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (api->controller_status[i].new_autotune_status) {
+      api->controller_status[i].new_autotune_status = false;
+      const autotune_status_t* s = &api->controller_status[i].autotune_status;
+      AutotuneStatus* as = &msg->autotuneStatus;
+
+      as->controller_index = i;
+      as->state = s->state;
+      as->cycles = s->cycles;
+      as->ultimate_gain = s->ku;
+      as->ultimate_period = s->tu;
+      as->kp = s->kp;
+      as->ki = s->ki;
+      as->kd = s->kd;
+
+      printf("Sending autotune status\r\n");
+      send_api_msg(api, msg);
+    }
+  }
+
+  free(msg);
+#else
+  (void)api;
+#endif
+}
+
 static void
 request_activation_token(web_api_t* api)
 {
@@ -469,12 +757,30 @@ dispatch_net_status(web_api_t* api, net_status_t* ns)
 static void
 dispatch_sensor_sample(web_api_t* api, sensor_msg_t* sample)
 {
+  int i;
+
   if (sample->sensor >= NUM_SENSORS)
     return;
 
-  api_controller_status_t* s = &api->controller_status[sample->sensor];
-  s->new_sample = true;
-  s->last_sample = sample->sample;
+  /* Every controller fed by this sensor gets the sample in its report */
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (app_cfg_get_controller_settings(i)->sensor == sample->sensor) {
+      api_controller_status_t* s = &api->controller_status[i];
+      s->new_sample = true;
+      s->last_sample = sample->sample;
+    }
+  }
+}
+
+static void
+dispatch_autotune_status(web_api_t* api, autotune_status_t* status)
+{
+  if (status->controller >= NUM_CONTROLLERS)
+    return;
+
+  api_controller_status_t* s = &api->controller_status[status->controller];
+  s->autotune_status = *status;
+  s->new_autotune_status = true;
 }
 
 static void
@@ -495,7 +801,7 @@ dispatch_controller_settings_from_device(
 {
   printf("controller settings updated\r\n");
 
-  if (ssm != NULL)
+  if (ssm != NULL && ssm->controller < NUM_CONTROLLERS)
     api->controller_status[ssm->controller].new_settings = true;
 }
 
@@ -616,9 +922,10 @@ dispatch_firmware_rqst(web_api_t* api, firmware_update_t* firmware_data)
   free(msg);
 }
 
-static void
+static bool
 send_api_msg(web_api_t* api, ApiMessage* msg)
 {
+  bool sent = false;
   uint8_t* buffer = malloc(ApiMessage_size);
 
   pb_ostream_t stream = pb_ostream_from_buffer(buffer, ApiMessage_size);
@@ -627,7 +934,8 @@ send_api_msg(web_api_t* api, ApiMessage* msg)
   if (encoded_ok) {
     uint32_t buf_len = htonl(stream.bytes_written);
     if (send_all(api, &buf_len, sizeof(buf_len))) {
-      if (!send_all(api, buffer, stream.bytes_written)) {
+      sent = send_all(api, buffer, stream.bytes_written);
+      if (!sent) {
         printf("buffer send failed!\r\n");
       }
     }
@@ -637,6 +945,8 @@ send_api_msg(web_api_t* api, ApiMessage* msg)
   }
 
   free(buffer);
+
+  return sent;
 }
 
 static bool
@@ -727,6 +1037,27 @@ dispatch_api_msg(web_api_t* api, ApiMessage* msg)
     dispatch_controller_settings_from_server(&msg->controllerSettings);
     break;
 
+#if WEB_API_TELEMETRY
+  case ApiMessage_Type_DEVICE_REPORT_ACK:
+    telemetry_ack(msg->deviceReportAck.sequence);
+    if (telemetry_ack_seq() >= api->report_seq)
+      api->reports_in_flight = 0;
+    else if (api->reports_in_flight > 0)
+      api->reports_in_flight--;
+    break;
+#endif
+
+#if WEB_API_AUTOTUNE
+  case ApiMessage_Type_AUTOTUNE_COMMAND:
+    printf("got autotune command %d %d\r\n",
+        (int)msg->autotuneCommand.controller_index,
+        msg->autotuneCommand.start);
+    if (msg->autotuneCommand.controller_index < NUM_CONTROLLERS)
+      temp_control_autotune(msg->autotuneCommand.controller_index,
+          msg->autotuneCommand.start);
+    break;
+#endif
+
   default:
     printf("Unsupported API message: %d\r\n", msg->type);
     break;
@@ -755,6 +1086,11 @@ dispatch_controller_settings_from_server(ControllerSettings* settings)
 
   printf("got controller settings from server\r\n");
 
+  if (settings->sensor_index >= NUM_CONTROLLERS) {
+    printf("Invalid controller index: %d\r\n", (int)settings->sensor_index);
+    return;
+  }
+
   controller_settings_t* csl = calloc(1, sizeof(controller_settings_t));
   memcpy(csl, app_cfg_get_controller_settings(settings->sensor_index), sizeof(controller_settings_t));
 
@@ -802,10 +1138,14 @@ dispatch_controller_settings_from_server(ControllerSettings* settings)
   }
 
   printf("  got %d output settings\r\n", settings->output_settings_count);
-  csl->output_settings[OUTPUT_1].enabled = false;
-  csl->output_settings[OUTPUT_2].enabled = false;
+  for (i = 0; i < NUM_OUTPUTS; ++i)
+    csl->output_settings[i].enabled = false;
   for (i = 0; i < (int)settings->output_settings_count; ++i) {
     OutputSettings* osm = &settings->output_settings[i];
+    if (osm->index >= NUM_OUTPUTS) {
+      printf("Invalid output index: %d\r\n", (int)osm->index);
+      continue;
+    }
     output_settings_t* os = &csl->output_settings[osm->index];
 
     os->cycle_delay.value = osm->cycle_delay;
@@ -26,6 +26,18 @@ static const part_info_t part_info[NUM_SXFS_PARTS] = {
         .offset = 0x00110000,
         .size   = 0x00110000 // 1024 KB
     },
+    [SP_SENSOR_REPLAY] = {
+        .offset = 0x00220000,
+        .size   = 0x00080000 // 512 KB
+    },
+    [SP_SAMPLE_STORE] = {
+        .offset = 0x002A0000,
+        .size   = 0x00130000 // 1216 KB
+    },
+    [SP_TELEMETRY] = {
+        .offset = 0x003D0000,
+        .size   = 0x00030000 // 192 KB
+    },
 };
 
 
@@ -41,6 +53,23 @@ sxfs_erase(sxfs_part_id_t part_id)
   return true;
 }
 
+/* Erases the single flash sector holding offset */
+bool
+sxfs_erase_sector(sxfs_part_id_t part_id, uint32_t offset)
+{
+  if (part_id >= NUM_SXFS_PARTS)
+    return false;
+
+  part_info_t pinfo = part_info[part_id];
+  if (offset >= pinfo.size)
+    return false;
+
+  offset -= offset % XFLASH_SECTOR_SIZE;
+  xflash_erase(pinfo.offset + offset, XFLASH_SECTOR_SIZE);
+
+  return true;
+}
+
 bool
 sxfs_write(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
 {
@@ -12,6 +12,9 @@ typedef enum {
   SP_BOOT_PARAMS,
   SP_RECOVERY_IMG,
   SP_UPDATE_IMG,
+  SP_SENSOR_REPLAY,
+  SP_SAMPLE_STORE,
+  SP_TELEMETRY,
   NUM_SXFS_PARTS
 } sxfs_part_id_t;
 
@@ -25,6 +28,9 @@ sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_
 bool
 sxfs_erase(sxfs_part_id_t part_id);
 
+bool
+sxfs_erase_sector(sxfs_part_id_t part_id, uint32_t offset);
+
 bool
 sxfs_crc(sxfs_part_id_t part_id, uint32_t offset, uint32_t size, uint32_t* crc);
 
@@ -60,12 +60,23 @@
 #define SR_SRWD  0x80
 
 
+static void
+bus_acquire(void);
+
+static void
+bus_release(void);
+
 static void
 xflash_txn_begin(void);
 
 static void
 xflash_txn_end(void);
 
+static void
+transfer(uint8_t cmd, uint32_t addr,
+    const uint8_t* cmd_tx_buf, uint32_t cmd_tx_len,
+    uint8_t* cmd_rx_buf, uint32_t cmd_rx_len);
+
 static void
 send_cmd(uint8_t cmd, uint32_t addr,
     const uint8_t* cmd_tx_buf, uint32_t cmd_tx_len,
@@ -87,11 +98,24 @@ static const SPIConfig flash_spi_cfg = {
 
 
 static void
-xflash_txn_begin()
+bus_acquire()
 {
 #if SPI_USE_MUTUAL_EXCLUSION
   spiAcquireBus(SPI_FLASH);
 #endif
+}
+
+static void
+bus_release()
+{
+#if SPI_USE_MUTUAL_EXCLUSION
+  spiReleaseBus(SPI_FLASH);
+#endif
+}
+
+static void
+xflash_txn_begin()
+{
   spiStart(SPI_FLASH, &flash_spi_cfg);
   spiSelect(SPI_FLASH);
 }
@@ -100,13 +124,19 @@ static void
 xflash_txn_end()
 {
   spiUnselect(SPI_FLASH);
-#if SPI_USE_MUTUAL_EXCLUSION
-  spiReleaseBus(SPI_FLASH);
-#endif
 }
 
 static void
 send_cmd(uint8_t cmd, uint32_t addr, const uint8_t* cmd_tx_buf, uint32_t cmd_tx_len, uint8_t* cmd_rx_buf, uint32_t cmd_rx_len)
+{
+  bus_acquire();
+  transfer(cmd, addr, cmd_tx_buf, cmd_tx_len, cmd_rx_buf, cmd_rx_len);
+  bus_release();
+}
+
+/* One command with the bus already acquired */
+static void
+transfer(uint8_t cmd, uint32_t addr, const uint8_t* cmd_tx_buf, uint32_t cmd_tx_len, uint8_t* cmd_rx_buf, uint32_t cmd_rx_len)
 {
   xflash_txn_begin();
 
@@ -207,7 +237,25 @@ xflash_write(uint32_t addr, const uint8_t* buf, uint32_t buf_len)
 void
 xflash_read(uint32_t addr, uint8_t* buf, uint32_t buf_len)
 {
-  send_cmd(CMD_READ, addr, NULL, 0, buf, buf_len);
+  uint8_t sr;
+
+  /* The flash ignores reads while another thread has an erase or program
+   * running. The bus is held from the status read on so none can start
+   * before the read.
+   */
+  bus_acquire();
+  while (1) {
+    transfer(CMD_RDSR, NO_ADDR, NULL, 0, &sr, 1);
+    if ((sr & SR_WIP) == 0)
+      break;
+
+    bus_release();
+    chThdSleepMilliseconds(10);
+    bus_acquire();
+  }
+
+  transfer(CMD_READ, addr, NULL, 0, buf, buf_len);
+  bus_release();
 }
 
 uint32_t
@@ -0,0 +1,298 @@
+/* Host test and benchmark of the asset decoders in src/app_mt/image.c.
+ *
+ * Every image in images/ and every glyph of fonts/font_specs is coded by
+ * scripts/asset_codec.py (see asset_vectors.py, which also round-trips
+ * them through asset_codec's own decoders) and decoded here by
+ * image_alpha_read() and image_read_px(): whole, a pixel at a time, which
+ * takes each literal's nibbles across calls, and through WINDOWS_PER_ASSET
+ * random clip windows, skipping to and between their rows as gfx.c does.
+ * It fails if any decode differs from the quantized source, if a decode
+ * writes past the pixels asked for, or if no asset has a literal of an odd
+ * number of pixels, whose last low nibble the decoder has to step over.
+ *
+ * It then prints the flash each group of assets takes raw (8 bit alpha,
+ * RGB565 pixels) and coded, and the host cycles per pixel to decode them a
+ * row at a time next to copying the raw rows. Glyphs are the stand-ins of
+ * host_resources.py, not OpenSans.
+ */
+
+#include "image.h"
+#include "asset_vectors.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define WINDOWS_PER_ASSET   200
+#define NUM_TIMED_RUNS      200
+#define MAX_PX              (64 * 64)
+#define GUARD               0xA5
+#define MAX_GROUPS          8
+
+/* Keeps the compiler from dropping the copies it is timed against */
+#define COMPILER_BARRIER()  __asm__ __volatile__("" ::: "memory")
+
+
+typedef struct {
+  const char* name;
+  uint32_t assets;
+  uint32_t pixels;
+  uint32_t raw_bytes;
+  uint32_t coded_bytes;
+  uint64_t decode_cycles;
+  uint64_t copy_cycles;
+} group_t;
+
+
+static void check_alpha(const asset_t* a);
+static void check_px(const asset_t* a);
+static void time_asset(const asset_t* a, group_t* alpha_group, group_t* px_group);
+static group_t* find_group(const char* name);
+static void print_group(const group_t* g);
+static uint32_t random_u32(void);
+static void check(bool ok, const char* what);
+
+
+static uint32_t failures;
+static uint32_t rng = 1;
+static group_t groups[MAX_GROUPS];
+static uint32_t num_groups;
+static uint8_t alpha_buf[MAX_PX + 1];
+static uint16_t px_buf[MAX_PX + 1];
+
+
+int
+main()
+{
+  group_t total = { .name = "total" };
+  uint32_t odd_literals = 0;
+  uint32_t i;
+
+  for (i = 0; i < num_assets; ++i) {
+    const asset_t* a = &assets[i];
+
+    check((a->width * a->height) <= MAX_PX, "the asset fits the test's buffers");
+    check_alpha(a);
+    if (a->px_rle != NULL)
+      check_px(a);
+    odd_literals += a->odd_literals;
+  }
+  printf("%u assets decoded, %u odd literals\n", (unsigned)num_assets, (unsigned)odd_literals);
+  check(odd_literals > 0, "some literal leaves a low nibble unused");
+
+  for (i = 0; i < num_assets; ++i) {
+    const asset_t* a = &assets[i];
+    group_t* alpha_group = find_group(a->group);
+    char px_name[32];
+
+    snprintf(px_name, sizeof(px_name), "%s px", a->group);
+    time_asset(a, alpha_group, (a->px_rle != NULL) ? find_group(px_name) : NULL);
+  }
+
+  printf("%-12s %6s %8s %8s %8s %7s %10s %10s\n", "assets", "count", "pixels", "raw B",
+      "coded B", "saved", "decode c/px", "copy c/px");
+  for (i = 0; i < num_groups; ++i) {
+    print_group(&groups[i]);
+    total.assets += groups[i].assets;
+    total.pixels += groups[i].pixels;
+    total.raw_bytes += groups[i].raw_bytes;
+    total.coded_bytes += groups[i].coded_bytes;
+    total.decode_cycles += groups[i].decode_cycles;
+    total.copy_cycles += groups[i].copy_cycles;
+  }
+  print_group(&total);
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+static void
+check_alpha(const asset_t* a)
+{
+  image_alpha_decoder_t d;
+  uint32_t n = a->width * a->height;
+  uint32_t i;
+  int w;
+
+  memset(alpha_buf, GUARD, sizeof(alpha_buf));
+  image_alpha_start(&d, a->alpha_code);
+  image_alpha_read(&d, alpha_buf, n);
+  check(memcmp(alpha_buf, a->alpha, n) == 0, "the alpha decodes whole");
+  check(alpha_buf[n] == GUARD, "a decode writes only the pixels asked for");
+  check(d.p == (a->alpha_code + a->alpha_code_size), "the decode ends with the code");
+
+  memset(alpha_buf, GUARD, sizeof(alpha_buf));
+  image_alpha_start(&d, a->alpha_code);
+  for (i = 0; i < n; ++i)
+    image_alpha_read(&d, &alpha_buf[i], 1);
+  check(memcmp(alpha_buf, a->alpha, n) == 0, "the alpha decodes a pixel at a time");
+  check(alpha_buf[n] == GUARD, "a decode writes only the pixels asked for");
+
+  for (w = 0; w < WINDOWS_PER_ASSET; ++w) {
+    int x = random_u32() % a->width;
+    int y = random_u32() % a->height;
+    int width = 1 + (random_u32() % (a->width - x));
+    int height = 1 + (random_u32() % (a->height - y));
+    bool ok = true;
+    int row;
+
+    image_alpha_start(&d, a->alpha_code);
+    image_alpha_read(&d, NULL, (y * a->width) + x);
+    for (row = y; row < (y + height); ++row) {
+      if (row > y)
+        image_alpha_read(&d, NULL, a->width - width);
+      alpha_buf[width] = GUARD;
+      image_alpha_read(&d, alpha_buf, width);
+      ok = ok && (memcmp(alpha_buf, &a->alpha[(row * a->width) + x], width) == 0) &&
+          (alpha_buf[width] == GUARD);
+    }
+    if (!ok) {
+      printf("%s: window %d,%d %dx%d\n", a->name, x, y, width, height);
+      check(false, "the alpha decodes through a clip window");
+    }
+  }
+}
+
+static void
+check_px(const asset_t* a)
+{
+  Image_t img = { a->width, a->height, NULL, a->alpha_code, a->px_rle, a->px_rows };
+  int y, w;
+
+  for (y = 0; y < a->height; ++y) {
+    px_buf[a->width] = GUARD;
+    image_read_px(&img, 0, y, px_buf, a->width);
+    check(memcmp(px_buf, &a->px[y * a->width], a->width * sizeof(uint16_t)) == 0,
+        "the pixels decode a row at a time");
+    check(px_buf[a->width] == GUARD, "a decode writes only the pixels asked for");
+  }
+
+  for (w = 0; w < WINDOWS_PER_ASSET; ++w) {
+    int x = random_u32() % a->width;
+    int n = 1 + (random_u32() % (a->width - x));
+
+    y = random_u32() % a->height;
+    px_buf[n] = GUARD;
+    image_read_px(&img, x, y, px_buf, n);
+    if ((memcmp(px_buf, &a->px[(y * a->width) + x], n * sizeof(uint16_t)) != 0) ||
+        (px_buf[n] != GUARD)) {
+      printf("%s: row %d from %d, %d pixels\n", a->name, y, x, n);
+      check(false, "the pixels decode through a clip window");
+    }
+  }
+}
+
+/* Decodes the asset a row at a time, as gfx.c draws it, and copies the
+ * raw rows for comparison.
+ */
+static void
+time_asset(const asset_t* a, group_t* alpha_group, group_t* px_group)
+{
+  Image_t img = { a->width, a->height, NULL, a->alpha_code, a->px_rle, a->px_rows };
+  image_alpha_decoder_t d;
+  uint32_t pixels = a->width * a->height;
+  uint64_t start;
+  int run, y;
+
+  alpha_group->assets++;
+  alpha_group->pixels += pixels;
+  alpha_group->raw_bytes += pixels;
+  alpha_group->coded_bytes += a->alpha_code_size;
+
+  start = sim_cycles();
+  for (run = 0; run < NUM_TIMED_RUNS; ++run) {
+    image_alpha_start(&d, a->alpha_code);
+    for (y = 0; y < a->height; ++y)
+      image_alpha_read(&d, alpha_buf, a->width);
+  }
+  alpha_group->decode_cycles += sim_cycles() - start;
+
+  start = sim_cycles();
+  for (run = 0; run < NUM_TIMED_RUNS; ++run) {
+    for (y = 0; y < a->height; ++y) {
+      memcpy(alpha_buf, &a->alpha[y * a->width], a->width);
+      COMPILER_BARRIER();
+    }
+  }
+  alpha_group->copy_cycles += sim_cycles() - start;
+
+  if (px_group == NULL)
+    return;
+
+  px_group->assets++;
+  px_group->pixels += pixels;
+  px_group->raw_bytes += pixels * sizeof(uint16_t);
+  px_group->coded_bytes += a->px_rle_size + (a->height * sizeof(uint32_t));
+
+  start = sim_cycles();
+  for (run = 0; run < NUM_TIMED_RUNS; ++run) {
+    for (y = 0; y < a->height; ++y)
+      image_read_px(&img, 0, y, px_buf, a->width);
+  }
+  px_group->decode_cycles += sim_cycles() - start;
+
+  start = sim_cycles();
+  for (run = 0; run < NUM_TIMED_RUNS; ++run) {
+    for (y = 0; y < a->height; ++y) {
+      memcpy(px_buf, &a->px[y * a->width], a->width * sizeof(uint16_t));
+      COMPILER_BARRIER();
+    }
+  }
+  px_group->copy_cycles += sim_cycles() - start;
+}
+
+static group_t*
+find_group(const char* name)
+{
+  uint32_t i;
+
+  for (i = 0; i < num_groups; ++i) {
+    if (strcmp(groups[i].name, name) == 0)
+      return &groups[i];
+  }
+
+  if (num_groups == MAX_GROUPS) {
+    printf("too many asset groups\n");
+    exit(1);
+  }
+  groups[num_groups].name = strdup(name);
+  return &groups[num_groups++];
+}
+
+static void
+print_group(const group_t* g)
+{
+  double runs = (double)NUM_TIMED_RUNS * g->pixels;
+
+  printf("%-12s %6u %8u %8u %8u %6.1f%% %10.2f %10.2f\n", g->name, (unsigned)g->assets,
+      (unsigned)g->pixels, (unsigned)g->raw_bytes, (unsigned)g->coded_bytes,
+      100.0 * (1.0 - ((double)g->coded_bytes / g->raw_bytes)),
+      g->decode_cycles / runs, g->copy_cycles / runs);
+}
+
+static uint32_t
+random_u32()
+{
+  uint32_t hi;
+
+  rng = (rng * 1103515245) + 12345;
+  hi = rng & 0xFFFF0000;
+  rng = (rng * 1103515245) + 12345;
+
+  return hi | (rng >> 16);
+}
+
+static void
+check(bool ok, const char* what)
+{
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
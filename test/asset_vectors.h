@@ -0,0 +1,29 @@
+#ifndef ASSET_VECTORS_H
+#define ASSET_VECTORS_H
+
+#include <stdint.h>
+
+/* The assets coded by scripts/asset_codec.py, with what image.c has to
+ * decode them to, generated by asset_vectors.py.
+ */
+
+typedef struct {
+  const char* name;
+  const char* group;        // "images" or "font <size>"
+  uint16_t width;
+  uint16_t height;
+  const uint8_t* alpha_code;
+  uint32_t alpha_code_size;
+  const uint8_t* alpha;     // width * height, 8 bit
+  uint32_t odd_literals;    // literal ops of an odd number of pixels
+  const uint8_t* px_rle;    // NULL for glyphs
+  uint32_t px_rle_size;
+  const uint32_t* px_rows;
+  const uint16_t* px;       // width * height
+} asset_t;
+
+
+extern const asset_t assets[];
+extern const uint32_t num_assets;
+
+#endif
@@ -0,0 +1,103 @@
+# Generates asset_vectors.c for asset_test: every image in images/ and
+# every glyph of fonts/font_specs coded with scripts/asset_codec.py, next to
+# what decoding has to give back.
+#
+# Each asset is first round-tripped through asset_codec's own decoders,
+# and this fails if that doesn't give the quantized source back. Glyphs
+# are the stand-ins of host_resources.py, as the real ones need pygame.
+# The images in the tree are alpha only, so their RGB565 pixels are made
+# as the icon would be stored pre-blended, white over black.
+#
+#   asset_vectors.py <out_file> <font_specs> <png>...
+
+import os
+import sys
+import ast
+
+import host_resources
+from host_resources import asset_codec, c_array
+
+
+def gray_px(a):
+  r = (a * 31 + 127) // 255
+  g = (a * 63 + 127) // 255
+  return (r << 11) | (g << 5) | r
+
+
+def odd_literals(code, count):
+  """Counts the literal ops of code with an odd number of pixels."""
+  n_odd = 0
+  pos = 0
+  done = 0
+
+  while done < count:
+    op = code[pos] & 0xC0
+    n = (code[pos] & 0x3F) + 1
+    pos += 1
+    if op == asset_codec.OP_RUN:
+      pos += 1
+    elif op == asset_codec.OP_LITERAL:
+      pos += (n + 1) // 2
+      n_odd += n % 2
+    done += n
+
+  return n_odd
+
+
+def vector(c, index, name, group, width, height, alpha, with_px):
+  expected = [asset_codec.expand_alpha(asset_codec.quantize_alpha(a)) for a in alpha]
+  code = asset_codec.encode_alpha(alpha)
+  if asset_codec.decode_alpha(code, len(alpha)) != expected:
+    raise SystemExit('%s: alpha does not round trip through asset_codec' % name)
+
+  c += ['static const uint8_t a%d_code[] = { %s };' % (index, c_array(bytearray(code))),
+        'static const uint8_t a%d_alpha[] = { %s };' % (index, c_array(expected))]
+
+  px_fields = 'NULL, 0, NULL, NULL'
+  if with_px:
+    px = [gray_px(a) for a in expected]
+    px_code, rows = asset_codec.encode_px(px, width)
+    for y in range(height):
+      if asset_codec.decode_px_row(px_code, rows[y], width) != px[y * width:(y + 1) * width]:
+        raise SystemExit('%s: pixels do not round trip through asset_codec' % name)
+
+    c += ['static const uint8_t a%d_px_code[] = { %s };' % (index, c_array(bytearray(px_code))),
+          'static const uint32_t a%d_px_rows[] = { %s };' % (index, c_array(rows)),
+          'static const uint16_t a%d_px[] = { %s };' % (index, c_array(px))]
+    px_fields = 'a%d_px_code, sizeof(a%d_px_code), a%d_px_rows, a%d_px' % (index, index, index, index)
+
+  c.append('')
+  return '  { "%s", "%s", %d, %d, a%d_code, sizeof(a%d_code), a%d_alpha, %d, %s },' % \
+      (name, group, width, height, index, index, index, odd_literals(bytearray(code), len(alpha)),
+       px_fields)
+
+
+def main():
+  out_file = sys.argv[1]
+  with open(sys.argv[2], 'r') as f:
+    font_specs = ast.literal_eval(f.read())
+
+  c = ['#include "asset_vectors.h"', '', '#include <stddef.h>', '']
+  entries = []
+
+  for path in sorted(sys.argv[3:]):
+    name = os.path.basename(path).split('.')[0]
+    width, height, px = host_resources.read_png(path)
+    entries.append(vector(c, len(entries), 'images/' + name, 'images', width, height,
+        [p[3] for p in px], True))
+
+  for spec in font_specs:
+    font, _, glyphs = host_resources.font_glyphs(spec)
+    for o, width, height, _, alpha in glyphs:
+      if width > 0:
+        entries.append(vector(c, len(entries), '%s/%d' % (font, o), 'font %d' % spec['font_size'],
+            width, height, alpha, False))
+
+  c += ['const asset_t assets[] = {'] + entries + ['};', '',
+        'const uint32_t num_assets = %d;' % len(entries), '']
+  with open(out_file, 'w') as f:
+    f.write('\n'.join(c))
+
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,334 @@
+/* Host test and benchmark of the RGB565 blending in src/app_mt/blend.c.
+ *
+ * blend_pixel() is checked against the reference formula in blend.h for
+ * every pair of values of each component at every alpha, with the other
+ * components set two ways so that the borrows between the spread fields
+ * are exercised too. Each row kernel is run for every length up to
+ * MAX_ROW_LEN from both a word aligned and an odd start, over alpha with
+ * runs of 0 and 255 and values in between, and has to give what
+ * blend_pixel() gives for every pixel. The benchmark times the kernels
+ * over display rows of glyph-like and fully partial alpha.
+ *
+ * It fails if a component is off the reference by more than MAX_ERROR, if
+ * alpha 0 or 255 does not give the background or foreground exactly, if a
+ * kernel's pixel differs from blend_pixel()'s or if a kernel writes
+ * outside its row.
+ */
+
+#include "blend.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+#define MAX_ERROR           2.0       // in units of each component
+#define MAX_ROW_LEN         67
+#define ROWS_PER_LEN        20
+#define GUARD_LEN           8         // pixels either side of a row
+#define GUARD_PX            0xA5C3
+
+#define BENCH_ROW_LEN       240       // DISP_WIDTH
+#define BENCH_ROWS          20000
+
+#define RGB(r, g, b)        ((uint16_t)(((r) << 11) | ((g) << 5) | (b)))
+#define RED(c)              (((c) >> 11) & 0x1F)
+#define GREEN(c)            (((c) >> 5) & 0x3F)
+#define BLUE(c)             ((c) & 0x1F)
+
+
+typedef enum {
+  KERNEL_FILL,
+  KERNEL_SOLID,
+  KERNEL_OVER,
+  KERNEL_RGBA_OVER,
+  NUM_KERNELS
+} kernel_t;
+
+
+static void check_pixels(void);
+static double component_error(int result, int fg, int bg, uint8_t alpha);
+static void check_kernels(void);
+static void run_kernel(kernel_t k, uint16_t* dst, const uint16_t* px, const uint8_t* alpha,
+    int n, uint16_t fcolor, uint16_t bcolor);
+static uint16_t expected_px(kernel_t k, uint16_t old, uint16_t px, uint8_t alpha,
+    uint16_t fcolor, uint16_t bcolor);
+static void bench(void);
+static void random_alpha(uint8_t* alpha, int n, bool edges);
+static uint32_t random_u32(void);
+static void check(bool ok, const char* what);
+
+
+static const char* kernel_names[NUM_KERNELS] = {
+  [KERNEL_FILL]      = "blend_fill",
+  [KERNEL_SOLID]     = "blend_solid",
+  [KERNEL_OVER]      = "blend_over",
+  [KERNEL_RGBA_OVER] = "blend_rgba_over",
+};
+
+static uint32_t failures;
+static uint32_t rng = 1;
+
+
+int
+main()
+{
+  check_pixels();
+  check_kernels();
+  bench();
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+/* Green takes every pair of its 64 values. Red and blue follow it in two
+ * ways that each give every pair of their 32 values.
+ */
+static void
+check_pixels()
+{
+  double max_error[3] = { 0 };
+  uint32_t inexact = 0;
+  uint32_t blends = 0;
+  int g1, g2, way, alpha;
+
+  for (way = 0; way < 2; ++way) {
+    for (g1 = 0; g1 < 64; ++g1) {
+      for (g2 = 0; g2 < 64; ++g2) {
+        uint16_t fg, bg;
+
+        if (way == 0) {
+          fg = RGB(g1 % 32, g1, (g1 * 7) % 32);
+          bg = RGB(g2 % 32, g2, (g2 * 7) % 32);
+        }
+        else {
+          fg = RGB(31 - (g1 % 32), g1, ((g1 * 13) + 5) % 32);
+          bg = RGB(31 - (g2 % 32), g2, ((g2 * 13) + 5) % 32);
+        }
+
+        for (alpha = 0; alpha < 256; ++alpha) {
+          uint16_t c = blend_pixel(fg, bg, alpha);
+          double e[3];
+          int i;
+
+          e[0] = component_error(RED(c), RED(fg), RED(bg), alpha);
+          e[1] = component_error(GREEN(c), GREEN(fg), GREEN(bg), alpha);
+          e[2] = component_error(BLUE(c), BLUE(fg), BLUE(bg), alpha);
+          for (i = 0; i < 3; ++i) {
+            if (e[i] > max_error[i])
+              max_error[i] = e[i];
+          }
+
+          if (((alpha == 0) && (c != bg)) || ((alpha == 255) && (c != fg)))
+            inexact++;
+          blends++;
+        }
+      }
+    }
+  }
+
+  printf("%u blends, worst error red %.3f green %.3f blue %.3f\n", (unsigned)blends,
+      max_error[0], max_error[1], max_error[2]);
+  check((max_error[0] <= MAX_ERROR) && (max_error[1] <= MAX_ERROR) && (max_error[2] <= MAX_ERROR),
+      "every component is within MAX_ERROR of the reference");
+  check(inexact == 0, "alpha 0 and 255 give the background and foreground exactly");
+}
+
+static double
+component_error(int result, int fg, int bg, uint8_t alpha)
+{
+  double ref = ((fg * alpha) / 255.0) + ((bg * (255 - alpha)) / 255.0);
+
+  return fabs(result - ref);
+}
+
+static void
+check_kernels()
+{
+  uint16_t buf[GUARD_LEN + 1 + MAX_ROW_LEN + GUARD_LEN] __attribute__((aligned(4)));
+  uint16_t old[MAX_ROW_LEN];
+  uint16_t px[MAX_ROW_LEN];
+  uint8_t alpha[MAX_ROW_LEN];
+  uint32_t wrong[NUM_KERNELS] = { 0 };
+  uint32_t outside[NUM_KERNELS] = { 0 };
+  kernel_t k;
+  int start, n, row, i;
+
+  for (k = 0; k < NUM_KERNELS; ++k) {
+    for (start = GUARD_LEN; start <= (GUARD_LEN + 1); ++start) {
+      for (n = 0; n <= MAX_ROW_LEN; ++n) {
+        for (row = 0; row < ROWS_PER_LEN; ++row) {
+          uint16_t fcolor = random_u32();
+          uint16_t bcolor = random_u32();
+          uint16_t* dst = &buf[start];
+
+          random_alpha(alpha, n, (row % 2) == 0);
+          for (i = 0; i < n; ++i) {
+            old[i] = random_u32();
+            px[i] = random_u32();
+          }
+
+          for (i = 0; i < (int)(sizeof(buf) / sizeof(buf[0])); ++i)
+            buf[i] = GUARD_PX;
+          memcpy(dst, old, n * sizeof(uint16_t));
+
+          run_kernel(k, dst, px, alpha, n, fcolor, bcolor);
+
+          for (i = 0; i < n; ++i) {
+            if (dst[i] != expected_px(k, old[i], px[i], alpha[i], fcolor, bcolor))
+              wrong[k]++;
+          }
+          for (i = 0; i < (int)(sizeof(buf) / sizeof(buf[0])); ++i) {
+            if (((i < start) || (i >= (start + n))) && (buf[i] != GUARD_PX))
+              outside[k]++;
+          }
+        }
+      }
+    }
+
+    printf("%-16s %u rows, %u wrong pixels, %u written outside the row\n", kernel_names[k],
+        (unsigned)(2 * (MAX_ROW_LEN + 1) * ROWS_PER_LEN), (unsigned)wrong[k],
+        (unsigned)outside[k]);
+    check(wrong[k] == 0, "the kernel gives blend_pixel()'s pixels");
+    check(outside[k] == 0, "the kernel writes only its row");
+  }
+}
+
+static void
+run_kernel(kernel_t k, uint16_t* dst, const uint16_t* px, const uint8_t* alpha,
+    int n, uint16_t fcolor, uint16_t bcolor)
+{
+  switch (k) {
+  case KERNEL_FILL:
+    blend_fill(dst, fcolor, n);
+    break;
+
+  case KERNEL_SOLID:
+    blend_solid(dst, alpha, n, fcolor, bcolor);
+    break;
+
+  case KERNEL_OVER:
+    blend_over(dst, alpha, n, fcolor);
+    break;
+
+  default:
+    blend_rgba_over(dst, px, alpha, n);
+    break;
+  }
+}
+
+static uint16_t
+expected_px(kernel_t k, uint16_t old, uint16_t px, uint8_t alpha,
+    uint16_t fcolor, uint16_t bcolor)
+{
+  switch (k) {
+  case KERNEL_FILL:
+    return fcolor;
+
+  case KERNEL_SOLID:
+    return blend_pixel(fcolor, bcolor, alpha);
+
+  case KERNEL_OVER:
+    return blend_pixel(fcolor, old, alpha);
+
+  default:
+    return blend_pixel(px, old, alpha);
+  }
+}
+
+static void
+bench()
+{
+  static uint16_t dst[BENCH_ROW_LEN] __attribute__((aligned(4)));
+  static uint16_t px[BENCH_ROW_LEN];
+  static uint8_t alpha[2][BENCH_ROW_LEN];
+  static const char* alpha_names[2] = { "glyph edges", "all partial" };
+  volatile uint16_t sink = 0;
+  kernel_t k;
+  int a, i;
+
+  for (i = 0; i < BENCH_ROW_LEN; ++i)
+    px[i] = random_u32();
+  random_alpha(alpha[0], BENCH_ROW_LEN, true);
+  for (i = 0; i < BENCH_ROW_LEN; ++i)
+    alpha[1][i] = 1 + (random_u32() % 254);
+
+  printf("%-16s %-12s %10s %10s\n", "kernel", "alpha", "cyc/px", "Mpx/s");
+  for (k = 0; k < NUM_KERNELS; ++k) {
+    for (a = 0; a < 2; ++a) {
+      uint64_t start_cycles = sim_cycles();
+      double start = sim_wall_clock();
+      double secs;
+      uint64_t cycles;
+
+      for (i = 0; i < BENCH_ROWS; ++i) {
+        run_kernel(k, dst, px, alpha[a], BENCH_ROW_LEN, i, ~i);
+        sink ^= dst[i % BENCH_ROW_LEN];
+      }
+      cycles = sim_cycles() - start_cycles;
+      secs = sim_wall_clock() - start;
+
+      printf("%-16s %-12s %10.2f %10.1f\n", kernel_names[k],
+          (k == KERNEL_FILL) ? "none" : alpha_names[a],
+          (double)cycles / ((double)BENCH_ROWS * BENCH_ROW_LEN),
+          ((double)BENCH_ROWS * BENCH_ROW_LEN) / secs / 1e6);
+
+      /* Filling takes no alpha */
+      if (k == KERNEL_FILL)
+        break;
+    }
+  }
+  (void)sink;
+}
+
+/* With edges, alpha in runs of 0 and 255 with a few values in between, as
+ * in a glyph's row; without, any value.
+ */
+static void
+random_alpha(uint8_t* alpha, int n, bool edges)
+{
+  int i = 0;
+
+  while (i < n) {
+    uint32_t r = random_u32();
+    int run = 1 + (r % 12);
+
+    for (; (run > 0) && (i < n); --run, ++i) {
+      if (!edges)
+        alpha[i] = random_u32();
+      else if (((r >> 8) % 3) == 0)
+        alpha[i] = 0;
+      else if (((r >> 8) % 3) == 1)
+        alpha[i] = 255;
+      else
+        alpha[i] = random_u32();
+    }
+  }
+}
+
+static uint32_t
+random_u32()
+{
+  uint32_t hi;
+
+  rng = (rng * 1103515245) + 12345;
+  hi = rng & 0xFFFF0000;
+  rng = (rng * 1103515245) + 12345;
+
+  return hi | (rng >> 16);
+}
+
+static void
+check(bool ok, const char* what)
+{
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
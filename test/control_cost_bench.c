@@ -0,0 +1,103 @@
+/* Host benchmark of the control loop's cost per sample period
+ * (src/app_mt/temp_control.c) as channels are added.
+ *
+ * It is built once for each channel count in the Makefile, with
+ * NUM_SENSORS, NUM_CONTROLLERS and NUM_OUTPUTS all set to it. Controller n
+ * reads sensor n and drives output n, heating or cooling in turn. A tick
+ * is one sample from every sensor, with the relay timers that come due
+ * before the next. The ticks are timed, and the controller settings
+ * lookups counted as a measure of the loop's work that doesn't depend on
+ * the host. It fails if that work per channel grows with the channel
+ * count.
+ */
+
+#include "message.h"
+#include "sensor.h"
+#include "temp_control.h"
+#include "control_stubs.h"
+#include "sim.h"
+
+#include <stdio.h>
+
+
+#define NUM_TICKS           20000
+#define WARMUP_TICKS        600       // past the first cycle delay
+#define SAMPLE_PERIOD_MS    1000
+
+/* Settings lookups per channel per tick, about 3 in any build */
+#define READS_PER_CHANNEL   4
+
+
+static void tick(uint32_t n);
+
+
+
+
+int
+main()
+{
+  double start, elapsed;
+  uint32_t reads;
+  uint32_t i;
+
+  sim_init();
+  msg_init();
+  control_stubs_init();
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    controller_settings_t* cs = control_stubs_controller_settings(i);
+
+    cs->output_settings[i].enabled = true;
+    cs->output_settings[i].function = (i % 2) ? OUTPUT_FUNC_COOLING : OUTPUT_FUNC_HEATING;
+  }
+  temp_control_init();
+
+  for (i = 0; i < WARMUP_TICKS; ++i)
+    tick(i);
+
+  reads = control_stubs_settings_reads();
+  start = sim_wall_clock();
+  for (i = 0; i < NUM_TICKS; ++i)
+    tick(WARMUP_TICKS + i);
+  elapsed = sim_wall_clock() - start;
+  reads = control_stubs_settings_reads() - reads;
+
+  printf("%d channels: %.2f us per tick, %.0f ns per channel, %.1f settings reads per channel\n",
+      NUM_CONTROLLERS,
+      (elapsed * 1e6) / NUM_TICKS,
+      (elapsed * 1e9) / (NUM_TICKS * NUM_CONTROLLERS),
+      (double)reads / (NUM_TICKS * NUM_CONTROLLERS));
+
+  if (reads > ((uint32_t)NUM_TICKS * NUM_CONTROLLERS * READS_PER_CHANNEL)) {
+    printf("FAILED: over %d settings reads per channel per tick\n", READS_PER_CHANNEL);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+/* Every sensor wanders around the setpoint, each out of phase with the
+ * others, so the relays keep switching.
+ */
+static void
+tick(uint32_t n)
+{
+  int i;
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    float offset = (float)(((n + (i * 37)) % 240) - 120) / 60;
+    sensor_msg_t msg = {
+        .sensor = i,
+        .sample = {
+            .value = 68 + ((offset < 0) ? -offset : offset) - 1,
+            .unit = UNIT_TEMP_DEG_F
+        },
+        .timestamp = chTimeNow(),
+        .seq = n,
+        .sample_period = SAMPLE_PERIOD_MS
+    };
+
+    msg_publish(MSG_SENSOR_SAMPLE, i, &msg, sizeof(msg));
+  }
+  chThdSleepMilliseconds(SAMPLE_PERIOD_MS);
+}
@@ -0,0 +1,131 @@
+#include "control_stubs.h"
+#include "app_cfg.h"
+#include "thread_watchdog.h"
+
+#include <string.h>
+
+
+#define NUM_TEMP_PROFILES   4
+
+
+static output_ctrl_t control_mode;
+static quantity_t hysteresis;
+static controller_settings_t controller_settings[NUM_CONTROLLERS];
+static temp_profile_t temp_profiles[NUM_TEMP_PROFILES];
+static temp_profile_checkpoint_t checkpoints[NUM_CONTROLLERS];
+static uint32_t settings_reads;
+
+
+void
+control_stubs_init()
+{
+  int i, j;
+
+  control_mode = PID;
+  hysteresis.value = 1;
+  hysteresis.unit = UNIT_TEMP_DEG_F;
+
+  memset(controller_settings, 0, sizeof(controller_settings));
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    controller_settings_t* cs = &controller_settings[i];
+
+    cs->controller = i;
+    cs->sensor = (i < NUM_SENSORS) ? (sensor_id_t)i : SENSOR_NONE;
+    cs->setpoint_type = SP_STATIC;
+    cs->static_setpoint.value = 68;
+    cs->static_setpoint.unit = UNIT_TEMP_DEG_F;
+    for (j = 0; j < NUM_OUTPUTS; ++j) {
+      cs->output_settings[j].function = OUTPUT_FUNC_HEATING;
+      cs->output_settings[j].cycle_delay.value = 3;
+      cs->output_settings[j].cycle_delay.unit = UNIT_TIME_MIN;
+    }
+    pid_get_default_settings(&cs->pid_settings);
+  }
+
+  memset(temp_profiles, 0, sizeof(temp_profiles));
+  memset(checkpoints, 0, sizeof(checkpoints));
+  settings_reads = 0;
+}
+
+controller_settings_t*
+control_stubs_controller_settings(temp_controller_id_t controller)
+{
+  return &controller_settings[controller];
+}
+
+uint32_t
+control_stubs_settings_reads()
+{
+  return settings_reads;
+}
+
+output_ctrl_t
+app_cfg_get_control_mode()
+{
+  return control_mode;
+}
+
+void
+app_cfg_set_control_mode(output_ctrl_t mode)
+{
+  control_mode = mode;
+}
+
+quantity_t
+app_cfg_get_hysteresis()
+{
+  return hysteresis;
+}
+
+void
+app_cfg_set_hysteresis(quantity_t q)
+{
+  hysteresis = q;
+}
+
+const controller_settings_t*
+app_cfg_get_controller_settings(temp_controller_id_t controller)
+{
+  settings_reads++;
+  return &controller_settings[controller];
+}
+
+void
+app_cfg_set_pid_settings(temp_controller_id_t controller, const pid_settings_t* settings)
+{
+  controller_settings[controller].pid_settings = *settings;
+}
+
+const temp_profile_t*
+app_cfg_get_temp_profile(uint32_t temp_profile_id)
+{
+  return &temp_profiles[temp_profile_id % NUM_TEMP_PROFILES];
+}
+
+void
+app_cfg_set_temp_profile(const temp_profile_t* profile, uint32_t index)
+{
+  temp_profiles[index % NUM_TEMP_PROFILES] = *profile;
+}
+
+const temp_profile_checkpoint_t*
+app_cfg_get_temp_profile_checkpoint(temp_controller_id_t controller)
+{
+  return &checkpoints[controller];
+}
+
+void
+app_cfg_set_temp_profile_checkpoint(temp_controller_id_t controller, temp_profile_checkpoint_t* checkpoint)
+{
+  checkpoints[controller] = *checkpoint;
+}
+
+void
+thread_watchdog_enable(Thread* tp, systime_t period)
+{
+}
+
+void
+thread_watchdog_kick()
+{
+}
@@ -0,0 +1,23 @@
+#ifndef CONTROL_STUBS_H
+#define CONTROL_STUBS_H
+
+#include "temp_control.h"
+#include "temp_profile.h"
+
+/* Stand-ins for app_cfg and the thread watchdog around the control loop
+ * (temp_control.c) under test. Settings live in RAM and start out as
+ * app_cfg's defaults: controller n reads sensor n and drives nothing.
+ */
+
+void
+control_stubs_init(void);
+
+/* Settings of a controller, for the test to change before it sends them */
+controller_settings_t*
+control_stubs_controller_settings(temp_controller_id_t controller);
+
+/* Number of calls to app_cfg_get_controller_settings() so far */
+uint32_t
+control_stubs_settings_reads(void);
+
+#endif
@@ -0,0 +1,340 @@
+/* Host benchmark of the probe filter chains (src/app_mt/sensor_filter.c),
+ * replaying sensor traces through each chain as sensor.c does.
+ *
+ * The built-in trace is a fermenter probe read once a second: a hold at
+ * 68 F, a 4 F/h ramp and a slow swing, with gaussian noise, the DS18B20's
+ * 1/16 C steps and 0.5% of reads glitched by 60 F. Against the true
+ * temperature it measures each chain's rms and worst error, its lag on a
+ * clean ramp, how well it tracks the ramp's rate and its time per sample.
+ * It fails if a chain is over its limits.
+ *
+ *   filter_bench [replay.bin]
+ *
+ * also replays a sensor replay partition image, as built by
+ * scripts/build_replay_trace.py from a recorded trace. A recording has no
+ * true temperature, so each probe's chain output is measured against a
+ * centered (non causal) average of its median filtered samples.
+ */
+
+#include "sensor_filter.h"
+#include "sensor_replay.h"
+#include "common.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+#define TRACE_SAMPLES       20000
+#define SAMPLE_PERIOD_S     1.0f
+#define SETTLE_SAMPLES      100       // left out of the error, the chains are filling
+#define RAMP_SAMPLES        3000
+#define RAMP_RATE           4.0f      // deg F per hour
+#define NUM_TIMED_RUNS      50
+
+#define REF_HALF_WIDTH      15        // samples either side in a recording's reference
+
+
+typedef struct {
+  const char* name;
+  bool is_default;          // sensor_filter_get_default_settings()
+  filter_stage_settings_t stages[FILTER_MAX_STAGES];
+
+  /* Limits on the built-in trace, none if 0 */
+  float max_rms;            // deg F
+  float max_error;          // deg F
+  float max_lag;            // s
+  float max_rate_error;     // deg F/h rms
+} chain_t;
+
+typedef struct {
+  float* values;
+  float* times;             // s
+  uint32_t num_samples;
+} trace_t;
+
+
+static void run_chain(const chain_t* c);
+static void replay_image(const char* path);
+static void replay_sensor(const trace_t* t);
+static void chain_settings(const chain_t* c, sensor_filter_settings_t* settings);
+static void make_trace(void);
+static float quantize(float value);
+static float gauss(void);
+
+
+static const chain_t chains[] = {
+    {
+      .name = "mean 10, no spike rejection",
+      .stages = { { .type = FILTER_MEAN, .taps = 10 } },
+    },
+    {
+      .name = "median 3 + mean 10 (default)",
+      .is_default = true,
+      .max_rms = 0.05f, .max_error = 0.25f, .max_lag = 10
+    },
+    {
+      .name = "median 5",
+      .stages = { { .type = FILTER_MEDIAN, .taps = 5 } },
+      .max_rms = 0.08f, .max_error = 0.4f, .max_lag = 5
+    },
+    {
+      .name = "median 3 + ema 0.2",
+      .stages = {
+          { .type = FILTER_MEDIAN, .taps = 3 },
+          { .type = FILTER_EMA, .alpha = 0.2f }
+      },
+      .max_rms = 0.05f, .max_error = 0.25f, .max_lag = 10
+    },
+    {
+      .name = "median 3 + kalman",
+      .stages = {
+          { .type = FILTER_MEDIAN, .taps = 3 },
+          { .type = FILTER_KALMAN, .process_noise = 1e-7f, .measurement_noise = 0.012f }
+      },
+      .max_rms = 0.04f, .max_error = 0.2f, .max_lag = 6, .max_rate_error = 4
+    },
+};
+
+static float truth[TRACE_SAMPLES];
+static float samples[TRACE_SAMPLES];
+static float output[TRACE_SAMPLES];
+static uint32_t rng = 1;
+static uint32_t failures;
+
+
+int
+main(int argc, char** argv)
+{
+  uint32_t i;
+
+  sim_init();
+  make_trace();
+
+  printf("%-30s %8s %8s %8s %10s %10s\n",
+      "built-in trace", "rms F", "max F", "lag s", "rate F/h", "ns/sample");
+  for (i = 0; i < (sizeof(chains) / sizeof(chains[0])); ++i)
+    run_chain(&chains[i]);
+
+  if (argc > 1)
+    replay_image(argv[1]);
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+static void
+run_chain(const chain_t* c)
+{
+  sensor_filter_settings_t settings;
+  sensor_filter_t f;
+  double sum_sq = 0, max_error = 0, lag_sum = 0, rate_sum_sq = 0;
+  double start, elapsed;
+  uint32_t i, n;
+
+  chain_settings(c, &settings);
+
+  start = sim_wall_clock();
+  for (n = 0; n < NUM_TIMED_RUNS; ++n) {
+    sensor_filter_init(&f, &settings);
+    for (i = 0; i < TRACE_SAMPLES; ++i)
+      output[i] = sensor_filter_apply(&f, samples[i], SAMPLE_PERIOD_S);
+  }
+  elapsed = sim_wall_clock() - start;
+
+  for (i = SETTLE_SAMPLES; i < TRACE_SAMPLES; ++i) {
+    double e = output[i] - truth[i];
+    sum_sq += e * e;
+    if (fabs(e) > max_error)
+      max_error = fabs(e);
+  }
+
+  /* Lag and rate on a noisy ramp without glitches, once the chain has
+   * caught up with it
+   */
+  sensor_filter_init(&f, &settings);
+  for (i = 0, n = 0; i < RAMP_SAMPLES; ++i) {
+    float t = 68 + ((i * SAMPLE_PERIOD_S * RAMP_RATE) / 3600);
+    float out = sensor_filter_apply(&f, t + (0.1f * gauss()), SAMPLE_PERIOD_S);
+
+    if (i >= (RAMP_SAMPLES / 3)) {
+      double rate_error = (sensor_filter_get_rate(&f) * 3600) - RAMP_RATE;
+      lag_sum += t - out;
+      rate_sum_sq += rate_error * rate_error;
+      n++;
+    }
+  }
+
+  float rms = sqrt(sum_sq / (TRACE_SAMPLES - SETTLE_SAMPLES));
+  float lag = ((lag_sum / n) * 3600) / RAMP_RATE;
+  float rate_rms = sqrt(rate_sum_sq / n);
+
+  printf("%-30s %8.3f %8.3f %8.1f %10.2f %10.1f\n", c->name, rms, max_error, lag,
+      rate_rms, (elapsed * 1e9) / (NUM_TIMED_RUNS * TRACE_SAMPLES));
+
+  if ((c->max_rms > 0 && rms > c->max_rms) ||
+      (c->max_error > 0 && max_error > c->max_error) ||
+      (c->max_lag > 0 && fabsf(lag) > c->max_lag) ||
+      (c->max_rate_error > 0 && rate_rms > c->max_rate_error)) {
+    printf("FAIL: %s is over its limits (rms %.2f, max %.2f, lag %.0f s, rate %.1f F/h)\n",
+        c->name, c->max_rms, c->max_error, c->max_lag, c->max_rate_error);
+    failures++;
+  }
+}
+
+static void
+chain_settings(const chain_t* c, sensor_filter_settings_t* settings)
+{
+  if (c->is_default)
+    sensor_filter_get_default_settings(settings);
+  else
+    memcpy(settings->stages, c->stages, sizeof(settings->stages));
+}
+
+/* Splits a partition image into one trace per probe and replays each */
+static void
+replay_image(const char* path)
+{
+  sensor_replay_hdr_t hdr;
+  sensor_replay_record_t rec;
+  trace_t traces[256];
+  uint32_t i;
+  FILE* fp = fopen(path, "rb");
+
+  if (fp == NULL ||
+      fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      hdr.magic != SENSOR_REPLAY_MAGIC) {
+    printf("FAIL: %s is not a sensor replay image\n", path);
+    failures++;
+    if (fp != NULL)
+      fclose(fp);
+    return;
+  }
+
+  memset(traces, 0, sizeof(traces));
+  for (i = 0; i < hdr.num_records && fread(&rec, sizeof(rec), 1, fp) == 1; ++i) {
+    trace_t* t = &traces[rec.sensor];
+
+    t->values = realloc(t->values, (t->num_samples + 1) * sizeof(float));
+    t->times = realloc(t->times, (t->num_samples + 1) * sizeof(float));
+    t->values[t->num_samples] = rec.value;
+    t->times[t->num_samples] = rec.time / 1000.0f;
+    t->num_samples++;
+  }
+  fclose(fp);
+
+  for (i = 0; i < 256; ++i) {
+    if (traces[i].num_samples == 0)
+      continue;
+
+    printf("\n%s, probe %u: %u samples over %.1f h\n", path, (unsigned)i,
+        (unsigned)traces[i].num_samples,
+        traces[i].times[traces[i].num_samples - 1] / 3600);
+    replay_sensor(&traces[i]);
+    free(traces[i].values);
+    free(traces[i].times);
+  }
+}
+
+static void
+replay_sensor(const trace_t* t)
+{
+  sensor_filter_settings_t median;
+  sensor_filter_t f;
+  float* ref = malloc(t->num_samples * sizeof(float));
+  float* filtered = malloc(t->num_samples * sizeof(float));
+  uint32_t i, j, c;
+
+  /* The reference: a median of 3 to drop glitches, then a centered mean */
+  memset(&median, 0, sizeof(median));
+  median.stages[0].type = FILTER_MEDIAN;
+  median.stages[0].taps = 3;
+  sensor_filter_init(&f, &median);
+  for (i = 0; i < t->num_samples; ++i)
+    filtered[i] = sensor_filter_apply(&f, t->values[i], 0);
+
+  for (i = 0; i < t->num_samples; ++i) {
+    uint32_t first = (i > REF_HALF_WIDTH) ? (i - REF_HALF_WIDTH) : 0;
+    uint32_t last = ((i + REF_HALF_WIDTH) < t->num_samples) ? (i + REF_HALF_WIDTH) : (t->num_samples - 1);
+    double sum = 0;
+
+    for (j = first; j <= last; ++j)
+      sum += filtered[j];
+    ref[i] = sum / ((last - first) + 1);
+  }
+
+  printf("%-30s %8s %8s %10s\n", "against the reference", "rms F", "max F", "ns/sample");
+  for (c = 0; c < (sizeof(chains) / sizeof(chains[0])); ++c) {
+    sensor_filter_settings_t settings;
+    double sum_sq = 0, max_error = 0, start, elapsed;
+    uint32_t n = 0;
+
+    chain_settings(&chains[c], &settings);
+    sensor_filter_init(&f, &settings);
+
+    start = sim_wall_clock();
+    for (i = 0; i < t->num_samples; ++i) {
+      float dt = (i > 0) ? (t->times[i] - t->times[i - 1]) : 0;
+      filtered[i] = sensor_filter_apply(&f, t->values[i], dt);
+    }
+    elapsed = sim_wall_clock() - start;
+
+    for (i = MIN(SETTLE_SAMPLES, t->num_samples / 2); i < t->num_samples; ++i, ++n) {
+      double e = filtered[i] - ref[i];
+      sum_sq += e * e;
+      if (fabs(e) > max_error)
+        max_error = fabs(e);
+    }
+
+    printf("%-30s %8.3f %8.3f %10.1f\n", chains[c].name, sqrt(sum_sq / MAX(n, 1)),
+        max_error, (elapsed * 1e9) / t->num_samples);
+  }
+
+  free(ref);
+  free(filtered);
+}
+
+static void
+make_trace()
+{
+  uint32_t i;
+
+  for (i = 0; i < TRACE_SAMPLES; ++i) {
+    float t = i * SAMPLE_PERIOD_S;
+    float ramp = (t > 5000) ? ((MIN(t - 5000, 3600) * RAMP_RATE) / 3600) : 0;
+
+    truth[i] = 68 + ramp + (0.3f * sinf(t / 900));
+    samples[i] = quantize(truth[i] + (0.1f * gauss()));
+
+    /* A bad read */
+    rng = (rng * 1103515245) + 12345;
+    if (((rng >> 16) % 200) == 0)
+      samples[i] += ((rng >> 24) & 1) ? 60 : -60;
+  }
+}
+
+/* To the DS18B20's 1/16 C at 12 bits, in deg F */
+static float
+quantize(float value)
+{
+  return roundf(value / 0.1125f) * 0.1125f;
+}
+
+static float
+gauss()
+{
+  float u, v;
+
+  rng = (rng * 1103515245) + 12345;
+  u = (((rng >> 16) & 0x7FFF) + 1.0f) / 0x8001;
+  rng = (rng * 1103515245) + 12345;
+  v = (((rng >> 16) & 0x7FFF) + 1.0f) / 0x8001;
+
+  return sqrtf(-2 * logf(u)) * cosf(2 * (float)M_PI * v);
+}
@@ -0,0 +1,238 @@
+/* Host benchmark of text drawing through the glyph cache (glyph_cache.c)
+ * over a GUI session on the virtual LCD.
+ *
+ * The home screen shows two channels, each with its reading in the 62 px
+ * font over the channel's colour. Samples come in for both every frame and
+ * walk through every digit, the outputs are switched now and then, and the
+ * settings screen is visited half way. For each part of the session it
+ * reports the characters drawn in the large font and the others, the host
+ * CPU cycles per character spent in gfx_draw_str(), and the hits, misses
+ * and evictions of the blended glyphs (glyph_cache_get_stats()) and of the
+ * large glyphs' alpha (glyph_cache_get_alpha_stats()). Damage is painted a
+ * band of rows at a time, so a character is counted for every band it is
+ * drawn in. It fails if a large digit misses once the warm up has drawn the
+ * digit set, or if the hit rate over the session is under MIN_HIT_RATE.
+ */
+
+#include "gfx.h"
+#include "glyph_cache.h"
+#include "gui.h"
+#include "gui/home.h"
+#include "gui/settings.h"
+#include "message.h"
+#include "sensor.h"
+#include "temp_control.h"
+#include "sim.h"
+
+#include <stdio.h>
+
+
+#define FRAME_MS            250       // at least one 100 ms paint
+#define MIN_HIT_RATE        0.9f
+
+
+typedef struct {
+  uint32_t large_chars;
+  uint32_t small_chars;
+  uint64_t large_cycles;
+  uint64_t small_cycles;
+  uint32_t large_misses;
+} text_stats_t;
+
+
+const glyph_t* __real_font_find_glyph(const font_t* font, char ch);
+void __real_gfx_draw_str(const char* str, int n, int x, int y);
+uint8_t* __real_glyph_cache_get_alpha(const glyph_t* g, bool* filled);
+
+static void begin_part(void);
+static void end_part(const char* name, uint32_t frames);
+static void run_samples(uint32_t frames);
+static void publish_sample(sensor_id_t sensor, float value);
+static void publish_output(output_id_t output, bool enabled);
+static void check(bool ok, const char* what);
+
+
+static uint32_t failures;
+static uint32_t frame;
+static bool drawing_large;
+static text_stats_t text;
+static glyph_cache_stats_t part_start;
+static glyph_cache_stats_t part_start_alpha;
+
+
+int
+main()
+{
+  glyph_cache_stats_t cs, ca;
+  uint32_t hits, lookups;
+
+  sim_init();
+  msg_init();
+  gfx_init();
+  lcd_init();
+  gui_init();
+  // let the GUI thread start up
+  chThdSleepMilliseconds(1);
+
+  printf("%-24s %6s %7s %7s %9s %9s %17s %17s\n", "", "", "", "", "", "",
+      "blended", "large alpha");
+  printf("%-24s %6s %7s %7s %9s %9s %5s %5s %5s %5s %5s %5s\n", "part", "frames", "62 px",
+      "others", "cyc/62px", "cyc/other", "hits", "miss", "evict", "hits", "miss", "evict");
+
+  begin_part();
+  gui_push_screen(home_screen_create());
+  publish_sample(SENSOR_1, 64.0f);
+  publish_sample(SENSOR_2, 35.0f);
+  chThdSleepMilliseconds(FRAME_MS);
+  end_part("home, first paint", 1);
+
+  /* Ten frames bring in every digit on both channels */
+  begin_part();
+  run_samples(10);
+  end_part("warm up", 10);
+
+  begin_part();
+  run_samples(200);
+  end_part("samples", 200);
+  check(text.large_misses == 0, "the large digits stay in the cache");
+
+  begin_part();
+  gui_push_screen(settings_screen_create());
+  chThdSleepMilliseconds(FRAME_MS);
+  gui_pop_screen();
+  chThdSleepMilliseconds(FRAME_MS);
+  end_part("settings and back", 2);
+
+  begin_part();
+  run_samples(100);
+  end_part("samples after settings", 100);
+  check(text.large_misses == 0, "the large digits stay in the cache");
+
+  glyph_cache_get_stats(&cs);
+  glyph_cache_get_alpha_stats(&ca);
+  hits = cs.hits + ca.hits;
+  lookups = hits + cs.misses + ca.misses;
+  printf("session: hit rate %.3f, %u bytes blended, %u bytes of alpha\n",
+      (double)hits / lookups, (unsigned)cs.bytes, (unsigned)ca.bytes);
+  check(hits >= (MIN_HIT_RATE * lookups), "the session hits the cache");
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+/* A reading every frame on both channels, channel 1 rising through 64-68.9
+ * and channel 2 falling through 35-32.1, with an output switched every 20
+ * frames.
+ */
+static void
+run_samples(uint32_t frames)
+{
+  uint32_t i;
+
+  for (i = 0; i < frames; ++i, ++frame) {
+    publish_sample(SENSOR_1, (640 + (frame % 50)) / 10.0f);
+    publish_sample(SENSOR_2, (350 - (frame % 30)) / 10.0f);
+    if ((frame % 20) == 0)
+      publish_output(OUTPUT_1, ((frame / 20) % 2) == 0);
+    chThdSleepMilliseconds(FRAME_MS);
+  }
+}
+
+static void
+begin_part()
+{
+  text = (text_stats_t){ 0 };
+  glyph_cache_get_stats(&part_start);
+  glyph_cache_get_alpha_stats(&part_start_alpha);
+}
+
+static void
+end_part(const char* name, uint32_t frames)
+{
+  glyph_cache_stats_t cs, ca;
+
+  glyph_cache_get_stats(&cs);
+  glyph_cache_get_alpha_stats(&ca);
+
+  printf("%-24s %6u %7u %7u %9.0f %9.0f %5u %5u %5u %5u %5u %5u\n", name, (unsigned)frames,
+      (unsigned)text.large_chars, (unsigned)text.small_chars,
+      text.large_chars ? (double)text.large_cycles / text.large_chars : 0.0,
+      text.small_chars ? (double)text.small_cycles / text.small_chars : 0.0,
+      (unsigned)(cs.hits - part_start.hits), (unsigned)(cs.misses - part_start.misses),
+      (unsigned)(cs.evictions - part_start.evictions),
+      (unsigned)(ca.hits - part_start_alpha.hits), (unsigned)(ca.misses - part_start_alpha.misses),
+      (unsigned)(ca.evictions - part_start_alpha.evictions));
+}
+
+/* gfx_draw_str() looks up each character it draws, all in one font */
+const glyph_t*
+__wrap_font_find_glyph(const font_t* font, char ch)
+{
+  drawing_large = (font == font_opensans_regular_62);
+  if (drawing_large)
+    text.large_chars++;
+  else
+    text.small_chars++;
+
+  return __real_font_find_glyph(font, ch);
+}
+
+void
+__wrap_gfx_draw_str(const char* str, int n, int x, int y)
+{
+  uint64_t start = sim_cycles();
+
+  __real_gfx_draw_str(str, n, x, y);
+
+  if (drawing_large)
+    text.large_cycles += sim_cycles() - start;
+  else
+    text.small_cycles += sim_cycles() - start;
+}
+
+uint8_t*
+__wrap_glyph_cache_get_alpha(const glyph_t* g, bool* filled)
+{
+  uint8_t* alpha = __real_glyph_cache_get_alpha(g, filled);
+
+  if ((alpha == NULL) || !*filled)
+    text.large_misses++;
+
+  return alpha;
+}
+
+static void
+publish_sample(sensor_id_t sensor, float value)
+{
+  sensor_msg_t msg = {
+      .sensor = sensor,
+      .sample = { .value = value, .unit = UNIT_TEMP_DEG_F },
+      .timestamp = chTimeNow(),
+  };
+
+  msg_publish(MSG_SENSOR_SAMPLE, sensor, &msg, sizeof(msg));
+}
+
+static void
+publish_output(output_id_t output, bool enabled)
+{
+  output_status_t status = {
+      .output = output,
+      .enabled = enabled,
+  };
+
+  msg_publish(MSG_OUTPUT_STATUS, output, &status, sizeof(status));
+}
+
+static void
+check(bool ok, const char* what)
+{
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
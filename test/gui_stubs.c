@@ -0,0 +1,145 @@
+#include "gui_stubs.h"
+#include "app_cfg.h"
+#include "temp_control.h"
+#include "thread_watchdog.h"
+#include "gui/calib.h"
+#include "gui/conn_status.h"
+#include "gui/controller_settings.h"
+#include "gui/history.h"
+#include "gui/info.h"
+#include "gui/quantity_select.h"
+#include "gui/update.h"
+
+
+static unit_t temp_unit = UNIT_TEMP_DEG_F;
+static output_ctrl_t control_mode = ON_OFF;
+static quantity_t hysteresis = { .value = 1, .unit = UNIT_TEMP_DEG_F };
+static controller_settings_t controller_settings[NUM_CONTROLLERS];
+static uint32_t controller_settings_reads;
+
+
+uint32_t
+gui_stubs_controller_settings_reads()
+{
+  return controller_settings_reads;
+}
+
+unit_t
+app_cfg_get_temp_unit()
+{
+  return temp_unit;
+}
+
+void
+app_cfg_set_temp_unit(unit_t unit)
+{
+  temp_unit = unit;
+}
+
+output_ctrl_t
+app_cfg_get_control_mode()
+{
+  return control_mode;
+}
+
+void
+app_cfg_set_control_mode(output_ctrl_t mode)
+{
+  control_mode = mode;
+}
+
+quantity_t
+app_cfg_get_hysteresis()
+{
+  return hysteresis;
+}
+
+void
+app_cfg_set_hysteresis(quantity_t q)
+{
+  hysteresis = q;
+}
+
+/* Controller n reads sensor n */
+const controller_settings_t*
+app_cfg_get_controller_settings(temp_controller_id_t controller)
+{
+  controller_settings_reads++;
+  controller_settings[controller].controller = controller;
+  controller_settings[controller].sensor = SENSOR_1 + controller;
+  return &controller_settings[controller];
+}
+
+float
+temp_control_get_current_setpoint(temp_controller_id_t controller)
+{
+  return 68;
+}
+
+output_ctrl_t
+temp_control_get_output_function(output_id_t output)
+{
+  return (output == OUTPUT_1) ? OUTPUT_FUNC_HEATING : OUTPUT_FUNC_COOLING;
+}
+
+void
+thread_watchdog_enable(Thread* tp, systime_t period)
+{
+}
+
+void
+thread_watchdog_kick()
+{
+}
+
+/* Screens reached by touch aren't built */
+
+widget_t*
+calib_screen_create()
+{
+  return NULL;
+}
+
+widget_t*
+conn_status_screen_create()
+{
+  return NULL;
+}
+
+widget_t*
+controller_settings_screen_create(temp_controller_id_t controller)
+{
+  return NULL;
+}
+
+widget_t*
+history_screen_create()
+{
+  return NULL;
+}
+
+widget_t*
+info_screen_create()
+{
+  return NULL;
+}
+
+widget_t*
+update_screen_create()
+{
+  return NULL;
+}
+
+widget_t*
+quantity_select_screen_create(
+    const char* title,
+    quantity_t quantity,
+    float min_value,
+    float max_value,
+    float* velocity_steps,
+    uint8_t num_velocity_steps,
+    quantity_select_cb_t cb,
+    void* cb_data)
+{
+  return NULL;
+}
@@ -0,0 +1,12 @@
+#ifndef GUI_STUBS_H
+#define GUI_STUBS_H
+
+#include <stdint.h>
+
+/* Stand-ins for the app modules around the GUI screens under test */
+
+/* Number of calls to app_cfg_get_controller_settings() so far */
+uint32_t
+gui_stubs_controller_settings_reads(void);
+
+#endif
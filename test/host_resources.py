@@ -0,0 +1,210 @@
+# Generates image_resources.[ch] and font_resources.[ch] for the host tests.
+#
+# scripts/imgconv and scripts/fontconv need pygame, which the host tests
+# don't. This writes the same structures, coded with the same asset_codec:
+# images are read from their PNGs with zlib, and fonts are stand-ins with
+# OpenSans-like metrics (a ring for every glyph, antialiased at the edges)
+# so that text costs about what it does on the device.
+#
+#   host_resources.py <out_dir> <font_specs> <png>...
+
+import os
+import sys
+import ast
+import zlib
+import struct
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', 'scripts'))
+import asset_codec
+
+
+def read_png(path):
+  """Returns (width, height, [(r, g, b, a)]) of an 8 bit RGBA PNG."""
+  with open(path, 'rb') as f:
+    data = f.read()
+
+  pos = 8
+  idat = b''
+  while pos < len(data):
+    length, kind = struct.unpack('>I4s', data[pos:pos + 8])
+    body = data[pos + 8:pos + 8 + length]
+    if kind == b'IHDR':
+      width, height, depth, color_type, _, _, interlace = struct.unpack('>IIBBBBB', body)
+      if depth != 8 or color_type != 6 or interlace != 0:
+        raise ValueError('%s: only 8 bit RGBA PNGs are supported' % path)
+    elif kind == b'IDAT':
+      idat += body
+    pos += length + 12
+
+  raw = zlib.decompress(idat)
+  stride = width * 4
+  rows = []
+  prev = bytearray(stride)
+  for y in range(height):
+    ftype = raw[y * (stride + 1)]
+    line = bytearray(raw[y * (stride + 1) + 1:(y + 1) * (stride + 1)])
+    for i in range(stride):
+      a = line[i - 4] if i >= 4 else 0
+      b = prev[i]
+      c = prev[i - 4] if i >= 4 else 0
+      if ftype == 1:
+        line[i] = (line[i] + a) & 0xFF
+      elif ftype == 2:
+        line[i] = (line[i] + b) & 0xFF
+      elif ftype == 3:
+        line[i] = (line[i] + ((a + b) >> 1)) & 0xFF
+      elif ftype == 4:
+        p = a + b - c
+        pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+        pred = a if (pa <= pb and pa <= pc) else (b if pb <= pc else c)
+        line[i] = (line[i] + pred) & 0xFF
+    rows.append(line)
+    prev = line
+
+  px = [tuple(row[x * 4:x * 4 + 4]) for row in rows for x in range(width)]
+  return width, height, px
+
+
+def c_array(values):
+  return ', '.join(str(v) for v in values)
+
+
+def write_images(out_dir, png_files):
+  h = ['#ifndef __IMAGE_RESOURCES_H__', '#define __IMAGE_RESOURCES_H__', '',
+       '#include <stdlib.h>', '#include <stdint.h>', '',
+       'typedef struct {',
+       '  const uint16_t width;',
+       '  const uint16_t height;',
+       '  const uint16_t* px;',
+       '  const uint8_t* alpha;',
+       '  const uint8_t* px_rle;',
+       '  const uint32_t* px_rows;',
+       '} Image_t;', '']
+  c = ['#include "image_resources.h"', '']
+
+  for path in sorted(png_files):
+    # only the alpha-only (.a.png) images are in the tree
+    name = os.path.basename(path).split('.')[0]
+    width, height, px = read_png(path)
+    alpha = asset_codec.encode_alpha([p[3] for p in px])
+
+    h.append('extern const Image_t* img_%s;' % name)
+    c += ['static const uint8_t img_%s_alpha[] = { %s };' % (name, c_array(bytearray(alpha))),
+          'static const Image_t _img_%s = { %d, %d, NULL, img_%s_alpha, NULL, NULL };' %
+          (name, width, height, name),
+          'const Image_t* img_%s = &_img_%s;' % (name, name), '']
+
+  h += ['', '#endif', '']
+  with open(os.path.join(out_dir, 'image_resources.h'), 'w') as f:
+    f.write('\n'.join(h))
+  with open(os.path.join(out_dir, 'image_resources.c'), 'w') as f:
+    f.write('\n'.join(c))
+
+
+def expand_charspec(charspecs):
+  char_classes = {
+    "alpha": list(range(65, 91)) + list(range(97, 123)),
+    "numeric": list(range(48, 58)),
+    "alphanumeric": list(range(48, 58)) + list(range(65, 91)) + list(range(97, 123)),
+    "symbols": list(range(33, 48)) + list(range(58, 65)) + list(range(91, 97)) + list(range(123, 127)),
+    "space": [32],
+    "degree": [176],
+    "all": list(range(32, 127))
+  }
+
+  ords = []
+  for charspec in charspecs.split(';'):
+    if charspec in char_classes:
+      ords += char_classes[charspec]
+    else:
+      ords += [ord(ch) for ch in charspec]
+  return ords
+
+
+def ring_alpha(width, height, stroke):
+  """An antialiased elliptical ring filling width x height."""
+  alpha = []
+  cx, cy = (width - 1) / 2.0, (height - 1) / 2.0
+  rx, ry = max(width / 2.0, 1), max(height / 2.0, 1)
+  for y in range(height):
+    for x in range(width):
+      # distance from the outline, in pixels
+      d = (((x - cx) / rx) ** 2 + ((y - cy) / ry) ** 2) ** 0.5
+      edge = abs(1.0 - d) * min(rx, ry)
+      a = max(0.0, min(1.0, (stroke / 2.0) + 0.5 - edge))
+      alpha.append(int(a * 255))
+  return alpha
+
+
+def font_glyphs(spec):
+  """Returns the font's name, its line height and (ord, width, height,
+  advance, [alpha]) for each of its stand-in glyphs."""
+  size = spec['font_size']
+  name = '%s_%d' % (os.path.splitext(spec['font_file'])[0].lower().replace('-', '_'), size)
+  ords = sorted(set(expand_charspec(spec['charspec']) + [ord('?')]))
+  height = int(round(size * 0.73))
+  stroke = max(1, size // 10)
+  glyphs = []
+
+  for o in ords:
+    if o == 32:
+      width, glyph_height, advance = 0, 0, int(round(size * 0.26))
+    elif o >= 97:
+      width, glyph_height, advance = int(round(size * 0.45)), int(round(size * 0.55)), int(round(size * 0.56))
+    else:
+      width, glyph_height, advance = int(round(size * 0.48)), height, int(round(size * 0.57))
+    glyphs.append((o, width, glyph_height, advance, ring_alpha(width, glyph_height, stroke)))
+
+  return name, height, glyphs
+
+
+def write_fonts(out_dir, font_specs):
+  h = ['#ifndef __FONT_RESOURCES_H__', '#define __FONT_RESOURCES_H__', '',
+       '#include <stdint.h>', '',
+       'typedef struct {',
+       '  uint8_t width;',
+       '  uint8_t height;',
+       '  int8_t xoffset;',
+       '  int8_t yoffset;',
+       '  uint8_t advance;',
+       '  const uint8_t* data;',
+       '} glyph_t;', '',
+       'typedef struct {',
+       '  uint8_t line_height;',
+       '  const glyph_t* glyphs[256];',
+       '} font_t;', '']
+  c = ['#include "font_resources.h"', '']
+
+  for spec in font_specs:
+    name, height, glyphs = font_glyphs(spec)
+    ords = [g[0] for g in glyphs]
+
+    for o, width, glyph_height, advance, alpha in glyphs:
+      data = asset_codec.encode_alpha(alpha) if width else b''
+      c += ['static const uint8_t glyph_%s_%d_data[] = { %s };' % (name, o, c_array(bytearray(data)) or '0'),
+            'static const glyph_t glyph_%s_%d = { %d, %d, %d, %d, %d, glyph_%s_%d_data };' %
+            (name, o, width, glyph_height, (advance - width) // 2, height - glyph_height, advance, name, o)]
+
+    c += ['', 'static const font_t _font_%s = {' % name,
+          '  .line_height = %d,' % height,
+          '  .glyphs = {',
+          '    [0] = &glyph_%s_63,' % name] + \
+         ['    [%d] = &glyph_%s_%d,' % (o, name, o) for o in ords] + \
+         ['  },', '};', '',
+          'const font_t* font_%s = &_font_%s;' % (name, name), '']
+    h.append('extern const font_t* font_%s;' % name)
+
+  h += ['', '#endif', '']
+  with open(os.path.join(out_dir, 'font_resources.h'), 'w') as f:
+    f.write('\n'.join(h))
+  with open(os.path.join(out_dir, 'font_resources.c'), 'w') as f:
+    f.write('\n'.join(c))
+
+
+if __name__ == "__main__":
+  out_dir = sys.argv[1]
+  with open(sys.argv[2], 'r') as f:
+    font_specs = ast.literal_eval(f.read())
+
+  write_images(out_dir, sys.argv[3:])
+  write_fonts(out_dir, font_specs)
@@ -0,0 +1,20 @@
+#ifndef LCD_BUS_H
+#define LCD_BUS_H
+
+/* Included ahead of src/app_mt/lcd.c in lcd_test. Each access to LCD_REG
+ * or LCD_RAM becomes one bus write to the test's model of the controller,
+ * and the LCD's DMA transfers target lcd_bus_ram, which the test's DMA
+ * stream writes through to the same model. It comes ahead of every source
+ * of the test, so it includes nothing that would fix the C library's
+ * feature macros before sim.c sets them.
+ */
+
+volatile unsigned short* lcd_bus_write(int rs);
+
+extern volatile unsigned short lcd_bus_ram;
+
+#define LCD_REG              (*lcd_bus_write(0))
+#define LCD_RAM              (*lcd_bus_write(1))
+#define LCD_RAM_ADDR         (&lcd_bus_ram)
+
+#endif
@@ -0,0 +1,432 @@
+/* Host test of the LCD driver (src/app_mt/lcd.c) on a model of the FSMC
+ * bus and the ILI9325 controller behind it, with the DMA stream it uses
+ * run on the virtual clock.
+ *
+ * The controller model keeps its register file and GRAM address counter,
+ * moving it through the window in the landscape entry mode lcd_init() sets
+ * up, so every pixel lands where its bus write puts it. The DMA stream
+ * writes a transfer out when it completes, taking the source as it is
+ * then, so a buffer reused before lcd_wait() shows up as wrong pixels.
+ *
+ * Covers writes short enough to go out by hand, DMA writes and fills,
+ * whole screens that have to be chunked past the 65535 transfers a stream
+ * takes, the DMA lock handed between the LCD and another DMA2 user, and a
+ * transfer error. It fails if a pixel is out of place, if the CPU writes
+ * to the bus while a transfer is on it, if a transfer isn't chunked as
+ * expected, if a transfer starts while the lock is held, or if a transfer
+ * error leaves the stream or the lock taken.
+ */
+
+#include "lcd.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+#define GRAM_WIDTH          240       // the controller's native orientation
+#define GRAM_HEIGHT         320
+#define NUM_PIXELS          (DISP_WIDTH * DISP_HEIGHT)
+#define LCD_STREAM          STM32_DMA_STREAM_ID(2, 0)
+#define MAX_CHUNK           0xFFFF
+#define BUS_WRITE_NS        50        // FSMC write cycle set up in board.c
+#define MAX_CHUNKS          8
+
+#define REG_GRAM_X          0x20
+#define REG_GRAM_Y          0x21
+#define REG_GRAM_DATA       0x22
+#define REG_WIN_X1          0x50
+#define REG_WIN_X2          0x51
+#define REG_WIN_Y1          0x52
+#define REG_WIN_Y2          0x53
+
+
+typedef struct {
+  uint8_t index;            // register selected by the last LCD_REG write
+  uint16_t regs[256];
+  uint16_t gram[GRAM_WIDTH * GRAM_HEIGHT];
+  int ax, ay;               // GRAM address counter
+
+  uint32_t reg_writes;
+  uint32_t data_writes;     // to registers other than the GRAM
+  uint32_t cpu_pixels;
+  uint32_t dma_pixels;
+  uint32_t conflicts;       // CPU writes while a transfer is on the bus
+} controller_t;
+
+typedef struct {
+  uint32_t chunks;
+  uint32_t sizes[MAX_CHUNKS];
+  uint32_t modes[MAX_CHUNKS];
+  bool busy;
+  bool inject_error;
+  uint64_t last_done;       // usec
+  uint64_t last_start;
+} dma_model_t;
+
+
+static msg_t dma_thread(void* arg);
+static msg_t lock_thread(void* arg);
+static void bus_commit(void);
+static void gram_write(uint16_t val);
+static uint16_t screen_px(int x, int y);
+static void begin_case(void);
+static void end_case(const char* name);
+static void write_window(const char* name, rect_t r, bool wait);
+static void test_chunking(void);
+static void test_lock(void);
+static void test_error(void);
+static void check(bool ok, const char* what);
+
+
+stm32_dma_stream_t sim_dma_streams[16];
+volatile uint16_t lcd_bus_ram;
+
+static controller_t lcd;
+static dma_model_t dma;
+static Semaphore dma_start;
+
+/* The bus write whose value is being stored */
+static struct {
+  bool valid;
+  int rs;
+  uint16_t val;
+} pending;
+
+static uint16_t pattern[NUM_PIXELS];
+static uint64_t lock_taken, lock_released;
+static uint32_t failures;
+
+
+volatile uint16_t*
+lcd_bus_write(int rs)
+{
+  bus_commit();
+
+  if (dma.busy)
+    lcd.conflicts++;
+
+  pending.valid = true;
+  pending.rs = rs;
+  return &pending.val;
+}
+
+bool
+dmaStreamAllocate(const stm32_dma_stream_t* dmastp, uint32_t priority,
+    stm32_dmaisr_t func, void* param)
+{
+  stm32_dma_stream_t* s = (stm32_dma_stream_t*)dmastp;
+
+  if (s->func != NULL)
+    return true;
+
+  s->func = func;
+  s->param = param;
+  return false;
+}
+
+void
+dmaStreamEnable(const stm32_dma_stream_t* dmastp)
+{
+  check(dmastp == STM32_DMA_STREAM(LCD_STREAM), "transfers use the LCD's stream");
+  check(!dma.busy, "a transfer starts on an idle stream");
+
+  if (dma.chunks < MAX_CHUNKS) {
+    dma.sizes[dma.chunks] = dmastp->ndtr;
+    dma.modes[dma.chunks] = dmastp->cr;
+  }
+  dma.chunks++;
+  dma.busy = true;
+  dma.last_start = sim_now();
+  chSemSignalI(&dma_start);
+}
+
+int
+main()
+{
+  uint32_t i;
+
+  sim_init();
+  chSemInit(&dma_start, 0);
+  chThdCreateFromHeap(NULL, 1024, HIGHPRIO, dma_thread, NULL);
+
+  for (i = 0; i < NUM_PIXELS; ++i)
+    pattern[i] = (uint16_t)((i * 2654435761u) >> 16);
+
+  lcd_init();
+  bus_commit();
+  check(sim_dma_streams[LCD_STREAM].func != NULL, "lcd_init() takes the stream");
+  check(lcd.regs[0x03] == 0x1018, "landscape entry mode");
+
+  printf("%-30s %8s %8s %8s %8s %8s\n", "case", "reg", "data", "cpu px", "dma px", "chunks");
+
+  /* Short enough to go out by hand, then through the DMA */
+  write_window("8 x 2, by hand", (rect_t){ 10, 20, 8, 2 }, true);
+  check(dma.chunks == 0, "short writes don't use the DMA");
+  write_window("100 x 10, DMA", (rect_t){ 200, 100, 100, 10 }, false);
+  check(dma.chunks == 1, "longer writes use the DMA");
+  write_window("bottom right corner", (rect_t){ DISP_WIDTH - 40, DISP_HEIGHT - 3, 40, 3 }, true);
+
+  test_chunking();
+  test_lock();
+  test_error();
+
+  check(lcd.conflicts == 0, "the CPU never writes while a transfer is on the bus");
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+/* Writes pattern into r and checks it comes out in place. Without wait,
+ * it checks that the write returns while the transfer is still going.
+ */
+static void
+write_window(const char* name, rect_t r, bool wait)
+{
+  int x, y;
+  uint32_t bad = 0;
+
+  begin_case();
+  lcd_set_cursor(r.x, r.y, r.x + r.width - 1, r.y + r.height - 1);
+  lcd_write_buf(pattern, r.width * r.height);
+  if (!wait)
+    check(dma.busy, "lcd_write_buf() returns with the transfer going");
+  lcd_wait();
+  check(!dma.busy, "lcd_wait() returns once the transfer is done");
+  end_case(name);
+
+  for (y = 0; y < r.height; ++y) {
+    for (x = 0; x < r.width; ++x) {
+      if (screen_px(r.x + x, r.y + y) != pattern[(y * r.width) + x])
+        bad++;
+    }
+  }
+  check(bad == 0, "every pixel lands in place, in order");
+  check(lcd.cpu_pixels + lcd.dma_pixels == (uint32_t)(r.width * r.height),
+      "one bus write per pixel");
+}
+
+/* A whole screen takes two chunks, written and filled */
+static void
+test_chunking()
+{
+  uint32_t i, bad = 0;
+
+  begin_case();
+  lcd_clr_cursor();
+  lcd_write_buf(pattern, NUM_PIXELS);
+  lcd_wait();
+  end_case("screen from a buffer");
+
+  for (i = 0; i < NUM_PIXELS; ++i) {
+    if (screen_px(i % DISP_WIDTH, i / DISP_WIDTH) != pattern[i])
+      bad++;
+  }
+  check(bad == 0, "a chunked buffer lands in place, in order");
+  check(dma.chunks == 2 && dma.sizes[0] == MAX_CHUNK && dma.sizes[1] == (NUM_PIXELS - MAX_CHUNK),
+      "a screen goes out in a full chunk and the rest");
+  check((dma.modes[0] & STM32_DMA_CR_PINC) && (dma.modes[1] & STM32_DMA_CR_PINC),
+      "buffers are read incrementing");
+  check((dma.modes[0] & (STM32_DMA_CR_DIR_M2M | STM32_DMA_CR_TCIE | STM32_DMA_CR_TEIE)) ==
+      (STM32_DMA_CR_DIR_M2M | STM32_DMA_CR_TCIE | STM32_DMA_CR_TEIE),
+      "memory to memory, with completion and error interrupts");
+
+  begin_case();
+  lcd_clr_cursor();
+  lcd_fill(0x1234, NUM_PIXELS);
+  lcd_wait();
+  end_case("screen fill");
+
+  for (i = 0, bad = 0; i < NUM_PIXELS; ++i) {
+    if (screen_px(i % DISP_WIDTH, i / DISP_WIDTH) != 0x1234)
+      bad++;
+  }
+  check(bad == 0, "a chunked fill covers the screen");
+  check(dma.chunks == 2 && !(dma.modes[0] & STM32_DMA_CR_PINC) && !(dma.modes[1] & STM32_DMA_CR_PINC),
+      "fills read one pixel over and over");
+}
+
+/* Another DMA2 user takes the lock while a fill is going, and the next
+ * fill waits for it to let go
+ */
+static void
+test_lock()
+{
+  uint64_t first_done;
+
+  begin_case();
+  lcd_clr_cursor();
+  lcd_fill(0x0F0F, NUM_PIXELS);
+  chThdCreateFromHeap(NULL, 1024, NORMALPRIO + 1, lock_thread, NULL);
+  lcd_fill(0xF0F0, NUM_PIXELS);
+  first_done = dma.last_done;
+  lcd_wait();
+  end_case("fill, lock, fill");
+
+  check(lock_taken >= first_done, "the lock waits for the transfer going");
+  check(lock_released > lock_taken, "the lock is held");
+  check(dma.last_start >= lock_released, "no transfer starts while the lock is held");
+  check(screen_px(DISP_WIDTH - 1, DISP_HEIGHT - 1) == 0xF0F0, "the second fill goes out after it");
+}
+
+static msg_t
+lock_thread(void* arg)
+{
+  (void)arg;
+
+  lcd_dma_lock();
+  lock_taken = sim_now();
+  check(!dma.busy, "no transfer is on the bus while the lock is held");
+  chThdSleepMilliseconds(2);
+  check(!dma.busy, "no transfer is on the bus while the lock is held");
+  lock_released = sim_now();
+  lcd_dma_unlock();
+
+  return 0;
+}
+
+/* An error drops the rest of the transfer and frees the stream */
+static void
+test_error()
+{
+  begin_case();
+  dma.inject_error = true;
+  lcd_clr_cursor();
+  lcd_fill(0x5555, NUM_PIXELS);
+  lcd_wait();
+  end_case("fill, transfer error");
+  check(dma.chunks == 1, "a transfer error drops the rest of the transfer");
+
+  lcd_dma_lock();
+  lcd_dma_unlock();
+
+  begin_case();
+  lcd_clr_cursor();
+  lcd_fill(0xAAAA, NUM_PIXELS);
+  lcd_wait();
+  end_case("fill after the error");
+  check(dma.chunks == 2 && lcd.dma_pixels == NUM_PIXELS, "transfers go on after an error");
+}
+
+/* The stream: each chunk is on the bus for its length of write cycles */
+static msg_t
+dma_thread(void* arg)
+{
+  stm32_dma_stream_t* s = &sim_dma_streams[LCD_STREAM];
+
+  (void)arg;
+  chRegSetThreadName("dma");
+
+  while (1) {
+    const volatile uint16_t* src;
+    uint32_t flags = STM32_DMA_ISR_TCIF;
+    uint32_t i;
+
+    chSemWait(&dma_start);
+
+    check(s->m0ar == &lcd_bus_ram, "transfers go to the LCD's RAM");
+    check(s->ndtr > 0 && s->ndtr <= MAX_CHUNK, "chunks fit the stream");
+    chThdSleepMicroseconds(((s->ndtr * BUS_WRITE_NS) / 1000) + 1);
+
+    src = s->par;
+    if (dma.inject_error) {
+      dma.inject_error = false;
+      flags = STM32_DMA_ISR_TEIF;
+    }
+    else {
+      for (i = 0; i < s->ndtr; ++i) {
+        gram_write((s->cr & STM32_DMA_CR_PINC) ? src[i] : src[0]);
+        lcd.dma_pixels++;
+      }
+    }
+
+    dma.busy = false;
+    dma.last_done = sim_now();
+    s->func(s->param, flags);
+  }
+
+  return 0;
+}
+
+/* Applies the last bus write once its value has been stored */
+static void
+bus_commit()
+{
+  if (!pending.valid)
+    return;
+  pending.valid = false;
+
+  if (pending.rs == 0) {
+    lcd.index = pending.val;
+    lcd.reg_writes++;
+    return;
+  }
+
+  if (lcd.index == REG_GRAM_DATA) {
+    gram_write(pending.val);
+    lcd.cpu_pixels++;
+    return;
+  }
+
+  lcd.regs[lcd.index] = pending.val;
+  lcd.data_writes++;
+  if (lcd.index == REG_GRAM_X)
+    lcd.ax = pending.val;
+  else if (lcd.index == REG_GRAM_Y)
+    lcd.ay = pending.val;
+}
+
+/* Entry mode 0x1018: the address counter moves down GRAM y first, then
+ * along x, within the window
+ */
+static void
+gram_write(uint16_t val)
+{
+  if (lcd.ax < GRAM_WIDTH && lcd.ay < GRAM_HEIGHT)
+    lcd.gram[(lcd.ay * GRAM_WIDTH) + lcd.ax] = val;
+
+  if (--lcd.ay < lcd.regs[REG_WIN_Y1]) {
+    lcd.ay = lcd.regs[REG_WIN_Y2];
+    if (++lcd.ax > lcd.regs[REG_WIN_X2])
+      lcd.ax = lcd.regs[REG_WIN_X1];
+  }
+}
+
+/* In landscape, screen x runs down GRAM y from the far end */
+static uint16_t
+screen_px(int x, int y)
+{
+  bus_commit();
+  return lcd.gram[((GRAM_HEIGHT - 1 - x) * GRAM_WIDTH) + y];
+}
+
+static void
+begin_case()
+{
+  bus_commit();
+  lcd.reg_writes = lcd.data_writes = lcd.cpu_pixels = lcd.dma_pixels = 0;
+  dma.chunks = 0;
+  memset(dma.sizes, 0, sizeof(dma.sizes));
+  memset(dma.modes, 0, sizeof(dma.modes));
+}
+
+static void
+end_case(const char* name)
+{
+  bus_commit();
+  printf("%-30s %8u %8u %8u %8u %8u\n", name, (unsigned)lcd.reg_writes, (unsigned)lcd.data_writes,
+      (unsigned)lcd.cpu_pixels, (unsigned)lcd.dma_pixels, (unsigned)dma.chunks);
+}
+
+static void
+check(bool ok, const char* what)
+{
+  if (!ok) {
+    printf("FAIL at %.3f ms: %s\n", sim_now() / 1e3, what);
+    failures++;
+  }
+}
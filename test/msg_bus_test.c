@@ -0,0 +1,341 @@
+/* Host test of the message bus (src/app_mt/message.c) on the simulated
+ * kernel, with listeners set up like the app's.
+ *
+ * The throughput run pushes a million sensor samples (with some posts and
+ * sends mixed in) through the bus and reports messages/sec and heap use. It
+ * fails if dispatch allocates from the heap once the listeners exist.
+ *
+ * The stall run stops the network listener in a long blocking call while the
+ * control thread keeps publishing and the GUI thread sends controller
+ * settings to temp_ctrl. It fails if a publish ever blocks or a send never
+ * completes.
+ *
+ * The pool run fills a listener's queue with posts until the envelope pool
+ * is empty, and has the listener post while they wait. It fails if that
+ * post blocks for good instead of giving up, or if the queued posts are
+ * lost.
+ */
+
+#include "message.h"
+#include "sensor.h"
+#include "temp_control.h"
+#include "thread_watchdog.h"
+#include "sim.h"
+#include "heap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define NUM_SAMPLES       1000000
+#define POST_INTERVAL     100       // samples per msg_post
+#define SEND_INTERVAL     1000      // samples per msg_send
+
+#define STALL_TIME_MS     10000
+#define STALL_CALL_MS     3000      // length of the blocking socket call
+#define SAMPLE_PERIOD_MS  10
+#define SEND_PERIOD_MS    100
+
+#define POOL_SIZE         16        // MSG_POOL_SIZE in message.c
+#define POOL_DISPATCH_MS  100       // the flooded listener's first dispatch
+
+
+typedef struct {
+  const char* name;
+  msg_prio_t prio;
+  int depth;
+  msg_listener_t* listener;
+  uint32_t dispatched;
+} test_listener_t;
+
+
+static void dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+static void throughput_run(void);
+static void stall_run(void);
+static void pool_run(void);
+static void pool_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+static msg_t control_thread(void* arg);
+static msg_t gui_thread(void* arg);
+
+
+static test_listener_t tl[] = {
+  { "temp_ctrl",    MSG_PRIO_CONTROL,    8  },
+  { "gui",          MSG_PRIO_UI,         16 },
+  { "web_api",      MSG_PRIO_BACKGROUND, 8  },
+  { "sample_store", MSG_PRIO_BACKGROUND, 8  },
+};
+#define NUM_LISTENERS (sizeof(tl) / sizeof(tl[0]))
+#define WEB_API (&tl[2])
+
+static bool web_api_stalled;
+static uint32_t failures;
+
+
+void
+thread_watchdog_enable(Thread* tp, systime_t period)
+{
+  (void)tp;
+  (void)period;
+}
+
+void
+thread_watchdog_kick()
+{
+}
+
+int
+main()
+{
+  heap_stats_t heap;
+  unsigned i;
+
+  sim_init();
+  msg_init();
+
+  for (i = 0; i < NUM_LISTENERS; ++i) {
+    tl[i].listener = msg_listener_create(tl[i].name, 1024, tl[i].prio, tl[i].depth, dispatch, &tl[i]);
+    msg_subscribe_latest(tl[i].listener, MSG_SENSOR_SAMPLE, NULL);
+  }
+  msg_subscribe(tl[0].listener, MSG_CONTROLLER_SETTINGS, NULL);
+  msg_subscribe(tl[1].listener, MSG_TOUCH_INPUT, NULL);
+  msg_subscribe_latest(tl[1].listener, MSG_OUTPUT_STATUS, NULL);
+  // the network listener takes every output change, so it is the one that
+  // backs up when it stalls
+  msg_subscribe(WEB_API->listener, MSG_OUTPUT_STATUS, NULL);
+  msg_subscribe_latest(tl[3].listener, MSG_OUTPUT_STATUS, NULL);
+
+  heap_get_stats(&heap);
+  printf("setup: %u bytes of heap in %u blocks, %u bytes of thread working areas\n",
+      (unsigned)heap.bytes, (unsigned)heap.allocs, (unsigned)sim_working_areas());
+
+  throughput_run();
+  stall_run();
+  pool_run();
+
+  msg_trace_print();
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+static void
+dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  test_listener_t* t = listener_data;
+
+  (void)msg_data;
+  (void)sub_data;
+
+  if ((id == MSG_INIT) || (id == MSG_IDLE))
+    return;
+
+  t->dispatched++;
+  if ((t == WEB_API) && web_api_stalled)
+    chThdSleepMilliseconds(STALL_CALL_MS);
+}
+
+static void
+throughput_run()
+{
+  double start;
+  heap_stats_t before, after;
+  uint32_t dispatched = 0;
+  uint32_t sent = 0;
+  uint32_t switches = sim_switches();
+  double secs;
+  unsigned i;
+
+  heap_get_stats(&before);
+  start = sim_wall_clock();
+
+  for (i = 0; i < NUM_SAMPLES; ++i) {
+    sensor_msg_t msg = {
+        .sensor = i % NUM_SENSORS,
+        .sample = { .value = 68, .unit = UNIT_TEMP_DEG_F },
+        .seq = i / NUM_SENSORS
+    };
+
+    msg_publish(MSG_SENSOR_SAMPLE, msg.sensor, &msg, sizeof(msg));
+    sent++;
+
+    if ((i % POST_INTERVAL) == 0) {
+      msg_post(MSG_TOUCH_INPUT, NULL);
+      sent++;
+    }
+    if ((i % SEND_INTERVAL) == 0) {
+      msg_send(MSG_CONTROLLER_SETTINGS, NULL);
+      sent++;
+    }
+
+    // one round of samples per tick lets the lower priority listeners run
+    if (msg.sensor == (NUM_SENSORS - 1))
+      chThdSleep(1);
+  }
+  chThdSleepMilliseconds(100);
+
+  secs = sim_wall_clock() - start;
+  heap_get_stats(&after);
+
+  for (i = 0; i < NUM_LISTENERS; ++i)
+    dispatched += tl[i].dispatched;
+
+  printf("throughput: %u messages, %u dispatches, %u context switches in %.2f s\n",
+      (unsigned)sent, (unsigned)dispatched, (unsigned)(sim_switches() - switches), secs);
+  printf("  %.0f messages/sec, %.0f dispatches/sec\n", sent / secs, dispatched / secs);
+  printf("  heap: %u allocations during the run, peak %u bytes\n",
+      (unsigned)(after.allocs - before.allocs), (unsigned)after.peak_bytes);
+
+  if (after.allocs != before.allocs) {
+    printf("  FAIL: message dispatch allocated from the heap\n");
+    failures++;
+  }
+}
+
+static uint32_t publishes;
+static uint32_t publish_drops;
+static uint64_t max_publish_time;
+static uint32_t sends_started;
+static uint32_t sends_done;
+
+static void
+stall_run()
+{
+  Thread* control;
+  Thread* gui;
+
+  web_api_stalled = true;
+
+  control = chThdCreateFromHeap(NULL, 1024, MSG_PRIO_CONTROL, control_thread, NULL);
+  gui = chThdCreateFromHeap(NULL, 1024, MSG_PRIO_UI, gui_thread, NULL);
+
+  chThdWait(control);
+  chThdTerminate(gui);
+  chThdWait(gui);
+
+  printf("stall: %u publishes, %u dropped, longest publish %u usec, %u of %u sends completed\n",
+      (unsigned)publishes, (unsigned)publish_drops, (unsigned)max_publish_time,
+      (unsigned)sends_done, (unsigned)sends_started);
+
+  if (max_publish_time > 0) {
+    printf("  FAIL: the control thread blocked in msg_publish()\n");
+    failures++;
+  }
+  if ((sends_started - sends_done) > 1) {
+    printf("  FAIL: the GUI thread is stuck in msg_send()\n");
+    failures++;
+  }
+
+  web_api_stalled = false;
+}
+
+static msg_t
+control_thread(void* arg)
+{
+  systime_t end = chTimeNow() + MS2ST(STALL_TIME_MS);
+  uint32_t n = 0;
+
+  (void)arg;
+
+  chRegSetThreadName("control");
+  while (chTimeNow() < end) {
+    sensor_msg_t msg = {
+        .sensor = n % NUM_SENSORS,
+        .sample = { .value = 68, .unit = UNIT_TEMP_DEG_F },
+        .seq = n / NUM_SENSORS
+    };
+    output_status_t status = {
+        .output = n % NUM_OUTPUTS,
+        .enabled = (n / NUM_OUTPUTS) % 2
+    };
+    uint64_t start = sim_now();
+
+    if (!msg_publish(MSG_SENSOR_SAMPLE, msg.sensor, &msg, sizeof(msg)))
+      publish_drops++;
+    if (!msg_publish(MSG_OUTPUT_STATUS, status.output, &status, sizeof(status)))
+      publish_drops++;
+    publishes += 2;
+
+    if ((sim_now() - start) > max_publish_time)
+      max_publish_time = sim_now() - start;
+
+    n++;
+    chThdSleepMilliseconds(SAMPLE_PERIOD_MS);
+  }
+  return 0;
+}
+
+static msg_t
+gui_thread(void* arg)
+{
+  (void)arg;
+
+  chRegSetThreadName("gui_send");
+  while (!chThdShouldTerminate()) {
+    sends_started++;
+    msg_send(MSG_CONTROLLER_SETTINGS, NULL);
+    sends_done++;
+    chThdSleepMilliseconds(SEND_PERIOD_MS);
+  }
+  return 0;
+}
+
+static uint32_t pool_dispatched;
+static bool pool_post_done;
+static bool pool_post_ok;
+static uint64_t pool_post_time;
+
+static void
+pool_run()
+{
+  msg_listener_t* l;
+  int i;
+
+  // let the stall run's queues drain
+  chThdSleepMilliseconds(2 * STALL_CALL_MS);
+
+  l = msg_listener_create("pool", 1024, MSG_PRIO_UI, POOL_SIZE, pool_dispatch, NULL);
+  msg_subscribe(l, MSG_OTAU_CHECK, NULL);
+
+  // the first post is being dispatched while the rest queue up behind it
+  for (i = 0; i < POOL_SIZE; ++i)
+    msg_post(MSG_OTAU_CHECK, NULL);
+
+  chThdSleepMilliseconds(1000);
+
+  printf("pool: post from the flooded listener %s after %u ms, %u of %u posts dispatched\n",
+      pool_post_ok ? "sent" : "dropped", (unsigned)(pool_post_time / 1000),
+      (unsigned)pool_dispatched, POOL_SIZE);
+
+  if (!pool_post_done || pool_post_ok) {
+    printf("  FAIL: a post with the pool empty didn't give up\n");
+    failures++;
+  }
+  if (pool_dispatched != POOL_SIZE) {
+    printf("  FAIL: queued posts were lost\n");
+    failures++;
+  }
+}
+
+static void
+pool_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  uint64_t start;
+
+  if (id != MSG_OTAU_CHECK)
+    return;
+
+  if (pool_dispatched++ > 0)
+    return;
+
+  chThdSleepMilliseconds(POOL_DISPATCH_MS);
+
+  // every envelope is in this listener's queue or being dispatched
+  start = sim_now();
+  pool_post_ok = msg_post(MSG_OTAU_START, NULL);
+  pool_post_time = sim_now() - start;
+  pool_post_done = true;
+}
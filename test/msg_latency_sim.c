@@ -0,0 +1,258 @@
+/* Host simulation of sample-to-relay latency on the message bus
+ * (src/app_mt/message.c) under GUI and network load.
+ *
+ * The sensor thread publishes a sample every SAMPLE_PERIOD_MS. temp_ctrl
+ * takes it, runs the control step and switches the relay; the latency is
+ * from the time the sample was due to the relay switching. Every few
+ * samples temp_ctrl also sends controller settings, as an autotune step
+ * does through app_cfg.
+ *
+ * Around it the GUI repaints on every sample and takes touch input, a
+ * network thread keeps the CPU busy at NORMALPRIO, and another one posts
+ * bursts of status messages that keep web_api's queue full. web_api takes
+ * the settings too, so temp_ctrl has to wait for a slot in a background
+ * listener's full queue.
+ *
+ * It fails if the worst case latency is over LATENCY_LIMIT_MS.
+ */
+
+#include "message.h"
+#include "sensor.h"
+#include "temp_control.h"
+#include "touch.h"
+#include "thread_watchdog.h"
+#include "sim.h"
+
+#include <stdio.h>
+
+
+#define SIM_TIME_MS         60000
+#define SAMPLE_PERIOD_MS    20
+#define SETTINGS_INTERVAL   20        // samples per settings send
+
+#define CONTROL_USEC        200       // control step
+#define PAINT_USEC          15000     // GUI repaint after a sample
+#define TOUCH_USEC          2000      // GUI touch handling
+#define TOUCH_PERIOD_MS     30
+#define NET_MSG_USEC        2000      // web_api work per message
+#define NET_BUSY_USEC       8000      // network stack CPU time...
+#define NET_PERIOD_MS       10        // ...in every period
+#define POST_BURST          12        // posts to web_api...
+#define POST_PERIOD_MS      500       // ...every period
+
+#define LATENCY_LIMIT_MS    50
+
+#define NUM_BUCKETS         1000      // 1 ms latency buckets
+#define SEQ_RING            64
+
+
+static void temp_ctrl_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+static void gui_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+static void web_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+static msg_t sensor_thread(void* arg);
+static msg_t touch_thread(void* arg);
+static msg_t net_thread(void* arg);
+static msg_t poster_thread(void* arg);
+static uint32_t percentile(uint32_t pct);
+
+
+static uint64_t due_time[NUM_SENSORS][SEQ_RING];
+static uint32_t latency_hist[NUM_BUCKETS];
+static uint64_t max_latency;
+static uint32_t relays;
+static uint32_t samples;
+static uint64_t max_send_time;
+static uint32_t sends;
+static uint32_t net_msgs;
+static uint32_t paints;
+static uint64_t end_time;
+
+
+void
+thread_watchdog_enable(Thread* tp, systime_t period)
+{
+}
+
+void
+thread_watchdog_kick()
+{
+}
+
+int
+main()
+{
+  msg_listener_t* l;
+  Thread* threads[4];
+  unsigned i;
+
+  sim_init();
+  msg_init();
+  end_time = (uint64_t)SIM_TIME_MS * 1000;
+
+  l = msg_listener_create("temp_ctrl", 1024, MSG_PRIO_CONTROL, 8, temp_ctrl_dispatch, NULL);
+  msg_subscribe_latest(l, MSG_SENSOR_SAMPLE, NULL);
+  msg_subscribe(l, MSG_CONTROLLER_SETTINGS, NULL);
+
+  l = msg_listener_create("gui", 2048, MSG_PRIO_UI, 16, gui_dispatch, NULL);
+  msg_subscribe_latest(l, MSG_SENSOR_SAMPLE, NULL);
+  msg_subscribe_latest(l, MSG_OUTPUT_STATUS, NULL);
+  msg_subscribe(l, MSG_TOUCH_INPUT, NULL);
+
+  l = msg_listener_create("web_api", 2048, MSG_PRIO_BACKGROUND, 8, web_api_dispatch, NULL);
+  msg_subscribe(l, MSG_CONTROLLER_SETTINGS, NULL);
+  msg_subscribe_latest(l, MSG_OUTPUT_STATUS, NULL);
+  msg_subscribe(l, MSG_NET_STATUS, NULL);
+
+  threads[0] = chThdCreateFromHeap(NULL, 1024, MSG_PRIO_CONTROL, sensor_thread, NULL);
+  threads[1] = chThdCreateFromHeap(NULL, 1024, NORMALPRIO, touch_thread, NULL);
+  threads[2] = chThdCreateFromHeap(NULL, 1024, NORMALPRIO, net_thread, NULL);
+  threads[3] = chThdCreateFromHeap(NULL, 1024, NORMALPRIO, poster_thread, NULL);
+
+  for (i = 0; i < 4; ++i)
+    chThdWait(threads[i]);
+
+  printf("%u s simulated: %u samples, %u relay updates, %u paints, %u web_api messages\n",
+      SIM_TIME_MS / 1000, (unsigned)samples, (unsigned)relays, (unsigned)paints,
+      (unsigned)net_msgs);
+  printf("sample to relay: p50 %u ms, p99 %u ms, max %.1f ms\n",
+      (unsigned)percentile(50), (unsigned)percentile(99), max_latency / 1000.0);
+  printf("temp_ctrl settings sends: %u, longest %.1f ms\n",
+      (unsigned)sends, max_send_time / 1000.0);
+
+  if (max_latency > (LATENCY_LIMIT_MS * 1000)) {
+    printf("FAILED: sample to relay latency over %u ms\n", LATENCY_LIMIT_MS);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+static void
+temp_ctrl_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  static uint32_t n;
+  static controller_settings_t settings;
+  sensor_msg_t* msg = msg_data;
+  uint64_t latency;
+
+  if (id != MSG_SENSOR_SAMPLE)
+    return;
+
+  sim_cpu(CONTROL_USEC);
+
+  latency = sim_now() - due_time[msg->sensor][msg->seq % SEQ_RING];
+  if (latency > max_latency)
+    max_latency = latency;
+  latency_hist[(latency / 1000) < NUM_BUCKETS ? (latency / 1000) : (NUM_BUCKETS - 1)]++;
+  relays++;
+
+  if ((++n % SETTINGS_INTERVAL) == 0) {
+    uint64_t start = sim_now();
+
+    msg_send(MSG_CONTROLLER_SETTINGS, &settings);
+    sends++;
+    if ((sim_now() - start) > max_send_time)
+      max_send_time = sim_now() - start;
+  }
+}
+
+static void
+gui_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  if (id == MSG_SENSOR_SAMPLE) {
+    sim_cpu(PAINT_USEC);
+    paints++;
+  }
+  else if (id == MSG_TOUCH_INPUT) {
+    sim_cpu(TOUCH_USEC);
+  }
+}
+
+static void
+web_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  if ((id == MSG_INIT) || (id == MSG_IDLE))
+    return;
+
+  sim_cpu(NET_MSG_USEC);
+  net_msgs++;
+}
+
+static msg_t
+sensor_thread(void* arg)
+{
+  uint32_t seq = 0;
+  uint64_t due = sim_now();
+
+  chRegSetThreadName("sensor");
+  while (due < end_time) {
+    sensor_msg_t msg = {
+        .sensor = seq % NUM_SENSORS,
+        .sample = { .value = 68, .unit = UNIT_TEMP_DEG_F },
+        .seq = seq
+    };
+
+    due_time[msg.sensor][seq % SEQ_RING] = due;
+    msg_publish(MSG_SENSOR_SAMPLE, msg.sensor, &msg, sizeof(msg));
+    samples++;
+    seq++;
+
+    // a late sample doesn't push the next one back
+    due += SAMPLE_PERIOD_MS * 1000;
+    if (due > sim_now())
+      chThdSleepMicroseconds(due - sim_now());
+  }
+  return 0;
+}
+
+static msg_t
+touch_thread(void* arg)
+{
+  touch_msg_t msg = { .touch_down = true };
+
+  chRegSetThreadName("touch");
+  while (sim_now() < end_time) {
+    msg_send(MSG_TOUCH_INPUT, &msg);
+    chThdSleepMilliseconds(TOUCH_PERIOD_MS);
+  }
+  return 0;
+}
+
+static msg_t
+net_thread(void* arg)
+{
+  chRegSetThreadName("net");
+  while (sim_now() < end_time) {
+    sim_cpu(NET_BUSY_USEC);
+    chThdSleepMilliseconds(NET_PERIOD_MS - (NET_BUSY_USEC / 1000));
+  }
+  return 0;
+}
+
+static msg_t
+poster_thread(void* arg)
+{
+  int i;
+
+  chRegSetThreadName("poster");
+  while (sim_now() < end_time) {
+    for (i = 0; i < POST_BURST; ++i)
+      msg_post(MSG_NET_STATUS, NULL);
+    chThdSleepMilliseconds(POST_PERIOD_MS);
+  }
+  return 0;
+}
+
+static uint32_t
+percentile(uint32_t pct)
+{
+  uint32_t n = 0;
+  int i;
+
+  for (i = 0; i < NUM_BUCKETS; ++i) {
+    n += latency_hist[i];
+    if ((n * 100) >= (relays * pct))
+      return i;
+  }
+  return NUM_BUCKETS;
+}
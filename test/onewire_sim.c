@@ -0,0 +1,631 @@
+/* Host simulation of the 1-Wire bus (src/app_mt/onewire.c) on a modelled
+ * half-duplex UART with DS18B20 probes on the line.
+ *
+ * The UART shifts frames out at the baud set in BRR on the virtual clock.
+ * The echo of the last frame of a transfer is in half way through its stop
+ * bit, when the receive DMA interrupt runs, and the transmission complete
+ * interrupt runs once the stop bit is out. A frame whose baud changes
+ * before then fails, as does any frame that isn't a reset pulse at 9600
+ * baud or a slot at 115200.
+ *
+ * The probes decode the slots bit by bit, like the real ones. Every
+ * transaction a sensor.c round makes is run against them: the slots seen
+ * on the wire have to be exactly the bytes sent, the data read back has to
+ * be the probes', and the bus time has to be the time of the frames on the
+ * wire, with no gap where the baud changes. The port is on USART2, which
+ * moves its data on DMA1, so it must never take the LCD's DMA lock.
+ */
+
+#include "onewire.h"
+#include "lcd.h"
+#include "crc/crc8.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+#define NUM_PROBES          3
+#define NUM_ROUNDS          4
+
+#define FAMILY_DS18B20      0x28
+#define CONVERT_T           0x44
+#define WRITE_SCRATCHPAD    0x4E
+#define READ_SCRATCHPAD     0xBE
+
+#define RESET_BRR           (STM32_PCLK1 / 9600)
+#define SLOT_BRR            (STM32_PCLK1 / 115200)
+#define FRAME_PS(brr)       (((uint64_t)(brr) * 10 * 1000000000000ULL) / STM32_PCLK1)
+
+/* Echo of the reset pulse with a presence pulse in it, and of a read slot
+ * a probe holds low for a 0
+ */
+#define PRESENCE_ECHO       0xE0
+#define READ_0_ECHO         0xF8
+
+#define MAX_LOG_SLOTS       (ONEWIRE_MAX_XFER * 8)
+
+
+typedef enum {
+  PROBE_ROM_CMD,
+  PROBE_MATCH_ROM,
+  PROBE_SEARCH_ROM,
+  PROBE_FUNC_CMD,
+  PROBE_READ,
+  PROBE_WRITE,
+  PROBE_CONVERTING,
+  PROBE_IDLE
+} probe_state_t;
+
+/* A DS18B20 as seen from its data pin */
+typedef struct {
+  uint8_t rom[8];
+  uint8_t scratchpad[9];
+  float temp;               // deg C
+
+  probe_state_t state;
+  uint8_t byte;             // shifting in, LSB first
+  uint8_t num_bits;
+  uint8_t search_phase;
+  uint8_t* data;            // shifting out, or written to
+  uint8_t data_bits;
+  uint8_t data_pos;
+  uint64_t convert_done;    // usec
+} probe_t;
+
+/* What was on the wire in the last transaction */
+typedef struct {
+  bool reset;
+  uint16_t num_slots;
+  uint8_t slots[MAX_LOG_SLOTS];   // bit written by the master
+} bus_log_t;
+
+
+static msg_t uart_thread(void* arg);
+static void wait_line(uint64_t ps);
+static void usart_irq(void);
+static uint8_t bus_frame(uint8_t frame, uint32_t brr);
+static uint8_t probe_slot(probe_t* p, uint8_t w);
+static void probe_command(probe_t* p, uint8_t cmd);
+static void probe_convert(probe_t* p);
+static void init_probes(uint8_t num_probes);
+static void run_round(void);
+static void run_search(void);
+static void run_no_probes(void);
+static bool timed_transaction(bool reset, const uint8_t* tx, uint8_t tx_len,
+    uint8_t* rx, uint8_t rx_len);
+static void check(bool ok, const char* what);
+
+
+USART_TypeDef sim_usart[3];
+static UARTDriver uart = { .usart = USART2 };
+static onewire_bus_t bus;
+
+/* The UART */
+static Semaphore uart_start;
+static const uint8_t* tx_buf;
+static size_t tx_len;
+static uint8_t* rx_buf;
+static size_t rx_len;
+static uint64_t line_ps;        // when the line is next idle
+
+static probe_t probes[NUM_PROBES];
+static uint8_t num_probes;
+static bus_log_t bus_log;
+
+static uint32_t failures;
+static uint32_t bad_frames;
+static uint32_t early_baud_changes;
+static uint64_t rx_end_time;
+static uint64_t max_tc_wait;
+static uint32_t transactions;
+static uint64_t max_time_error;
+static uint32_t dma_locks;
+
+
+void
+lcd_dma_lock()
+{
+  dma_locks++;
+}
+
+void
+lcd_dma_unlock()
+{
+}
+
+int
+main()
+{
+  uint8_t rom[8];
+  int i;
+
+  sim_init();
+  chSemInit(&uart_start, 0);
+  chThdCreateFromHeap(NULL, 1024, HIGHPRIO, uart_thread, NULL);
+
+  onewire_init(&bus, &uart);
+
+  init_probes(NUM_PROBES);
+  run_search();
+  for (i = 0; i < NUM_ROUNDS; ++i)
+    run_round();
+
+  init_probes(1);
+  run_search();
+  check(onewire_read_rom(&bus, rom) && memcmp(rom, probes[0].rom, 8) == 0,
+      "READ_ROM returns the probe's ROM");
+
+  run_no_probes();
+
+  printf("%u transactions, bus time within %u us of the wire time\n",
+      (unsigned)transactions, (unsigned)max_time_error);
+  printf("baud switch after a reset waits %u us for the stop bit to go out\n",
+      (unsigned)max_tc_wait);
+  check(bad_frames == 0, "every frame is a reset pulse at 9600 baud or a slot at 115200");
+  check(early_baud_changes == 0, "the baud never changes before a frame is out");
+  check(dma_locks == 0, "a port on DMA1 leaves the LCD's DMA alone");
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+/* One sensor.c round: convert every probe at once, wait for them and read
+ * back each scratchpad by ROM, then set the resolution on the first probe.
+ */
+static void
+run_round()
+{
+  static const uint8_t convert_t[] = { SKIP_ROM, CONVERT_T };
+  uint8_t cmd[13];
+  uint8_t scratchpad[9];
+  uint8_t bit = 0;
+  int i;
+
+  for (i = 0; i < num_probes; ++i)
+    probes[i].temp += 0.5f * (i + 1);
+
+  check(timed_transaction(true, convert_t, sizeof(convert_t), NULL, 0),
+      "SKIP_ROM CONVERT_T");
+
+  chThdSleepMilliseconds(94);
+  while (!bit) {
+    check(onewire_recv_bit(&bus, &bit), "read slot while converting");
+    if (!bit)
+      chThdSleepMilliseconds(10);
+  }
+  for (i = 0; i < num_probes; ++i)
+    check(probes[i].state == PROBE_CONVERTING && sim_now() >= probes[i].convert_done,
+        "polling ends when every probe is done");
+
+  cmd[0] = MATCH_ROM;
+  cmd[9] = READ_SCRATCHPAD;
+  for (i = 0; i < num_probes; ++i) {
+    memcpy(&cmd[1], probes[i].rom, 8);
+    check(timed_transaction(true, cmd, 10, scratchpad, sizeof(scratchpad)),
+        "MATCH_ROM READ_SCRATCHPAD");
+    check(memcmp(scratchpad, probes[i].scratchpad, sizeof(scratchpad)) == 0,
+        "scratchpad read back is the probe's");
+    check(crc8_block(0, scratchpad, 8) == scratchpad[8], "scratchpad CRC");
+  }
+
+  cmd[9] = WRITE_SCRATCHPAD;
+  cmd[10] = 0x4B;
+  cmd[11] = 0x46;
+  cmd[12] = 0x3F;   // 10 bits
+  memcpy(&cmd[1], probes[0].rom, 8);
+  check(timed_transaction(true, cmd, 13, NULL, 0), "MATCH_ROM WRITE_SCRATCHPAD");
+  check(probes[0].scratchpad[4] == 0x3F, "probe took the new resolution");
+}
+
+static void
+run_search()
+{
+  onewire_search_t search;
+  uint8_t rom[8];
+  uint8_t found = 0;
+  uint32_t seen[NUM_PROBES] = { 0 };
+  int i;
+
+  onewire_search_init(&search);
+  while (found <= num_probes && onewire_search_next(&bus, &search, rom)) {
+    for (i = 0; i < num_probes; ++i) {
+      if (memcmp(rom, probes[i].rom, 8) == 0)
+        seen[i]++;
+    }
+    found++;
+  }
+
+  check(found == num_probes, "search finds every probe");
+  for (i = 0; i < num_probes; ++i)
+    check(seen[i] == 1, "search finds each probe once");
+}
+
+static void
+run_no_probes()
+{
+  static const uint8_t convert_t[] = { SKIP_ROM, CONVERT_T };
+  uint64_t start;
+
+  init_probes(0);
+  start = sim_now();
+  check(!onewire_transaction(&bus, true, convert_t, sizeof(convert_t), NULL, 0),
+      "no presence fails the transaction");
+  check(bus_log.num_slots == 0, "no slots after a reset nobody answered");
+  check((sim_now() - start) <= ((FRAME_PS(RESET_BRR) / 1000000) + 1),
+      "no presence takes one reset pulse");
+}
+
+/* Runs a transaction and checks its slots and bus time */
+static bool
+timed_transaction(bool reset, const uint8_t* tx, uint8_t tx_len,
+    uint8_t* rx, uint8_t rx_len)
+{
+  uint64_t start = sim_now();
+  uint64_t wire_us, elapsed, error;
+  uint16_t n = 0;
+  bool ok;
+  int i, j;
+
+  memset(&bus_log, 0, sizeof(bus_log));
+  ok = onewire_transaction(&bus, reset, tx, tx_len, rx, rx_len);
+  elapsed = sim_now() - start;
+  transactions++;
+
+  wire_us = ((reset ? FRAME_PS(RESET_BRR) : 0) +
+      ((tx_len + rx_len) * 8 * FRAME_PS(SLOT_BRR))) / 1000000;
+  error = (elapsed > wire_us) ? (elapsed - wire_us) : (wire_us - elapsed);
+  if (error > max_time_error)
+    max_time_error = error;
+  check(error <= 2, "bus time is the wire time");
+
+  check(bus_log.reset == reset, "reset pulse sent");
+  check(bus_log.num_slots == ((tx_len + rx_len) * 8), "one slot per bit");
+  for (i = 0; i < tx_len; ++i) {
+    for (j = 0; j < 8; ++j, ++n) {
+      if (bus_log.slots[n] != ((tx[i] >> j) & 1)) {
+        check(false, "slots are the bytes sent, LSB first");
+        return ok;
+      }
+    }
+  }
+  for (; n < bus_log.num_slots; ++n)
+    check(bus_log.slots[n] == 1, "read slots are write 1 slots");
+
+  return ok;
+}
+
+static void
+check(bool ok, const char* what)
+{
+  if (!ok) {
+    printf("FAIL at %.3f s: %s\n", sim_now() / 1e6, what);
+    failures++;
+  }
+}
+
+/* The UART, shifting out one transfer after another */
+static msg_t
+uart_thread(void* arg)
+{
+  USART_TypeDef* u = uart.usart;
+
+  chRegSetThreadName("uart");
+  while (1) {
+    chSemWait(&uart_start);
+
+    if (line_ps < (sim_now() * 1000000))
+      line_ps = sim_now() * 1000000;
+
+    const uint8_t* buf = tx_buf;
+    size_t n = tx_len;
+    size_t i;
+
+    tx_buf = NULL;
+    tx_len = 0;
+    for (i = 0; i < n; ++i) {
+      uint32_t brr = u->BRR;
+      uint64_t frame_ps = FRAME_PS(brr);
+
+      /* The echo is in half way through the stop bit */
+      wait_line(line_ps + ((frame_ps * 19) / 20));
+      uint8_t echo = bus_frame(buf[i], brr);
+      if (rx_len > 0) {
+        *rx_buf++ = echo;
+        if (--rx_len == 0) {
+          rx_end_time = sim_now();
+          uart.config->rxend_cb(&uart);
+          usart_irq();
+        }
+      }
+
+      line_ps += frame_ps;
+      wait_line(line_ps);
+      if (u->BRR != brr)
+        early_baud_changes++;
+    }
+
+    u->SR |= USART_SR_TC;
+    usart_irq();
+  }
+
+  return 0;
+}
+
+static void
+wait_line(uint64_t ps)
+{
+  uint64_t us = (ps + 999999) / 1000000;
+
+  if (us > sim_now())
+    sim_cpu(us - sim_now());
+}
+
+/* As the HAL's USART interrupt handler */
+static void
+usart_irq()
+{
+  USART_TypeDef* u = uart.usart;
+
+  if ((u->SR & USART_SR_TC) && (u->CR1 & USART_CR1_TCIE)) {
+    uint64_t wait = sim_now() - rx_end_time;
+
+    u->SR &= ~USART_SR_TC;
+    if (wait > max_tc_wait)
+      max_tc_wait = wait;
+    if (uart.config->txend2_cb != NULL)
+      uart.config->txend2_cb(&uart);
+  }
+}
+
+void
+uartStart(UARTDriver* uartp, const UARTConfig* config)
+{
+  uartp->config = config;
+  uartp->usart->BRR = STM32_PCLK1 / config->speed;
+  uartp->usart->CR1 = config->cr1;
+  uartp->usart->CR2 = config->cr2;
+  uartp->usart->CR3 = config->cr3;
+  uartp->usart->SR = USART_SR_TC;
+}
+
+void
+uartStartSendI(UARTDriver* uartp, size_t n, const void* txbuf)
+{
+  tx_buf = txbuf;
+  tx_len = n;
+  chSemSignalI(&uart_start);
+}
+
+void
+uartStartSend(UARTDriver* uartp, size_t n, const void* txbuf)
+{
+  tx_buf = txbuf;
+  tx_len = n;
+  chSemSignal(&uart_start);
+}
+
+size_t
+uartStopSend(UARTDriver* uartp)
+{
+  tx_buf = NULL;
+  tx_len = 0;
+  return 0;
+}
+
+void
+uartStartReceiveI(UARTDriver* uartp, size_t n, void* rxbuf)
+{
+  rx_buf = rxbuf;
+  rx_len = n;
+}
+
+void
+uartStartReceive(UARTDriver* uartp, size_t n, void* rxbuf)
+{
+  uartStartReceiveI(uartp, n, rxbuf);
+}
+
+size_t
+uartStopReceive(UARTDriver* uartp)
+{
+  rx_len = 0;
+  return 0;
+}
+
+/* Puts a frame on the line and returns its echo */
+static uint8_t
+bus_frame(uint8_t frame, uint32_t brr)
+{
+  uint8_t line = 1;
+  int i;
+
+  if (brr == RESET_BRR && frame == 0xF0) {
+    bus_log.reset = true;
+    bus_log.num_slots = 0;
+    for (i = 0; i < num_probes; ++i) {
+      probes[i].state = PROBE_ROM_CMD;
+      probes[i].byte = 0;
+      probes[i].num_bits = 0;
+    }
+    return (num_probes > 0) ? PRESENCE_ECHO : frame;
+  }
+
+  if (brr != SLOT_BRR || (frame != 0x00 && frame != 0xFF)) {
+    bad_frames++;
+    return frame;
+  }
+
+  uint8_t w = (frame == 0xFF);
+  if (bus_log.num_slots < MAX_LOG_SLOTS)
+    bus_log.slots[bus_log.num_slots++] = w;
+
+  for (i = 0; i < num_probes; ++i)
+    line &= probe_slot(&probes[i], w);
+
+  return (w && !line) ? READ_0_ECHO : frame;
+}
+
+/* Takes one slot, returning 0 if the probe holds the line low */
+static uint8_t
+probe_slot(probe_t* p, uint8_t w)
+{
+  uint8_t bit;
+
+  switch (p->state) {
+  case PROBE_ROM_CMD:
+  case PROBE_FUNC_CMD:
+  case PROBE_WRITE:
+    p->byte |= (w << p->num_bits);
+    if (++p->num_bits == 8) {
+      uint8_t b = p->byte;
+      p->byte = 0;
+      p->num_bits = 0;
+      probe_command(p, b);
+    }
+    return 1;
+
+  case PROBE_MATCH_ROM:
+    if (w != ((p->rom[p->num_bits / 8] >> (p->num_bits % 8)) & 1))
+      p->state = PROBE_IDLE;
+    else if (++p->num_bits == 64) {
+      p->num_bits = 0;
+      p->state = PROBE_FUNC_CMD;
+    }
+    return 1;
+
+  case PROBE_SEARCH_ROM:
+    bit = (p->rom[p->num_bits / 8] >> (p->num_bits % 8)) & 1;
+    if (p->search_phase == 0) {
+      p->search_phase = 1;
+      return bit;
+    }
+    if (p->search_phase == 1) {
+      p->search_phase = 2;
+      return !bit;
+    }
+    p->search_phase = 0;
+    if (w != bit)
+      p->state = PROBE_IDLE;
+    else if (++p->num_bits == 64) {
+      p->num_bits = 0;
+      p->state = PROBE_FUNC_CMD;
+    }
+    return 1;
+
+  case PROBE_READ:
+    if (p->data_pos == p->data_bits)
+      return 1;
+    bit = (p->data[p->data_pos / 8] >> (p->data_pos % 8)) & 1;
+    p->data_pos++;
+    return bit;
+
+  case PROBE_CONVERTING:
+    return (sim_now() >= p->convert_done);
+
+  default:
+    return 1;
+  }
+}
+
+static void
+probe_command(probe_t* p, uint8_t cmd)
+{
+  switch (p->state) {
+  case PROBE_ROM_CMD:
+    p->state = PROBE_IDLE;
+    if (cmd == READ_ROM) {
+      p->data = p->rom;
+      p->data_bits = 64;
+      p->data_pos = 0;
+      p->state = PROBE_READ;
+    }
+    else if (cmd == MATCH_ROM)
+      p->state = PROBE_MATCH_ROM;
+    else if (cmd == SKIP_ROM)
+      p->state = PROBE_FUNC_CMD;
+    else if (cmd == SEARCH_ROM) {
+      p->search_phase = 0;
+      p->state = PROBE_SEARCH_ROM;
+    }
+    break;
+
+  case PROBE_FUNC_CMD:
+    p->state = PROBE_IDLE;
+    if (cmd == CONVERT_T)
+      probe_convert(p);
+    else if (cmd == READ_SCRATCHPAD) {
+      p->data = p->scratchpad;
+      p->data_bits = 72;
+      p->data_pos = 0;
+      p->state = PROBE_READ;
+    }
+    else if (cmd == WRITE_SCRATCHPAD) {
+      /* TH, TL and config */
+      p->data = &p->scratchpad[2];
+      p->data_bits = 3;
+      p->data_pos = 0;
+      p->state = PROBE_WRITE;
+    }
+    break;
+
+  case PROBE_WRITE:
+    /* Only the resolution bits of the config register are writable */
+    p->data[p->data_pos] = (p->data_pos == 2) ? ((cmd & 0x60) | 0x1F) : cmd;
+    if (++p->data_pos == p->data_bits) {
+      p->scratchpad[8] = crc8_block(0, p->scratchpad, 8);
+      p->state = PROBE_IDLE;
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+/* Converts at the scratchpad's resolution, taking 94 ms at 9 bits and
+ * twice as long for every extra bit
+ */
+static void
+probe_convert(probe_t* p)
+{
+  uint8_t bits = ((p->scratchpad[4] >> 5) & 0x3) + 9;
+  int16_t t = (int16_t)(p->temp * 16) & ~((1 << (12 - bits)) - 1);
+
+  p->scratchpad[0] = t & 0xFF;
+  p->scratchpad[1] = (t >> 8) & 0xFF;
+  p->scratchpad[8] = crc8_block(0, p->scratchpad, 8);
+
+  p->convert_done = sim_now() + ((uint64_t)94000 << (bits - 9));
+  p->state = PROBE_CONVERTING;
+}
+
+static void
+init_probes(uint8_t n)
+{
+  static const uint8_t power_up[8] = { 0x50, 0x05, 0x4B, 0x46, 0x7F, 0xFF, 0x0C, 0x10 };
+  uint32_t rng = 7;
+  int i, j;
+
+  memset(probes, 0, sizeof(probes));
+  for (i = 0; i < n; ++i) {
+    probe_t* p = &probes[i];
+
+    p->rom[0] = FAMILY_DS18B20;
+    for (j = 1; j < 7; ++j) {
+      rng = (rng * 1103515245) + 12345;
+      p->rom[j] = rng >> 16;
+    }
+    p->rom[7] = crc8_block(0, p->rom, 7);
+
+    memcpy(p->scratchpad, power_up, 8);
+    p->scratchpad[8] = crc8_block(0, p->scratchpad, 8);
+    p->temp = 18 + i;
+    p->state = PROBE_IDLE;
+  }
+  num_probes = n;
+}
@@ -0,0 +1,175 @@
+/* Host benchmark of screen painting (gui/controls/widget.c and gfx.c) on
+ * the virtual LCD.
+ *
+ * The home and settings screens are pushed and updated through the real
+ * GUI listener (gui/gui.c), which paints the top screen every 100 ms as on
+ * the device. For each frame it counts the pixels written, the distinct
+ * pixels and those written more than once, next to the writes of the
+ * renderer before damage tracking, which repainted every invalidated
+ * widget whole, and the host time taken. It fails if a frame writes more
+ * than its limit, writes a pixel more than once (damage is composed off
+ * screen a band at a time, see widget_paint()) or writes outside the
+ * display, if a full paint leaves part of the display unpainted, or if a
+ * frame without changes or a change to a hidden screen paints anything.
+ * The home screen after a sensor sample and an output change must also
+ * look the same as a full repaint of it.
+ */
+
+#include "gfx.h"
+#include "gui.h"
+#include "gui/home.h"
+#include "gui/settings.h"
+#include "message.h"
+#include "sensor.h"
+#include "temp_control.h"
+#include "vlcd.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+#define FRAME_MS            250       // at least one 100 ms paint
+#define NUM_PIXELS          (DISP_WIDTH * DISP_HEIGHT)
+#define MAX_OVERDRAWN       0         // pixels written more than once a frame
+
+
+static void begin_frame(void);
+static vlcd_stats_t end_frame(const char* name, uint32_t before, uint32_t max_writes);
+static void publish_sample(sensor_id_t sensor, float value);
+static void publish_output(output_id_t output, bool enabled);
+static void check(bool ok, const char* what);
+
+
+static uint16_t fb[NUM_PIXELS];
+static uint32_t failures;
+static double frame_start;
+
+
+int
+main()
+{
+  widget_t* home;
+  vlcd_stats_t s;
+
+  sim_init();
+  msg_init();
+  gfx_init();
+  lcd_init();
+  gui_init();
+  // let the GUI thread start up
+  chThdSleepMilliseconds(1);
+
+  printf("%-28s %8s %8s %8s %10s %10s %8s\n", "frame", "before", "writes", "pixels", "overdrawn",
+      "transfers", "host ms");
+
+  begin_frame();
+  home = home_screen_create();
+  gui_push_screen(home);
+  s = end_frame("home, full paint", 171764, NUM_PIXELS);
+  check(s.pixels == NUM_PIXELS, "a full paint covers the display");
+
+  begin_frame();
+  end_frame("home, idle", 0, 0);
+
+  begin_frame();
+  publish_sample(SENSOR_1, 66.5f);
+  s = end_frame("home, sensor sample", 23324, 16000);
+  check(s.writes > 0, "a sensor sample is painted");
+
+  begin_frame();
+  publish_output(OUTPUT_1, true);
+  s = end_frame("home, output on", 7488, 5400);
+  check(s.writes > 0, "an output change is painted");
+
+  /* The damaged areas repainted give the same screen as a full paint */
+  memcpy(fb, vlcd_frame_buffer(), sizeof(fb));
+  begin_frame();
+  widget_invalidate(home);
+  end_frame("home, full repaint", 171764, NUM_PIXELS);
+  check(memcmp(fb, vlcd_frame_buffer(), sizeof(fb)) == 0,
+      "updates leave the screen as a full repaint does");
+
+  begin_frame();
+  gui_push_screen(settings_screen_create());
+  s = end_frame("settings, full paint", 238096, NUM_PIXELS);
+  check(s.pixels == NUM_PIXELS, "a full paint covers the display");
+
+  begin_frame();
+  end_frame("settings, idle", 0, 0);
+
+  begin_frame();
+  publish_sample(SENSOR_1, 67.0f);
+  end_frame("settings, sample for home", 0, 0);
+
+  begin_frame();
+  gui_pop_screen();
+  s = end_frame("home, back from settings", 171764, NUM_PIXELS);
+  check(s.pixels == NUM_PIXELS, "a full paint covers the display");
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+static void
+begin_frame()
+{
+  vlcd_reset_stats();
+  frame_start = sim_wall_clock();
+}
+
+/* before: pixels the renderer before damage tracking wrote for the frame */
+static vlcd_stats_t
+end_frame(const char* name, uint32_t before, uint32_t max_writes)
+{
+  vlcd_stats_t s;
+
+  chThdSleepMilliseconds(FRAME_MS);
+  vlcd_get_stats(&s);
+
+  printf("%-28s %8u %8u %8u %10u %10u %8.3f\n", name, (unsigned)before, (unsigned)s.writes,
+      (unsigned)s.pixels, (unsigned)s.overdrawn, (unsigned)s.transfers,
+      (sim_wall_clock() - frame_start) * 1000);
+
+  check(s.out_of_bounds == 0, "nothing is written outside the display");
+  check(s.writes <= max_writes, "the frame's writes are within their limit");
+  check(s.overdrawn <= MAX_OVERDRAWN, "no pixel is written twice in a frame");
+
+  return s;
+}
+
+static void
+publish_sample(sensor_id_t sensor, float value)
+{
+  sensor_msg_t msg = {
+      .sensor = sensor,
+      .sample = { .value = value, .unit = UNIT_TEMP_DEG_F },
+      .timestamp = chTimeNow(),
+  };
+
+  msg_publish(MSG_SENSOR_SAMPLE, sensor, &msg, sizeof(msg));
+}
+
+static void
+publish_output(output_id_t output, bool enabled)
+{
+  output_status_t status = {
+      .output = output,
+      .enabled = enabled,
+  };
+
+  msg_publish(MSG_OUTPUT_STATUS, output, &status, sizeof(status));
+}
+
+static void
+check(bool ok, const char* what)
+{
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
@@ -0,0 +1,272 @@
+/* Host benchmark and agreement check of the Q16.16 PID step
+ * (src/app_mt/pid.c) against the same step in float (pid_float.c).
+ *
+ * Both are driven through the same probe trace: a slow swing around the
+ * setpoint, wide enough to saturate the output, with probe noise on top.
+ * Every combination of output sign, anti-windup mode and gain tuning is
+ * run twice. Once with the float step started from the Q16.16 state every
+ * time, which shows the rounding of a single step; it fails if that is
+ * over MAX_STEP_DIFF. And once with both running free, where a step that
+ * rounds to the other side of the clamp's limit sends the integrators
+ * apart until the output saturates; it fails if their RMS difference is
+ * over MAX_RMS_DIFF. A step given a NAN setpoint or rate must hold the
+ * output and state, and the next step with both known must then run.
+ *
+ * The host has an FPU and the F205 doesn't, so the timings only compare
+ * the two here; on the device float is done in software.
+ */
+
+#include "pid.h"
+#include "pid_float.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <math.h>
+
+
+#define NUM_STEPS           50000     // about 28 hours at 2 s
+#define NUM_TIMED_STEPS     2000000
+#define SETPOINT            68
+#define OUTPUT_LIMIT        20        // as temp_control.c
+#define MAX_STEP_DIFF       0.001f    // deg F
+#define MAX_RMS_DIFF        0.1f      // deg F
+
+
+typedef struct {
+  float sample;
+  float rate;
+} probe_t;
+
+static void run_case(int8_t sign, pid_anti_windup_t anti_windup, bool auto_tune);
+static void nan_case(void);
+static void sync_ref(pid_float_t* ref, const pid_t* pid);
+static void time_steps(void);
+static probe_t probe(uint32_t step, float sample_time_s);
+static float noise(void);
+
+
+static uint32_t rng = 1;
+static uint32_t failures;
+
+
+int
+main()
+{
+  int8_t sign;
+  int aw;
+
+  sim_init();
+
+  for (sign = POSITIVE; sign <= NEGATIVE; ++sign) {
+    for (aw = PID_AW_CLAMP; aw <= PID_AW_BACK_CALC; ++aw) {
+      run_case(sign, aw, false);
+      run_case(sign, aw, true);
+    }
+  }
+
+  nan_case();
+  time_steps();
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+static void
+init_pair(pid_t* pid, pid_float_t* ref, pid_settings_t* settings, int8_t sign)
+{
+  pid_init(pid);
+  pid_apply_settings(pid, settings);
+  pid_set_output_limits(pid, -OUTPUT_LIMIT, OUTPUT_LIMIT);
+  pid_set_output_sign(pid, sign);
+  pid_enable(pid, SETPOINT, true);
+
+  pid_float_init(ref, settings, sign, -OUTPUT_LIMIT, OUTPUT_LIMIT);
+}
+
+static void
+run_case(int8_t sign, pid_anti_windup_t anti_windup, bool auto_tune)
+{
+  pid_settings_t settings;
+  pid_t pid, free_pid;
+  pid_float_t ref, free_ref;
+  float max_step_diff = 0;
+  double sum_sq = 0;
+  uint32_t saturated = 0;
+  uint32_t i;
+
+  pid_get_default_settings(&settings);
+  settings.anti_windup = anti_windup;
+  settings.auto_tune = auto_tune;
+  init_pair(&pid, &ref, &settings, sign);
+  init_pair(&free_pid, &free_ref, &settings, sign);
+
+  rng = 1;
+  for (i = 0; i < NUM_STEPS; ++i) {
+    probe_t p = probe(i, ref.sample_time_s);
+    float diff;
+
+    /* One step from the same state */
+    sync_ref(&ref, &pid);
+    pid.last_time = chTimeNow() - pid.sample_time;
+    pid_exec(&pid, SETPOINT, p.sample, p.rate);
+    pid_float_exec(&ref, SETPOINT, p.sample, p.rate);
+
+    diff = fabsf(pid_get_output(&pid) - ref.out);
+    if (diff > max_step_diff)
+      max_step_diff = diff;
+
+    /* Free running */
+    free_pid.last_time = chTimeNow() - free_pid.sample_time;
+    pid_exec(&free_pid, SETPOINT, p.sample, p.rate);
+    pid_float_exec(&free_ref, SETPOINT, p.sample, p.rate);
+
+    diff = pid_get_output(&free_pid) - free_ref.out;
+    sum_sq += diff * diff;
+    if (fabsf(free_ref.out) >= OUTPUT_LIMIT)
+      saturated++;
+  }
+
+  float rms_diff = sqrt(sum_sq / NUM_STEPS);
+
+  printf("%s %s%s: step diff %.5f F, free running rms diff %.4f F (%u%% saturated)\n",
+      (sign == POSITIVE) ? "heating" : "cooling",
+      (anti_windup == PID_AW_CLAMP) ? "clamp" : "back-calc",
+      auto_tune ? ", tuning" : "",
+      max_step_diff, rms_diff, (unsigned)((saturated * 100) / NUM_STEPS));
+
+  if (max_step_diff > MAX_STEP_DIFF) {
+    printf("FAIL: a step differs by more than %.3f F\n", MAX_STEP_DIFF);
+    failures++;
+  }
+  if (rms_diff > MAX_RMS_DIFF) {
+    printf("FAIL: free running outputs differ by more than %.3f F rms\n", MAX_RMS_DIFF);
+    failures++;
+  }
+}
+
+static void
+nan_step(pid_t* pid, float setpoint, float rate, const char* what)
+{
+  fix16_t out = pid->out;
+  fix16_t err_i = pid->err_i;
+  fix16_t d_term = pid->d_term;
+
+  pid->last_time = chTimeNow() - pid->sample_time;
+  pid_exec(pid, setpoint, SETPOINT + 1, rate);
+
+  if (pid->out != out || pid->err_i != err_i || pid->d_term != d_term) {
+    printf("FAIL: a step with %s changes the output\n", what);
+    failures++;
+  }
+}
+
+static void
+nan_case()
+{
+  pid_settings_t settings;
+  pid_t pid;
+  pid_float_t ref;
+  fix16_t out;
+  uint32_t i;
+
+  pid_get_default_settings(&settings);
+  init_pair(&pid, &ref, &settings, POSITIVE);
+
+  rng = 1;
+  for (i = 0; i < 100; ++i) {
+    probe_t p = probe(i, ref.sample_time_s);
+    pid.last_time = chTimeNow() - pid.sample_time;
+    pid_exec(&pid, SETPOINT, p.sample, p.rate);
+  }
+
+  nan_step(&pid, NAN, 0, "no setpoint");
+  nan_step(&pid, SETPOINT, NAN, "no rate");
+  nan_step(&pid, NAN, NAN, "neither");
+
+  out = pid.out;
+  pid.last_time = chTimeNow() - pid.sample_time;
+  pid_exec(&pid, SETPOINT, SETPOINT + 1, 0);
+  if (pid.out == out) {
+    printf("FAIL: the step after a NAN setpoint or rate does not run\n");
+    failures++;
+  }
+
+  printf("nan setpoint/rate: output held at %.3f\n", FIX16_2F(out));
+}
+
+/* Starts the float step from the Q16.16 state */
+static void
+sync_ref(pid_float_t* ref, const pid_t* pid)
+{
+  ref->kp = FIX16_2F(pid->kp);
+  ref->ki = FIX16_2F(pid->ki);
+  ref->kd = FIX16_2F(pid->kd);
+  ref->kb = FIX16_2F(pid->kb);
+  ref->d_alpha = FIX16_2F(pid->d_alpha);
+  ref->err_i = FIX16_2F(pid->err_i);
+  ref->err_i_tune = FIX16_2F(pid->err_i_tune);
+  ref->d_term = FIX16_2F(pid->d_term);
+  ref->last_err = FIX16_2F(pid->last_err);
+  ref->out = FIX16_2F(pid->out);
+}
+
+static void
+time_steps()
+{
+  pid_settings_t settings;
+  pid_t pid;
+  pid_float_t ref;
+  static probe_t trace[1024];
+  volatile float sink = 0;
+  double start, fixed_time, float_time;
+  uint32_t i;
+
+  pid_get_default_settings(&settings);
+  init_pair(&pid, &ref, &settings, POSITIVE);
+  for (i = 0; i < 1024; ++i)
+    trace[i] = probe(i, ref.sample_time_s);
+
+  start = sim_wall_clock();
+  for (i = 0; i < NUM_TIMED_STEPS; ++i) {
+    pid.last_time = chTimeNow() - pid.sample_time;
+    pid_exec(&pid, SETPOINT, trace[i % 1024].sample, trace[i % 1024].rate);
+    sink += pid_get_output(&pid);
+  }
+  fixed_time = sim_wall_clock() - start;
+
+  start = sim_wall_clock();
+  for (i = 0; i < NUM_TIMED_STEPS; ++i) {
+    pid_float_exec(&ref, SETPOINT, trace[i % 1024].sample, trace[i % 1024].rate);
+    sink += ref.out;
+  }
+  float_time = sim_wall_clock() - start;
+
+  printf("step time on the host: Q16.16 %.1f ns, float %.1f ns\n",
+      (fixed_time * 1e9) / NUM_TIMED_STEPS, (float_time * 1e9) / NUM_TIMED_STEPS);
+}
+
+/* A 3 deg F swing around the setpoint every 4 hours, with probe noise */
+static probe_t
+probe(uint32_t step, float sample_time_s)
+{
+  float t = step * sample_time_s;
+  float w = (2 * (float)M_PI) / (4 * 3600);
+  probe_t p = {
+      .sample = SETPOINT + (3 * sinf(w * t)) + noise(),
+      .rate = 3 * w * cosf(w * t)
+  };
+
+  return p;
+}
+
+/* Uniform within +-0.06 deg F */
+static float
+noise()
+{
+  rng = (rng * 1103515245) + 12345;
+  return ((float)((rng >> 16) & 0x7FFF) / 0x7FFF - 0.5f) * 0.12f;
+}
@@ -0,0 +1,81 @@
+#include "pid_float.h"
+
+#include <string.h>
+
+
+#define GAMMA       0.005f
+#define KP_MAX      50.0f
+#define KI_MAX      5.0f
+#define KD_MAX      5.0f
+
+
+void
+pid_float_init(pid_float_t* pid, const pid_settings_t* settings, int8_t output_sign,
+    float out_min, float out_max)
+{
+  memset(pid, 0, sizeof(*pid));
+
+  pid->auto_mode = settings->auto_tune;
+  pid->anti_windup = settings->anti_windup;
+  pid->output_sign = output_sign;
+  pid->d_alpha = LIMIT(settings->d_filter, 0.01f, 1.0f);
+  pid->sample_time_s = MAX(settings->sample_time, 100) / 1000.0f;
+
+  pid->kp = settings->kp;
+  pid->ki = settings->ki * pid->sample_time_s;
+  pid->kd = settings->kd / pid->sample_time_s;
+  pid->kb = (pid->kp > 0) ? LIMIT(pid->ki / pid->kp, 0, 1) : 1;
+
+  pid->out_min = out_min;
+  pid->out_max = out_max;
+}
+
+void
+pid_float_exec(pid_float_t* pid, float setpoint, float sample, float rate)
+{
+  float err_p = setpoint - sample;
+  float d_input = rate * pid->sample_time_s;
+  float out;
+
+  if (pid->output_sign == NEGATIVE) {
+    err_p = -err_p;
+    d_input = -d_input;
+  }
+
+  pid->err_i_tune = LIMIT(pid->err_i_tune + err_p, pid->out_min, pid->out_max);
+
+  if (pid->auto_mode) {
+    float step = GAMMA * err_p;
+
+    pid->kp = LIMIT(pid->kp - step, 0, KP_MAX);
+    pid->ki = LIMIT(pid->ki - (step * pid->err_i_tune), 0, KI_MAX);
+    pid->kd = LIMIT(pid->kd - (step * (err_p - pid->last_err)), 0, KD_MAX);
+  }
+
+  pid->d_term += pid->d_alpha * ((-pid->kd * d_input) - pid->d_term);
+
+  float p_term = pid->kp * err_p;
+  float i_step = pid->ki * err_p;
+
+  switch (pid->anti_windup) {
+  case PID_AW_BACK_CALC:
+  {
+    float err_i = pid->err_i + i_step;
+    out = p_term + err_i + pid->d_term;
+    pid->err_i = err_i + (pid->kb * (LIMIT(out, pid->out_min, pid->out_max) - out));
+    break;
+  }
+
+  case PID_AW_CLAMP:
+  default:
+    out = p_term + pid->err_i + i_step + pid->d_term;
+    if (!(out > pid->out_max && i_step > 0) &&
+        !(out < pid->out_min && i_step < 0))
+      pid->err_i += i_step;
+    pid->err_i = LIMIT(pid->err_i, pid->out_min, pid->out_max);
+    break;
+  }
+
+  pid->out = LIMIT(p_term + pid->err_i + pid->d_term, pid->out_min, pid->out_max);
+  pid->last_err = err_p;
+}
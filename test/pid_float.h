@@ -0,0 +1,41 @@
+#ifndef PID_FLOAT_H
+#define PID_FLOAT_H
+
+#include "pid.h"
+
+/* The PID step of src/app_mt/pid.c in single precision float, as a
+ * reference for its Q16.16 arithmetic. Steps are taken every sample time;
+ * there is no clock.
+ */
+
+typedef struct {
+  bool auto_mode;
+  pid_anti_windup_t anti_windup;
+  int8_t output_sign;
+
+  float kp;
+  float ki;
+  float kd;
+  float kb;
+  float d_alpha;
+  float sample_time_s;
+
+  float err_i;
+  float err_i_tune;
+  float d_term;
+  float last_err;
+
+  float out;
+  float out_min;
+  float out_max;
+} pid_float_t;
+
+
+void
+pid_float_init(pid_float_t* pid, const pid_settings_t* settings, int8_t output_sign,
+    float out_min, float out_max);
+
+void
+pid_float_exec(pid_float_t* pid, float setpoint, float sample, float rate);
+
+#endif
@@ -0,0 +1,398 @@
+/* Closed loop simulation of the control loop (src/app_mt/temp_control.c
+ * with pid.c, temp_profile.c and the probes' sensor_filter.c) driving a
+ * simulated fermenter on the virtual clock.
+ *
+ * The fermenter is 20 L of wort in an insulated chamber with a heat wrap
+ * and a small chiller whose compressor takes a few minutes to reach full
+ * power. Its probe is read once a second like a DS18B20 at 12 bits, with
+ * a little noise, and filtered like sensor.c does. Controller 1 reads it
+ * and drives the heater on output 1 and the chiller on output 2.
+ *
+ * Each scenario sends new settings and runs for days of simulated time,
+ * measuring the step response to the setpoint: overshoot, settling time
+ * into a band around it, relay cycles and short cycles (a relay switched back
+ * on within its cycle delay). It fails if any is over the scenario's
+ * limits.
+ */
+
+#include "message.h"
+#include "sensor.h"
+#include "sensor_filter.h"
+#include "temp_control.h"
+#include "temp_profile.h"
+#include "app_cfg.h"
+#include "control_stubs.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <math.h>
+
+
+#define SAMPLE_PERIOD_MS    1000
+#define CYCLE_DELAY_MIN     3
+
+#define PROBE               SENSOR_1
+#define HEATER              OUTPUT_1
+#define CHILLER             OUTPUT_2
+
+#define C_TO_F(t)           (((t) * 1.8f) + 32)
+#define HOURS(h)            ((uint64_t)(h) * 3600 * 1000000)
+
+/* Fermenter and chamber model. All values are SI (W, J/K, s, deg C). */
+typedef struct {
+  float heat_capacity;    // wort mass * specific heat
+  float ambient_loss;     // W/K through the chamber walls
+  float ambient_temp;
+  float heater_power;
+  float chiller_power;
+  float compressor_lag;   // time constant for the chiller to reach full power
+} plant_params_t;
+
+typedef struct {
+  const char* name;
+  output_ctrl_t control_mode;
+  bool adaptive;          // PID gains tune themselves, as by default
+  float start_temp;       // deg C
+  float setpoint;         // deg F, or NAN to run a temp profile
+  uint32_t hours;
+
+  /* Limits */
+  float max_overshoot;    // deg F
+  float settle_band;      // deg F either side of the setpoint
+  uint32_t max_settle_min;
+  uint32_t max_cycles_per_day;
+} scenario_t;
+
+typedef struct {
+  bool on;
+  uint32_t cycles;
+  uint32_t short_cycles;
+  uint64_t off_time;      // usec, when it last switched off
+} relay_t;
+
+
+static void run_scenario(const scenario_t* s);
+static void dispatch_plant_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+static msg_t probe_thread(void* arg);
+static void plant_step(void);
+static void track_setpoint(float temp, float band);
+static float noise(void);
+
+
+static const plant_params_t plant_params = {
+    .heat_capacity  = 20 * 4186,
+    .ambient_loss   = 2,
+    .ambient_temp   = 22,
+    .heater_power   = 60,
+    .chiller_power  = 150,
+    .compressor_lag = 180,
+};
+
+/* Hold at 64 F, then ramp up to 68 F over a day for the diacetyl rest */
+static const temp_profile_t diacetyl_rest = {
+    .id = 0,
+    .name = "diacetyl rest",
+    .num_steps = 2,
+    .start_value = { .value = 64, .unit = UNIT_TEMP_DEG_F },
+    .steps = {
+        { .duration = 2 * 24 * 3600, .value = { .value = 64, .unit = UNIT_TEMP_DEG_F }, .type = STEP_HOLD },
+        { .duration = 24 * 3600, .value = { .value = 68, .unit = UNIT_TEMP_DEG_F }, .type = STEP_RAMP },
+    }
+};
+
+static const scenario_t scenarios[] = {
+    {
+        .name = "PID cool to 64 F",
+        .control_mode = PID,
+        .start_temp = 22,
+        .setpoint = 64,
+        .hours = 48,
+        .max_overshoot = 1.5f,
+        .settle_band = 0.5f,
+        .max_settle_min = 180,
+        .max_cycles_per_day = 400,
+    },
+    {
+        .name = "PID heat to 68 F",
+        .control_mode = PID,
+        .start_temp = 14,
+        .setpoint = 68,
+        .hours = 48,
+        .max_overshoot = 1.0f,
+        .settle_band = 0.5f,
+        .max_settle_min = 240,
+        .max_cycles_per_day = 500,
+    },
+    {
+        .name = "adaptive PID cool to 64 F",
+        .control_mode = PID,
+        .adaptive = true,
+        .start_temp = 22,
+        .setpoint = 64,
+        .hours = 48,
+        .max_overshoot = 1.0f,
+        .settle_band = 1.0f,
+        .max_settle_min = 240,
+        .max_cycles_per_day = 500,
+    },
+    {
+        .name = "ON_OFF cool to 64 F",
+        .control_mode = ON_OFF,
+        .start_temp = 22,
+        .setpoint = 64,
+        .hours = 48,
+        .max_overshoot = 1.0f,
+        .settle_band = 1.0f,
+        .max_settle_min = 240,
+        .max_cycles_per_day = 150,
+    },
+    {
+        .name = "PID profile 64 F to 68 F",
+        .control_mode = PID,
+        .start_temp = 22,
+        .setpoint = NAN,
+        .hours = 72,
+        .max_overshoot = 1.5f,
+        .settle_band = 0.5f,
+        .max_settle_min = 240,
+        .max_cycles_per_day = 480,
+    },
+};
+
+static float wort_temp;
+static float chiller_output;
+static uint64_t last_step_time;
+static sensor_filter_t filter;
+static uint32_t seq;
+static uint32_t rng = 1;
+
+static relay_t relays[NUM_OUTPUTS];
+static const scenario_t* scenario;
+
+/* Step response to the current setpoint */
+static float setpoint;
+static int approach;
+static bool crossed;
+static float overshoot;
+static uint64_t setpoint_time;
+static uint64_t last_unsettled_time;
+
+static uint32_t failures;
+
+
+int
+main()
+{
+  unsigned i;
+
+  sim_init();
+  msg_init();
+  control_stubs_init();
+  app_cfg_set_temp_profile(&diacetyl_rest, diacetyl_rest.id);
+
+  temp_control_init();
+
+  msg_listener_t* l = msg_listener_create("plant", 1024, MSG_PRIO_CONTROL, 8, dispatch_plant_msg, NULL);
+  msg_subscribe(l, MSG_OUTPUT_STATUS, NULL);
+
+  chThdCreateFromHeap(NULL, 1024, MSG_PRIO_CONTROL, probe_thread, NULL);
+
+  for (i = 0; i < (sizeof(scenarios) / sizeof(scenarios[0])); ++i)
+    run_scenario(&scenarios[i]);
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+static void
+run_scenario(const scenario_t* s)
+{
+  controller_settings_t* cs = control_stubs_controller_settings(CONTROLLER_1);
+  uint64_t start;
+  float days = s->hours / 24.0f;
+  float settle_min;
+  int i;
+
+  scenario = s;
+  plant_step();
+  wort_temp = s->start_temp;
+  chiller_output = 0;
+  setpoint = NAN;
+  for (i = 0; i < NUM_OUTPUTS; ++i)
+    relays[i].cycles = relays[i].short_cycles = 0;
+
+  app_cfg_set_control_mode(s->control_mode);
+  cs->sensor = PROBE;
+  cs->output_settings[HEATER].enabled = true;
+  cs->output_settings[HEATER].function = OUTPUT_FUNC_HEATING;
+  cs->output_settings[HEATER].cycle_delay.value = CYCLE_DELAY_MIN;
+  cs->output_settings[CHILLER].enabled = true;
+  cs->output_settings[CHILLER].function = OUTPUT_FUNC_COOLING;
+  cs->output_settings[CHILLER].cycle_delay.value = CYCLE_DELAY_MIN;
+  if (isnan(s->setpoint)) {
+    cs->setpoint_type = SP_TEMP_PROFILE;
+    cs->temp_profile_id = diacetyl_rest.id;
+  }
+  else {
+    cs->setpoint_type = SP_STATIC;
+    cs->static_setpoint.value = s->setpoint;
+  }
+  cs->pid_settings.auto_tune = s->adaptive;
+  msg_send(MSG_CONTROLLER_SETTINGS, cs);
+
+  start = sim_now();
+  while ((sim_now() - start) < HOURS(s->hours))
+    chThdSleepMilliseconds(60 * 1000);
+
+  settle_min = (last_unsettled_time - setpoint_time) / 60e6f;
+  printf("%s: %.2f F at sp %.2f F, overshoot %.2f F, settled in %.0f min\n",
+      s->name, C_TO_F(wort_temp), setpoint, overshoot, settle_min);
+  printf("  heater %u cycles, chiller %u cycles (%.0f per day), %u short cycles\n",
+      (unsigned)relays[HEATER].cycles, (unsigned)relays[CHILLER].cycles,
+      (relays[HEATER].cycles + relays[CHILLER].cycles) / days,
+      (unsigned)(relays[HEATER].short_cycles + relays[CHILLER].short_cycles));
+
+  if (overshoot > s->max_overshoot) {
+    printf("FAIL: overshoot over %.2f F\n", s->max_overshoot);
+    failures++;
+  }
+  if (settle_min > s->max_settle_min) {
+    printf("FAIL: not settled within %u min\n", (unsigned)s->max_settle_min);
+    failures++;
+  }
+  if ((relays[HEATER].cycles + relays[CHILLER].cycles) > (s->max_cycles_per_day * days)) {
+    printf("FAIL: over %u relay cycles per day\n", (unsigned)s->max_cycles_per_day);
+    failures++;
+  }
+  if ((relays[HEATER].short_cycles + relays[CHILLER].short_cycles) > 0) {
+    printf("FAIL: relays short cycled\n");
+    failures++;
+  }
+}
+
+static void
+dispatch_plant_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  output_status_t* status = msg_data;
+  relay_t* relay;
+
+  if ((id != MSG_OUTPUT_STATUS) ||
+      (status->output < 0) || (status->output >= NUM_OUTPUTS))
+    return;
+
+  relay = &relays[status->output];
+  if (status->enabled == relay->on)
+    return;
+
+  /* The plant runs up to now with the relay as it was */
+  plant_step();
+
+  if (status->enabled) {
+    if ((relay->off_time != 0) &&
+        ((sim_now() - relay->off_time) < (CYCLE_DELAY_MIN * 60 * 1000000ULL)))
+      relay->short_cycles++;
+    relay->cycles++;
+  }
+  else {
+    relay->off_time = sim_now();
+  }
+  relay->on = status->enabled;
+}
+
+static msg_t
+probe_thread(void* arg)
+{
+  sensor_filter_settings_t fs;
+  systime_t last_sample_time = chTimeNow();
+
+  chRegSetThreadName("probe");
+  sensor_filter_get_default_settings(&fs);
+  sensor_filter_init(&filter, &fs);
+
+  while (1) {
+    sensor_msg_t msg;
+    float temp;
+
+    chThdSleepMilliseconds(SAMPLE_PERIOD_MS);
+    plant_step();
+
+    /* 12 bit DS18B20: 1/16 deg C steps */
+    temp = C_TO_F(roundf((wort_temp + noise()) * 16) / 16);
+    track_setpoint(C_TO_F(wort_temp), scenario->settle_band);
+
+    msg.sensor = PROBE;
+    msg.sample.unit = UNIT_TEMP_DEG_F;
+    msg.sample.value = sensor_filter_apply(&filter, temp,
+        (float)(chTimeNow() - last_sample_time) / CH_FREQUENCY);
+    msg.timestamp = chTimeNow();
+    msg.seq = seq++;
+    msg.rate = sensor_filter_get_rate(&filter);
+    msg.sample_period = chTimeNow() - last_sample_time;
+    last_sample_time = chTimeNow();
+
+    msg_publish(MSG_SENSOR_SAMPLE, PROBE, &msg, sizeof(msg));
+  }
+  return 0;
+}
+
+/* Integrates the fermenter from the last step to now */
+static void
+plant_step()
+{
+  float dt = (sim_now() - last_step_time) / 1e6f;
+  float power;
+
+  last_step_time = sim_now();
+
+  chiller_output += ((relays[CHILLER].on ? plant_params.chiller_power : 0) - chiller_output) *
+      fminf(1, dt / plant_params.compressor_lag);
+
+  power = (plant_params.ambient_loss * (plant_params.ambient_temp - wort_temp)) - chiller_output;
+  if (relays[HEATER].on)
+    power += plant_params.heater_power;
+
+  wort_temp += (power / plant_params.heat_capacity) * dt;
+}
+
+static void
+track_setpoint(float temp, float band)
+{
+  float sp = temp_control_get_current_setpoint(CONTROLLER_1);
+  float err;
+
+  if (isnan(sp))
+    return;
+
+  /* Restart the step response when the setpoint moves by more than a
+   * ramp would in a few minutes
+   */
+  if (isnan(setpoint) || (fabsf(sp - setpoint) > band)) {
+    approach = (sp > temp) ? 1 : -1;
+    crossed = false;
+    overshoot = 0;
+    setpoint_time = sim_now();
+    last_unsettled_time = sim_now();
+  }
+  setpoint = sp;
+
+  err = (temp - sp) * approach;
+  if (err >= 0)
+    crossed = true;
+  if (crossed && (err > overshoot))
+    overshoot = err;
+
+  if (fabsf(temp - sp) > band)
+    last_unsettled_time = sim_now();
+}
+
+/* Probe noise, uniform within +-0.05 deg C */
+static float
+noise()
+{
+  rng = (rng * 1103515245) + 12345;
+  return ((float)((rng >> 16) & 0x7FFF) / 0x7FFF - 0.5f) * 0.1f;
+}
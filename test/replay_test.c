@@ -0,0 +1,237 @@
+/* Host test of the sensor replay source (src/app_mt/sensor_replay.c)
+ * playing a trace from an in-memory replay partition at
+ * SENSOR_REPLAY_SPEED times real time.
+ *
+ * The trace has two probes ramping at known rates with different sample
+ * periods and a gap, and a record for a sensor id out of range. A listener
+ * takes every MSG_SENSOR_SAMPLE and checks that each record comes out once
+ * a loop, in order, with its value, on time at the playback speed, that
+ * sequence numbers have no gaps across loops, that sample periods are in
+ * trace time and start over with each loop, and that the rate estimate
+ * follows the ramp in trace units. Before that, a partition without a
+ * trace must publish nothing.
+ *
+ * replay_test_long plays an 80 minute trace at 1x, past the 71.6 minutes
+ * at which milliseconds overflow 32 bits when converted to ticks.
+ */
+
+#include "sensor_replay.h"
+#include "sensor.h"
+#include "message.h"
+#include "sxfs.h"
+#include "thread_watchdog.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+
+#ifndef TRACE_MS
+#define TRACE_MS            600000    // 10 minutes
+#endif
+#define PROBE0_PERIOD_MS    1000
+#define PROBE1_PERIOD_MS    750
+#define GAP_START_MS        200000    // probe 1 misses samples...
+#define GAP_END_MS          205000    // ...until here
+#define PROBE0_RATE         0.01f     // deg F per s of trace time
+#define PROBE1_RATE         -0.02f
+#ifndef NUM_LOOPS
+#define NUM_LOOPS           3
+#endif
+
+#ifndef MAX_RECORDS
+#define MAX_RECORDS         2000
+#endif
+#define RATE_SETTLE         60        // samples of a probe before its rate is checked
+#define MAX_RATE_ERROR      0.01f     // of the ramp's rate
+
+
+static void build_trace(void);
+static void add_record(uint32_t time, uint8_t sensor, float value);
+static void dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+static void check(bool ok, const char* what);
+
+
+static struct {
+  sensor_replay_hdr_t hdr;
+  sensor_replay_record_t recs[MAX_RECORDS];
+} partition;
+
+/* The records a listener should see, without the one out of range */
+static uint32_t num_expected;
+static uint32_t next;
+static uint32_t loops;
+static uint64_t loop_start;
+static uint32_t loop_samples[NUM_SENSORS];
+static uint32_t next_seq[NUM_SENSORS];
+static uint32_t last_time[NUM_SENSORS];
+static uint32_t samples;
+static uint64_t max_late;
+static uint32_t failures;
+
+
+void
+thread_watchdog_enable(Thread* tp, systime_t period)
+{
+}
+
+void
+thread_watchdog_kick()
+{
+}
+
+bool
+sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  if (part_id != SP_SENSOR_REPLAY || (offset + data_len) > sizeof(partition))
+    return false;
+
+  memcpy(data, (uint8_t*)&partition + offset, data_len);
+  return true;
+}
+
+int
+main()
+{
+  msg_listener_t* l;
+  uint32_t run_ms;
+
+  sim_init();
+  msg_init();
+
+  l = msg_listener_create("replay_test", 1024, MSG_PRIO_CONTROL + 1, 16, dispatch, NULL);
+  msg_subscribe(l, MSG_SENSOR_SAMPLE, NULL);
+
+  /* An erased partition */
+  memset(&partition, 0xFF, sizeof(partition));
+  sensor_replay_init();
+  chThdSleepSeconds(10);
+  check(samples == 0, "nothing published without a trace");
+
+  /* A loop ends with its last record, and the next one starts right away.
+   * Stop half way through the one after NUM_LOOPS.
+   */
+  build_trace();
+  sensor_replay_init();
+  run_ms = ((NUM_LOOPS * partition.recs[partition.hdr.num_records - 1].time) +
+      (TRACE_MS / 2)) / SENSOR_REPLAY_SPEED;
+  chThdSleepSeconds(run_ms / 1000);
+  chThdSleepMilliseconds(run_ms % 1000);
+
+  printf("%u records at %ux: %u samples in %u loops, at most %u ms late\n",
+      (unsigned)partition.hdr.num_records, SENSOR_REPLAY_SPEED, (unsigned)samples,
+      (unsigned)loops, (unsigned)(max_late / 1000));
+
+  check(loops == (NUM_LOOPS + 1), "the trace loops");
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+static void
+dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  const sensor_msg_t* msg = msg_data;
+  const sensor_replay_record_t* rec;
+  uint64_t due, late;
+
+  if (id != MSG_SENSOR_SAMPLE)
+    return;
+
+  /* The out of range record is never published */
+  rec = &partition.recs[next];
+  if (rec->sensor >= NUM_SENSORS)
+    rec = &partition.recs[++next];
+
+  if (next == 0) {
+    if (loops > 0)
+      check((loop_samples[0] + loop_samples[1]) == num_expected,
+          "every record published once a loop");
+    memset(loop_samples, 0, sizeof(loop_samples));
+    loop_start = sim_now();
+    loops++;
+  }
+
+  check(msg->sensor == rec->sensor && msg->sample.value == rec->value,
+      "records are published in order with their values");
+  check(msg->sample.unit == UNIT_TEMP_DEG_F, "samples are in deg F");
+
+  due = loop_start + (((uint64_t)rec->time * 1000) / SENSOR_REPLAY_SPEED);
+  late = (sim_now() > due) ? (sim_now() - due) : (due - sim_now());
+  if (late > max_late)
+    max_late = late;
+  check(late <= 1000, "published at the trace time over the playback speed");
+
+  check(msg->seq == next_seq[msg->sensor], "no gaps in sequence numbers");
+  next_seq[msg->sensor] = msg->seq + 1;
+
+  if (loop_samples[msg->sensor] == 0)
+    check(msg->sample_period == 0, "no period for the first sample of a loop");
+  else
+    check(msg->sample_period == (rec->time - last_time[msg->sensor]),
+        "sample periods are in trace time");
+  last_time[msg->sensor] = rec->time;
+
+  if (++loop_samples[msg->sensor] > RATE_SETTLE) {
+    float rate = (msg->sensor == 0) ? PROBE0_RATE : PROBE1_RATE;
+    check(fabsf(msg->rate - rate) <= fabsf(rate * MAX_RATE_ERROR),
+        "rate follows the ramp in trace time");
+  }
+
+  samples++;
+  if (++next == partition.hdr.num_records)
+    next = 0;
+}
+
+static void
+build_trace()
+{
+  uint32_t t0 = 0, t1 = 0;
+
+  memset(&partition, 0xFF, sizeof(partition));
+  partition.hdr.magic = SENSOR_REPLAY_MAGIC;
+  partition.hdr.num_records = 0;
+  num_expected = 0;
+
+  while (t0 < TRACE_MS || t1 < TRACE_MS) {
+    if (t0 <= t1) {
+      if (t0 == (TRACE_MS / 2))
+        add_record(t0, NUM_SENSORS, 0);
+      add_record(t0, 0, 60 + ((PROBE0_RATE * t0) / 1000));
+      t0 += PROBE0_PERIOD_MS;
+    }
+    else {
+      if (t1 < GAP_START_MS || t1 >= GAP_END_MS)
+        add_record(t1, 1, 70 + ((PROBE1_RATE * t1) / 1000));
+      t1 += PROBE1_PERIOD_MS;
+    }
+  }
+}
+
+static void
+add_record(uint32_t time, uint8_t sensor, float value)
+{
+  sensor_replay_record_t* rec = &partition.recs[partition.hdr.num_records++];
+
+  memset(rec, 0, sizeof(*rec));
+  rec->time = time;
+  rec->sensor = sensor;
+  rec->value = value;
+
+  if (sensor < NUM_SENSORS)
+    num_expected++;
+}
+
+static void
+check(bool ok, const char* what)
+{
+  if (!ok) {
+    printf("FAIL at %.3f s: %s\n", sim_now() / 1e6, what);
+    failures++;
+  }
+}
@@ -0,0 +1,177 @@
+#ifndef SIM_CH_H
+#define SIM_CH_H
+
+/* Host stand-in for the subset of the ChibiOS 2.x kernel API used by the
+ * app. Threads are ucontext coroutines run by a single core, strictly
+ * priority based scheduler on a virtual clock (see sim.h), so runs are
+ * deterministic and simulated time only passes when threads sleep, wait
+ * or call sim_cpu().
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <ucontext.h>
+
+#define TRUE                    1
+#define FALSE                   0
+
+#define CH_FREQUENCY            1000
+#define CH_DBG_ENABLE_ASSERTS   TRUE
+
+typedef uint32_t systime_t;
+typedef uint32_t tprio_t;
+typedef int32_t msg_t;
+typedef int32_t cnt_t;
+typedef uint8_t tstate_t;
+typedef msg_t (*tfunc_t)(void* arg);
+
+#define NOPRIO                  0
+#define IDLEPRIO                1
+#define LOWPRIO                 2
+#define NORMALPRIO              64
+#define HIGHPRIO                127
+
+#define TIME_IMMEDIATE          ((systime_t)0)
+#define TIME_INFINITE           ((systime_t)-1)
+
+#define RDY_OK                  0
+#define RDY_TIMEOUT             -1
+#define RDY_RESET               -2
+
+#define THD_STATE_READY         0
+#define THD_STATE_CURRENT       1
+#define THD_STATE_SUSPENDED     2
+#define THD_STATE_WTSEM         3
+#define THD_STATE_WTMTX         4
+#define THD_STATE_SLEEPING      5
+#define THD_STATE_WTEXIT        6
+#define THD_STATE_FINAL         7
+
+#define S2ST(sec)               ((systime_t)((sec) * CH_FREQUENCY))
+#define MS2ST(msec)             ((systime_t)((((msec) * CH_FREQUENCY) + 999UL) / 1000UL))
+#define US2ST(usec)             ((systime_t)((((usec) * CH_FREQUENCY) + 999999UL) / 1000000UL))
+
+typedef struct Thread Thread;
+
+typedef struct {
+  Thread* p_next;
+  Thread* p_prev;
+} ThreadsQueue;
+
+typedef struct Semaphore {
+  ThreadsQueue s_queue;
+  cnt_t s_cnt;
+} Semaphore;
+
+typedef struct {
+  Semaphore bs_sem;
+} BinarySemaphore;
+
+typedef struct Mutex {
+  ThreadsQueue m_queue;
+  Thread* m_owner;
+  struct Mutex* m_next;
+} Mutex;
+
+typedef struct {
+  void* mp_next;
+  size_t mp_object_size;
+  void* (*mp_provider)(size_t size);
+} MemoryPool;
+
+struct Thread {
+  Thread* p_next;
+  Thread* p_prev;
+  tprio_t p_prio;
+  tprio_t p_realprio;
+  tstate_t p_state;
+  const char* p_name;
+  msg_t p_rdymsg;
+  void* p_wtobjp;
+  Mutex* p_mtxlist;
+
+  /* THREAD_EXT_FIELDS of the app's chconf.h */
+  Semaphore mb_sem;
+  int local_errno;
+
+  /* simulator state */
+  uint64_t sim_wakeup;        // usec, 0 if no timeout is pending
+  bool sim_terminate;
+  msg_t sim_exitcode;
+  Thread* sim_joiner;
+  Thread* sim_all_next;
+  tfunc_t sim_func;
+  void* sim_arg;
+  ucontext_t sim_ctx;
+  void* sim_stack;
+};
+
+#define SEMAPHORE_DECL(name, n) Semaphore name = { { (Thread*)&name.s_queue, (Thread*)&name.s_queue }, (n) }
+#define MUTEX_DECL(name) Mutex name = { { (Thread*)&name.m_queue, (Thread*)&name.m_queue }, NULL, NULL }
+
+/* Interrupts never preempt simulated threads, so lock zones are empty */
+#define chSysLock()
+#define chSysUnlock()
+#define chSysLockFromIsr()
+#define chSysUnlockFromIsr()
+
+#define chDbgAssert(c, m, r)    do { if (!(c)) chDbgPanic(m); } while (0)
+
+void chDbgPanic(const char* msg);
+
+systime_t chTimeNow(void);
+
+Thread* chThdSelf(void);
+tprio_t chThdGetPriority(void);
+tprio_t chThdSetPriority(tprio_t prio);
+Thread* chThdCreateFromHeap(void* heapp, size_t size, tprio_t prio, tfunc_t pf, void* arg);
+Thread* chThdCreateStatic(void* wsp, size_t size, tprio_t prio, tfunc_t pf, void* arg);
+void chThdSleep(systime_t time);
+#define chThdSleepSeconds(sec)        chThdSleep(S2ST(sec))
+#define chThdSleepMilliseconds(msec)  chThdSleep(MS2ST(msec))
+#define chThdSleepMicroseconds(usec)  chThdSleep(US2ST(usec))
+void chThdYield(void);
+void chThdExit(msg_t msg);
+void chThdTerminate(Thread* tp);
+bool chThdShouldTerminate(void);
+msg_t chThdWait(Thread* tp);
+#define chRegSetThreadName(name)      (chThdSelf()->p_name = (name))
+#define WORKING_AREA(name, size)      uint8_t name[(size)]
+
+void chSchReadyI(Thread* tp);
+void chSchRescheduleS(void);
+Thread* dequeue(Thread* tp);
+
+void chSemInit(Semaphore* sp, cnt_t n);
+void chSemReset(Semaphore* sp, cnt_t n);
+msg_t chSemWait(Semaphore* sp);
+msg_t chSemWaitS(Semaphore* sp);
+msg_t chSemWaitTimeout(Semaphore* sp, systime_t time);
+msg_t chSemWaitTimeoutS(Semaphore* sp, systime_t time);
+void chSemSignal(Semaphore* sp);
+void chSemSignalI(Semaphore* sp);
+#define chSemGetCounterI(sp)    ((sp)->s_cnt)
+
+#define chBSemInit(bsp, taken)  chSemInit(&(bsp)->bs_sem, (taken) ? 0 : 1)
+void chBSemReset(BinarySemaphore* bsp, bool taken);
+msg_t chBSemWait(BinarySemaphore* bsp);
+msg_t chBSemWaitTimeout(BinarySemaphore* bsp, systime_t time);
+void chBSemSignal(BinarySemaphore* bsp);
+void chBSemSignalI(BinarySemaphore* bsp);
+
+void chMtxInit(Mutex* mp);
+void chMtxLock(Mutex* mp);
+bool chMtxTryLock(Mutex* mp);
+Mutex* chMtxUnlock(void);
+
+void chPoolInit(MemoryPool* mp, size_t size, void* (*provider)(size_t size));
+void chPoolLoadArray(MemoryPool* mp, void* p, size_t n);
+void* chPoolAlloc(MemoryPool* mp);
+void chPoolFree(MemoryPool* mp, void* objp);
+
+/* The LDREX/STREX pair can't fail without preemption */
+#define __LDREXW(p)             (*(volatile uint32_t*)(p))
+#define __STREXW(v, p)          ((*(volatile uint32_t*)(p) = (v)), 0)
+
+#endif
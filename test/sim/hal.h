@@ -0,0 +1,133 @@
+#ifndef SIM_HAL_H
+#define SIM_HAL_H
+
+/* Host stand-in for the parts of the ChibiOS HAL the app's portable code
+ * uses. The cycle counter runs at the F205's 120 MHz on the virtual clock.
+ */
+
+#include "ch.h"
+
+#define SIM_CPU_FREQ            120000000UL
+
+typedef uint32_t halrtcnt_t;
+
+halrtcnt_t halGetCounterValue(void);
+#define halGetCounterFrequency()  SIM_CPU_FREQ
+
+/* GPIO ports and the pins of board.h the app drives */
+typedef void* ioportid_t;
+
+#define GPIOA                   ((ioportid_t)0x40020000)
+#define GPIOC                   ((ioportid_t)0x40020800)
+#define PAD_RELAY1              4
+#define PAD_RELAY2              5
+#define PORT_TFT_RST            GPIOA
+#define PAD_TFT_RST             8
+
+#define palSetPad(port, pad)
+#define palClearPad(port, pad)
+#define palWritePad(port, pad, v)
+#define palReadPad(port, pad)   0
+
+/* UART driver, enough for the 1-Wire bus. A test that runs the bus supplies
+ * sim_usart[], uartStart() and friends and models the line itself.
+ */
+typedef struct {
+  volatile uint32_t SR;
+  volatile uint32_t DR;
+  volatile uint32_t BRR;
+  volatile uint32_t CR1;
+  volatile uint32_t CR2;
+  volatile uint32_t CR3;
+} USART_TypeDef;
+
+extern USART_TypeDef sim_usart[];
+
+#define USART1                  (&sim_usart[0])
+#define USART2                  (&sim_usart[1])
+#define USART6                  (&sim_usart[2])
+
+#define STM32_PCLK1             30000000
+#define STM32_PCLK2             60000000
+
+#define USART_SR_TC             0x0040
+#define USART_CR1_TCIE          0x0040
+#define USART_CR2_STOP1_BITS    0x0000
+#define USART_CR3_HDSEL         0x0008
+
+struct UARTDriver;
+typedef void (*uartcb_t)(struct UARTDriver* uartp);
+typedef void (*uartccb_t)(struct UARTDriver* uartp, uint16_t c);
+typedef void (*uartecb_t)(struct UARTDriver* uartp, uint16_t e);
+
+typedef struct {
+  uartcb_t txend1_cb;
+  uartcb_t txend2_cb;
+  uartcb_t rxend_cb;
+  uartccb_t rxchar_cb;
+  uartecb_t rxerr_cb;
+  uint32_t speed;
+  uint16_t cr1;
+  uint16_t cr2;
+  uint16_t cr3;
+} UARTConfig;
+
+typedef struct UARTDriver {
+  const UARTConfig* config;
+  USART_TypeDef* usart;
+} UARTDriver;
+
+void uartStart(UARTDriver* uartp, const UARTConfig* config);
+void uartStartSend(UARTDriver* uartp, size_t n, const void* txbuf);
+void uartStartSendI(UARTDriver* uartp, size_t n, const void* txbuf);
+size_t uartStopSend(UARTDriver* uartp);
+void uartStartReceive(UARTDriver* uartp, size_t n, void* rxbuf);
+void uartStartReceiveI(UARTDriver* uartp, size_t n, void* rxbuf);
+size_t uartStopReceive(UARTDriver* uartp);
+
+/* DMA streams, enough for the LCD. The stream registers are plain fields;
+ * a test that runs transfers supplies sim_dma_streams[], dmaStreamAllocate()
+ * and dmaStreamEnable(), and completes them by calling the stream's
+ * handler.
+ */
+typedef void (*stm32_dmaisr_t)(void* p, uint32_t flags);
+
+typedef struct {
+  const volatile void* par;
+  volatile void* m0ar;
+  uint32_t ndtr;
+  uint32_t cr;
+  uint32_t fcr;
+  stm32_dmaisr_t func;
+  void* param;
+} stm32_dma_stream_t;
+
+extern stm32_dma_stream_t sim_dma_streams[16];
+
+#define STM32_DMA_STREAM_ID(dma, stream)  ((((dma) - 1) * 8) + (stream))
+#define STM32_DMA_STREAM(id)              (&sim_dma_streams[id])
+
+#define STM32_DMA_CR_TEIE               (1 << 2)
+#define STM32_DMA_CR_TCIE               (1 << 4)
+#define STM32_DMA_CR_DIR_M2M            (2 << 6)
+#define STM32_DMA_CR_PINC               (1 << 9)
+#define STM32_DMA_CR_MINC               (1 << 10)
+#define STM32_DMA_CR_PSIZE_HWORD        (1 << 11)
+#define STM32_DMA_CR_MSIZE_HWORD        (1 << 13)
+#define STM32_DMA_CR_PL(n)              ((n) << 16)
+#define STM32_DMA_FCR_FTH_FULL          (3 << 0)
+#define STM32_DMA_FCR_DMDIS             (1 << 2)
+#define STM32_DMA_ISR_TEIF              (1 << 3)
+#define STM32_DMA_ISR_TCIF              (1 << 5)
+
+#define dmaStreamSetPeripheral(dmastp, addr)    (((stm32_dma_stream_t*)(dmastp))->par = (addr))
+#define dmaStreamSetMemory0(dmastp, addr)       (((stm32_dma_stream_t*)(dmastp))->m0ar = (addr))
+#define dmaStreamSetTransactionSize(dmastp, n)  (((stm32_dma_stream_t*)(dmastp))->ndtr = (n))
+#define dmaStreamSetMode(dmastp, mode)          (((stm32_dma_stream_t*)(dmastp))->cr = (mode))
+#define dmaStreamSetFIFO(dmastp, mode)          (((stm32_dma_stream_t*)(dmastp))->fcr = (mode))
+
+bool dmaStreamAllocate(const stm32_dma_stream_t* dmastp, uint32_t priority,
+    stm32_dmaisr_t func, void* param);
+void dmaStreamEnable(const stm32_dma_stream_t* dmastp);
+
+#endif
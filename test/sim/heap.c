@@ -0,0 +1,96 @@
+#include "heap.h"
+
+#include <stddef.h>
+#include <string.h>
+
+
+/* Each block is prefixed with its size, padded to keep the payload aligned */
+typedef union {
+  size_t size;
+  long double align;
+  void* align_p;
+} block_hdr_t;
+
+
+void* __real_malloc(size_t size);
+void __real_free(void* p);
+
+
+static heap_stats_t stats;
+
+
+void*
+__wrap_malloc(size_t size)
+{
+  block_hdr_t* b = __real_malloc(sizeof(block_hdr_t) + size);
+
+  if (b == NULL)
+    return NULL;
+
+  b->size = size;
+  stats.allocs++;
+  stats.bytes += size;
+  if (stats.bytes > stats.peak_bytes)
+    stats.peak_bytes = stats.bytes;
+
+  return b + 1;
+}
+
+void
+__wrap_free(void* p)
+{
+  block_hdr_t* b;
+
+  if (p == NULL)
+    return;
+
+  b = (block_hdr_t*)p - 1;
+  stats.frees++;
+  stats.bytes -= b->size;
+  __real_free(b);
+}
+
+void*
+__wrap_calloc(size_t n, size_t size)
+{
+  void* p = __wrap_malloc(n * size);
+
+  if (p != NULL)
+    memset(p, 0, n * size);
+  return p;
+}
+
+void*
+__wrap_realloc(void* p, size_t size)
+{
+  void* np;
+  size_t old_size;
+
+  if (p == NULL)
+    return __wrap_malloc(size);
+
+  old_size = ((block_hdr_t*)p - 1)->size;
+  np = __wrap_malloc(size);
+  if (np != NULL) {
+    memcpy(np, p, (old_size < size) ? old_size : size);
+    __wrap_free(p);
+  }
+  return np;
+}
+
+char*
+__wrap_strdup(const char* str)
+{
+  size_t len = strlen(str) + 1;
+  char* p = __wrap_malloc(len);
+
+  if (p != NULL)
+    memcpy(p, str, len);
+  return p;
+}
+
+void
+heap_get_stats(heap_stats_t* s)
+{
+  *s = stats;
+}
@@ -0,0 +1,22 @@
+#ifndef SIM_HEAP_H
+#define SIM_HEAP_H
+
+#include <stdint.h>
+
+/* Accounting of the heap use of the code under test. Link with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free,--wrap=strdup
+ * to route its allocations through here. Allocations made inside the C
+ * library itself are not seen.
+ */
+
+typedef struct {
+  uint32_t allocs;          // calls to malloc, calloc and realloc
+  uint32_t frees;
+  uint32_t bytes;           // currently allocated
+  uint32_t peak_bytes;
+} heap_stats_t;
+
+void
+heap_get_stats(heap_stats_t* stats);
+
+#endif
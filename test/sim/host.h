@@ -0,0 +1,13 @@
+#ifndef SIM_HOST_H
+#define SIM_HOST_H
+
+/* Included ahead of every source file. The app is built against newlib,
+ * which declares these by default; the host's C library only does with
+ * POSIX extensions turned on, and those clash with the app's pid_t.
+ */
+
+char* strdup(const char* s);
+
+#define M_PI 3.14159265358979323846
+
+#endif
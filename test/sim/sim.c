@@ -0,0 +1,669 @@
+/* for mmap() and the ucontext functions */
+#define _DEFAULT_SOURCE
+
+#include "sim.h"
+#include "hal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+
+/* Host stacks are much larger than the app's working areas, printf alone
+ * needs several KB. They are mapped rather than taken from the heap so that
+ * tests can account for the app's own heap use.
+ */
+#define SIM_STACK_SIZE          (64 * 1024)
+
+#define USEC_PER_TICK           (1000000 / CH_FREQUENCY)
+
+/* Round robin time slice between threads of equal priority, as set by
+ * CH_TIME_QUANTUM in the app's chconf.h
+ */
+#define QUANTUM_USEC            (20 * USEC_PER_TICK)
+
+
+static void queue_init(ThreadsQueue* q);
+static bool queue_empty(ThreadsQueue* q);
+static void queue_insert(Thread* tp, ThreadsQueue* q);
+static void prio_insert(Thread* tp, ThreadsQueue* q, bool ahead);
+static Thread* fifo_remove(ThreadsQueue* q);
+static void thread_init(Thread* tp, const char* name, tprio_t prio);
+static void thread_start(void);
+static void go_sleep(tstate_t state);
+static void switch_to(Thread* tp);
+static uint64_t next_timeout(void);
+static void fire_timeouts(void);
+static void dump_threads(void);
+
+
+static ThreadsQueue rlist;
+static uint32_t working_areas;
+static Thread main_thread;
+static Thread* current;
+static Thread* all_threads;
+static uint64_t now;
+static uint64_t slice_start;
+static uint32_t switches;
+
+
+void
+sim_init()
+{
+  queue_init(&rlist);
+  thread_init(&main_thread, "main", NORMALPRIO);
+  main_thread.p_state = THD_STATE_CURRENT;
+  current = &main_thread;
+  all_threads = &main_thread;
+  now = 0;
+  switches = 0;
+}
+
+uint64_t
+sim_now()
+{
+  return now;
+}
+
+uint32_t
+sim_switches()
+{
+  return switches;
+}
+
+double
+sim_wall_clock()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+uint64_t
+sim_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return (uint64_t)(sim_wall_clock() * 1e9);
+#endif
+}
+
+uint32_t
+sim_working_areas()
+{
+  return working_areas;
+}
+
+void
+sim_cpu(uint32_t usec)
+{
+  uint64_t left = usec;
+
+  while (left > 0) {
+    uint64_t t = next_timeout();
+    bool round_robin = !queue_empty(&rlist) && (rlist.p_next->p_prio == current->p_prio);
+
+    // a thread whose slice is used up yields to its equals
+    if (round_robin && ((t == 0) || (t > (slice_start + QUANTUM_USEC))))
+      t = (now > (slice_start + QUANTUM_USEC)) ? now : (slice_start + QUANTUM_USEC);
+
+    if ((t == 0) || (t > (now + left))) {
+      now += left;
+      break;
+    }
+
+    if (t > now) {
+      left -= t - now;
+      now = t;
+    }
+    fire_timeouts();
+    chSchRescheduleS();
+    if (round_robin && (now >= (slice_start + QUANTUM_USEC)))
+      chThdYield();
+  }
+}
+
+void
+chDbgPanic(const char* msg)
+{
+  fprintf(stderr, "panic in %s at %llu usec: %s\n",
+      current->p_name, (unsigned long long)now, msg);
+  dump_threads();
+  exit(2);
+}
+
+systime_t
+chTimeNow()
+{
+  return (systime_t)(now / USEC_PER_TICK);
+}
+
+halrtcnt_t
+halGetCounterValue()
+{
+  return (halrtcnt_t)(now * (SIM_CPU_FREQ / 1000000));
+}
+
+Thread*
+chThdSelf()
+{
+  return current;
+}
+
+tprio_t
+chThdGetPriority()
+{
+  return current->p_prio;
+}
+
+tprio_t
+chThdSetPriority(tprio_t prio)
+{
+  tprio_t old = current->p_realprio;
+
+  if ((current->p_prio == current->p_realprio) || (prio > current->p_prio))
+    current->p_prio = prio;
+  current->p_realprio = prio;
+  chSchRescheduleS();
+
+  return old;
+}
+
+Thread*
+chThdCreateFromHeap(void* heapp, size_t size, tprio_t prio, tfunc_t pf, void* arg)
+{
+  uint8_t* wa = mmap(NULL, sizeof(Thread) + SIM_STACK_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  Thread* tp = (Thread*)wa;
+
+  (void)heapp;
+  if (wa == MAP_FAILED)
+    chDbgPanic("out of memory for thread");
+  working_areas += size;
+
+  thread_init(tp, "noname", prio);
+  tp->sim_func = pf;
+  tp->sim_arg = arg;
+  tp->sim_stack = wa + sizeof(Thread);
+  tp->sim_all_next = all_threads;
+  all_threads = tp;
+
+  getcontext(&tp->sim_ctx);
+  tp->sim_ctx.uc_stack.ss_sp = tp->sim_stack;
+  tp->sim_ctx.uc_stack.ss_size = SIM_STACK_SIZE;
+  tp->sim_ctx.uc_link = NULL;
+  makecontext(&tp->sim_ctx, thread_start, 0);
+
+  chSchReadyI(tp);
+  chSchRescheduleS();
+
+  return tp;
+}
+
+Thread*
+chThdCreateStatic(void* wsp, size_t size, tprio_t prio, tfunc_t pf, void* arg)
+{
+  (void)wsp;
+  return chThdCreateFromHeap(NULL, size, prio, pf, arg);
+}
+
+void
+chThdSleep(systime_t time)
+{
+  if (time != TIME_INFINITE)
+    current->sim_wakeup = now + ((uint64_t)time * USEC_PER_TICK);
+  go_sleep(THD_STATE_SLEEPING);
+}
+
+void
+chThdYield()
+{
+  if (!queue_empty(&rlist) && (rlist.p_next->p_prio >= current->p_prio)) {
+    Thread* otp = current;
+    Thread* ntp = fifo_remove(&rlist);
+
+    otp->p_state = THD_STATE_READY;
+    prio_insert(otp, &rlist, false);
+    switch_to(ntp);
+  }
+}
+
+void
+chThdExit(msg_t msg)
+{
+  current->sim_exitcode = msg;
+  if (current->sim_joiner != NULL) {
+    current->sim_joiner->p_rdymsg = RDY_OK;
+    chSchReadyI(current->sim_joiner);
+    current->sim_joiner = NULL;
+  }
+  go_sleep(THD_STATE_FINAL);
+}
+
+void
+chThdTerminate(Thread* tp)
+{
+  tp->sim_terminate = true;
+}
+
+bool
+chThdShouldTerminate()
+{
+  return current->sim_terminate;
+}
+
+msg_t
+chThdWait(Thread* tp)
+{
+  if (tp->p_state != THD_STATE_FINAL) {
+    tp->sim_joiner = current;
+    go_sleep(THD_STATE_WTEXIT);
+  }
+  return tp->sim_exitcode;
+}
+
+void
+chSchReadyI(Thread* tp)
+{
+  if (tp->p_state == THD_STATE_READY)
+    chDbgPanic("chSchReadyI(), #1");
+
+  tp->p_state = THD_STATE_READY;
+  prio_insert(tp, &rlist, false);
+}
+
+void
+chSchRescheduleS()
+{
+  if (!queue_empty(&rlist) && (rlist.p_next->p_prio > current->p_prio)) {
+    Thread* otp = current;
+    Thread* ntp = fifo_remove(&rlist);
+
+    // a preempted thread goes ahead of its equals, as in ChibiOS
+    otp->p_state = THD_STATE_READY;
+    prio_insert(otp, &rlist, true);
+    switch_to(ntp);
+  }
+}
+
+Thread*
+dequeue(Thread* tp)
+{
+  tp->p_prev->p_next = tp->p_next;
+  tp->p_next->p_prev = tp->p_prev;
+  tp->p_next = tp->p_prev = tp;
+  return tp;
+}
+
+void
+chSemInit(Semaphore* sp, cnt_t n)
+{
+  queue_init(&sp->s_queue);
+  sp->s_cnt = n;
+}
+
+void
+chSemReset(Semaphore* sp, cnt_t n)
+{
+  while (!queue_empty(&sp->s_queue)) {
+    Thread* tp = fifo_remove(&sp->s_queue);
+    tp->sim_wakeup = 0;
+    tp->p_rdymsg = RDY_RESET;
+    chSchReadyI(tp);
+  }
+  sp->s_cnt = n;
+  chSchRescheduleS();
+}
+
+msg_t
+chSemWait(Semaphore* sp)
+{
+  return chSemWaitTimeoutS(sp, TIME_INFINITE);
+}
+
+msg_t
+chSemWaitS(Semaphore* sp)
+{
+  return chSemWaitTimeoutS(sp, TIME_INFINITE);
+}
+
+msg_t
+chSemWaitTimeout(Semaphore* sp, systime_t time)
+{
+  return chSemWaitTimeoutS(sp, time);
+}
+
+msg_t
+chSemWaitTimeoutS(Semaphore* sp, systime_t time)
+{
+  if (--sp->s_cnt >= 0)
+    return RDY_OK;
+
+  if (time == TIME_IMMEDIATE) {
+    sp->s_cnt++;
+    return RDY_TIMEOUT;
+  }
+
+  queue_insert(current, &sp->s_queue);
+  current->p_wtobjp = sp;
+  if (time != TIME_INFINITE)
+    current->sim_wakeup = now + ((uint64_t)time * USEC_PER_TICK);
+  go_sleep(THD_STATE_WTSEM);
+
+  return current->p_rdymsg;
+}
+
+void
+chSemSignal(Semaphore* sp)
+{
+  chSemSignalI(sp);
+  chSchRescheduleS();
+}
+
+void
+chSemSignalI(Semaphore* sp)
+{
+  if (++sp->s_cnt <= 0) {
+    Thread* tp = fifo_remove(&sp->s_queue);
+    tp->sim_wakeup = 0;
+    tp->p_rdymsg = RDY_OK;
+    chSchReadyI(tp);
+  }
+}
+
+void
+chBSemReset(BinarySemaphore* bsp, bool taken)
+{
+  chSemReset(&bsp->bs_sem, taken ? 0 : 1);
+}
+
+msg_t
+chBSemWait(BinarySemaphore* bsp)
+{
+  return chSemWait(&bsp->bs_sem);
+}
+
+msg_t
+chBSemWaitTimeout(BinarySemaphore* bsp, systime_t time)
+{
+  return chSemWaitTimeout(&bsp->bs_sem, time);
+}
+
+void
+chBSemSignal(BinarySemaphore* bsp)
+{
+  chBSemSignalI(bsp);
+  chSchRescheduleS();
+}
+
+void
+chBSemSignalI(BinarySemaphore* bsp)
+{
+  if (bsp->bs_sem.s_cnt < 1)
+    chSemSignalI(&bsp->bs_sem);
+}
+
+void
+chMtxInit(Mutex* mp)
+{
+  queue_init(&mp->m_queue);
+  mp->m_owner = NULL;
+  mp->m_next = NULL;
+}
+
+void
+chMtxLock(Mutex* mp)
+{
+  Thread* tp;
+
+  if (mp->m_owner == NULL) {
+    mp->m_owner = current;
+    mp->m_next = current->p_mtxlist;
+    current->p_mtxlist = mp;
+    return;
+  }
+
+  // Priority inheritance along the chain of owners
+  tp = mp->m_owner;
+  while (tp->p_prio < current->p_prio) {
+    tp->p_prio = current->p_prio;
+    if (tp->p_state == THD_STATE_READY) {
+      tp->p_state = THD_STATE_CURRENT;
+      chSchReadyI(dequeue(tp));
+      break;
+    }
+    if (tp->p_state != THD_STATE_WTMTX)
+      break;
+    prio_insert(dequeue(tp), &((Mutex*)tp->p_wtobjp)->m_queue, false);
+    tp = ((Mutex*)tp->p_wtobjp)->m_owner;
+  }
+
+  prio_insert(current, &mp->m_queue, false);
+  current->p_wtobjp = mp;
+  go_sleep(THD_STATE_WTMTX);
+}
+
+bool
+chMtxTryLock(Mutex* mp)
+{
+  if (mp->m_owner != NULL)
+    return false;
+
+  chMtxLock(mp);
+  return true;
+}
+
+Mutex*
+chMtxUnlock()
+{
+  Mutex* mp = current->p_mtxlist;
+  Mutex* held;
+  tprio_t prio = current->p_realprio;
+
+  if (mp == NULL)
+    chDbgPanic("chMtxUnlock(), #1");
+
+  current->p_mtxlist = mp->m_next;
+  for (held = current->p_mtxlist; held != NULL; held = held->m_next) {
+    if (!queue_empty(&held->m_queue) && (held->m_queue.p_next->p_prio > prio))
+      prio = held->m_queue.p_next->p_prio;
+  }
+  current->p_prio = prio;
+
+  if (!queue_empty(&mp->m_queue)) {
+    Thread* tp = fifo_remove(&mp->m_queue);
+    mp->m_owner = tp;
+    mp->m_next = tp->p_mtxlist;
+    tp->p_mtxlist = mp;
+    tp->p_rdymsg = RDY_OK;
+    chSchReadyI(tp);
+  }
+  else {
+    mp->m_owner = NULL;
+  }
+  chSchRescheduleS();
+
+  return mp;
+}
+
+void
+chPoolInit(MemoryPool* mp, size_t size, void* (*provider)(size_t size))
+{
+  mp->mp_next = NULL;
+  mp->mp_object_size = size;
+  mp->mp_provider = provider;
+}
+
+void
+chPoolLoadArray(MemoryPool* mp, void* p, size_t n)
+{
+  while (n-- > 0) {
+    chPoolFree(mp, p);
+    p = (uint8_t*)p + mp->mp_object_size;
+  }
+}
+
+void*
+chPoolAlloc(MemoryPool* mp)
+{
+  void* objp = mp->mp_next;
+
+  if (objp != NULL)
+    mp->mp_next = *(void**)objp;
+  else if (mp->mp_provider != NULL)
+    objp = mp->mp_provider(mp->mp_object_size);
+
+  return objp;
+}
+
+void
+chPoolFree(MemoryPool* mp, void* objp)
+{
+  *(void**)objp = mp->mp_next;
+  mp->mp_next = objp;
+}
+
+static void
+queue_init(ThreadsQueue* q)
+{
+  q->p_next = q->p_prev = (Thread*)q;
+}
+
+static bool
+queue_empty(ThreadsQueue* q)
+{
+  return q->p_next == (Thread*)q;
+}
+
+static void
+queue_insert(Thread* tp, ThreadsQueue* q)
+{
+  tp->p_next = (Thread*)q;
+  tp->p_prev = q->p_prev;
+  tp->p_prev->p_next = tp;
+  q->p_prev = tp;
+}
+
+/* Inserts behind the threads of higher (or, unless ahead, equal) priority */
+static void
+prio_insert(Thread* tp, ThreadsQueue* q, bool ahead)
+{
+  Thread* cp = (Thread*)q;
+
+  do {
+    cp = cp->p_next;
+  } while ((cp != (Thread*)q) &&
+           (ahead ? (cp->p_prio > tp->p_prio) : (cp->p_prio >= tp->p_prio)));
+
+  tp->p_next = cp;
+  tp->p_prev = cp->p_prev;
+  tp->p_prev->p_next = tp;
+  cp->p_prev = tp;
+}
+
+static Thread*
+fifo_remove(ThreadsQueue* q)
+{
+  return dequeue(q->p_next);
+}
+
+static void
+thread_init(Thread* tp, const char* name, tprio_t prio)
+{
+  tp->p_next = tp->p_prev = tp;
+  tp->p_prio = prio;
+  tp->p_realprio = prio;
+  tp->p_state = THD_STATE_SUSPENDED;
+  tp->p_name = name;
+  tp->p_mtxlist = NULL;
+  tp->sim_wakeup = 0;
+  chSemInit(&tp->mb_sem, 0);
+}
+
+static void
+thread_start()
+{
+  chThdExit(current->sim_func(current->sim_arg));
+}
+
+/* Puts the current thread to sleep in the given state and runs the next
+ * ready thread. With nothing ready the clock jumps to the next timeout.
+ */
+static void
+go_sleep(tstate_t state)
+{
+  current->p_state = state;
+
+  while (queue_empty(&rlist)) {
+    uint64_t t = next_timeout();
+    if (t == 0)
+      chDbgPanic("deadlock, no thread can run");
+    if (t > now)
+      now = t;
+    fire_timeouts();
+  }
+
+  switch_to(fifo_remove(&rlist));
+}
+
+static void
+switch_to(Thread* tp)
+{
+  Thread* otp = current;
+
+  current = tp;
+  tp->p_state = THD_STATE_CURRENT;
+  slice_start = now;
+  if (tp != otp) {
+    switches++;
+    swapcontext(&otp->sim_ctx, &tp->sim_ctx);
+  }
+}
+
+static uint64_t
+next_timeout()
+{
+  uint64_t t = 0;
+  Thread* tp;
+
+  for (tp = all_threads; tp != NULL; tp = tp->sim_all_next) {
+    if ((tp->sim_wakeup != 0) && ((t == 0) || (tp->sim_wakeup < t)))
+      t = tp->sim_wakeup;
+  }
+  return t;
+}
+
+static void
+fire_timeouts()
+{
+  Thread* tp;
+
+  for (tp = all_threads; tp != NULL; tp = tp->sim_all_next) {
+    if ((tp->sim_wakeup == 0) || (tp->sim_wakeup > now))
+      continue;
+
+    tp->sim_wakeup = 0;
+    if (tp->p_state == THD_STATE_WTSEM) {
+      dequeue(tp);
+      ((Semaphore*)tp->p_wtobjp)->s_cnt++;
+    }
+    tp->p_rdymsg = RDY_TIMEOUT;
+    chSchReadyI(tp);
+  }
+}
+
+static void
+dump_threads()
+{
+  static const char* states[] = {
+    "READY", "CURRENT", "SUSPENDED", "WTSEM", "WTMTX", "SLEEPING", "WTEXIT", "FINAL"
+  };
+  Thread* tp;
+
+  for (tp = all_threads; tp != NULL; tp = tp->sim_all_next)
+    fprintf(stderr, "  %-12s prio %3u/%3u %s\n", tp->p_name,
+        (unsigned)tp->p_prio, (unsigned)tp->p_realprio, states[tp->p_state]);
+}
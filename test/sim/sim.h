@@ -0,0 +1,48 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include "ch.h"
+
+/* Control of the simulated kernel. The calling thread of sim_init()
+ * becomes the main thread at NORMALPRIO.
+ */
+
+void
+sim_init(void);
+
+/* Virtual time in usec since sim_init() */
+uint64_t
+sim_now(void);
+
+/* Consumes usec of CPU time in the calling thread. Threads woken by their
+ * timeouts in the meantime preempt it if they have a higher priority, and
+ * it yields to ready threads of its own priority every CH_TIME_QUANTUM
+ * ticks.
+ */
+void
+sim_cpu(uint32_t usec);
+
+/* Number of context switches so far */
+uint32_t
+sim_switches(void);
+
+/* Host wall clock time in seconds, for benchmarks. Tests that include app
+ * headers can't include <time.h> themselves, as the POSIX headers clash
+ * with the app's pid_t.
+ */
+double
+sim_wall_clock(void);
+
+/* Host CPU cycle counter, for benchmarks. Where the host has none it counts
+ * nanoseconds instead.
+ */
+uint64_t
+sim_cycles(void);
+
+/* Total stack size asked for by the threads created so far, which the app
+ * takes from the heap on the device
+ */
+uint32_t
+sim_working_areas(void);
+
+#endif
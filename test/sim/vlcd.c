@@ -0,0 +1,168 @@
+#include "vlcd.h"
+
+#include <string.h>
+
+
+static void flush(void);
+static void put(uint16_t px);
+
+
+const rect_t display_rect = {
+    .x = 0,
+    .y = 0,
+    .width = DISP_WIDTH,
+    .height = DISP_HEIGHT
+};
+
+static uint16_t fb[DISP_HEIGHT * DISP_WIDTH];
+static uint8_t hits[DISP_HEIGHT * DISP_WIDTH];
+static vlcd_stats_t stats;
+
+static int win_x1, win_y1, win_x2, win_y2;
+static int cur_x, cur_y;
+
+/* Transfer started but not yet done */
+static const uint16_t* pending_buf;
+static uint16_t pending_color;
+static uint32_t pending_count;
+
+
+void
+vlcd_reset_stats()
+{
+  flush();
+  memset(hits, 0, sizeof(hits));
+  memset(&stats, 0, sizeof(stats));
+}
+
+void
+vlcd_get_stats(vlcd_stats_t* s)
+{
+  flush();
+  *s = stats;
+}
+
+const uint16_t*
+vlcd_frame_buffer()
+{
+  flush();
+  return fb;
+}
+
+void
+lcd_init()
+{
+  vlcd_reset_stats();
+}
+
+void
+lcd_write(uint16_t val)
+{
+}
+
+void
+lcd_write_cmd(uint8_t val)
+{
+}
+
+void
+lcd_write_param(uint8_t cmd, uint16_t val)
+{
+}
+
+void
+lcd_write_data(uint16_t val)
+{
+  flush();
+  put(val);
+}
+
+void
+lcd_set_cursor(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2)
+{
+  flush();
+  win_x1 = cur_x = x1;
+  win_y1 = cur_y = y1;
+  win_x2 = x2;
+  win_y2 = y2;
+}
+
+void
+lcd_clr_cursor()
+{
+  flush();
+  lcd_set_cursor(0, 0, DISP_WIDTH - 1, DISP_HEIGHT - 1);
+}
+
+void
+lcd_fill(uint16_t color, uint32_t count)
+{
+  flush();
+  stats.transfers++;
+  pending_buf = NULL;
+  pending_color = color;
+  pending_count = count;
+}
+
+void
+lcd_write_buf(const uint16_t* buf, uint32_t count)
+{
+  flush();
+  stats.transfers++;
+  pending_buf = buf;
+  pending_count = count;
+}
+
+void
+lcd_wait()
+{
+  flush();
+}
+
+void
+lcd_dma_lock()
+{
+  flush();
+}
+
+void
+lcd_dma_unlock()
+{
+}
+
+static void
+flush()
+{
+  while (pending_count > 0) {
+    put((pending_buf != NULL) ? *pending_buf++ : pending_color);
+    pending_count--;
+  }
+}
+
+/* Writes at the cursor, which wraps within the window like the controller's */
+static void
+put(uint16_t px)
+{
+  stats.writes++;
+  if ((cur_x < 0) || (cur_x >= DISP_WIDTH) ||
+      (cur_y < 0) || (cur_y >= DISP_HEIGHT)) {
+    stats.out_of_bounds++;
+  }
+  else {
+    int i = (cur_y * DISP_WIDTH) + cur_x;
+
+    fb[i] = px;
+    if (hits[i] == 0)
+      stats.pixels++;
+    else if (hits[i] == 1)
+      stats.overdrawn++;
+    if (hits[i] < 255)
+      hits[i]++;
+  }
+
+  if (++cur_x > win_x2) {
+    cur_x = win_x1;
+    if (++cur_y > win_y2)
+      cur_y = win_y1;
+  }
+}
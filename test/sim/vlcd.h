@@ -0,0 +1,30 @@
+#ifndef SIM_VLCD_H
+#define SIM_VLCD_H
+
+#include "lcd.h"
+
+/* Virtual LCD behind the app's lcd.h. It keeps a frame buffer and counts
+ * how often each pixel is written. Like the device's DMA transfers, the
+ * pixels given to lcd_write_buf() are only read at the next LCD call, so a
+ * caller that reuses the buffer too early draws the wrong pixels here too.
+ */
+
+typedef struct {
+  uint32_t writes;          // pixels written
+  uint32_t pixels;          // distinct pixels written
+  uint32_t overdrawn;       // pixels written more than once
+  uint32_t transfers;       // lcd_fill() and lcd_write_buf() calls
+  uint32_t out_of_bounds;   // pixels written outside the display
+} vlcd_stats_t;
+
+/* Clears the counts (not the frame buffer) */
+void
+vlcd_reset_stats(void);
+
+void
+vlcd_get_stats(vlcd_stats_t* stats);
+
+const uint16_t*
+vlcd_frame_buffer(void);
+
+#endif
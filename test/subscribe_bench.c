@@ -0,0 +1,173 @@
+/* Host benchmark of the message bus subscription table during screen
+ * creation.
+ *
+ * Builds and destroys the home screen over and over with the real GUI
+ * listener (gui/gui.c) and message.c behind it, counting and timing the
+ * subscribe and unsubscribe calls the screen makes. Each screen is checked
+ * to get the sensor samples it subscribed to, and to get nothing once it
+ * is destroyed. It fails if the table grows or touches the heap.
+ */
+
+#include "gfx.h"
+#include "gui.h"
+#include "gui/home.h"
+#include "message.h"
+#include "sensor.h"
+#include "gui_stubs.h"
+#include "sim.h"
+#include "heap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define NUM_SCREENS       10000
+
+
+void __real_msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data);
+void __real_msg_subscribe_latest(msg_listener_t* l, msg_id_t id, void* user_data);
+void __real_msg_unsubscribe(msg_listener_t* l, msg_id_t id, void* user_data);
+
+static void timed_start(void);
+static void timed_end(void);
+static uint32_t screen_samples(void);
+
+
+static uint32_t subscribes;
+static uint32_t unsubscribes;
+static double sub_time;
+static uint32_t sub_allocs;
+
+static double call_start;
+static heap_stats_t call_heap;
+
+
+/* The GUI calls the bus through these (see the link flags in the Makefile) */
+void
+__wrap_msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data)
+{
+  timed_start();
+  __real_msg_subscribe(l, id, user_data);
+  timed_end();
+  subscribes++;
+}
+
+void
+__wrap_msg_subscribe_latest(msg_listener_t* l, msg_id_t id, void* user_data)
+{
+  timed_start();
+  __real_msg_subscribe_latest(l, id, user_data);
+  timed_end();
+  subscribes++;
+}
+
+void
+__wrap_msg_unsubscribe(msg_listener_t* l, msg_id_t id, void* user_data)
+{
+  timed_start();
+  __real_msg_unsubscribe(l, id, user_data);
+  timed_end();
+  unsubscribes++;
+}
+
+int
+main()
+{
+  uint32_t failures = 0;
+  double start, build_time = 0;
+  int i;
+
+  sim_init();
+  msg_init();
+  gfx_init();
+  gui_init();
+  // let the GUI thread start up
+  chThdSleepMilliseconds(1);
+
+  subscribes = unsubscribes = 0;
+
+  for (i = 0; i < NUM_SCREENS; ++i) {
+    widget_t* screen;
+    uint32_t before;
+
+    start = sim_wall_clock();
+    screen = home_screen_create();
+    build_time += sim_wall_clock() - start;
+
+    before = screen_samples();
+
+    if (screen_samples() == before) {
+      if (failures++ == 0)
+        printf("FAIL: screen %d doesn't get sensor samples\n", i);
+    }
+
+    start = sim_wall_clock();
+    widget_destroy(screen);
+    build_time += sim_wall_clock() - start;
+
+    before = screen_samples();
+    if (screen_samples() != before) {
+      if (failures++ == 0)
+        printf("FAIL: destroyed screen %d still gets sensor samples\n", i);
+    }
+  }
+
+  printf("%d home screens built and destroyed in %.3f s\n", NUM_SCREENS, build_time);
+  printf("  %u subscribes, %u unsubscribes (%u per screen)\n",
+      (unsigned)subscribes, (unsigned)unsubscribes,
+      (unsigned)((subscribes + unsubscribes) / NUM_SCREENS));
+  printf("  %.0f ns per call, %.1f%% of screen build time\n",
+      (sub_time * 1e9) / (subscribes + unsubscribes), (100 * sub_time) / build_time);
+  printf("  %u heap allocations in the message layer\n", (unsigned)sub_allocs);
+
+  if (subscribes != unsubscribes) {
+    printf("FAIL: %u subscriptions left\n", (unsigned)(subscribes - unsubscribes));
+    failures++;
+  }
+  if (sub_allocs > 0) {
+    printf("FAIL: subscribing allocated from the heap\n");
+    failures++;
+  }
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+static void
+timed_start()
+{
+  heap_get_stats(&call_heap);
+  call_start = sim_wall_clock();
+}
+
+static void
+timed_end()
+{
+  heap_stats_t heap;
+
+  sub_time += sim_wall_clock() - call_start;
+  heap_get_stats(&heap);
+  sub_allocs += heap.allocs - call_heap.allocs;
+}
+
+/* Publishes a sample from the sensor that controller 1 shows and returns
+ * the number of samples the home screen has taken so far
+ */
+static uint32_t
+screen_samples()
+{
+  sensor_msg_t msg = {
+      .sensor = SENSOR_1,
+      .sample = { .value = 68, .unit = UNIT_TEMP_DEG_F },
+  };
+
+  msg_publish(MSG_SENSOR_SAMPLE, msg.sensor, &msg, sizeof(msg));
+  // let the lower priority GUI thread take it
+  chThdSleepMilliseconds(1);
+
+  return gui_stubs_controller_settings_reads();
+}
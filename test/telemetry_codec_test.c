@@ -0,0 +1,391 @@
+/* Host test and benchmark of the packed telemetry coding
+ * (src/app_mt/telemetry_codec.c).
+ *
+ * Round trips batches of records through the encoder and decoder: a
+ * fermenter trace as web_api queues it, and random records over every
+ * controller with negative readings, big gaps, time going backwards and
+ * setpoints coming and going. Decoded readings and setpoints must be
+ * within half a centidegree, everything else exact. It also checks that a
+ * record that does not fit leaves the buffer as it was, and that the
+ * decoder stops at malformed input.
+ *
+ * The benchmark sends the fermenter trace in reports of
+ * TELEMETRY_BATCH_SIZE records and compares bytes per sample and encode
+ * time with the plain ControllerReport encoding. nanopb is not built
+ * here, so the plain encoding is written out by hand in the same wire
+ * format; its time is a lower bound for nanopb's.
+ */
+
+#include "telemetry_codec.h"
+#include "common.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+#define NUM_RECORDS         4000
+#define BATCH_SIZE          32        // TELEMETRY_BATCH_SIZE in web_api.c
+#define SAMPLE_INTERVAL     30        // TELEMETRY_SAMPLE_INTERVAL in web_api.c
+#define NUM_TIMED_RUNS      200
+#define MAX_ERROR           0.005f    // deg F, half a centidegree
+#define MAX_PACKED_BYTES    4.0f      // per sample of the fermenter trace
+
+/* Protobuf wire types */
+#define WT_VARINT           0
+#define WT_LEN              2
+#define WT_FIXED32          5
+
+
+static void fermenter_trace(void);
+static void random_records(void);
+static uint32_t round_trip(const char* name, uint32_t num_recs);
+static void check_full_buffer(void);
+static void check_malformed(void);
+static void bench(void);
+static uint32_t encode_packed(const telemetry_record_t* recs, uint32_t num_recs, uint8_t* buf, uint32_t size);
+static uint32_t encode_plain(const telemetry_record_t* recs, uint32_t num_recs, uint8_t* buf);
+static uint32_t put_tag(uint8_t* p, uint32_t field, uint32_t wire_type);
+static uint32_t put_varint(uint8_t* p, uint32_t v);
+static uint32_t put_float(uint8_t* p, float v);
+static bool same_reading(float a, float b);
+static uint32_t random_u32(void);
+static void check(bool ok, const char* what);
+
+
+static telemetry_record_t recs[NUM_RECORDS];
+static telemetry_record_t decoded[NUM_RECORDS];
+static uint8_t buf[NUM_RECORDS * sizeof(telemetry_record_t)];
+static uint32_t rng = 1;
+static uint32_t failures;
+
+
+int
+main()
+{
+  sim_init();
+
+  fermenter_trace();
+  round_trip("fermenter trace", NUM_RECORDS);
+
+  random_records();
+  round_trip("random records", NUM_RECORDS);
+
+  check_full_buffer();
+  check_malformed();
+
+  fermenter_trace();
+  bench();
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+/* Two controllers sampled every SAMPLE_INTERVAL on SNTP time, one drifting
+ * around a setpoint that steps half way, the other without a setpoint. A
+ * sample now and then is a second late, and the outputs cycle.
+ */
+static void
+fermenter_trace()
+{
+  float beer = 65, chamber = 40;
+  uint32_t i;
+
+  memset(recs, 0, sizeof(recs));
+  for (i = 0; i < NUM_RECORDS; ++i) {
+    telemetry_record_t* rec = &recs[i];
+
+    rec->seq = i;
+    rec->controller = i & 1;
+    rec->time = 1700000000 + ((i / 2) * SAMPLE_INTERVAL) + ((random_u32() % 50) == 0);
+
+    if (rec->controller == 0) {
+      beer += (((int)(random_u32() % 5)) - 2) * 0.05f;
+      rec->value = beer;
+      rec->setpoint = (i < (NUM_RECORDS / 2)) ? 64.0f : 68.5f;
+      rec->outputs = (i / 120) & 1;
+    }
+    else {
+      chamber += (((int)(random_u32() % 7)) - 3) * 0.01f;
+      rec->value = chamber;
+      rec->setpoint = NAN;
+      rec->outputs = ((i / 200) & 1) ? 2 : 0;
+    }
+  }
+}
+
+static void
+random_records()
+{
+  uint32_t i;
+
+  memset(recs, 0, sizeof(recs));
+  for (i = 0; i < NUM_RECORDS; ++i) {
+    telemetry_record_t* rec = &recs[i];
+
+    rec->seq = i;
+    rec->controller = random_u32() % TELEMETRY_CODEC_MAX_CONTROLLERS;
+    rec->time = random_u32() * 7;
+    rec->value = (((int)(random_u32() % 200001)) - 100000) / 100.0f;
+    rec->setpoint = ((random_u32() % 3) == 0) ? NAN :
+        ((((int)(random_u32() % 20001)) - 10000) / 100.0f);
+    rec->outputs = random_u32() & 0xFFFF;
+  }
+}
+
+/* Encodes the records in one batch and checks they decode to the same.
+ * Returns the encoded length.
+ */
+static uint32_t
+round_trip(const char* name, uint32_t num_recs)
+{
+  telemetry_codec_t c;
+  uint32_t len, i;
+
+  len = encode_packed(recs, num_recs, buf, sizeof(buf));
+  check(len > 0, "every record fits");
+
+  check(telemetry_decode_start(&c, buf, len), "the header decodes");
+  for (i = 0; i < num_recs; ++i) {
+    if (!telemetry_decode(&c, &decoded[i])) {
+      check(false, "every record decodes");
+      return len;
+    }
+  }
+  check(!telemetry_decode(&c, &decoded[0]), "nothing after the last record");
+
+  for (i = 0; i < num_recs; ++i) {
+    const telemetry_record_t* r = &recs[i];
+    const telemetry_record_t* d = &decoded[i];
+
+    if (d->time != r->time ||
+        d->controller != r->controller ||
+        d->outputs != r->outputs ||
+        !same_reading(d->value, r->value) ||
+        isnan(d->setpoint) != isnan(r->setpoint) ||
+        (!isnan(r->setpoint) && !same_reading(d->setpoint, r->setpoint))) {
+      printf("record %u: time %u controller %u value %.2f setpoint %.2f outputs %x, "
+          "decoded time %u controller %u value %.2f setpoint %.2f outputs %x\n",
+          (unsigned)i, (unsigned)r->time, r->controller, r->value, r->setpoint, r->outputs,
+          (unsigned)d->time, d->controller, d->value, d->setpoint, d->outputs);
+      check(false, "records decode to what was encoded");
+      break;
+    }
+  }
+
+  printf("%s: %u records in %u bytes, %.2f bytes per record\n", name,
+      (unsigned)num_recs, (unsigned)len, (double)len / num_recs);
+
+  return len;
+}
+
+/* A record that does not fit is refused and leaves the buffer as it was,
+ * and everything before it still decodes
+ */
+static void
+check_full_buffer()
+{
+  telemetry_codec_t c;
+  uint8_t small[40];
+  uint8_t before[sizeof(small)];
+  uint32_t num_encoded = 0, num_decoded = 0;
+  uint32_t len;
+
+  random_records();
+
+  telemetry_encode_start(&c, small, sizeof(small), recs[0].time);
+  while (telemetry_encode(&c, &recs[num_encoded]))
+    num_encoded++;
+
+  len = c.len;
+  memcpy(before, small, sizeof(small));
+  check(!telemetry_encode(&c, &recs[num_encoded]), "a record that does not fit is refused");
+  check(c.len == len && memcmp(before, small, sizeof(small)) == 0,
+      "a refused record leaves the buffer as it was");
+
+  check(telemetry_decode_start(&c, small, len), "a full buffer's header decodes");
+  while (telemetry_decode(&c, &decoded[num_decoded]))
+    num_decoded++;
+  check(num_encoded > 0 && num_decoded == num_encoded, "a full buffer decodes");
+
+  recs[0].controller = TELEMETRY_CODEC_MAX_CONTROLLERS;
+  telemetry_encode_start(&c, buf, sizeof(buf), 0);
+  check(!telemetry_encode(&c, &recs[0]), "a controller out of range is refused");
+}
+
+static void
+check_malformed()
+{
+  static const uint8_t bad_tag[] = { TELEMETRY_CODEC_VERSION, 0, 0x80, 0, 0 };
+  static const uint8_t truncated[] = { TELEMETRY_CODEC_VERSION, 0, 0, 0x81 };
+  static const uint8_t long_varint[] = { TELEMETRY_CODEC_VERSION, 0, 0, 0x80, 0x80, 0x80, 0x80, 0x80, 0 };
+  static const uint8_t bad_version[] = { TELEMETRY_CODEC_VERSION + 1, 0 };
+  telemetry_codec_t c;
+  telemetry_record_t rec;
+
+  check(telemetry_decode_start(&c, bad_tag, sizeof(bad_tag)) && !telemetry_decode(&c, &rec),
+      "a tag with bit 7 set is refused");
+  check(telemetry_decode_start(&c, truncated, sizeof(truncated)) && !telemetry_decode(&c, &rec),
+      "a truncated record is refused");
+  check(telemetry_decode_start(&c, long_varint, sizeof(long_varint)) && !telemetry_decode(&c, &rec),
+      "a varint over 5 bytes is refused");
+  check(!telemetry_decode_start(&c, bad_version, sizeof(bad_version)),
+      "another format version is refused");
+}
+
+static void
+bench()
+{
+  uint32_t packed_len = 0, plain_len = 0;
+  uint32_t num_reports = 0;
+  double start, packed_time, plain_time;
+  uint32_t i, n;
+
+  for (i = 0; i < NUM_RECORDS; i += BATCH_SIZE) {
+    packed_len += encode_packed(&recs[i], MIN(BATCH_SIZE, NUM_RECORDS - i), buf, sizeof(buf));
+    plain_len += encode_plain(&recs[i], MIN(BATCH_SIZE, NUM_RECORDS - i), buf);
+    num_reports++;
+  }
+
+  start = sim_wall_clock();
+  for (n = 0; n < NUM_TIMED_RUNS; ++n) {
+    for (i = 0; i < NUM_RECORDS; i += BATCH_SIZE)
+      encode_packed(&recs[i], MIN(BATCH_SIZE, NUM_RECORDS - i), buf, sizeof(buf));
+  }
+  packed_time = sim_wall_clock() - start;
+
+  start = sim_wall_clock();
+  for (n = 0; n < NUM_TIMED_RUNS; ++n) {
+    for (i = 0; i < NUM_RECORDS; i += BATCH_SIZE)
+      encode_plain(&recs[i], MIN(BATCH_SIZE, NUM_RECORDS - i), buf);
+  }
+  plain_time = sim_wall_clock() - start;
+
+  float packed_bytes = (float)packed_len / NUM_RECORDS;
+  float plain_bytes = (float)plain_len / NUM_RECORDS;
+
+  printf("\n%u reports of %u samples %14s %14s\n", (unsigned)num_reports, BATCH_SIZE,
+      "bytes/sample", "ns/sample");
+  printf("%-33s %14.2f %14.1f\n", "ControllerReport", plain_bytes,
+      (plain_time * 1e9) / (NUM_TIMED_RUNS * NUM_RECORDS));
+  printf("%-33s %14.2f %14.1f\n", "packed_reports", packed_bytes,
+      (packed_time * 1e9) / (NUM_TIMED_RUNS * NUM_RECORDS));
+  printf("packed is %.1fx smaller\n", plain_bytes / packed_bytes);
+
+  if (packed_bytes > MAX_PACKED_BYTES) {
+    printf("FAIL: packed reports take over %.1f bytes per sample\n", MAX_PACKED_BYTES);
+    failures++;
+  }
+}
+
+/* As many records as fit, as web_api packs a report. Returns the length. */
+static uint32_t
+encode_packed(const telemetry_record_t* recs, uint32_t num_recs, uint8_t* buf, uint32_t size)
+{
+  telemetry_codec_t c;
+  uint32_t i;
+
+  telemetry_encode_start(&c, buf, size, recs[0].time);
+  for (i = 0; i < num_recs; ++i) {
+    if (!telemetry_encode(&c, &recs[i]))
+      return 0;
+  }
+
+  return c.len;
+}
+
+/* The controller_reports of a DeviceReport as web_api fills them without
+ * WEB_API_TELEMETRY_PACKED: controller_index, the reading and setpoint as
+ * floats, timestamp and output_status. Every field number is below 16, so
+ * each tag takes a byte. Returns the length.
+ */
+static uint32_t
+encode_plain(const telemetry_record_t* recs, uint32_t num_recs, uint8_t* buf)
+{
+  uint8_t report[32];
+  uint32_t len = 0;
+  uint32_t i;
+
+  for (i = 0; i < num_recs; ++i) {
+    const telemetry_record_t* rec = &recs[i];
+    uint32_t n = 0;
+
+    n += put_tag(report + n, 1, WT_VARINT);
+    n += put_varint(report + n, rec->controller);
+    n += put_tag(report + n, 2, WT_FIXED32);
+    n += put_float(report + n, rec->value);
+    n += put_tag(report + n, 3, WT_FIXED32);
+    n += put_float(report + n, rec->setpoint);
+    n += put_tag(report + n, 4, WT_VARINT);
+    n += put_varint(report + n, rec->time);
+    n += put_tag(report + n, 5, WT_VARINT);
+    n += put_varint(report + n, rec->outputs);
+
+    len += put_tag(buf + len, 1, WT_LEN);
+    len += put_varint(buf + len, n);
+    memcpy(buf + len, report, n);
+    len += n;
+  }
+
+  return len;
+}
+
+static uint32_t
+put_tag(uint8_t* p, uint32_t field, uint32_t wire_type)
+{
+  return put_varint(p, (field << 3) | wire_type);
+}
+
+static uint32_t
+put_varint(uint8_t* p, uint32_t v)
+{
+  uint32_t len = 0;
+
+  while (v >= 0x80) {
+    p[len++] = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  p[len++] = v;
+
+  return len;
+}
+
+static uint32_t
+put_float(uint8_t* p, float v)
+{
+  memcpy(p, &v, sizeof(v));
+  return sizeof(v);
+}
+
+static bool
+same_reading(float a, float b)
+{
+  return fabsf(a - b) <= (MAX_ERROR + (fabsf(b) * 1e-6f));
+}
+
+static uint32_t
+random_u32()
+{
+  uint32_t hi;
+
+  rng = (rng * 1103515245) + 12345;
+  hi = rng & 0xFFFF0000;
+  rng = (rng * 1103515245) + 12345;
+
+  return hi | (rng >> 16);
+}
+
+static void
+check(bool ok, const char* what)
+{
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
@@ -0,0 +1,431 @@
+/* Host test of the telemetry queue (src/app_mt/telemetry.c) with its
+ * spill area in an in-memory SP_TELEMETRY partition, reporting to a local
+ * TCP stand-in server.
+ *
+ * The device side sends reports the way web_api does: up to BATCH_SIZE
+ * records peeked from the last one sent, acknowledged by the server
+ * echoing the sequence number after the last of them. The server records
+ * every record that arrives, checks that its contents belong to its
+ * sequence number and drops those it already has, as the real one does.
+ *
+ * Runs through reporting while connected, outages that spill to flash and
+ * wrap the ring of sectors, an outage that overflows it, a reset with
+ * records in flash, and a reset with a partly acknowledged sector. It
+ * fails if the server misses a record that should have survived, gets
+ * them out of order, or gets the records of a partly acknowledged sector
+ * anything but once more; if a record reaches flash while connected; if
+ * a flash write lands on programmed bytes or outside the partition; or
+ * if the spill area is not emptied once everything has been acknowledged.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "telemetry.h"
+#include "sxfs.h"
+#include "xflash.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+#define NUM_SECTORS         3         // as telemetry.c
+#define LOG_HDR_SIZE        16        // sizeof(log_hdr_t) in telemetry.c
+#define SLOTS_PER_SECTOR    ((XFLASH_SECTOR_SIZE - LOG_HDR_SIZE) / sizeof(telemetry_record_t))
+#define RAM_RECORDS         64        // TELEMETRY_RAM_RECORDS
+#define BATCH_SIZE          32        // TELEMETRY_BATCH_SIZE in web_api.c
+#define MAX_SEQ             100000
+
+
+/* Sent ahead of a report's records */
+typedef struct {
+  uint32_t sequence;        // acknowledged by echoing it
+  uint32_t count;
+} report_hdr_t;
+
+typedef struct {
+  int listen_fd;
+  int fd;
+  uint8_t received[MAX_SEQ];
+  uint32_t records;         // distinct records that arrived
+  uint32_t duplicates;
+  uint32_t out_of_order;
+  uint32_t bad;
+  uint32_t last_seq;
+} server_t;
+
+
+static void connect_server(void);
+static bool send_report(void);
+static void serve_report(void);
+static uint32_t drain(uint32_t max_reports);
+static void push(uint32_t num_recs);
+static void reset_device(void);
+static uint32_t received(uint32_t from, uint32_t to);
+static void report(const char* name, uint32_t records, uint32_t duplicates);
+static void check_erased(void);
+static void check(bool ok, const char* what);
+
+
+static uint8_t flash[NUM_SECTORS * XFLASH_SECTOR_SIZE];
+static uint32_t flash_writes;
+static uint32_t flash_erases;
+
+static server_t server;
+static int device_fd;
+static uint32_t report_seq;
+static uint32_t failures;
+
+
+bool
+sxfs_write(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  uint32_t i;
+
+  if (part_id != SP_TELEMETRY || (offset + data_len) > sizeof(flash)) {
+    check(false, "writes stay in the partition");
+    return false;
+  }
+
+  for (i = 0; i < data_len; ++i) {
+    if (flash[offset + i] != 0xFF) {
+      check(false, "writes only land on erased bytes");
+      break;
+    }
+  }
+
+  /* NOR flash only clears bits */
+  for (i = 0; i < data_len; ++i)
+    flash[offset + i] &= data[i];
+  flash_writes++;
+  return true;
+}
+
+bool
+sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  if (part_id != SP_TELEMETRY || (offset + data_len) > sizeof(flash)) {
+    check(false, "reads stay in the partition");
+    return false;
+  }
+
+  memcpy(data, &flash[offset], data_len);
+  return true;
+}
+
+bool
+sxfs_erase_sector(sxfs_part_id_t part_id, uint32_t offset)
+{
+  if (part_id != SP_TELEMETRY || (offset % XFLASH_SECTOR_SIZE) != 0 ||
+      offset >= sizeof(flash)) {
+    check(false, "erases are of whole sectors in the partition");
+    return false;
+  }
+
+  memset(&flash[offset], 0xFF, XFLASH_SECTOR_SIZE);
+  flash_erases++;
+  return true;
+}
+
+int
+main()
+{
+  uint32_t start, end, kept, acked;
+  int i;
+
+  sim_init();
+  memset(flash, 0xFF, sizeof(flash));
+  connect_server();
+  telemetry_init();
+
+  printf("%u records per sector, %u sectors, %u in RAM\n",
+      (unsigned)SLOTS_PER_SECTOR, NUM_SECTORS, RAM_RECORDS);
+  printf("%-34s %8s %8s %8s %8s %8s\n", "case", "pushed", "received", "dups", "writes", "erases");
+
+  /* Connected, the RAM queue is enough */
+  start = telemetry_end_seq();
+  flash_writes = flash_erases = 0;
+  for (i = 0; i < 50; ++i) {
+    push(10);
+    drain(1);
+  }
+  drain(UINT32_MAX);
+  report("connected", 500, 0);
+  check(received(start, telemetry_end_seq()) == 500, "every record arrives while connected");
+  check(flash_writes == 0, "nothing reaches flash while connected");
+
+  /* Outages of over a sector, so the head moves on a sector each time and
+   * goes round the ring twice
+   */
+  for (i = 0; i < (2 * NUM_SECTORS); ++i) {
+    start = telemetry_end_seq();
+    flash_writes = flash_erases = 0;
+    push(SLOTS_PER_SECTOR + 500);
+    drain(UINT32_MAX);
+    report("outage, spilled", SLOTS_PER_SECTOR + 500, 0);
+    check(flash_writes > 0, "an outage spills to flash");
+    check(received(start, telemetry_end_seq()) == (SLOTS_PER_SECTOR + 500),
+        "every spilled record arrives");
+    check_erased();
+  }
+
+  /* An outage longer than the ring keeps the newest records */
+  start = telemetry_end_seq();
+  flash_writes = flash_erases = 0;
+  push((NUM_SECTORS * SLOTS_PER_SECTOR) + 2000);
+  end = telemetry_end_seq();
+  drain(UINT32_MAX);
+  kept = received(start, end);
+  report("outage, overflowed", end - start, 0);
+  check(kept >= ((NUM_SECTORS - 1) * SLOTS_PER_SECTOR) + RAM_RECORDS - 16,
+      "an overflow only loses the oldest sector's worth");
+  check(kept == received(end - kept, end), "an overflow loses the oldest records");
+  check_erased();
+
+  /* A reset during an outage: the records in flash are sent after it, and
+   * those still in RAM are lost, their numbers used again
+   */
+  start = telemetry_end_seq();
+  flash_writes = flash_erases = 0;
+  push(1000);
+  reset_device();
+  end = telemetry_end_seq();
+  check(end > (start + 1000 - RAM_RECORDS) && end < (start + 1000),
+      "sequence numbers carry on after the spilled records");
+  check(telemetry_ack_seq() == start, "the spilled records are still to be sent");
+  push(10);
+  drain(UINT32_MAX);
+  report("outage, reset", end + 10 - start, 0);
+  check(received(start, end + 10) == (end + 10 - start),
+      "the spilled records and the new ones arrive");
+  check_erased();
+
+  /* A reset with a sector partly acknowledged sends all of it again */
+  start = telemetry_end_seq();
+  flash_writes = flash_erases = 0;
+  push(1000);
+  server.duplicates = 0;
+  drain(10);
+  acked = telemetry_ack_seq() - start;
+  reset_device();
+  check(telemetry_ack_seq() == start, "a partly acknowledged sector is sent again");
+  end = telemetry_end_seq();
+  drain(UINT32_MAX);
+  report("partly acked, reset", end - start, acked);
+  check(acked == (10 * BATCH_SIZE), "the acknowledged records are sent before the reset");
+  check(server.duplicates == acked, "the acknowledged records are sent once more");
+  check(received(start, end) == (end - start), "the sector's records all arrive");
+  check_erased();
+
+  check(server.out_of_order == 0, "records arrive in order");
+  check(server.bad == 0, "records arrive as they were pushed");
+
+  close(device_fd);
+  close(server.fd);
+  close(server.listen_fd);
+
+  if (failures > 0) {
+    printf("FAILED: %u\n", (unsigned)failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
+
+/* Listens on a loopback port and connects the device side to it */
+static void
+connect_server()
+{
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  server.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (server.listen_fd < 0 ||
+      bind(server.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(server.listen_fd, 1) != 0 ||
+      getsockname(server.listen_fd, (struct sockaddr*)&addr, &addr_len) != 0) {
+    printf("FAILED: no loopback server\n");
+    _exit(1);
+  }
+
+  device_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (device_fd < 0 ||
+      connect(device_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      (server.fd = accept(server.listen_fd, NULL, NULL)) < 0) {
+    printf("FAILED: no connection to the loopback server\n");
+    _exit(1);
+  }
+}
+
+/* Sends the next report as web_api's send_telemetry_report does, and
+ * takes the server's ack. False when there is nothing to send.
+ */
+static bool
+send_report()
+{
+  telemetry_record_t recs[BATCH_SIZE];
+  report_hdr_t hdr;
+  uint32_t ack;
+  uint32_t n;
+
+  n = telemetry_peek(report_seq, recs, BATCH_SIZE);
+  if (n == 0) {
+    report_seq = telemetry_end_seq();
+    return false;
+  }
+
+  hdr.sequence = recs[n - 1].seq + 1;
+  hdr.count = n;
+  if (send(device_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      send(device_fd, recs, n * sizeof(recs[0]), 0) != (ssize_t)(n * sizeof(recs[0]))) {
+    check(false, "reports are sent");
+    return false;
+  }
+  report_seq = hdr.sequence;
+
+  serve_report();
+
+  if (recv(device_fd, &ack, sizeof(ack), MSG_WAITALL) != sizeof(ack)) {
+    check(false, "reports are acknowledged");
+    return false;
+  }
+  telemetry_ack(ack);
+  return true;
+}
+
+/* The stand-in server takes a report, records what arrived and acks it */
+static void
+serve_report()
+{
+  telemetry_record_t rec;
+  report_hdr_t hdr;
+  uint32_t i;
+
+  if (recv(server.fd, &hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr)) {
+    check(false, "the server gets the report");
+    return;
+  }
+
+  for (i = 0; i < hdr.count; ++i) {
+    if (recv(server.fd, &rec, sizeof(rec), MSG_WAITALL) != sizeof(rec)) {
+      check(false, "the server gets every record of the report");
+      return;
+    }
+
+    if (rec.seq >= MAX_SEQ ||
+        rec.time != (1000 + rec.seq) ||
+        rec.value != (rec.seq * 0.25f) ||
+        rec.controller != (rec.seq % 2)) {
+      server.bad++;
+      continue;
+    }
+
+    if (server.received[rec.seq]) {
+      server.duplicates++;
+      continue;
+    }
+
+    if (server.records > 0 && rec.seq < server.last_seq)
+      server.out_of_order++;
+    server.received[rec.seq] = 1;
+    server.last_seq = rec.seq;
+    server.records++;
+  }
+
+  send(server.fd, &hdr.sequence, sizeof(hdr.sequence), 0);
+}
+
+/* Sends up to max_reports, returns how many went */
+static uint32_t
+drain(uint32_t max_reports)
+{
+  uint32_t n = 0;
+
+  report_seq = telemetry_ack_seq();
+  while (n < max_reports && send_report())
+    n++;
+
+  return n;
+}
+
+static void
+push(uint32_t num_recs)
+{
+  while (num_recs-- > 0) {
+    uint32_t seq = telemetry_end_seq();
+    telemetry_record_t rec = {
+        .time = 1000 + seq,
+        .controller = seq % 2,
+        .value = seq * 0.25f,
+        .setpoint = 68,
+    };
+
+    telemetry_push(&rec);
+    check(rec.seq == seq, "records are numbered in order");
+  }
+}
+
+/* Forgets what the server has of numbers the device will use again */
+static void
+reset_device()
+{
+  uint32_t seq;
+
+  telemetry_init();
+
+  for (seq = telemetry_end_seq(); seq < MAX_SEQ; ++seq)
+    server.received[seq] = 0;
+  server.last_seq = telemetry_ack_seq();
+}
+
+static uint32_t
+received(uint32_t from, uint32_t to)
+{
+  uint32_t n = 0;
+
+  for (; from < to; ++from)
+    n += server.received[from];
+
+  return n;
+}
+
+static void
+report(const char* name, uint32_t records, uint32_t duplicates)
+{
+  printf("%-34s %8u %8u %8u %8u %8u\n", name, (unsigned)records, (unsigned)server.records,
+      (unsigned)duplicates, (unsigned)flash_writes, (unsigned)flash_erases);
+  server.records = 0;
+}
+
+/* Everything acknowledged, so nothing is left to send after a reset */
+static void
+check_erased()
+{
+  telemetry_record_t rec;
+  uint32_t i;
+
+  check(telemetry_ack_seq() == telemetry_end_seq(), "everything is acknowledged");
+  check(telemetry_peek(0, &rec, 1) == 0, "nothing is left to send");
+
+  for (i = 0; i < sizeof(flash) && flash[i] == 0xFF; ++i)
+    ;
+  check(i == sizeof(flash), "the spill area is erased once acknowledged");
+}
+
+static void
+check(bool ok, const char* what)
+{
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}